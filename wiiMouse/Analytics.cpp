@@ -0,0 +1,607 @@
+/*************************
+Analytics.cpp
+
+Parallel statistics over capture files. See Analytics.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+#include "Analytics.h"
+
+#include <thread>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Merge() treats the summary as an array of counters */
+static_assert(sizeof(WM_ANALYTICS) % sizeof(unsigned long long) == 0, "WM_ANALYTICS must hold only counters");
+
+/* Names for the ButtonMask() bits, NULL for bits no button uses */
+static const char *buttonNames[WM_AN_BUTTONS] = {
+	"two", "one", "B", "A", "minus", NULL, NULL, "home",
+	"left", "right", "down", "up", "plus", NULL, NULL, NULL
+};
+
+CCaptureMap::CCaptureMap(void)
+{
+	view = NULL;
+	size = 0;
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#endif
+}
+
+CCaptureMap::~CCaptureMap(void)
+{
+	Close();
+}
+
+/* Map path and check it is a capture this build can read */
+BOOL CCaptureMap::Open(const char *path)
+{
+	Close();
+
+#ifdef _WIN32
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		printf("Couldn't open %s (error %lu)\n", path, GetLastError());
+		return false;
+	}
+	LARGE_INTEGER length;
+	if(!GetFileSizeEx(file, &length) || length.QuadPart < (LONGLONG)sizeof(WM_CAPTURE_HEADER))
+	{
+		printf("%s is too short to be a capture\n", path);
+		Close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping)
+		view = (const byte *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!view)
+	{
+		printf("Couldn't map %s (error %lu)\n", path, GetLastError());
+		Close();
+		return false;
+	}
+	size = (size_t)length.QuadPart;
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		printf("Couldn't open %s (%s)\n", path, strerror(errno));
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(WM_CAPTURE_HEADER))
+	{
+		printf("%s is too short to be a capture\n", path);
+		close(fd);
+		return false;
+	}
+	void *mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapped == MAP_FAILED)
+	{
+		printf("Couldn't map %s (%s)\n", path, strerror(errno));
+		return false;
+	}
+	/* Each chunk is read front to back */
+	madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL);
+	view = (const byte *)mapped;
+	size = (size_t)info.st_size;
+#endif
+
+	const WM_CAPTURE_HEADER *header = Header();
+	if(memcmp(header->magic, WM_CAPTURE_MAGIC, sizeof(header->magic)) || header->version != WM_CAPTURE_VERSION
+		|| header->recordSize != sizeof(WM_CAPTURE_RECORD))
+	{
+		printf("%s isn't a version %d capture\n", path, WM_CAPTURE_VERSION);
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void CCaptureMap::Close()
+{
+#ifdef _WIN32
+	if(view)
+		UnmapViewOfFile(view);
+	if(mapping)
+		CloseHandle(mapping);
+	if(file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if(view)
+		munmap((void *)view, size);
+#endif
+	view = NULL;
+	size = 0;
+}
+
+const WM_CAPTURE_HEADER *CCaptureMap::Header() const { return (const WM_CAPTURE_HEADER *)view; }
+const WM_CAPTURE_RECORD *CCaptureMap::Records() const { return (const WM_CAPTURE_RECORD *)(view + sizeof(WM_CAPTURE_HEADER)); }
+size_t CCaptureMap::Bytes() const { return size; }
+
+/* Whole records only; a capture cut short mid-record just loses that one */
+size_t CCaptureMap::Count() const
+{
+	return view ? (size - sizeof(WM_CAPTURE_HEADER)) / sizeof(WM_CAPTURE_RECORD) : 0;
+}
+
+CCaptureAnalyzer::CCaptureAnalyzer(void)
+{
+	next = 0;
+}
+
+CCaptureAnalyzer::~CCaptureAnalyzer(void)
+{
+	for(size_t i = 0; i < files.size(); i++)
+		delete files[i];
+}
+
+/* Map a capture and cut it into chunks */
+BOOL CCaptureAnalyzer::Add(const char *path)
+{
+	CCaptureMap *map = new CCaptureMap();
+	if(!map->Open(path))
+	{
+		delete map;
+		return false;
+	}
+
+	int file = (int)files.size();
+	files.push_back(map);
+	for(size_t first = 0; first < map->Count(); first += WM_AN_CHUNK)
+	{
+		_chunk chunk;
+		chunk.file = file;
+		chunk.first = first;
+		chunk.count = map->Count() - first < WM_AN_CHUNK ? map->Count() - first : WM_AN_CHUNK;
+		chunks.push_back(chunk);
+	}
+	return true;
+}
+
+size_t CCaptureAnalyzer::Records() const
+{
+	size_t count = 0;
+	for(size_t i = 0; i < files.size(); i++)
+		count += files[i]->Count();
+	return count;
+}
+
+size_t CCaptureAnalyzer::Bytes() const
+{
+	size_t bytes = 0;
+	for(size_t i = 0; i < files.size(); i++)
+		bytes += files[i]->Bytes();
+	return bytes;
+}
+
+int CCaptureAnalyzer::DefaultJobs()
+{
+	unsigned cores = std::thread::hardware_concurrency();
+	return cores ? (int)cores : 1;
+}
+
+/* Analyze everything added so far on jobs threads, this one included */
+void CCaptureAnalyzer::Run(int jobs, WM_ANALYTICS *out)
+{
+	if(jobs < 1)
+		jobs = 1;
+
+	std::vector<WM_ANALYTICS> partial(jobs);
+	memset(&partial[0], 0, sizeof(WM_ANALYTICS) * jobs);
+	next = 0;
+
+	std::vector<std::thread> workers;
+	for(int i = 1; i < jobs; i++)
+		workers.push_back(std::thread(&CCaptureAnalyzer::Work, this, &partial[i]));
+	Work(&partial[0]);
+	for(size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	memset(out, 0, sizeof(*out));
+	out->files = files.size();
+	for(int i = 0; i < jobs; i++)
+		Merge(out, &partial[i]);
+}
+
+/* Worker - take chunks until there are none left */
+void CCaptureAnalyzer::Work(WM_ANALYTICS *out)
+{
+	for(;;)
+	{
+		size_t index = next.fetch_add(1);
+		if(index >= chunks.size())
+			break;
+		const _chunk *chunk = &chunks[index];
+		Analyze(files[chunk->file], chunk->first, chunk->count, out);
+	}
+}
+
+static int Bin(float value, float low, float high, int bins)
+{
+	int bin = (int)((value - low) / (high - low) * bins);
+	return bin < 0 ? 0 : bin >= bins ? bins - 1 : bin;
+}
+
+static bool Shaking(float x, float y, float z)
+{
+	return x * x + y * y + z * z > WM_AN_SHAKE_G * WM_AN_SHAKE_G;
+}
+
+/* Decode count records from first and add what they show to out */
+void CCaptureAnalyzer::Analyze(const CCaptureMap *map, size_t first, size_t count, WM_ANALYTICS *out)
+{
+	const WM_CAPTURE_RECORD *records = map->Records();
+	CWiimote decoder(map->Header());
+
+	/* Settle the decoder on what came just before the chunk */
+	size_t warm = first < WM_AN_WARMUP ? first : WM_AN_WARMUP;
+	for(size_t i = first - warm; i < first; i++)
+		decoder.DecodeReport(records[i].data, records[i].length);
+
+	unsigned short buttons = decoder.ButtonMask();
+	bool chukC = decoder.mote.chuk.button.c;
+	bool chukZ = decoder.mote.chuk.button.z;
+	decoder.Derive(WM_DERIVE_FORCE | WM_DERIVE_CHUK_FORCE);
+	bool moteShake = Shaking(decoder.mote.force.x, decoder.mote.force.y, decoder.mote.force.z);
+	bool chukShake = decoder.mote.chuk.connected && Shaking(decoder.mote.chuk.force.x, decoder.mote.chuk.force.y, decoder.mote.chuk.force.z);
+	const WM_CAPTURE_RECORD *previous = first ? &records[first - 1] : NULL;
+	const WM_CAPTURE_RECORD *lastData = NULL; /* continuous gaps are measured between data reports */
+	for(size_t i = first; i-- > first - warm;)
+	{
+		if(records[i].data[0] >= WM_MODE_DEFAULT)
+		{
+			lastData = &records[i];
+			break;
+		}
+	}
+
+	for(size_t i = first; i < first + count; i++)
+	{
+		const WM_CAPTURE_RECORD *record = &records[i];
+		byte type = record->data[0];
+		decoder.DecodeReport(record->data, record->length);
+
+		out->records++;
+		if(type >= WM_STATS_FIRST_TYPE && type < WM_STATS_FIRST_TYPE + WM_AN_REPORT_TYPES)
+			out->byType[type - WM_STATS_FIRST_TYPE]++;
+		else
+			out->otherType++;
+
+		if(previous && record->seq > previous->seq + 1)
+			out->captureDrops += record->seq - previous->seq - 1;
+		if(type >= WM_MODE_DEFAULT)
+		{
+			if(lastData && record->time > lastData->time)
+			{
+				/* As CReportStats counts them: more than 1.5 periods is a gap */
+				WM_TIME interval = record->time - lastData->time;
+				if(interval * 8 > WM_REPORT_PERIOD_NS * WM_GAP_THRESHOLD_EIGHTHS)
+					out->linkDrops += (interval + WM_REPORT_PERIOD_NS / 2) / WM_REPORT_PERIOD_NS - 1;
+			}
+			lastData = record;
+		}
+		previous = record;
+
+		/* Presses are counted on the way down */
+		unsigned short now = decoder.ButtonMask();
+		unsigned short pressed = now & ~buttons;
+		for(int bit = 0; pressed; bit++, pressed >>= 1)
+			if(pressed & 1)
+				out->presses[bit]++;
+		buttons = now;
+		if(decoder.mote.chuk.button.c && !chukC)
+			out->chukPresses[0]++;
+		if(decoder.mote.chuk.button.z && !chukZ)
+			out->chukPresses[1]++;
+		chukC = decoder.mote.chuk.button.c;
+		chukZ = decoder.mote.chuk.button.z;
+
+		/* Only reports that carry motion say anything about it */
+		if(type == WM_MODE_ACC || type == WM_MODE_ACC_EXT || type == WM_MODE_ACC_IR || type == WM_MODE_ACC_IR_EXT)
+		{
+			decoder.Derive(WM_DERIVE_FORCE | WM_DERIVE_TILT);
+			bool shake = Shaking(decoder.mote.force.x, decoder.mote.force.y, decoder.mote.force.z);
+			if(shake && !moteShake)
+				out->moteShakes++;
+			moteShake = shake;
+
+			const float *tilt[3] = { &decoder.mote.tilt.x, &decoder.mote.tilt.y, &decoder.mote.tilt.z };
+			for(int axis = 0; axis < 3; axis++)
+			{
+				if(*tilt[axis] == *tilt[axis]) /* NaN past 1G */
+					out->tilt[axis][Bin(*tilt[axis], -90.0f, 90.0f, WM_AN_TILT_BINS)]++;
+				else
+					out->tiltOutOfRange++;
+			}
+		}
+		if(decoder.mote.chuk.connected && (type == WM_MODE_ACC_EXT || type == WM_MODE_EXT))
+		{
+			decoder.Derive(WM_DERIVE_CHUK_FORCE | WM_DERIVE_STICK);
+			bool shake = Shaking(decoder.mote.chuk.force.x, decoder.mote.chuk.force.y, decoder.mote.chuk.force.z);
+			if(shake && !chukShake)
+				out->chukShakes++;
+			chukShake = shake;
+
+			out->stick[0][Bin(decoder.mote.chuk.stick.x, -1.0f, 1.0f, WM_AN_STICK_BINS)]++;
+			out->stick[1][Bin(decoder.mote.chuk.stick.y, -1.0f, 1.0f, WM_AN_STICK_BINS)]++;
+		}
+	}
+
+	/* The file's span is counted once, by the chunk holding its last record */
+	if(first + count == map->Count() && count)
+		out->duration += records[first + count - 1].time - records[0].time;
+}
+
+void CCaptureAnalyzer::Merge(WM_ANALYTICS *into, const WM_ANALYTICS *from)
+{
+	unsigned long long *a = (unsigned long long *)into;
+	const unsigned long long *b = (const unsigned long long *)from;
+	for(size_t i = 0; i < sizeof(WM_ANALYTICS) / sizeof(unsigned long long); i++)
+		a[i] += b[i];
+}
+
+static void PrintHistogram(FILE *out, const char *label, const unsigned long long *bins, int count, float low, float high)
+{
+	unsigned long long total = 0, most = 0;
+	for(int i = 0; i < count; i++)
+	{
+		total += bins[i];
+		if(bins[i] > most)
+			most = bins[i];
+	}
+	if(!total)
+		return;
+
+	fprintf(out, "%s:\n", label);
+	float width = (high - low) / count;
+	for(int i = 0; i < count; i++)
+	{
+		if(!bins[i])
+			continue;
+		int bar = (int)(bins[i] * 40 / most);
+		fprintf(out, "  %6.1f to %6.1f %6.2f%% ", low + i * width, low + (i + 1) * width, bins[i] * 100.0 / total);
+		for(int j = 0; j < bar; j++)
+			fputc('#', out);
+		fputc('\n', out);
+	}
+}
+
+void CCaptureAnalyzer::Print(FILE *out, const WM_ANALYTICS *summary)
+{
+	double minutes = summary->duration / (60.0 * WM_NS_PER_SEC);
+	unsigned long long data = 0;
+	for(int type = WM_MODE_DEFAULT; type < WM_STATS_FIRST_TYPE + WM_AN_REPORT_TYPES; type++)
+		data += summary->byType[type - WM_STATS_FIRST_TYPE];
+
+	fprintf(out, "%llu records in %llu file%s, %.1f minutes\n", summary->records, summary->files,
+		summary->files == 1 ? "" : "s", minutes);
+	fprintf(out, "Report types:");
+	for(int i = 0; i < WM_AN_REPORT_TYPES; i++)
+		if(summary->byType[i])
+			fprintf(out, " 0x%02x %llu", WM_STATS_FIRST_TYPE + i, summary->byType[i]);
+	if(summary->otherType)
+		fprintf(out, " other %llu", summary->otherType);
+	fprintf(out, "\n");
+	fprintf(out, "Dropped: %llu by the capture (%.3f%%), about %llu on the link (%.3f%% of data reports)\n",
+		summary->captureDrops, summary->captureDrops * 100.0 / (summary->records + summary->captureDrops + !summary->records),
+		summary->linkDrops, summary->linkDrops * 100.0 / (data + summary->linkDrops + !data));
+
+	fprintf(out, "Button presses:");
+	for(int bit = 0; bit < WM_AN_BUTTONS; bit++)
+		if(buttonNames[bit] && summary->presses[bit])
+			fprintf(out, " %s %llu", buttonNames[bit], summary->presses[bit]);
+	if(summary->chukPresses[0] || summary->chukPresses[1])
+		fprintf(out, " C %llu Z %llu", summary->chukPresses[0], summary->chukPresses[1]);
+	fprintf(out, "\n");
+	fprintf(out, "Shakes over %.1fG: mote %llu (%.1f/min), nunchuk %llu (%.1f/min)\n", WM_AN_SHAKE_G,
+		summary->moteShakes, minutes > 0 ? summary->moteShakes / minutes : 0.0,
+		summary->chukShakes, minutes > 0 ? summary->chukShakes / minutes : 0.0);
+
+	static const char *tiltNames[3] = { "Tilt x (degrees)", "Tilt y (degrees)", "Tilt z (degrees)" };
+	for(int axis = 0; axis < 3; axis++)
+		PrintHistogram(out, tiltNames[axis], summary->tilt[axis], WM_AN_TILT_BINS, -90.0f, 90.0f);
+	if(summary->tiltOutOfRange)
+		fprintf(out, "  %llu axis readings past 1G had no tilt\n", summary->tiltOutOfRange);
+	PrintHistogram(out, "Stick x", summary->stick[0], WM_AN_STICK_BINS, -1.0f, 1.0f);
+	PrintHistogram(out, "Stick y", summary->stick[1], WM_AN_STICK_BINS, -1.0f, 1.0f);
+}
+
+/* Replay every file through mode's pointer and schedule, looking at the
+pointer refresh times a second. Files are replayed one at a time, each from
+its own first report. */
+void CCaptureAnalyzer::Smoothness(int mode, const WM_SCHED_CONFIG *schedule, int refresh, WM_SMOOTHNESS *out) const
+{
+	memset(out, 0, sizeof(*out));
+	double variance = 0, lag = 0;
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		WM_SMOOTHNESS file;
+		memset(&file, 0, sizeof(file));
+		Replay(files[i], mode, schedule, refresh, &file);
+
+		out->reports += file.reports;
+		out->frames += file.frames;
+		out->moves += file.moves;
+		out->seconds += file.seconds;
+		variance += file.stepVariance * file.frames;
+		lag += file.lagMs * file.frames;
+		if(file.drift > out->drift)
+			out->drift = file.drift;
+	}
+	if(out->frames)
+	{
+		out->stepVariance = variance / out->frames;
+		out->lagMs = lag / out->frames;
+	}
+}
+
+/* Note a mouse move, as where it leaves the pointer */
+void CCaptureAnalyzer::Send(std::vector<_point> *sent, WM_TIME time, int dx, int dy)
+{
+	_point point;
+	point.time = time;
+	point.x = sent->empty() ? dx : sent->back().x + dx;
+	point.y = sent->empty() ? dy : sent->back().y + dy;
+	sent->push_back(point);
+}
+
+void CCaptureAnalyzer::Replay(const CCaptureMap *map, int mode, const WM_SCHED_CONFIG *schedule, int refresh, WM_SMOOTHNESS *out)
+{
+	const WM_CAPTURE_RECORD *records = map->Records();
+	size_t count = map->Count();
+	if(count < 2 || refresh < 1)
+		return;
+
+	CWiimote decoder(map->Header());
+	CProfile *profile = CProfile::Builtin(mode);
+	CSampleClock clock;
+	clock.SetStreaming(true);
+	CPointerScheduler scheduler;
+	scheduler.Configure(schedule);
+
+	std::vector<_point> sent; /* the pointer after each move */
+	std::vector<_point> ideal; /* where each report meant it to be, when it arrived */
+	_point want = { 0, 0, 0 };
+	bool moved = false;
+	int dx, dy;
+	for(size_t i = 0; i < count; i++)
+	{
+		const WM_CAPTURE_RECORD *record = &records[i];
+		WM_TIME arrival = record->time;
+
+		/* The ticks the loop would have woken for while waiting */
+		for(WM_TIME next = scheduler.NextTick(); next && next < arrival; next = scheduler.NextTick())
+			if(scheduler.Tick(next, &dx, &dy))
+				Send(&sent, next, dx, dy);
+
+		decoder.DecodeReport(record->data, record->length);
+		decoder.mote.sampleTime = clock.Stamp(arrival, record->data[0] >= WM_MODE_DEFAULT);
+		decoder.mote.sampleDt = clock.Delta();
+		out->reports++;
+
+		/* As Poll() and then MapReport() go */
+		float moveX, moveY;
+		if(scheduler.Tick(arrival, &dx, &dy))
+			Send(&sent, arrival, dx, dy);
+		decoder.PointerMotion(profile, &moveX, &moveY);
+		if(scheduler.Enabled())
+		{
+			scheduler.Add(decoder.mote.sampleTime, clock.Period(), moveX, moveY);
+			want.x += moveX;
+			want.y += moveY;
+		}
+		else if((int)moveX || (int)moveY)
+		{
+			Send(&sent, arrival, (int)moveX, (int)moveY);
+			want.x += (int)moveX;
+			want.y += (int)moveY;
+		}
+		want.time = arrival;
+		moved = moved || want.x || want.y;
+		ideal.push_back(want);
+	}
+	WM_TIME last = records[count - 1].time;
+	for(WM_TIME next = scheduler.NextTick(); next && next < last + WM_NS_PER_SEC; next = scheduler.NextTick())
+		if(scheduler.Tick(next, &dx, &dy))
+			Send(&sent, next, dx, dy);
+	delete profile;
+
+	/* Look at the pointer once a frame, from half a frame in */
+	double frame = (double)WM_NS_PER_SEC / refresh;
+	std::vector<_point> frames;
+	size_t shown = 0;
+	_point pointer = { 0, 0, 0 };
+	double squares = 0, stepX = 0, stepY = 0;
+	for(double at = records[0].time + frame / 2; at <= last; at += frame)
+	{
+		while(shown < sent.size() && sent[shown].time <= (WM_TIME)at)
+			pointer = sent[shown++];
+		pointer.time = (WM_TIME)at;
+
+		if(!frames.empty())
+		{
+			double x = pointer.x - frames.back().x;
+			double y = pointer.y - frames.back().y;
+			if(frames.size() > 1)
+				squares += (x - stepX) * (x - stepX) + (y - stepY) * (y - stepY);
+			stepX = x;
+			stepY = y;
+		}
+		frames.push_back(pointer);
+	}
+
+	out->frames = frames.size();
+	out->moves = sent.size();
+	out->seconds = (double)(last - records[0].time) / WM_NS_PER_SEC;
+	out->stepVariance = frames.size() > 2 ? squares / (2.0 * (frames.size() - 2)) : 0;
+	double endX = sent.empty() ? 0 : sent.back().x;
+	double endY = sent.empty() ? 0 : sent.back().y;
+	out->drift = sqrt((endX - want.x) * (endX - want.x) + (endY - want.y) * (endY - want.y));
+
+	/* The lag that lines the frames up best with the reports, coarse then fine */
+	if(!moved)
+		return;
+	double best = 0, bestError = -1;
+	for(double lagMs = -WM_AN_LAG_RANGE_MS; lagMs <= WM_AN_LAG_RANGE_MS; lagMs += WM_AN_LAG_COARSE_MS)
+	{
+		double error = LagError(frames, ideal, lagMs);
+		if(bestError < 0 || error < bestError)
+		{
+			bestError = error;
+			best = lagMs;
+		}
+	}
+	double coarse = best;
+	for(double lagMs = coarse - WM_AN_LAG_COARSE_MS; lagMs <= coarse + WM_AN_LAG_COARSE_MS; lagMs += WM_AN_LAG_FINE_MS)
+	{
+		double error = LagError(frames, ideal, lagMs);
+		if(error < bestError)
+		{
+			bestError = error;
+			best = lagMs;
+		}
+	}
+	out->lagMs = best;
+}
+
+/* How far the frames are from the reports' positions lagMs earlier, squared
+and added up. Between reports the positions are joined by straight lines. */
+double CCaptureAnalyzer::LagError(const std::vector<_point> &frames, const std::vector<_point> &ideal, double lagMs)
+{
+	double error = 0;
+	size_t k = 0;
+	for(size_t j = 0; j < frames.size(); j++)
+	{
+		double at = frames[j].time - lagMs * WM_NS_PER_MS;
+		while(k + 1 < ideal.size() && ideal[k + 1].time <= at)
+			k++;
+
+		double x = ideal[k].x, y = ideal[k].y;
+		if(at <= ideal[k].time)
+		{
+			/* Before the first report: nothing has moved yet */
+			x = y = 0;
+		}
+		else if(k + 1 < ideal.size())
+		{
+			double part = (at - ideal[k].time) / (double)(ideal[k + 1].time - ideal[k].time);
+			x += (ideal[k + 1].x - x) * part;
+			y += (ideal[k + 1].y - y) * part;
+		}
+		error += (frames[j].x - x) * (frames[j].x - x) + (frames[j].y - y) * (frames[j].y - y);
+	}
+	return error;
+}
@@ -0,0 +1,148 @@
+/*************************
+Analytics.h
+
+Offline statistics over capture files (see Capture.h): which buttons get
+pressed, how often the mote and nunchuk are shaken, where tilt and the stick
+spend their time, and how many reports went missing.
+
+CCaptureAnalyzer maps each capture read-only and cuts it into chunks of
+WM_AN_CHUNK records. Records are fixed-size, so every chunk starts on a
+record. Worker threads take chunks off a shared counter until none are left.
+Each worker decodes its chunks with an offline CWiimote - the same
+DecodeReport() and calibration code the live loop runs, calibrated from the
+chunk's own file header - and adds to a summary of its own. The per-worker
+summaries are added together at the end, so workers share nothing but the
+counter and the mapped files.
+
+A chunk's first records depend on what came before them (a button is only
+pressed if it was up in the report before, and a report without the
+accelerometer keeps the last one's), so each worker first decodes the
+WM_AN_WARMUP records ahead of its chunk without counting them. Chunk
+boundaries don't depend on the number of workers, so the summary comes out
+the same whatever it is.
+
+Smoothness() replays the captures through a pointer schedule instead (see
+PointerScheduler.h), one file after another on one thread: each report is
+decoded at its recorded arrival time and mapped through the pointer of the
+given mode's built-in profile, and output ticks run as DebugLoop() would run
+them. The pointer is then looked at once
+per display frame. It measures:
+	step variance	how unevenly the pointer moves from frame to frame:
+			half the mean square of each frame's step less the
+			one before, so steady motion scores 0 whatever its
+			speed, and one jump per report on a faster display
+			scores high
+	lag		how far, in ms, the pointer runs behind a line drawn
+			through where each report put it when it arrived,
+			fitted over the whole replay; negative is ahead, and 0
+			if the pointer never moved
+	drift		counts between where the pointer ended up and where
+			the reports add up to
+**************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include "Timing.h"
+#include "Capture.h"
+#include "PointerScheduler.h"
+
+#define WM_AN_CHUNK 65536 /* records per chunk, about 2.5 MB */
+#define WM_AN_WARMUP 64 /* records decoded ahead of a chunk to settle the state */
+#define WM_AN_BUTTONS 16 /* bits of CWiimote::ButtonMask() */
+#define WM_AN_TILT_BINS 36 /* 5 degrees each, -90 to 90 */
+#define WM_AN_STICK_BINS 20 /* 0.1 each, -1 to 1 */
+#define WM_AN_SHAKE_G 2.0f /* more force than this is a shake */
+#define WM_AN_REPORT_TYPES 0x20 /* 0x20 - 0x3f, as in ReportStats.h */
+#define WM_AN_LAG_RANGE_MS 50 /* lag is looked for this far either side of 0 */
+#define WM_AN_LAG_COARSE_MS 1.0 /* first in steps of this */
+#define WM_AN_LAG_FINE_MS 0.05 /* then in these, around the best */
+
+/* The summary. Counters only, so summaries add up as one array. */
+struct WM_ANALYTICS {
+	unsigned long long files;
+	unsigned long long records;
+	unsigned long long byType[WM_AN_REPORT_TYPES];
+	unsigned long long otherType;
+	unsigned long long duration; /* ns between the first and last record of each file, added up */
+	unsigned long long captureDrops; /* gaps in the sequence numbers: the capture couldn't keep up */
+	unsigned long long linkDrops; /* reports estimated lost from gaps in continuous reporting */
+	unsigned long long presses[WM_AN_BUTTONS]; /* by ButtonMask() bit */
+	unsigned long long chukPresses[2]; /* C, Z */
+	unsigned long long moteShakes;
+	unsigned long long chukShakes;
+	unsigned long long tilt[3][WM_AN_TILT_BINS]; /* mote tilt x, y, z */
+	unsigned long long stick[2][WM_AN_STICK_BINS];
+	unsigned long long tiltOutOfRange; /* more than 1G on an axis, so no tilt */
+};
+
+/* Pointer motion replayed through one schedule */
+struct WM_SMOOTHNESS {
+	unsigned long long reports;
+	unsigned long long frames; /* display frames the pointer was looked at in */
+	unsigned long long moves; /* mouse moves sent */
+	double seconds; /* of capture */
+	double stepVariance; /* counts squared */
+	double lagMs;
+	double drift; /* counts, the most of any file */
+};
+
+/* One capture file, mapped read-only */
+class CCaptureMap
+{
+public:
+	CCaptureMap(void);
+	~CCaptureMap(void);
+	BOOL Open(const char *path);
+	void Close();
+	const WM_CAPTURE_HEADER *Header() const;
+	const WM_CAPTURE_RECORD *Records() const;
+	size_t Count() const;
+	size_t Bytes() const;
+private:
+	const byte *view;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+class CCaptureAnalyzer
+{
+public:
+	CCaptureAnalyzer(void);
+	~CCaptureAnalyzer(void);
+	BOOL Add(const char *path);
+	void Run(int jobs, WM_ANALYTICS *out);
+	void Smoothness(int mode, const WM_SCHED_CONFIG *schedule, int refresh, WM_SMOOTHNESS *out) const;
+	size_t Records() const;
+	size_t Bytes() const;
+	static int DefaultJobs();
+	static void Merge(WM_ANALYTICS *into, const WM_ANALYTICS *from);
+	static void Print(FILE *out, const WM_ANALYTICS *summary);
+private:
+	struct _chunk {
+		int file;
+		size_t first;
+		size_t count;
+	};
+
+	struct _point {
+		WM_TIME time;
+		double x;
+		double y;
+	};
+
+	void Work(WM_ANALYTICS *out);
+	static void Analyze(const CCaptureMap *map, size_t first, size_t count, WM_ANALYTICS *out);
+	static void Replay(const CCaptureMap *map, int mode, const WM_SCHED_CONFIG *schedule, int refresh, WM_SMOOTHNESS *out);
+	static void Send(std::vector<_point> *sent, WM_TIME time, int dx, int dy);
+	static double LagError(const std::vector<_point> &frames, const std::vector<_point> &ideal, double lagMs);
+
+	std::vector<CCaptureMap *> files;
+	std::vector<_chunk> chunks;
+	std::atomic<size_t> next; /* next chunk to hand out */
+};
@@ -0,0 +1,2356 @@
+/*************************
+Bench.cpp
+
+Measurement runs for the -bench option. See Bench.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+#include "Bench.h"
+#include "Analytics.h"
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <limits>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include "VirtualMote.h"
+#endif
+
+/* A sweep from 200 Hz to 1200 Hz, the kind of thing the speaker manages */
+static void MakeSweep(short *pcm, int samples, int sampleRate)
+{
+	double phase = 0;
+	for(int i = 0; i < samples; i++)
+	{
+		double freq = 200.0 + 1000.0 * i / samples;
+		phase += 2.0 * M_PI * freq / sampleRate;
+		pcm[i] = (short)(12000.0 * sin(phase));
+	}
+}
+
+/* ADPCM encoder speed, and signal-to-noise of a decode of its output */
+static void BenchAdpcm()
+{
+	const int samples = 1 << 20;
+	std::vector<short> pcm(samples);
+	std::vector<short> decoded(samples);
+	std::vector<byte> adpcm(samples / 2);
+	MakeSweep(&pcm[0], samples, WM_SPKR_RATE);
+
+	CAdpcmEncoder encoder;
+	WM_TIME best = 0;
+	for(int pass = 0; pass < 5; pass++)
+	{
+		encoder.Reset();
+		WM_TIME t = WmNow();
+		encoder.Encode(&pcm[0], samples, &adpcm[0]);
+		t = WmNow() - t;
+		if(!best || t < best)
+			best = t;
+	}
+
+	AdpcmDecode(&adpcm[0], samples, &decoded[0]);
+	double signal = 0, noise = 0;
+	for(int i = 0; i < samples; i++)
+	{
+		double error = (double)pcm[i] - decoded[i];
+		signal += (double)pcm[i] * pcm[i];
+		noise += error * error;
+	}
+
+	printf("ADPCM encode: %d samples in %.2f ms, %.1f Msamples/s (%.2f ns/sample), SNR %.1f dB\n",
+		samples, (double)best / WM_NS_PER_MS, samples * 1000.0 / best,
+		(double)best / samples, 10.0 * log10(signal / (noise > 0 ? noise : 1)));
+}
+
+#define WM_BENCH_POOL_ROUNDS 250000
+#define WM_BENCH_POOL_HELD 16
+
+/* One pool bench thread: take a handful of slots with two references each, then drop them */
+static void PoolWorker(CReportPool *pool, std::atomic<unsigned long long> *misses)
+{
+	WM_REPORT *held[WM_BENCH_POOL_HELD];
+
+	for(int round = 0; round < WM_BENCH_POOL_ROUNDS; round++)
+	{
+		int n = 0;
+		for(; n < WM_BENCH_POOL_HELD; n++)
+		{
+			held[n] = pool->Acquire();
+			if(!held[n])
+			{
+				(*misses)++;
+				break;
+			}
+			ReportAddRef(held[n]); /* a second consumer */
+		}
+
+		for(int i = 0; i < n; i++)
+		{
+			ReportRelease(held[i]);
+			ReportRelease(held[i]);
+		}
+	}
+}
+
+/* Hammer the report pool from several threads and check every slot finds its way back */
+static void BenchPool()
+{
+	const int threads = 4;
+	CReportPool *pool = new CReportPool;
+	std::atomic<unsigned long long> misses;
+	misses = 0;
+
+	std::thread workers[threads];
+	WM_TIME t = WmNow();
+	for(int i = 0; i < threads; i++)
+		workers[i] = std::thread(PoolWorker, pool, &misses);
+	for(int i = 0; i < threads; i++)
+		workers[i].join();
+	t = WmNow() - t;
+
+	unsigned long long pairs = (unsigned long long)threads * WM_BENCH_POOL_ROUNDS * WM_BENCH_POOL_HELD;
+	printf("Report pool: %llu acquire/release pairs on %d threads, %.1f ns each, %llu misses, %d of %d slots free after\n",
+		pairs, threads, (double)t / pairs, (unsigned long long)misses, pool->Available(), WM_POOL_SLOTS);
+
+	delete pool;
+}
+
+#define WM_BENCH_NET_DEVICES 4
+#define WM_BENCH_NET_PORT (WM_NET_PORT + 1)
+#define WM_BENCH_NET_EPOCH_US ((3ULL << 32) - 5000000) /* the time's low word wraps halfway through */
+
+/* Something like a mote in a hand at tick n: 8-bit accelerometer steps,
+tilt that follows them, a button now and then, a wandering stick, no IR */
+static void FakeMoteState(WM_SHARED_STATE *state, int device, int tick)
+{
+	memset(state, 0, sizeof(*state));
+	double t = tick / 100.0 + device;
+
+	for(int i = 0; i < 3; i++)
+	{
+		int raw = (int)floor(128.5 + 20 * sin(t * (0.7 + 0.3 * i)) + (i == 2 ? 26 : 0));
+		state->force[i] = (raw - 128) / 26.f;
+		int chukRaw = (int)floor(128.5 + 30 * cos(t * (0.5 + 0.2 * i)));
+		state->chukForce[i] = (chukRaw - 128) / 51.f;
+	}
+	for(int i = 0; i < 3; i++)
+	{
+		state->tilt[i] = (float)(asin(state->force[i] > 1 ? 1 : (state->force[i] < -1 ? -1 : state->force[i])) * 180 / M_PI);
+		state->chukTilt[i] = state->chukForce[i] * 57.f;
+	}
+	state->stick[0] = (float)(floor(0.5 + 100 * sin(t / 3)) / 127);
+	state->stick[1] = (float)(floor(0.5 + 100 * cos(t / 3)) / 127);
+	state->buttons = (tick / 50 + device) % 7 == 0 ? WM_BUT_A : 0;
+	state->time = WM_BENCH_NET_EPOCH_US * WM_NS_PER_US + tick * 10 * WM_NS_PER_MS + device * 1234;
+	state->flags = WM_SHM_CONNECTED | WM_SHM_CHUK;
+	state->battery = 80;
+	for(int i = 0; i < WM_SHM_IR_DOTS; i++)
+		state->ir[i].x = state->ir[i].y = 0x3ff;
+}
+
+/* Delta frames against whole structs over loopback: bytes for 10 s of 4 motes at
+100 Hz, then round-trip cost of one batch, sent and received on this thread */
+static int BenchNet()
+{
+	CStateReceiver receiver;
+	CStateSender sender;
+	if(!receiver.Open(WM_BENCH_NET_PORT) || !sender.Open("127.0.0.1", WM_BENCH_NET_PORT, WM_BENCH_NET_DEVICES))
+		return 1;
+
+	const int ticks = 1000;
+	WM_SHARED_STATE state;
+	double worstTilt = 0, worstForce = 0;
+	WM_TIME worstTime = 0;
+
+	for(int tick = 0; tick < ticks; tick++)
+	{
+		for(int device = 0; device < WM_BENCH_NET_DEVICES; device++)
+		{
+			FakeMoteState(&state, device, tick);
+			sender.Queue(device, &state);
+		}
+		while(receiver.Receive(0) > 0)
+			;
+
+		/* What arrived should match what went in, to quantization */
+		for(int device = 0; device < WM_BENCH_NET_DEVICES; device++)
+		{
+			WM_SHARED_STATE got;
+			FakeMoteState(&state, device, tick);
+			if(!receiver.GetState(device, &got))
+				continue;
+			for(int i = 0; i < 3; i++)
+			{
+				worstTilt = max(worstTilt, fabs((double)got.tilt[i] - state.tilt[i]));
+				worstForce = max(worstForce, fabs((double)got.force[i] - state.force[i]));
+			}
+			WM_TIME off = got.time > state.time ? got.time - state.time : state.time - got.time;
+			worstTime = max(worstTime, off);
+		}
+	}
+
+	WM_NET_STATS sent, received;
+	sender.GetStats(&sent);
+	receiver.GetStats(&received);
+
+	double seconds = ticks / 100.0;
+	double naiveBytes = (4.0 + WM_BENCH_NET_DEVICES * sizeof(WM_SHARED_STATE)) * ticks;
+	printf("Net stream, %d motes at 100 Hz:\n", WM_BENCH_NET_DEVICES);
+	printf("  delta:  %.0f bytes/s payload (%.0f with UDP/IP headers), %.1f bytes a frame, %llu keyframes, %llu lost\n",
+		sent.bytes / seconds, (sent.bytes + 28.0 * sent.datagrams) / seconds, (double)sent.bytes / sent.frames,
+		sent.keyframes, received.lost);
+	printf("  struct: %.0f bytes/s payload (%.0f with UDP/IP headers)\n",
+		naiveBytes / seconds, (naiveBytes + 28.0 * ticks) / seconds);
+	printf("  quantization error: tilt %.3f degrees, force %.4f G, sample time %llu ns%s\n",
+		worstTilt, worstForce, worstTime, worstTime < WM_NS_PER_US ? "" : " WRONG");
+
+	/* Round trips, one batch in flight at a time */
+	const int trips = 5000;
+	WM_TIME deltaTime = 0, naiveTime = 0;
+	std::vector<byte> naive(4 + WM_BENCH_NET_DEVICES * sizeof(WM_SHARED_STATE));
+	std::vector<byte> back(naive.size());
+	WM_SHARED_STATE states[WM_BENCH_NET_DEVICES];
+
+	for(int trip = 0; trip < trips; trip++)
+	{
+		WM_TIME t = WmNow();
+		for(int device = 0; device < WM_BENCH_NET_DEVICES; device++)
+		{
+			FakeMoteState(&state, device, ticks + trip);
+			sender.Queue(device, &state);
+		}
+		receiver.Receive(100);
+		deltaTime += WmNow() - t;
+
+		t = WmNow();
+		for(int device = 0; device < WM_BENCH_NET_DEVICES; device++)
+		{
+			FakeMoteState(&state, device, ticks + trip);
+			memcpy(&naive[4 + device * sizeof(WM_SHARED_STATE)], &state, sizeof(state));
+		}
+		sender.SendRaw(&naive[0], (int)naive.size());
+		if(receiver.ReceiveRaw(&back[0], (int)back.size(), 100) == (int)back.size())
+			memcpy(states, &back[4], sizeof(states));
+		naiveTime += WmNow() - t;
+	}
+
+	printf("  loopback send to decoded: delta %.1f us, struct %.1f us a batch (includes building the states)\n",
+		(double)deltaTime / trips / WM_NS_PER_US, (double)naiveTime / trips / WM_NS_PER_US);
+	return worstTime < WM_NS_PER_US ? 0 : 1;
+}
+
+#define WM_BENCH_CLOCK_REPORTS 6000 /* a minute of continuous reporting */
+#define WM_BENCH_CLOCK_PERIOD_NS 10020000ULL /* a mote running 0.2% slow */
+#define WM_BENCH_CLOCK_DELAY_NS (1500 * WM_NS_PER_US) /* radio and stack latency at best */
+#define WM_BENCH_CLOCK_JITTER_NS (500 * WM_NS_PER_US) /* mean extra latency */
+#define WM_BENCH_CLOCK_STALL_ODDS 40 /* one report in this many starts a stall */
+#define WM_BENCH_CLOCK_DROP_ODDS 500 /* one report in this many is lost */
+
+/* Deterministic uniform 0 - 1, so every run sees the same link */
+static double BenchRandom(unsigned *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return ((*state >> 8) & 0xffffff) / (double)0x1000000;
+}
+
+static void PrintClockErrors(const char *label, std::vector<double> *interval, std::vector<double> *offset)
+{
+	std::sort(interval->begin(), interval->end());
+	std::sort(offset->begin(), offset->end());
+	size_t n = interval->size();
+	size_t m = offset->size();
+	printf("  %-13s interval error p50 %7.3f p99 %7.3f max %7.3f ms   time error p50 %7.3f p99 %7.3f max %7.3f ms\n", label,
+		(*interval)[n / 2], (*interval)[n * 99 / 100], (*interval)[n - 1],
+		(*offset)[m / 2], (*offset)[m * 99 / 100], (*offset)[m - 1]);
+}
+
+/* Feed CSampleClock a simulated link that delays each report a little,
+holds some back in bursts and loses a few, and compare how far the read
+times and the reconstructed times are from when the reports were sampled */
+static int BenchClock()
+{
+	unsigned seed = 1;
+	std::vector<WM_TIME> sampled, arrived;
+	WM_TIME stallUntil = 0;
+	WM_TIME lastArrival = 0;
+	for(int k = 0; k < WM_BENCH_CLOCK_REPORTS; k++)
+	{
+		WM_TIME at = WM_NS_PER_SEC + k * WM_BENCH_CLOCK_PERIOD_NS;
+		if(BenchRandom(&seed) * WM_BENCH_CLOCK_DROP_ODDS < 1)
+			continue;
+		if(at >= stallUntil && BenchRandom(&seed) * WM_BENCH_CLOCK_STALL_ODDS < 1)
+			stallUntil = at + (WM_TIME)((20 + 40 * BenchRandom(&seed)) * WM_NS_PER_MS);
+
+		WM_TIME arrival = at + WM_BENCH_CLOCK_DELAY_NS - (WM_TIME)(WM_BENCH_CLOCK_JITTER_NS * log(1 - BenchRandom(&seed)));
+		if(arrival < stallUntil)
+			arrival = stallUntil;
+		if(arrival < lastArrival)
+			arrival = lastArrival;
+		lastArrival = arrival;
+		sampled.push_back(at);
+		arrived.push_back(arrival);
+	}
+
+	CSampleClock clock;
+	clock.SetStreaming(true);
+	std::vector<WM_TIME> stamped(arrived.size());
+	for(size_t i = 0; i < arrived.size(); i++)
+		stamped[i] = clock.Stamp(arrived[i], true);
+
+	/* Skip the first window, while the period is still being learned */
+	std::vector<double> rawInterval, rawOffset, clockInterval, clockOffset;
+	for(size_t i = WM_CLOCK_MIN_SPAN + 1; i < arrived.size(); i++)
+	{
+		double truth = (double)(sampled[i] - sampled[i - 1]);
+		rawInterval.push_back(fabs((double)(arrived[i] - arrived[i - 1]) - truth) / WM_NS_PER_MS);
+		clockInterval.push_back(fabs((double)(stamped[i] - stamped[i - 1]) - truth) / WM_NS_PER_MS);
+		rawOffset.push_back(fabs((double)arrived[i] - (double)sampled[i] - WM_BENCH_CLOCK_DELAY_NS) / WM_NS_PER_MS);
+		clockOffset.push_back(fabs((double)stamped[i] - (double)sampled[i] - WM_BENCH_CLOCK_DELAY_NS) / WM_NS_PER_MS);
+	}
+
+	printf("%d reports at %.2f ms, %.1f ms + %.1f ms mean latency, 1 in %d stalled 20-60 ms, 1 in %d lost:\n",
+		(int)arrived.size(), (double)WM_BENCH_CLOCK_PERIOD_NS / WM_NS_PER_MS, (double)WM_BENCH_CLOCK_DELAY_NS / WM_NS_PER_MS,
+		(double)WM_BENCH_CLOCK_JITTER_NS / WM_NS_PER_MS, WM_BENCH_CLOCK_STALL_ODDS, WM_BENCH_CLOCK_DROP_ODDS);
+	PrintClockErrors("read time", &rawInterval, &rawOffset);
+	PrintClockErrors("sample clock", &clockInterval, &clockOffset);
+	printf("  period estimate %.4f ms, %llu reports respaced, %llu steps\n",
+		(double)clock.Period() / WM_NS_PER_MS, clock.Respaced(), clock.Steps());
+	return 0;
+}
+
+#define WM_BENCH_LAYOUT_DECODES 4000000
+#define WM_BENCH_LAYOUT_MAX 4096
+#define WM_BENCH_LAYOUT_REPORTS 64 /* distinct reports cycled through */
+
+/* A capture header calibrating a mote with a nunchuk */
+static void FillBenchHeader(WM_CAPTURE_HEADER *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, WM_CAPTURE_MAGIC, sizeof(header->magic));
+	header->version = WM_CAPTURE_VERSION;
+	header->recordSize = sizeof(WM_CAPTURE_RECORD);
+	for(int i = 0; i < 3; i++)
+	{
+		header->moteZero[i] = header->chukZero[i] = 0x80;
+		header->moteScale[i] = 0x9a;
+		header->chukScale[i] = 0xb3;
+	}
+	header->stickMin[0] = header->stickMin[1] = 0x20;
+	header->stickMax[0] = header->stickMax[1] = 0xe0;
+	header->stickCenter[0] = header->stickCenter[1] = 0x80;
+	header->chukConnected = 1;
+}
+
+/* Decode reports for many motes in one thread, taking them in a scattered
+order as a daemon serving them all would, and read back what a mapping reads.
+Shows what each mote's state costs in cache once there are too many to stay resident. */
+static int BenchLayout()
+{
+	WM_CAPTURE_HEADER header;
+	FillBenchHeader(&header);
+
+	byte reports[WM_BENCH_LAYOUT_REPORTS][WM_PACKET_SIZE];
+	for(int n = 0; n < WM_BENCH_LAYOUT_REPORTS; n++)
+	{
+		double phase = n * 0.1;
+		byte *data = reports[n];
+		memset(data, 0, WM_PACKET_SIZE);
+		data[2] = n % 8 < 2 ? WM_BUT_A : 0;
+		data[3] = (byte)(0x80 + 12 * sin(phase));
+		data[4] = (byte)(0x80 + 12 * cos(phase * 0.7));
+		data[5] = 0x9a;
+		data[6] = (byte)(0x80 + 0x50 * sin(phase * 0.3));
+		data[7] = (byte)(0x80 + 0x50 * cos(phase * 0.2));
+		data[8] = data[9] = 0x80;
+		data[10] = 0xb3;
+		data[11] = WM_CHUK_BUT_C | WM_CHUK_BUT_Z;
+	}
+
+	printf("Decoding %d reports spread over N motes in one thread, sizeof(CWiimote) %u:\n",
+		WM_BENCH_LAYOUT_DECODES, (unsigned)sizeof(CWiimote));
+
+	for(int motes = 1; motes <= WM_BENCH_LAYOUT_MAX; motes *= 4)
+	{
+		std::vector<CWiimote *> decoders(motes);
+		for(int i = 0; i < motes; i++)
+			decoders[i] = new CWiimote(&header);
+
+		/* A fixed scattered order, the same every run */
+		unsigned seed = 1;
+		std::vector<int> order(motes);
+		for(int i = 0; i < motes; i++)
+			order[i] = i;
+		for(int i = motes - 1; i > 0; i--)
+			std::swap(order[i], order[(int)(BenchRandom(&seed) * (i + 1))]);
+
+		/* Buttons-only reports show the cost of reaching the state; full ones add the maths */
+		double best[2] = { 0, 0 };
+		float sink = 0;
+		for(int kind = 0; kind < 2; kind++)
+		{
+			for(int n = 0; n < WM_BENCH_LAYOUT_REPORTS; n++)
+				reports[n][0] = kind ? WM_MODE_ACC_EXT : WM_MODE_DEFAULT;
+			for(int pass = 0; pass < 5; pass++)
+			{
+				WM_TIME started = WmNow();
+				for(int n = 0; n < WM_BENCH_LAYOUT_DECODES; n++)
+				{
+					CWiimote *wiimote = decoders[order[n % motes]];
+					wiimote->DecodeReport(reports[(n / motes) % WM_BENCH_LAYOUT_REPORTS], WM_PACKET_SIZE);
+					sink += wiimote->Tilt().x + wiimote->Force().z + wiimote->ChukStick().x + wiimote->ButtonMask();
+				}
+				double ns = (double)(WmNow() - started) / WM_BENCH_LAYOUT_DECODES;
+				if(!best[kind] || ns < best[kind])
+					best[kind] = ns;
+			}
+		}
+		printf("  %5d motes %8.1f ns per buttons report %8.1f ns per accelerometer and nunchuk report%s\n",
+			motes, best[0], best[1], sink == 12345.f ? " " : "");
+
+		for(int i = 0; i < motes; i++)
+			delete decoders[i];
+	}
+	return 0;
+}
+
+#define WM_BENCH_DERIVE_DECODES 4000000
+
+/* Bit for bit, so a NaN tilt past 1G matches too */
+static bool SameDerived(const CWiimote *a, const CWiimote *b)
+{
+	return memcmp(&a->mote.force, &b->mote.force, sizeof(a->mote.force)) == 0
+		&& memcmp(&a->mote.tilt, &b->mote.tilt, sizeof(a->mote.tilt)) == 0
+		&& memcmp(&a->mote.chuk.force, &b->mote.chuk.force, sizeof(a->mote.chuk.force)) == 0
+		&& memcmp(&a->mote.chuk.tilt, &b->mote.chuk.tilt, sizeof(a->mote.chuk.tilt)) == 0
+		&& memcmp(&a->mote.chuk.stick, &b->mote.chuk.stick, sizeof(a->mote.chuk.stick)) == 0;
+}
+
+/* Decode accelerometer and nunchuk reports on one mote with consumers that
+read different amounts of what can be worked out from them. Tilt, force and
+the stick are only calculated for the consumers that ask, so one reading
+buttons pays for the decode alone. "Everything" is what every report cost
+when they were calculated during decoding. */
+static int BenchDerive()
+{
+	WM_CAPTURE_HEADER header;
+	FillBenchHeader(&header);
+
+	byte reports[WM_BENCH_LAYOUT_REPORTS][WM_PACKET_SIZE];
+	for(int n = 0; n < WM_BENCH_LAYOUT_REPORTS; n++)
+	{
+		double phase = n * 0.1;
+		byte *data = reports[n];
+		memset(data, 0, WM_PACKET_SIZE);
+		data[0] = WM_MODE_ACC_EXT;
+		data[2] = n % 8 < 2 ? WM_BUT_A : 0;
+		data[3] = (byte)(0x80 + 12 * sin(phase));
+		data[4] = (byte)(0x80 + 12 * cos(phase * 0.7));
+		data[5] = 0x9a;
+		data[6] = (byte)(0x80 + 0x50 * sin(phase * 0.3));
+		data[7] = (byte)(0x80 + 0x50 * cos(phase * 0.2));
+		data[8] = (byte)(0x80 + 10 * sin(phase * 0.5));
+		data[9] = 0x80;
+		data[10] = 0xb3;
+		data[11] = WM_CHUK_BUT_C | WM_CHUK_BUT_Z;
+	}
+
+	static const char *consumers[] = { "buttons", "stick", "mote tilt and force", "everything", "everything, read twice" };
+	static const unsigned groups[] = { 0, WM_DERIVE_STICK, WM_DERIVE_TILT | WM_DERIVE_FORCE, WM_DERIVE_ALL, WM_DERIVE_ALL };
+	const int kinds = sizeof(groups) / sizeof(groups[0]);
+
+	printf("Decoding %d accelerometer and nunchuk reports, best of 5:\n", WM_BENCH_DERIVE_DECODES);
+	CWiimote wiimote(&header);
+	float sink = 0;
+	for(int kind = 0; kind < kinds; kind++)
+	{
+		double best = 0;
+		for(int pass = 0; pass < 5; pass++)
+		{
+			WM_TIME started = WmNow();
+			for(int n = 0; n < WM_BENCH_DERIVE_DECODES; n++)
+			{
+				wiimote.DecodeReport(reports[n % WM_BENCH_LAYOUT_REPORTS], WM_PACKET_SIZE);
+				for(int read = kind == kinds - 1 ? 2 : 1; read > 0; read--)
+				{
+					wiimote.Derive(groups[kind]);
+					sink += wiimote.mote.tilt.x + wiimote.mote.force.z + wiimote.mote.chuk.stick.x + wiimote.ButtonMask();
+				}
+			}
+			double ns = (double)(WmNow() - started) / WM_BENCH_DERIVE_DECODES;
+			if(!best || ns < best)
+				best = ns;
+		}
+		printf("  %-24s %6.1f ns per report%s\n", consumers[kind], best, sink == 12345.f ? " " : "");
+	}
+
+	/* Values read late must be the ones the last report gives, not older ones */
+	CWiimote eager(&header), lazy(&header);
+	bool same = true;
+	for(int n = 0; n < WM_BENCH_LAYOUT_REPORTS; n++)
+	{
+		eager.DecodeReport(reports[n], WM_PACKET_SIZE);
+		eager.Derive(WM_DERIVE_ALL);
+		lazy.DecodeReport(reports[n], WM_PACKET_SIZE);
+		if(n % 5 == 0)
+			lazy.Derive(WM_DERIVE_STICK);
+		if(n % 7 == 0)
+			lazy.Derive(WM_DERIVE_TILT);
+		if(n % 9 == 0)
+		{
+			lazy.Derive(WM_DERIVE_ALL);
+			same = same && SameDerived(&eager, &lazy);
+		}
+	}
+	lazy.Derive(WM_DERIVE_ALL);
+	same = same && SameDerived(&eager, &lazy);
+	printf("Values read on demand match values calculated on every report: %s\n", same ? "yes" : "MISMATCH");
+	return same ? 0 : 1;
+}
+
+#define WM_BENCH_TRACE_LOOPS 50000000
+#define WM_BENCH_TRACE_RECORD_LOOPS 1000000 /* recording fills rings, so fewer */
+
+/* ns per pass of a loop with a begin/end tracepoint pair in it, best of 3 */
+static double BenchTraceLoop(int loops, bool traced)
+{
+	volatile unsigned long long sink = 0;
+	double best = 0;
+	for(int pass = 0; pass < 3; pass++)
+	{
+		WM_TIME started = WmNow();
+		if(traced)
+		{
+			for(int i = 0; i < loops; i++)
+			{
+				WM_TRACE_BEGIN(decode);
+				sink = sink + i;
+				WM_TRACE_END(decode, i, 0x30);
+			}
+		}
+		else
+		{
+			for(int i = 0; i < loops; i++)
+				sink = sink + i;
+		}
+		double ns = (double)(WmNow() - started) / loops;
+		if(!best || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+#ifndef _WIN32
+static int BenchTraceRun();
+#endif
+
+/* What the tracepoints cost, off and on, and (on Linux) a traced run */
+static int BenchTrace()
+{
+	double bare = BenchTraceLoop(WM_BENCH_TRACE_LOOPS, false);
+	double off = BenchTraceLoop(WM_BENCH_TRACE_LOOPS, true);
+	CTracer::Start();
+	double recording = BenchTraceLoop(WM_BENCH_TRACE_RECORD_LOOPS, true);
+	CTracer::Stop();
+	CTracer::Clear();
+
+	printf("A begin/end tracepoint pair around one add, best of 3:\n");
+	printf("  no tracepoints       %6.2f ns per pass\n", bare);
+	printf("  tracing off          %6.2f ns per pass (%+.2f ns a pair)\n", off, off - bare);
+	printf("  recording            %6.2f ns per pass (%+.2f ns a pair)\n", recording, recording - bare);
+#ifndef _WIN32
+	return BenchTraceRun();
+#else
+	return 0;
+#endif
+}
+
+#ifndef _WIN32
+
+#define WM_BENCH_RUMBLE_PLAYER_MS 30 /* how long the loop has been waiting when another thread plays */
+
+/* Play fx once the read loop has had time to settle into waiting */
+static void RumblePlayerThread(CWiimote *wiimote, const CRumbleEffect *fx, WM_TIME *played)
+{
+	Sleep(WM_BENCH_RUMBLE_PLAYER_MS);
+	*played = WmNow();
+	wiimote->rumbleFx.Play(*fx);
+}
+
+/* Play an effect on a virtual mote and compare when the mote saw the rumble bit flip
+against when the effect asked for it. Run once with the mote streaming and once with
+it silent, so effect timing is shown not to depend on reports coming in, and once
+more with the effect played from another thread while the quiet loop is waiting. */
+static void BenchRumblePass(const char *label, byte mode, byte continuous, bool fromThread = false)
+{
+	CVirtualMote vmote;
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+
+	if(!wiimote.mote.connected)
+	{
+		printf("%s: virtual mote didn't connect\n", label);
+		return;
+	}
+
+	wiimote.SetReportMode(mode, continuous);
+	Sleep(20); /* keep the mode change's write spacing out of the measurement */
+
+	CRumbleEffect fx;
+	fx.Pulse(50, 50, 5).Heartbeat(2, 90).Intensity(0.5f, 400);
+
+	/* Transitions the mote should see, ending with the motor off */
+	std::vector<WM_VMOTE_RUMBLE> expected;
+	for(size_t i = 0; i < fx.Steps(); i++)
+	{
+		WM_VMOTE_RUMBLE step;
+		step.at = fx.Step(i).at;
+		step.on = fx.Step(i).on;
+		expected.push_back(step);
+	}
+	if(!expected.empty() && expected.back().on)
+	{
+		WM_VMOTE_RUMBLE step;
+		step.at = fx.Length();
+		step.on = false;
+		expected.push_back(step);
+	}
+
+	WM_VMOTE_RUMBLE observed[WM_VMOTE_RUMBLE_LOG];
+	int before = vmote.RumbleLog(observed, WM_VMOTE_RUMBLE_LOG);
+
+	WM_TIME played = WmNow();
+	WM_TIME end = played + fx.Length() + 100 * WM_NS_PER_MS;
+	unsigned reports = 0;
+	WM_TIME longestPoll = 0;
+
+	std::thread player;
+	if(fromThread)
+	{
+		end += WM_BENCH_RUMBLE_PLAYER_MS * WM_NS_PER_MS;
+		player = std::thread(RumblePlayerThread, &wiimote, &fx, &played);
+	}
+	else
+		wiimote.rumbleFx.Play(fx);
+	while(WmNow() < end)
+	{
+		WM_TIME t = WmNow();
+		if(wiimote.Poll(WM_POLL_WAIT_MS))
+			reports++;
+		if(WmNow() - t > longestPoll)
+			longestPoll = WmNow() - t;
+	}
+	if(player.joinable())
+		player.join();
+
+	/* Let the writer thread finish sending the last change */
+	Sleep(20);
+	int count = vmote.RumbleLog(observed, WM_VMOTE_RUMBLE_LOG) - before;
+	WM_VMOTE_RUMBLE *seen = observed + before;
+
+	printf("%s: %u reports in, %d of %d transitions seen",
+		label, reports, count, (int)expected.size());
+
+	if(count > 0)
+	{
+		/* First transition anchors the rest; it also shows the lag from Play() */
+		double sum = 0, worst = 0;
+		int n = count < (int)expected.size() ? count : (int)expected.size();
+		int mismatched = 0;
+
+		for(int i = 0; i < n; i++)
+		{
+			if(seen[i].on != expected[i].on)
+				mismatched++;
+
+			double want = (double)(expected[i].at - expected[0].at);
+			double got = (double)(seen[i].at - seen[0].at);
+			double error = fabs(got - want) / WM_NS_PER_MS;
+			sum += error;
+			if(error > worst)
+				worst = error;
+		}
+
+		printf(", start lag %.2f ms, error mean %.2f ms max %.2f ms, %d out of order",
+			(double)(seen[0].at - played) / WM_NS_PER_MS, sum / n, worst, mismatched);
+	}
+
+	printf(", longest Poll() %.2f ms\n", (double)longestPoll / WM_NS_PER_MS);
+}
+
+/* Stream a clip to a virtual mote that is also streaming input, with LED changes
+competing for the output link, and measure how evenly the 0x18 reports arrive */
+static void BenchSpeakerPacing()
+{
+	CVirtualMote vmote;
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+
+	if(!wiimote.mote.connected)
+	{
+		printf("speaker: virtual mote didn't connect\n");
+		return;
+	}
+
+	wiimote.SetReportMode(WM_MODE_ACC_EXT, WM_MODE_CONT);
+	wiimote.SpeakerOn();
+	Sleep(100); /* let the speaker setup go out */
+
+	const int seconds = 3;
+	std::vector<short> pcm(WM_SPKR_RATE * seconds);
+	MakeSweep(&pcm[0], (int)pcm.size(), WM_SPKR_RATE);
+
+	WM_TIME period = SpeakerPeriod(WM_SPKR_RATE);
+	WM_TIME started = WmNow();
+	WM_TIME end = started + seconds * WM_NS_PER_SEC + 200 * WM_NS_PER_MS;
+	WM_TIME nextLed = started;
+	unsigned reports = 0;
+	byte led = WM_LED_ONE;
+
+	wiimote.PlaySound(&pcm[0], (int)pcm.size());
+	while(WmNow() < end)
+	{
+		if(wiimote.Poll(WM_POLL_WAIT_MS))
+			reports++;
+
+		if(WmNow() >= nextLed)
+		{
+			led = led == WM_LED_FOUR ? WM_LED_ONE : (byte)(led << 1);
+			wiimote.EnableLED(led);
+			nextLed += 50 * WM_NS_PER_MS;
+		}
+	}
+
+	WM_AUDIO_STATS audio;
+	wiimote.GetAudioStats(&audio);
+
+	static WM_TIME arrivals[WM_VMOTE_AUDIO_LOG];
+	int count = vmote.AudioLog(arrivals, WM_VMOTE_AUDIO_LOG);
+
+	double sum = 0, sumSquares = 0, worst = 0;
+	for(int i = 1; i < count; i++)
+	{
+		double interval = (double)(arrivals[i] - arrivals[i - 1]);
+		double error = fabs(interval - period);
+		sum += interval;
+		sumSquares += interval * interval;
+		if(error > worst)
+			worst = error;
+	}
+
+	int intervals = count > 1 ? count - 1 : 1;
+	double mean = sum / intervals;
+	double deviation = sqrt(fabs(sumSquares / intervals - mean * mean));
+
+	printf("Speaker pacing at %d Hz (mote saw %d Hz): %d of %d reports arrived, %llu bytes, %llu ignored\n",
+		WM_SPKR_RATE, vmote.SpeakerRate(), count, (int)((pcm.size() + WM_SPKR_SAMPLES - 1) / WM_SPKR_SAMPLES),
+		vmote.AudioBytes(), vmote.AudioIgnored());
+	printf("  interval mean %.3f ms (want %.3f), jitter %.3f ms, worst %.3f ms off\n",
+		mean / WM_NS_PER_MS, (double)period / WM_NS_PER_MS, deviation / WM_NS_PER_MS, worst / WM_NS_PER_MS);
+	printf("  sender: late mean %.3f ms max %.3f ms, %llu underruns; input meanwhile %.1f reports/s\n",
+		(double)audio.meanLate / WM_NS_PER_MS, (double)audio.maxLate / WM_NS_PER_MS, audio.underruns,
+		reports * (double)WM_NS_PER_SEC / (end - started));
+
+	wiimote.SpeakerOff();
+}
+
+static int BenchRumble()
+{
+	printf("Rumble effect timing (pulses, heartbeat, 50%% intensity):\n");
+	BenchRumblePass("streaming 0x31", WM_MODE_ACC, WM_MODE_CONT);
+	BenchRumblePass("quiet 0x30", WM_MODE_DEFAULT, WM_MODE_NONCONT);
+	BenchRumblePass("quiet, other thread", WM_MODE_DEFAULT, WM_MODE_NONCONT, true);
+	return 0;
+}
+
+#define WM_BENCH_IDLE_AFTER_NS (1 * WM_NS_PER_SEC)
+#define WM_BENCH_IDLE_WINDOW_MS 4000
+
+static void IdleLoopThread(CWiimote *wiimote)
+{
+	wiimote->DebugLoop();
+}
+
+static double ThreadCpuMs(std::thread *thread)
+{
+	clockid_t clock;
+	struct timespec ts;
+	if(pthread_getcpuclockid(thread->native_handle(), &clock) != 0 || clock_gettime(clock, &ts) != 0)
+		return 0;
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Wait up to timeout for DebugLoop() to be streaming (or not). Returns how long it took in ms. */
+static double WaitForIdleState(CWiimote *wiimote, bool active, WM_TIME timeout)
+{
+	WM_TIME started = WmNow();
+	while((wiimote->IdleState() == WM_IDLE_ACTIVE) != active && WmNow() - started < timeout)
+		Sleep(1);
+	return (double)(WmNow() - started) / WM_NS_PER_MS;
+}
+
+/* Run DebugLoop() against a virtual mote lying still, and count what a few
+seconds of that costs the loop thread. With throttling, also time how quickly
+a button press and then movement bring back continuous reporting. */
+static void BenchIdlePass(const char *label, bool throttle)
+{
+	CVirtualMote vmote;
+	vmote.SetMotion(false);
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+	if(!wiimote.mote.connected)
+	{
+		printf("%s: virtual mote didn't connect\n", label);
+		return;
+	}
+
+	wiimote.idleAfter = throttle ? WM_BENCH_IDLE_AFTER_NS : 0;
+	std::thread loop(IdleLoopThread, &wiimote);
+
+	/* Until it goes idle, or long enough to show it won't */
+	WaitForIdleState(&wiimote, false, 5 * WM_BENCH_IDLE_AFTER_NS);
+
+	unsigned long long reports = vmote.ReportsSent();
+	unsigned long long wakeups = wiimote.Wakeups();
+	double cpu = ThreadCpuMs(&loop);
+	Sleep(WM_BENCH_IDLE_WINDOW_MS);
+	double seconds = WM_BENCH_IDLE_WINDOW_MS / 1000.0;
+
+	printf("  %-16s %7.1f reports/s %7.1f wakeups/s %7.3f ms CPU/s (%s)\n", label,
+		(vmote.ReportsSent() - reports) / seconds, (wiimote.Wakeups() - wakeups) / seconds,
+		(ThreadCpuMs(&loop) - cpu) / seconds,
+		wiimote.IdleState() == WM_IDLE_ACTIVE ? "streaming" : "idle");
+
+	if(throttle)
+	{
+		vmote.SetButtons(WM_BUT_ONE);
+		double button = WaitForIdleState(&wiimote, true, WM_NS_PER_SEC);
+		vmote.SetButtons(0);
+
+		WaitForIdleState(&wiimote, false, 5 * WM_BENCH_IDLE_AFTER_NS);
+		bool asleep = wiimote.IdleState() != WM_IDLE_ACTIVE;
+		vmote.SetMotion(true);
+		double motion = WaitForIdleState(&wiimote, true, WM_NS_PER_SEC);
+
+		printf("  back to full rate: %.1f ms after a button press, %.1f ms after motion%s (probe every %d ms)\n",
+			button, motion, asleep ? "" : " (never went idle again)", WM_IDLE_PROBE_MS);
+	}
+
+	wiimote.commands.Post(WM_CMD_QUIT);
+	loop.join();
+}
+
+static int BenchIdle()
+{
+	printf("Mote lying still, %d s measured:\n", WM_BENCH_IDLE_WINDOW_MS / 1000);
+	BenchIdlePass("always streaming", false);
+	BenchIdlePass("idle throttled", true);
+	return 0;
+}
+
+#define WM_BENCH_REPORTS_WINDOW_MS 2000
+#define WM_BENCH_REPORTS_SETTLE_MS 200
+
+/* Run DebugLoop() against a moving virtual mote with a nunchuk, and measure
+the link traffic and loop CPU of each mode, with the report mode chosen from
+the mode's profile or fixed at 0x35 as before */
+static void BenchReportsPass(bool minimal)
+{
+	CVirtualMote vmote;
+	vmote.SetMotion(true);
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+	if(!wiimote.mote.connected)
+	{
+		printf("virtual mote didn't connect\n");
+		return;
+	}
+
+	wiimote.idleAfter = 0;
+	wiimote.minimalReports = minimal;
+	std::thread loop(IdleLoopThread, &wiimote);
+
+	for(int mode = 0; mode <= WM_MY_MAX; mode++)
+	{
+		wiimote.commands.Post(WM_CMD_MODE, mode);
+		Sleep(WM_BENCH_REPORTS_SETTLE_MS);
+
+		unsigned long long reports = vmote.ReportsSent();
+		unsigned long long bytes = vmote.BytesSent();
+		double cpu = ThreadCpuMs(&loop);
+		Sleep(WM_BENCH_REPORTS_WINDOW_MS);
+		double seconds = WM_BENCH_REPORTS_WINDOW_MS / 1000.0;
+
+		printf("  %-7s %-6s 0x%02x %-7s %7.1f reports/s %8.1f bytes/s %7.3f ms CPU/s\n",
+			minimal ? "minimal" : "fixed", CProfile::ModeName(mode), vmote.ReportMode(),
+			vmote.Continuous() ? "cont" : "changes", (vmote.ReportsSent() - reports) / seconds,
+			(vmote.BytesSent() - bytes) / seconds, (ThreadCpuMs(&loop) - cpu) / seconds);
+	}
+
+	wiimote.commands.Post(WM_CMD_QUIT);
+	loop.join();
+}
+
+static int BenchReports()
+{
+	printf("Moving mote with a nunchuk, built-in profiles, %d s per mode:\n", WM_BENCH_REPORTS_WINDOW_MS / 1000);
+	BenchReportsPass(false);
+	BenchReportsPass(true);
+	return 0;
+}
+
+#define WM_BENCH_GAMEPAD_WINDOW_MS 2000
+
+/* Run DebugLoop() in fps mode and then as a gamepad against a moving virtual
+mote with extension plugged in, and count the calls each makes to the host
+per report: SendInput calls or uinput writes, swallowed by the null output */
+static bool BenchGamepadPass(int extension, bool pad)
+{
+	CVirtualMote vmote;
+	vmote.SetExtension(extension);
+	vmote.SetMotion(true);
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+	if(!wiimote.mote.connected)
+	{
+		printf("virtual mote didn't connect\n");
+		return false;
+	}
+
+	wiimote.idleAfter = 0;
+	wiimote.gamepadOutput = pad;
+	wiimote.SetNullOutput(true);
+	std::thread loop(IdleLoopThread, &wiimote);
+	wiimote.commands.Post(WM_CMD_MODE, WM_MY_FPS);
+	Sleep(WM_BENCH_REPORTS_SETTLE_MS);
+
+	unsigned long long reports = vmote.ReportsSent();
+	unsigned long long calls = wiimote.NullEvents();
+	double cpu = ThreadCpuMs(&loop);
+	Sleep(WM_BENCH_GAMEPAD_WINDOW_MS);
+	reports = vmote.ReportsSent() - reports;
+	calls = wiimote.NullEvents() - calls;
+	cpu = ThreadCpuMs(&loop) - cpu;
+	byte mode = vmote.ReportMode();
+	bool continuous = vmote.Continuous();
+
+	wiimote.commands.Post(WM_CMD_QUIT);
+	loop.join();
+
+	/* Whatever the pad showed last, it is let go of on the way out */
+	WM_GAMEPAD_FRAME rest;
+	wiimote.GetGamepadFrame(&rest);
+	bool atRest = rest.buttons == 0;
+	for(int i = 0; i < WM_PAD_AXES; i++)
+		atRest = atRest && rest.axes[i] == 0;
+
+	printf("  %-8s %-8s 0x%02x %-7s %7.1f reports/s %5.2f calls/report %7.3f ms CPU/s%s\n",
+		CWiimote::ExtensionName(extension), pad ? "gamepad" : "fps", mode, continuous ? "cont" : "changes",
+		reports * 1000.0 / WM_BENCH_GAMEPAD_WINDOW_MS, reports ? (double)calls / reports : 0.0,
+		cpu * 1000.0 / WM_BENCH_GAMEPAD_WINDOW_MS, pad && !atRest ? " LEFT HELD" : "");
+	return !pad || (atRest && calls > 0);
+}
+
+static int BenchGamepad()
+{
+	printf("Moving mote, %d s each, output swallowed:\n", WM_BENCH_GAMEPAD_WINDOW_MS / 1000);
+	int failures = 0;
+	failures += !BenchGamepadPass(WM_EXT_NUNCHUK, false);
+	failures += !BenchGamepadPass(WM_EXT_NUNCHUK, true);
+	failures += !BenchGamepadPass(WM_EXT_CLASSIC, true);
+	return failures ? 1 : 0;
+}
+
+#define WM_BENCH_EXT_STREAM_MS 300
+#define WM_BENCH_EXT_HOLD 0.5f /* how far the virtual mote holds the extension from rest */
+#define WM_BENCH_EXT_TOLERANCE 0.07f /* two steps of a 5-bit stick axis */
+#define WM_BENCH_EXT_CHUK_BUTTONS WM_CHUK_BUT_C
+/* A button from each byte of the word, Up being bit 0 */
+#define WM_BENCH_EXT_CLASSIC_BUTTONS (WM_CLASSIC_UP | WM_CLASSIC_ZL | WM_CLASSIC_R | WM_CLASSIC_MINUS)
+
+static bool Near(float value, float expected, float tolerance)
+{
+	return fabs(value - expected) <= tolerance;
+}
+
+/* Whether the decoded extension matches what the virtual mote was told to
+hold (see CVirtualMote::Synthesize()), with motion off */
+static bool CheckExtension(CWiimote *wiimote, float h)
+{
+	const float tol = WM_BENCH_EXT_TOLERANCE;
+	switch(wiimote->mote.extension)
+	{
+	case WM_EXT_NUNCHUK:
+		return wiimote->mote.chuk.button.c && !wiimote->mote.chuk.button.z
+			&& Near(wiimote->mote.chuk.stick.x, h, tol) && Near(wiimote->mote.chuk.stick.y, -h, tol)
+			&& Near(wiimote->mote.chuk.force.x, 0.f, tol) && Near(wiimote->mote.chuk.force.z, 1.f, tol);
+	case WM_EXT_CLASSIC:
+		return wiimote->mote.classic.buttons == WM_BENCH_EXT_CLASSIC_BUTTONS
+			&& Near(wiimote->mote.classic.left.x, h, tol) && Near(wiimote->mote.classic.left.y, -h, tol)
+			&& Near(wiimote->mote.classic.right.x, h, tol) && Near(wiimote->mote.classic.right.y, -h, tol)
+			&& Near(wiimote->mote.classic.leftTrigger, h, tol) && Near(wiimote->mote.classic.rightTrigger, h / 2, tol);
+	case WM_EXT_MOTIONPLUS:
+		/* deg/s, to within the tolerance of the fastest */
+		return Near(wiimote->mote.motionPlus.rate.z, h * 100.f, tol * 300.f * h)
+			&& Near(wiimote->mote.motionPlus.rate.y, h * 200.f, tol * 300.f * h)
+			&& Near(wiimote->mote.motionPlus.rate.x, h * 300.f, tol * 300.f * h);
+	case WM_EXT_BALANCE:
+	{
+		bool ok = true;
+		float total = 0.f;
+		for(int i = 0; i < 4; i++)
+		{
+			float kg = 20.f + h * 10.f * (i + 1);
+			ok = ok && Near(wiimote->mote.balance.kg[i], kg, tol);
+			total += kg;
+		}
+		return ok && Near(wiimote->mote.balance.total, total, 4 * tol);
+	}
+	default:
+		return true;
+	}
+}
+
+/* Plug each kind of extension into a virtual mote, plus a nunchuk clone that
+only takes the encrypted init, and check it is identified, initialized the
+right way and decoded from a stream of 0x35 reports: the mote holds the
+sticks, triggers, gyros and board at known values with buttons held in each
+byte, and every decoded field has to match */
+static int BenchExtensions()
+{
+	static const int types[] = { WM_EXT_NONE, WM_EXT_NUNCHUK, WM_EXT_NUNCHUK, WM_EXT_CLASSIC, WM_EXT_MOTIONPLUS, WM_EXT_BALANCE };
+	int failures = 0;
+
+	printf("Extensions on a virtual mote:\n");
+	for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		bool clone = i == 2;
+		CVirtualMote vmote;
+		vmote.SetExtension(types[i]);
+		vmote.SetCloneInit(clone);
+		vmote.SetMotion(false);
+		vmote.SetExtHold(WM_BENCH_EXT_HOLD);
+		vmote.SetExtButtons(types[i] == WM_EXT_CLASSIC ? WM_BENCH_EXT_CLASSIC_BUTTONS : WM_BENCH_EXT_CHUK_BUTTONS);
+		CWiimote wiimote(vmote.StartSocket(), "virtual");
+		if(!wiimote.mote.connected)
+		{
+			printf("virtual mote didn't connect\n");
+			return 1;
+		}
+
+		wiimote.idleAfter = 0;
+		wiimote.minimalReports = false;
+		std::thread loop(IdleLoopThread, &wiimote);
+		Sleep(WM_BENCH_EXT_STREAM_MS);
+		wiimote.commands.Post(WM_CMD_QUIT);
+		loop.join();
+
+		char decoded[128];
+		wiimote.Derive(WM_DERIVE_ALL);
+		switch(wiimote.mote.extension)
+		{
+		case WM_EXT_NUNCHUK:
+			_snprintf(decoded, sizeof(decoded), "stick %+.2f %+.2f, force %+.2f %+.2f %+.2f, %s%s",
+				wiimote.mote.chuk.stick.x, wiimote.mote.chuk.stick.y, wiimote.mote.chuk.force.x, wiimote.mote.chuk.force.y, wiimote.mote.chuk.force.z,
+				wiimote.mote.chuk.button.c ? "C" : "", wiimote.mote.chuk.button.z ? "Z" : "");
+			break;
+		case WM_EXT_CLASSIC:
+			_snprintf(decoded, sizeof(decoded), "left %+.2f %+.2f, right %+.2f %+.2f, triggers %.2f %.2f, buttons %04x",
+				wiimote.mote.classic.left.x, wiimote.mote.classic.left.y, wiimote.mote.classic.right.x, wiimote.mote.classic.right.y,
+				wiimote.mote.classic.leftTrigger, wiimote.mote.classic.rightTrigger, wiimote.mote.classic.buttons);
+			break;
+		case WM_EXT_MOTIONPLUS:
+			_snprintf(decoded, sizeof(decoded), "pitch %+.1f, roll %+.1f, yaw %+.1f deg/s",
+				wiimote.mote.motionPlus.rate.x, wiimote.mote.motionPlus.rate.y, wiimote.mote.motionPlus.rate.z);
+			break;
+		case WM_EXT_BALANCE:
+			_snprintf(decoded, sizeof(decoded), "%.1f %.1f %.1f %.1f kg, %.1f kg in all",
+				wiimote.mote.balance.kg[0], wiimote.mote.balance.kg[1], wiimote.mote.balance.kg[2], wiimote.mote.balance.kg[3], wiimote.mote.balance.total);
+			break;
+		default:
+			decoded[0] = 0;
+		}
+		decoded[sizeof(decoded) - 1] = 0;
+
+		bool ok = wiimote.mote.extension == types[i] && wiimote.mote.extEncrypted == clone && CheckExtension(&wiimote, WM_BENCH_EXT_HOLD);
+		failures += !ok;
+		printf("  %-16s %-10s %-9s %s%s\n", clone ? "nunchuk clone" : CWiimote::ExtensionName(types[i]),
+			CWiimote::ExtensionName(wiimote.mote.extension), wiimote.mote.extEncrypted ? "encrypted" : "clear", decoded, ok ? "" : " FAILED");
+	}
+
+	return failures ? 1 : 0;
+}
+
+#define WM_BENCH_MEM_LOSS 7 /* the lossy pass drops every 7th piece */
+
+static void PrintTransfer(const char *label, const WM_TRANSFER *transfer, bool verified)
+{
+	printf("  %-28s %5d bytes %8.1f ms %4d requests %3d retries %s\n", label, transfer->length,
+		(double)(transfer->finished - transfer->started) / WM_NS_PER_MS, transfer->requests, transfer->retries,
+		transfer->state != WM_XFER_DONE ? "FAILED" : verified ? "ok" : "MISMATCH");
+}
+
+/* Run one transfer to completion on this thread */
+static bool BenchTransfer(CWiimote *wiimote, WM_TRANSFER *transfer, bool write, byte space, DWORD address, byte *data, int length)
+{
+	transfer->write = write;
+	transfer->space = space;
+	transfer->address = address;
+	transfer->length = length;
+	transfer->data = data;
+	return wiimote->StartTransfer(transfer) && wiimote->WaitTransfer(transfer);
+}
+
+/* Fill the virtual mote's EEPROM with a pattern and read it back: whole, one
+16-byte request at a time as Initialize() used to, and whole again with
+pieces going missing. Then the extension's register block and an address
+that doesn't exist. */
+static int BenchMemory()
+{
+	CVirtualMote vmote;
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+	if(!wiimote.mote.connected)
+	{
+		printf("virtual mote didn't connect\n");
+		return 1;
+	}
+
+	std::vector<byte> pattern(WM_MEM_EEPROM_SIZE), back(WM_MEM_EEPROM_SIZE);
+	for(int i = 0; i < WM_MEM_EEPROM_SIZE; i++)
+		pattern[i] = (byte)(i * 7 + (i >> 8));
+
+	WM_TRANSFER transfer;
+	int failures = 0;
+
+	printf("EEPROM and registers of a virtual mote:\n");
+	BenchTransfer(&wiimote, &transfer, true, WM_MEM_EEPROM, 0, &pattern[0], WM_MEM_EEPROM_SIZE);
+	PrintTransfer("write EEPROM", &transfer, true);
+	failures += transfer.state != WM_XFER_DONE;
+
+	bool same = BenchTransfer(&wiimote, &transfer, false, WM_MEM_EEPROM, 0, &back[0], WM_MEM_EEPROM_SIZE) && back == pattern;
+	PrintTransfer("read EEPROM", &transfer, same);
+	failures += !same;
+
+	/* The old way: one request and one answer at a time */
+	std::fill(back.begin(), back.end(), 0);
+	WM_TIME started = WmNow();
+	int requests = 0;
+	bool ok = true;
+	for(int offset = 0; ok && offset < WM_MEM_EEPROM_SIZE; offset += WM_MEM_CHUNK)
+	{
+		ok = BenchTransfer(&wiimote, &transfer, false, WM_MEM_EEPROM, offset, &back[offset], WM_MEM_CHUNK);
+		requests += transfer.requests;
+	}
+	transfer.started = started;
+	transfer.length = WM_MEM_EEPROM_SIZE;
+	transfer.requests = requests;
+	transfer.retries = 0;
+	PrintTransfer("read EEPROM 16 bytes a time", &transfer, ok && back == pattern);
+	failures += !(ok && back == pattern);
+
+	std::fill(back.begin(), back.end(), 0);
+	vmote.SetReadLoss(WM_BENCH_MEM_LOSS);
+	same = BenchTransfer(&wiimote, &transfer, false, WM_MEM_EEPROM, 0, &back[0], WM_MEM_EEPROM_SIZE) && back == pattern;
+	PrintTransfer("read EEPROM, 1 in 7 lost", &transfer, same);
+	failures += !same;
+	vmote.SetReadLoss(0);
+
+	byte block[256];
+	ok = BenchTransfer(&wiimote, &transfer, false, WM_MEM_REGISTERS, 0xa40000, block, sizeof(block));
+	/* The extension is initialized in the clear, so 0xfc reads back as the plain ID byte 0xa4 */
+	PrintTransfer("read extension registers", &transfer, ok && block[0xfc] == 0xa4);
+	failures += !ok;
+
+	BenchTransfer(&wiimote, &transfer, false, WM_MEM_REGISTERS, 0xa80000, block, 16);
+	printf("  %-28s error %d (%s)\n", "read 0xa80000", transfer.error,
+		transfer.error == WM_MEM_NONEXISTENT ? "nonexistent, as expected" : "UNEXPECTED");
+	failures += transfer.error != WM_MEM_NONEXISTENT;
+
+	return failures ? 1 : 0;
+}
+
+#define WM_BENCH_RT_WINDOW_MS 3000
+#define WM_BENCH_RT_SETTLE_MS 300
+#define WM_BENCH_RT_PRIORITY 50
+#define WM_BENCH_RT_MOTE_PRIORITY 60 /* the virtual mote stands in for hardware, so it always runs on time */
+#define WM_BENCH_RT_LOAD 8 /* spinning threads per CPU */
+
+/* Notes when each data report was read, by its sequence number */
+class CBenchReadTimes : public CReportSubscriber
+{
+public:
+	CBenchReadTimes(void) { recording = false; seq.reserve(WM_VMOTE_EMIT_LOG); done.reserve(WM_VMOTE_EMIT_LOG); }
+	virtual void OnReport(WM_REPORT *report)
+	{
+		if(recording && report->data[0] >= WM_MODE_DEFAULT && seq.size() < WM_VMOTE_EMIT_LOG)
+		{
+			seq.push_back(report->seq);
+			done.push_back(report->readDone);
+		}
+	}
+	std::atomic<bool> recording;
+	std::vector<unsigned long long> seq;
+	std::vector<WM_TIME> done;
+};
+
+static void SpinThread(std::atomic<bool> *stop)
+{
+	volatile unsigned long long n = 0;
+	while(!*stop)
+		n++;
+}
+
+/* Run DebugLoop() against a moving virtual mote while other threads keep every
+CPU busy, and measure how long each report took from the mote sending it to
+the read loop having it */
+static void BenchRealTimePass(const char *label, int priority, int cpu, bool busyPoll)
+{
+	WM_RT_CONFIG moteConfig;
+	CRealTime::Defaults(&moteConfig);
+	moteConfig.priority = WM_BENCH_RT_MOTE_PRIORITY;
+
+	CVirtualMote vmote;
+	vmote.SetMotion(true);
+	vmote.SetRealTime(&moteConfig);
+	CWiimote wiimote(vmote.StartSocket(), "virtual");
+	if(!wiimote.mote.connected)
+	{
+		printf("%s: virtual mote didn't connect\n", label);
+		return;
+	}
+
+	CBenchReadTimes reads;
+	wiimote.idleAfter = 0;
+	wiimote.realTime.priority = priority;
+	wiimote.realTime.cpu = cpu;
+	wiimote.realTime.busyPoll = busyPoll;
+	wiimote.Subscribe(&reads);
+	std::thread loop(IdleLoopThread, &wiimote);
+
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> load;
+	for(int i = 0; i < WM_BENCH_RT_LOAD * CRealTime::CpuCount(); i++)
+		load.push_back(std::thread(SpinThread, &stop));
+
+	Sleep(WM_BENCH_RT_SETTLE_MS);
+	double cpuUsed = ThreadCpuMs(&loop);
+	reads.recording = true;
+	Sleep(WM_BENCH_RT_WINDOW_MS);
+	reads.recording = false;
+	cpuUsed = ThreadCpuMs(&loop) - cpuUsed;
+
+	stop = true;
+	for(size_t i = 0; i < load.size(); i++)
+		load[i].join();
+	wiimote.commands.Post(WM_CMD_QUIT);
+	loop.join();
+	wiimote.Unsubscribe(&reads);
+
+	std::vector<WM_TIME> sentAt(WM_VMOTE_EMIT_LOG);
+	int logged = vmote.EmitLog(&sentAt[0], WM_VMOTE_EMIT_LOG);
+	std::vector<double> latency;
+	for(size_t i = 0; i < reads.seq.size(); i++)
+	{
+		if(reads.seq[i] > (unsigned long long)logged)
+			continue;
+		WM_TIME sent = sentAt[(size_t)reads.seq[i] - 1];
+		latency.push_back(reads.done[i] > sent ? (double)(reads.done[i] - sent) / WM_NS_PER_US : 0);
+	}
+	if(latency.empty())
+	{
+		printf("  %-22s no reports read\n", label);
+		return;
+	}
+
+	std::sort(latency.begin(), latency.end());
+	double sum = 0;
+	for(size_t i = 0; i < latency.size(); i++)
+		sum += latency[i];
+	size_t n = latency.size();
+	double seconds = WM_BENCH_RT_WINDOW_MS / 1000.0;
+
+	printf("  %-22s %5u reports  mean %8.1f  p50 %8.1f  p99 %8.1f  max %8.1f us  %6.1f ms CPU/s\n", label, (unsigned)n,
+		sum / n, latency[n / 2], latency[n * 99 / 100], latency[n - 1], cpuUsed / seconds);
+}
+
+static int BenchRealTime()
+{
+	int cpus = CRealTime::CpuCount();
+	printf("Send-to-read latency with %d spinning threads on %d CPU%s, %d s per mode:\n",
+		WM_BENCH_RT_LOAD * cpus, cpus, cpus == 1 ? "" : "s", WM_BENCH_RT_WINDOW_MS / 1000);
+	BenchRealTimePass("normal", 0, -1, false);
+	BenchRealTimePass("pinned", 0, 0, false);
+	BenchRealTimePass("fifo", WM_BENCH_RT_PRIORITY, -1, false);
+	BenchRealTimePass("fifo, pinned", WM_BENCH_RT_PRIORITY, 0, false);
+	BenchRealTimePass("busy-poll, pinned", 0, 0, true);
+	if(cpus > 1)
+		BenchRealTimePass("fifo, busy-poll, pinned", WM_BENCH_RT_PRIORITY, cpus - 1, true);
+	else
+		printf("  fifo with busy-poll needs a second CPU, skipped\n");
+	return 0;
+}
+
+#define WM_BENCH_SOAK_WINDOW_MS 5000
+#define WM_BENCH_SOAK_SETTLE_MS 1000
+#define WM_BENCH_SOAK_MAX 256
+#define WM_BENCH_SOAK_SCRIPT_TICKS 100 /* the button script repeats every second */
+#define WM_BENCH_SOAK_BEHIND 0.01 /* more reports than this not sent on time is falling behind */
+#define WM_BENCH_SOAK_LOST 0.001 /* and more than this lost */
+
+/* One virtual mote and the full host stack reading it */
+struct WM_SOAK_DEVICE {
+	CVirtualMote *vmote;
+	CWiimote *wiimote;
+	CBenchReadTimes *reads;
+	std::thread *loop;
+	double cpu;
+	unsigned long long sent;
+	WM_STATS stats;
+};
+
+/* What one fleet size came to over the window */
+struct WM_SOAK_RESULT {
+	int motes;
+	double reports; /* read per second, all motes */
+	double loopCpu; /* ms CPU per second per mote, read loop thread only */
+	double allCpu; /* the same for the whole process, emulated motes included */
+	double busy; /* share of the machine's CPUs in use */
+	double behind; /* share of 100Hz reports the motes couldn't send, because the host wasn't reading */
+	unsigned long long drops; /* reports the host's gap detection counted as lost */
+	unsigned long long overruns;
+	unsigned long long events; /* keyboard and mouse events mapped into the null output */
+	double transport[4]; /* send to read done, us: p50, p99, p99.9, max */
+	double stage[WM_STAGE_COUNT][4];
+};
+
+/* Press A for a tenth of every second and B for a twentieth, each mote a
+little later than the one before so they don't all change at once */
+static void SoakScript(std::vector<WM_SOAK_DEVICE> *devices, std::atomic<bool> *stop)
+{
+	WM_TIME next = WmNow();
+	for(unsigned tick = 0; !*stop; tick++)
+	{
+		for(size_t i = 0; i < devices->size(); i++)
+		{
+			unsigned phase = (tick + (unsigned)i * 37) % WM_BENCH_SOAK_SCRIPT_TICKS;
+			unsigned short buttons = phase < 10 ? WM_BUT_A : phase >= 50 && phase < 55 ? WM_BUT_B : 0;
+			(*devices)[i].vmote->SetButtons(buttons);
+		}
+		next += WM_REPORT_PERIOD_NS;
+		WM_TIME now = WmNow();
+		if(next > now)
+			Sleep((DWORD)((next - now) / WM_NS_PER_MS));
+	}
+}
+
+static double ProcessCpuMs()
+{
+	struct timespec ts;
+	if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* p50, p99, p99.9 and max in us. Buckets report their midpoint, which can be past the max. */
+static void SoakPercentiles(const CLatencyHistogram *histogram, double *out)
+{
+	static const double pct[3] = { 50, 99, 99.9 };
+	WM_TIME max = histogram->Max();
+	for(int i = 0; i < 3; i++)
+	{
+		WM_TIME value = histogram->Percentile(pct[i]);
+		out[i] = (double)(value < max ? value : max) / WM_NS_PER_US;
+	}
+	out[3] = (double)max / WM_NS_PER_US;
+}
+
+/* Run motes virtual motes through transport, decode, calibration, mapping and
+a null output at once, each on its own read loop */
+static bool BenchSoakPass(int motes, WM_SOAK_RESULT *result)
+{
+	std::vector<WM_SOAK_DEVICE> devices(motes);
+	bool connected = true;
+	for(int i = 0; i < motes; i++)
+	{
+		WM_SOAK_DEVICE *device = &devices[i];
+		device->vmote = new CVirtualMote();
+		device->vmote->SetMotion(true);
+		device->wiimote = new CWiimote(device->vmote->StartSocket(), "virtual");
+		device->reads = new CBenchReadTimes();
+		device->loop = NULL;
+		connected = connected && device->wiimote->mote.connected;
+	}
+
+	if(connected)
+	{
+		for(int i = 0; i < motes; i++)
+		{
+			CWiimote *wiimote = devices[i].wiimote;
+			wiimote->idleAfter = 0;
+			wiimote->SetNullOutput(true);
+			wiimote->Subscribe(devices[i].reads);
+			devices[i].loop = new std::thread(IdleLoopThread, wiimote);
+		}
+
+		std::atomic<bool> stop(false);
+		std::thread script(SoakScript, &devices, &stop);
+		Sleep(WM_BENCH_SOAK_SETTLE_MS);
+
+		for(int i = 0; i < motes; i++)
+		{
+			WM_SOAK_DEVICE *device = &devices[i];
+			device->wiimote->ResetLatency();
+			device->wiimote->GetStats(&device->stats);
+			device->sent = device->vmote->ReportsSent();
+			device->cpu = ThreadCpuMs(device->loop);
+			device->reads->recording = true;
+		}
+		double processCpu = ProcessCpuMs();
+		WM_TIME started = WmNow();
+
+		Sleep(WM_BENCH_SOAK_WINDOW_MS);
+
+		double seconds = (double)(WmNow() - started) / WM_NS_PER_SEC;
+		processCpu = ProcessCpuMs() - processCpu;
+		CLatencyStats latency;
+		double loopCpu = 0;
+		unsigned long long sent = 0, received = 0, drops = 0, overruns = 0;
+		for(int i = 0; i < motes; i++)
+		{
+			WM_SOAK_DEVICE *device = &devices[i];
+			WM_STATS stats;
+			device->reads->recording = false;
+			device->wiimote->GetStats(&stats);
+			device->wiimote->AddLatency(&latency);
+			loopCpu += ThreadCpuMs(device->loop) - device->cpu;
+			sent += device->vmote->ReportsSent() - device->sent;
+			received += stats.received - device->stats.received;
+			drops += stats.drops - device->stats.drops;
+			overruns += stats.overruns - device->stats.overruns;
+		}
+
+		stop = true;
+		script.join();
+		for(int i = 0; i < motes; i++)
+			devices[i].wiimote->commands.Post(WM_CMD_QUIT);
+		for(int i = 0; i < motes; i++)
+			devices[i].loop->join();
+
+		/* Match each report read in the window to when its mote sent it */
+		std::vector<WM_TIME> sentAt(WM_VMOTE_EMIT_LOG);
+		std::vector<double> transport;
+		for(int i = 0; i < motes; i++)
+		{
+			CBenchReadTimes *reads = devices[i].reads;
+			int logged = devices[i].vmote->EmitLog(&sentAt[0], WM_VMOTE_EMIT_LOG);
+			for(size_t j = 0; j < reads->seq.size(); j++)
+			{
+				if(reads->seq[j] > (unsigned long long)logged)
+					continue;
+				WM_TIME at = sentAt[(size_t)reads->seq[j] - 1];
+				transport.push_back(reads->done[j] > at ? (double)(reads->done[j] - at) / WM_NS_PER_US : 0);
+			}
+		}
+		std::sort(transport.begin(), transport.end());
+
+		double expected = motes * seconds * WM_NS_PER_SEC / WM_REPORT_PERIOD_NS;
+		result->motes = motes;
+		result->reports = received / seconds;
+		result->loopCpu = loopCpu / seconds / motes;
+		result->allCpu = processCpu / seconds / motes;
+		result->busy = processCpu / seconds / 1000.0 / CRealTime::CpuCount();
+		result->behind = sent < expected ? 1.0 - sent / expected : 0;
+		result->drops = drops;
+		result->overruns = overruns;
+		result->events = 0;
+		for(int i = 0; i < motes; i++)
+			result->events += devices[i].wiimote->NullEvents();
+		size_t n = transport.size();
+		result->transport[0] = n ? transport[n / 2] : 0;
+		result->transport[1] = n ? transport[n * 99 / 100] : 0;
+		result->transport[2] = n ? transport[n * 999 / 1000] : 0;
+		result->transport[3] = n ? transport[n - 1] : 0;
+		for(int s = 0; s < WM_STAGE_COUNT; s++)
+			SoakPercentiles(&latency.stage[s], result->stage[s]);
+	}
+
+	for(int i = 0; i < motes; i++)
+	{
+		WM_SOAK_DEVICE *device = &devices[i];
+		if(device->loop)
+			device->wiimote->Unsubscribe(device->reads);
+		delete device->loop;
+		delete device->wiimote;
+		delete device->reads;
+		delete device->vmote;
+	}
+	return connected;
+}
+
+/* 1, 4, 16, 64 and 256 motes at once, each streaming moving 100Hz reports
+with buttons going up and down, to find where the host stops keeping up */
+static int BenchSoak()
+{
+	int cpus = CRealTime::CpuCount();
+	printf("Virtual motes streaming at 100Hz through the whole stack into a null output, %d CPU%s, %d s each:\n",
+		cpus, cpus == 1 ? "" : "s", WM_BENCH_SOAK_WINDOW_MS / 1000);
+
+	std::vector<WM_SOAK_RESULT> results;
+	for(int motes = 1; motes <= WM_BENCH_SOAK_MAX; motes *= 4)
+	{
+		WM_SOAK_RESULT result;
+		if(!BenchSoakPass(motes, &result))
+		{
+			printf("  %d virtual motes didn't all connect\n", motes);
+			return 1;
+		}
+		results.push_back(result);
+		printf("  %d motes done\n", motes);
+	}
+
+	printf("\n  %5s %10s %13s %13s %6s %8s %7s %8s %9s\n", "motes", "reports/s", "loop ms CPU/s",
+		"all ms CPU/s", "busy", "behind", "drops", "overruns", "events");
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const WM_SOAK_RESULT *r = &results[i];
+		printf("  %5d %10.1f %13.3f %13.3f %5.1f%% %7.2f%% %7llu %8llu %9llu\n", r->motes, r->reports,
+			r->loopCpu, r->allCpu, 100 * r->busy, 100 * r->behind, r->drops, r->overruns, r->events);
+	}
+
+	printf("\n  Latency in us, p99 / p99.9 (max); transport is the mote sending to the read returning\n");
+	printf("  %5s %-24s", "motes", "transport");
+	for(int s = 0; s < WM_STAGE_COUNT; s++)
+		printf(" %-22s", CLatencyStats::StageName(s));
+	printf("\n");
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const WM_SOAK_RESULT *r = &results[i];
+		printf("  %5d %6.0f / %6.0f (%6.0f)", r->motes, r->transport[1], r->transport[2], r->transport[3]);
+		for(int s = 0; s < WM_STAGE_COUNT; s++)
+			printf(" %5.1f / %5.1f (%6.1f)", r->stage[s][1], r->stage[s][2], r->stage[s][3]);
+		printf("\n");
+	}
+
+	/* Keeping up means every report sent on time, read within a period and hardly any lost */
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const WM_SOAK_RESULT *r = &results[i];
+		double lost = r->reports ? r->drops / (r->reports * WM_BENCH_SOAK_WINDOW_MS / 1000.0) : 0;
+		if(r->behind > WM_BENCH_SOAK_BEHIND || lost > WM_BENCH_SOAK_LOST || r->transport[1] * WM_NS_PER_US > WM_REPORT_PERIOD_NS)
+		{
+			printf("\n  Stops keeping up at %d motes: %.2f%% of reports not sent, %.2f%% estimated lost, p99 transport %.1f ms\n",
+				r->motes, 100 * r->behind, 100 * lost, r->transport[1] / 1000);
+			return 0;
+		}
+	}
+	printf("\n  Kept up at every size\n");
+	return 0;
+}
+
+#define WM_BENCH_AN_RECORDS 2000000 /* about 5.5 hours of 100Hz reports, 80 MB */
+#define WM_BENCH_AN_PRESS_EVERY 300 /* A goes down for 20 reports this often */
+#define WM_BENCH_AN_SHAKE_EVERY 2000 /* a 10-report shake this often */
+#define WM_BENCH_AN_SKIP_EVERY 10000 /* the capture misses a report this often */
+#define WM_BENCH_AN_STALL_EVERY 5000 /* the link loses two reports this often */
+
+/* Write a capture of a mote with a nunchuk being waved about, pressed and
+shaken on a regular schedule, so the counts to expect are known */
+static BOOL WriteBenchCapture(const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if(!file)
+		return false;
+
+	WM_CAPTURE_HEADER header;
+	FillBenchHeader(&header);
+	fwrite(&header, sizeof(header), 1, file);
+
+	std::vector<WM_CAPTURE_RECORD> batch(4096);
+	WM_TIME time = WM_NS_PER_SEC;
+	DWORD seq = 0;
+	for(int n = 0; n < WM_BENCH_AN_RECORDS; n++)
+	{
+		WM_CAPTURE_RECORD *record = &batch[n % batch.size()];
+		memset(record, 0, sizeof(*record));
+
+		seq += n && n % WM_BENCH_AN_SKIP_EVERY == 0 ? 2 : 1;
+		time += n && n % WM_BENCH_AN_STALL_EVERY == 0 ? 3 * WM_REPORT_PERIOD_NS : WM_REPORT_PERIOD_NS;
+		record->time = time;
+		record->seq = seq;
+		record->length = 22;
+
+		bool shaking = n % WM_BENCH_AN_SHAKE_EVERY < 10;
+		double phase = n * 0.01;
+		byte *data = record->data;
+		data[0] = WM_MODE_ACC_EXT;
+		data[2] = n % WM_BENCH_AN_PRESS_EVERY < 20 ? WM_BUT_A : 0;
+		data[3] = shaking ? 0xe0 : (byte)(0x80 + 12 * sin(phase));
+		data[4] = (byte)(0x80 + 12 * cos(phase * 0.7));
+		data[5] = 0x9a;
+		data[6] = (byte)(0x80 + 0x50 * sin(phase * 0.3));
+		data[7] = (byte)(0x80 + 0x50 * cos(phase * 0.2));
+		data[8] = data[9] = 0x80;
+		data[10] = 0xb3;
+		data[11] = WM_CHUK_BUT_C | WM_CHUK_BUT_Z; /* both up */
+
+		if((n + 1) % batch.size() == 0 || n + 1 == WM_BENCH_AN_RECORDS)
+			fwrite(&batch[0], sizeof(WM_CAPTURE_RECORD), n % batch.size() + 1, file);
+	}
+
+	fclose(file);
+	return true;
+}
+
+/* Analyze a large capture on 1, 2, 4... threads up to one per CPU, and
+check every run comes to the same, expected summary */
+static int BenchAnalytics()
+{
+	char path[] = "/tmp/wiimouse-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0 || !WriteBenchCapture(path))
+	{
+		printf("Couldn't write the bench capture\n");
+		return 1;
+	}
+	close(fd);
+
+	CCaptureAnalyzer analyzer;
+	if(!analyzer.Add(path))
+	{
+		unlink(path);
+		return 1;
+	}
+
+	/* At least 4, so the summaries are compared across threads even on a small machine */
+	int cores = CCaptureAnalyzer::DefaultJobs();
+	int most = cores < 4 ? 4 : cores;
+	std::vector<int> jobs;
+	for(int n = 1; n < most; n *= 2)
+		jobs.push_back(n);
+	jobs.push_back(most);
+
+	printf("%llu records, %.0f MB, %d CPU%s:\n", (unsigned long long)analyzer.Records(),
+		analyzer.Bytes() / (1024.0 * 1024.0), cores, cores == 1 ? "" : "s");
+
+	WM_ANALYTICS first, summary;
+	double baseline = 0;
+	int failures = 0;
+	for(size_t i = 0; i < jobs.size(); i++)
+	{
+		/* Best of three, so page cache warm-up doesn't count */
+		double best = 0;
+		for(int pass = 0; pass < 3; pass++)
+		{
+			WM_TIME started = WmNow();
+			analyzer.Run(jobs[i], &summary);
+			double seconds = (double)(WmNow() - started) / WM_NS_PER_SEC;
+			if(!best || seconds < best)
+				best = seconds;
+		}
+		if(i == 0)
+		{
+			first = summary;
+			baseline = best;
+		}
+		bool same = memcmp(&first, &summary, sizeof(summary)) == 0;
+		failures += !same;
+		printf("  %3d thread%s %8.1f M records/s %7.0f MB/s  speedup %5.2fx%s%s\n", jobs[i], jobs[i] == 1 ? " " : "s",
+			summary.records / best / 1e6, analyzer.Bytes() / best / (1024 * 1024), baseline / best,
+			jobs[i] > cores ? " (more threads than CPUs)" : "", same ? "" : "  SUMMARY DIFFERS");
+	}
+	unlink(path);
+
+	unsigned long long presses = (WM_BENCH_AN_RECORDS + WM_BENCH_AN_PRESS_EVERY - 1) / WM_BENCH_AN_PRESS_EVERY;
+	unsigned long long shakes = (WM_BENCH_AN_RECORDS + WM_BENCH_AN_SHAKE_EVERY - 1) / WM_BENCH_AN_SHAKE_EVERY;
+	unsigned long long skips = (WM_BENCH_AN_RECORDS - 1) / WM_BENCH_AN_SKIP_EVERY;
+	unsigned long long stalls = 2 * ((WM_BENCH_AN_RECORDS - 1) / WM_BENCH_AN_STALL_EVERY);
+	bool expected = first.presses[3] == presses && first.moteShakes == shakes && first.captureDrops == skips && first.linkDrops == stalls;
+	failures += !expected;
+	printf("  A presses %llu/%llu, shakes %llu/%llu, capture drops %llu/%llu, link drops %llu/%llu (found/expected)%s\n",
+		first.presses[3], presses, first.moteShakes, shakes, first.captureDrops, skips, first.linkDrops, stalls,
+		expected ? "" : " MISMATCH");
+	return failures ? 1 : 0;
+}
+
+#define WM_BENCH_SHM_DEVICE 99 /* out of the way of real devices */
+#define WM_BENCH_SHM_READERS 4
+
+/* Every field of a bench state is derived from its report number, so a reader
+can tell a torn copy from a whole one */
+#define WM_BENCH_SCHED_SECONDS 60
+#define WM_BENCH_SCHED_MOVE_MS 3000 /* the stick circles this long, */
+#define WM_BENCH_SCHED_REST_MS 1000 /* then rests this long */
+#define WM_BENCH_SCHED_SHAKE_MS 400 /* one swing of the shaken mote */
+
+/* A minute of 0x35 reports with the nunchuk stick going round in circles and
+stopping, arriving over the same simulated link as the clock bench. With
+shake, the mote is swung side to side hard enough to read past 1G for part
+of every swing, where its tilt is NaN. */
+static BOOL WriteScheduleCapture(const char *path, bool shake)
+{
+	FILE *file = fopen(path, "wb");
+	if(!file)
+		return false;
+
+	WM_CAPTURE_HEADER header;
+	FillBenchHeader(&header);
+	fwrite(&header, sizeof(header), 1, file);
+
+	unsigned seed = 1;
+	WM_TIME stallUntil = 0, lastArrival = 0;
+	int reports = WM_BENCH_SCHED_SECONDS * (int)(WM_NS_PER_SEC / WM_BENCH_CLOCK_PERIOD_NS);
+	for(int k = 0; k < reports; k++)
+	{
+		WM_TIME at = WM_NS_PER_SEC + k * WM_BENCH_CLOCK_PERIOD_NS;
+		if(at >= stallUntil && BenchRandom(&seed) * WM_BENCH_CLOCK_STALL_ODDS < 1)
+			stallUntil = at + (WM_TIME)((20 + 40 * BenchRandom(&seed)) * WM_NS_PER_MS);
+		WM_TIME arrival = at + WM_BENCH_CLOCK_DELAY_NS - (WM_TIME)(WM_BENCH_CLOCK_JITTER_NS * log(1 - BenchRandom(&seed)));
+		if(arrival < stallUntil)
+			arrival = stallUntil;
+		if(arrival < lastArrival)
+			arrival = lastArrival;
+		lastArrival = arrival;
+
+		WM_CAPTURE_RECORD record;
+		memset(&record, 0, sizeof(record));
+		record.time = arrival;
+		record.seq = k + 1;
+		record.length = 22;
+
+		double ms = (double)(at - WM_NS_PER_SEC) / WM_NS_PER_MS;
+		bool moving = fmod(ms, WM_BENCH_SCHED_MOVE_MS + WM_BENCH_SCHED_REST_MS) < WM_BENCH_SCHED_MOVE_MS;
+		double phase = 2.0 * M_PI * ms / WM_BENCH_SCHED_MOVE_MS;
+		byte *data = record.data;
+		data[0] = WM_MODE_ACC_EXT;
+		data[3] = data[4] = 0x80;
+		data[5] = 0x9a;
+		if(shake)
+		{
+			/* 26 counts a G, so 0x30 either side is over 1.8G; y only tips */
+			data[3] = (byte)(0x80 + 0x30 * sin(2.0 * M_PI * ms / WM_BENCH_SCHED_SHAKE_MS));
+			data[4] = (byte)(0x80 + 0x10 * cos(2.0 * M_PI * ms / WM_BENCH_SCHED_SHAKE_MS));
+		}
+		data[6] = (byte)(moving ? 0x80 + 0x50 * sin(phase) : 0x80);
+		data[7] = (byte)(moving ? 0x80 + 0x50 * cos(phase) : 0x80);
+		data[8] = data[9] = 0x80;
+		data[10] = 0xb3;
+		data[11] = WM_CHUK_BUT_C | WM_CHUK_BUT_Z; /* both up */
+		fwrite(&record, sizeof(record), 1, file);
+	}
+
+	fclose(file);
+	return true;
+}
+
+/* Feed a scheduler motion that isn't a number between two real moves. It has
+to be dropped: the real moves add up exactly and the ticks stop. */
+static bool ScheduleSkipsNaN()
+{
+	WM_SCHED_CONFIG config;
+	CPointerScheduler::Defaults(&config);
+	config.mode = WM_SCHED_INTERPOLATE;
+	CPointerScheduler scheduler;
+	scheduler.Configure(&config);
+
+	WM_TIME at = WM_NS_PER_SEC;
+	scheduler.Add(at, WM_REPORT_PERIOD_NS, 5.f, -5.f);
+	scheduler.Add(at + WM_REPORT_PERIOD_NS, WM_REPORT_PERIOD_NS, std::numeric_limits<float>::quiet_NaN(), 1.f);
+	scheduler.Add(at + 2 * WM_REPORT_PERIOD_NS, WM_REPORT_PERIOD_NS, std::numeric_limits<float>::infinity(), 1.f);
+	scheduler.Add(at + 3 * WM_REPORT_PERIOD_NS, WM_REPORT_PERIOD_NS, 5.f, -5.f);
+
+	int x = 0, y = 0, ticks = 0, dx, dy;
+	for(WM_TIME next = scheduler.NextTick(); next && ticks < 1000; next = scheduler.NextTick(), ticks++)
+	{
+		scheduler.Tick(next, &dx, &dy);
+		x += dx;
+		y += dy;
+	}
+	printf("  NaN and infinite motion dropped: %d %d counts in %d ticks (want 10 -10, ticks stopping)\n", x, y, ticks);
+	return x == 10 && y == -10 && ticks < 1000;
+}
+
+static BOOL OpenScheduleCapture(char *path, bool shake, CCaptureAnalyzer *analyzer)
+{
+	int fd = mkstemp(path);
+	if(fd < 0 || !WriteScheduleCapture(path, shake))
+	{
+		printf("Couldn't write the bench capture\n");
+		return false;
+	}
+	close(fd);
+	return analyzer->Add(path);
+}
+
+/* Replay the capture through each schedule at a few display rates, then a
+shaken mote through the mouse pointer, which follows its tilt */
+static int BenchSchedule()
+{
+	char path[] = "/tmp/wiimouse-bench-XXXXXX";
+	CCaptureAnalyzer analyzer;
+	if(!OpenScheduleCapture(path, false, &analyzer))
+	{
+		unlink(path);
+		return 1;
+	}
+
+	static const int refreshes[] = { 144, 240, 360 };
+	static const int modes[] = { WM_SCHED_OFF, WM_SCHED_INTERPOLATE, WM_SCHED_EXTRAPOLATE };
+	static const char *modeNames[] = { "per report", "interpolate", "extrapolate" };
+	int failures = 0;
+	printf("%d s of nunchuk aiming over a bursty link, fps pointer, ticks at the display rate:\n", WM_BENCH_SCHED_SECONDS);
+	for(size_t r = 0; r < sizeof(refreshes) / sizeof(refreshes[0]); r++)
+	{
+		WM_SMOOTHNESS baseline;
+		for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+		{
+			WM_SCHED_CONFIG schedule;
+			CPointerScheduler::Defaults(&schedule);
+			schedule.mode = modes[m];
+			schedule.rate = refreshes[r];
+
+			WM_SMOOTHNESS result;
+			analyzer.Smoothness(WM_MY_FPS, &schedule, refreshes[r], &result);
+			if(m == 0)
+				baseline = result;
+
+			/* Spread out it must be smoother, and must still add up to the same motion */
+			bool ok = m == 0 || (result.stepVariance < baseline.stepVariance / 4 && result.drift < 2);
+			failures += !ok;
+			printf("  %3d Hz %-12s %6.1f moves/s  step variance %7.2f  lag %6.2f ms (%+6.2f)  drift %4.1f%s\n",
+				refreshes[r], modeNames[m], result.moves / result.seconds, result.stepVariance,
+				result.lagMs, result.lagMs - baseline.lagMs, result.drift, ok ? "" : "  FAILED");
+		}
+	}
+	unlink(path);
+
+	/* Past 1G the tilt is NaN. The pointer must sit those reports out and
+	carry on, not be thrown to the edge of the screen on every tick after. */
+	char shaken[] = "/tmp/wiimouse-bench-XXXXXX";
+	CCaptureAnalyzer shakes;
+	if(!OpenScheduleCapture(shaken, true, &shakes))
+	{
+		unlink(shaken);
+		return 1;
+	}
+	printf("Mote shaken past 1G, mouse pointer, 240 Hz:\n");
+	for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+	{
+		WM_SCHED_CONFIG schedule;
+		CPointerScheduler::Defaults(&schedule);
+		schedule.mode = modes[m];
+
+		WM_SMOOTHNESS result;
+		shakes.Smoothness(WM_MY_MOUSE, &schedule, WM_SCHED_RATE, &result);
+		bool ok = result.moves > 0 && result.drift < 2 && result.stepVariance < WM_SCHED_MAX_COUNTS;
+		failures += !ok;
+		printf("  %-12s %6.1f moves/s  step variance %7.2f  drift %4.1f%s\n", modeNames[m],
+			result.moves / result.seconds, result.stepVariance, result.drift, ok ? "" : "  FAILED");
+	}
+	unlink(shaken);
+
+	failures += !ScheduleSkipsNaN();
+	return failures ? 1 : 0;
+}
+
+static void FillBenchState(WM_SHARED_STATE *state, unsigned long long n)
+{
+	memset(state, 0, sizeof(*state));
+	state->time = WmNow();
+	state->report = n;
+	state->buttons = (unsigned short)n;
+	state->battery = (int)(n % 101);
+	for(int i = 0; i < 3; i++)
+	{
+		state->force[i] = (float)(n + i);
+		state->chukTilt[i] = (float)(n * 2 + i);
+	}
+	for(int i = 0; i < WM_SHM_IR_DOTS; i++)
+		state->ir[i].x = (unsigned short)((n + i) & 0x3ff);
+}
+
+static bool CheckBenchState(const WM_SHARED_STATE *state)
+{
+	WM_SHARED_STATE expected;
+	FillBenchState(&expected, state->report);
+	expected.time = state->time;
+	return memcmp(&expected, state, sizeof(expected)) == 0;
+}
+
+/* One reader process: follow the segment until the writer goes away, either
+blocking in Wait() or polling Read() every millisecond */
+static int ShmReader(int id, bool wait)
+{
+	CStateReader reader;
+	for(int tries = 0; !reader.Open(WM_BENCH_SHM_DEVICE) && tries < 1000; tries++)
+		Sleep(1);
+	if(!reader.IsOpen())
+	{
+		printf("  reader %d: couldn't open the segment\n", id);
+		return 1;
+	}
+
+	unsigned long long seen = 0, missed = 0, torn = 0, last = 0;
+	double latencySum = 0, latencyMax = 0;
+	unsigned sequence = 0;
+	WM_SHARED_STATE state;
+
+	while(reader.Live())
+	{
+		if(wait)
+			reader.Wait(sequence, 200);
+		else
+			Sleep(1);
+
+		if(!reader.Read(&state, &sequence) || state.report == last)
+			continue;
+
+		WM_TIME now = WmNow();
+		if(!CheckBenchState(&state))
+			torn++;
+		if(last && state.report > last + 1)
+			missed += state.report - last - 1;
+		last = state.report;
+		seen++;
+
+		double latency = (double)(now - state.time) / WM_NS_PER_US;
+		latencySum += latency;
+		if(latency > latencyMax)
+			latencyMax = latency;
+	}
+
+	printf("  reader %d (%s): %llu updates, %llu missed, %llu torn, latency mean %.1f us max %.1f us\n",
+		id, wait ? "wait" : "poll", seen, missed, torn, seen ? latencySum / seen : 0.0, latencyMax);
+	return torn ? 1 : 0;
+}
+
+/* Publish at the mote's 100 Hz and then flat out, with several reader processes
+following along. Fails if any reader ever sees a torn state. */
+static int BenchShm()
+{
+	printf("Shared state: %d reader processes, 2 s at 100 Hz then 0.5 s flat out\n", WM_BENCH_SHM_READERS);
+	fflush(stdout);
+
+	CStatePublisher publisher;
+	if(!publisher.Open(WM_BENCH_SHM_DEVICE))
+		return 1;
+
+	WM_SHARED_STATE state;
+	FillBenchState(&state, 0);
+	publisher.Publish(&state);
+
+	pid_t readers[WM_BENCH_SHM_READERS];
+	for(int i = 0; i < WM_BENCH_SHM_READERS; i++)
+	{
+		readers[i] = fork();
+		if(readers[i] == 0)
+		{
+			int code = ShmReader(i, (i & 1) == 0);
+			fflush(stdout);
+			_exit(code);
+		}
+	}
+	Sleep(100);
+
+	unsigned long long n = 0;
+	WM_TIME end = WmNow() + 2 * WM_NS_PER_SEC;
+	while(WmNow() < end)
+	{
+		FillBenchState(&state, ++n);
+		publisher.Publish(&state);
+		Sleep(10);
+	}
+
+	unsigned long long slow = n;
+	WM_TIME t = WmNow();
+	end = t + WM_NS_PER_SEC / 2;
+	while(WmNow() < end)
+	{
+		FillBenchState(&state, ++n);
+		publisher.Publish(&state);
+	}
+	t = WmNow() - t;
+	printf("  writer: %llu updates, flat out %.0f ns each\n", n, (double)t / (n - slow));
+	fflush(stdout);
+
+	publisher.Close();
+
+	int failed = 0;
+	for(int i = 0; i < WM_BENCH_SHM_READERS; i++)
+	{
+		int status = 0;
+		waitpid(readers[i], &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	printf("Shared state: %s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
+#define WM_BENCH_STARTUP_UNLINKED 8 /* one class entry in this many is a plain directory, so its IDs take a probe */
+
+/* Lay out a sysfs and /dev under root with count hidraw nodes, one of them
+the mote at index mote. Each node is its own HID device, with a vendor and
+product from a handful of common ones, and /dev entries are plain files
+except the mote's, which is a FIFO the bench writes a report into. */
+static bool BuildDeviceTree(const char *root, int count, int mote)
+{
+	static const unsigned vendors[][2] = {
+		{ 0x046d, 0xc52b }, { 0x045e, 0x07a5 }, { 0x1532, 0x0084 }, { 0x05ac, 0x024f },
+		{ 0x04d9, 0xa0f8 }, { 0x8087, 0x0a2b }, { 0x0b05, 0x1866 }, { 0x1b1c, 0x1b3e }
+	};
+	char dir[WM_PATH_SIZE], file[WM_PATH_SIZE * 2], target[WM_PATH_SIZE * 3];
+
+	const char *dirs[] = { "/sys", "/sys/class", "/sys/class/hidraw", "/sys/devices", "/sys/devices/virtual", "/sys/devices/virtual/hid", "/dev" };
+	for(size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+	{
+		snprintf(dir, sizeof(dir), "%s%s", root, dirs[i]);
+		if(mkdir(dir, 0700) != 0)
+			return false;
+	}
+
+	unsigned seed = 7;
+	for(int i = 0; i < count; i++)
+	{
+		unsigned vid = WIIMOTE_VID, pid = WIIMOTE_PID;
+		if(i != mote)
+		{
+			int which = (int)(BenchRandom(&seed) * (sizeof(vendors) / sizeof(vendors[0])));
+			vid = vendors[which][0];
+			pid = vendors[which][1];
+		}
+
+		/* devices/virtual/hid/0005:057E:0306.0004/uevent and .../hidraw/hidraw3/device */
+		char hid[64];
+		snprintf(hid, sizeof(hid), "%04X:%04X:%04X.%04X", i == mote ? 5 : 3, vid, pid, i + 1);
+		snprintf(dir, sizeof(dir), "%s/sys/devices/virtual/hid/%s", root, hid);
+		if(mkdir(dir, 0700) != 0)
+			return false;
+		snprintf(file, sizeof(file), "%s/uevent", dir);
+		FILE *uevent = fopen(file, "w");
+		if(!uevent)
+			return false;
+		fprintf(uevent, "DRIVER=hid-generic\nHID_ID=%04X:%08X:%08X\nHID_NAME=bench device %d\n", i == mote ? 5 : 3, vid, pid, i);
+		fclose(uevent);
+
+		snprintf(file, sizeof(file), "%s/hidraw", dir);
+		if(mkdir(file, 0700) != 0)
+			return false;
+		snprintf(file, sizeof(file), "%s/hidraw/hidraw%d", dir, i);
+		if(mkdir(file, 0700) != 0)
+			return false;
+		snprintf(file, sizeof(file), "%s/hidraw/hidraw%d/device", dir, i);
+		if(symlink(dir, file) != 0)
+			return false;
+
+		/* The class entry, usually a link into the device tree */
+		snprintf(file, sizeof(file), "%s/sys/class/hidraw/hidraw%d", root, i);
+		if(i % WM_BENCH_STARTUP_UNLINKED == WM_BENCH_STARTUP_UNLINKED - 1)
+		{
+			if(mkdir(file, 0700) != 0)
+				return false;
+			snprintf(target, sizeof(target), "%s/device", file);
+			if(symlink(dir, target) != 0)
+				return false;
+		}
+		else
+		{
+			snprintf(target, sizeof(target), "../../devices/virtual/hid/%s/hidraw/hidraw%d", hid, i);
+			if(symlink(target, file) != 0)
+				return false;
+		}
+
+		snprintf(file, sizeof(file), "%s/dev/hidraw%d", root, i);
+		if(i == mote)
+		{
+			if(mkfifo(file, 0600) != 0)
+				return false;
+		}
+		else
+		{
+			int node = open(file, O_CREAT | O_WRONLY, 0600);
+			if(node < 0)
+				return false;
+			close(node);
+		}
+	}
+	return true;
+}
+
+static int RemoveTreeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+	return remove(path);
+}
+
+/* Time from Open() to the mote's first report, best of 5. The FIFO's writer
+end stays open, so a report written ahead waits there for the reader. */
+static double BenchFirstReport(int writer, WM_SCAN_STATS *stats)
+{
+	byte report[WM_PACKET_SIZE];
+	memset(report, 0, sizeof(report));
+	report[0] = 0x20;
+
+	double best = 0;
+	for(int pass = 0; pass < 5; pass++)
+	{
+		if(write(writer, report, sizeof(report)) != (ssize_t)sizeof(report))
+			return -1;
+		CHidDevice hid;
+		WM_TIME started = WmNow();
+		byte buffer[WM_PACKET_SIZE];
+		if(!hid.Open(WIIMOTE_VID, WIIMOTE_PID) || hid.Read(buffer, sizeof(buffer), 1000) != (int)sizeof(report))
+			return -1;
+		double ms = (double)(WmNow() - started) / WM_NS_PER_MS;
+		if(!best || ms < best)
+			best = ms;
+		hid.GetScanStats(stats);
+	}
+	return best;
+}
+
+/* Find the mote in simulated device trees of growing size: enumerating
+with every node's IDs read from sysfs one after another (as every start
+used to), telling nodes apart by their links with the rest probed in
+parallel, and a warm start from the cache. The tree lives in /tmp, so
+sysfs, where every read goes through a driver, would be slower. */
+static int BenchStartup()
+{
+	static const int sizes[] = { 16, 256, 4096 };
+	int failures = 0;
+
+	printf("Open() to the mote's first report in a simulated device tree, best of 5:\n");
+	printf("  %5s  %24s  %24s  %24s\n", "nodes", "every node probed", "by path, rest parallel", "warm start from cache");
+	for(size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+	{
+		char root[] = "/tmp/wiimouse-tree-XXXXXX";
+		if(!mkdtemp(root))
+			return 1;
+		int count = sizes[n];
+		int mote = count * 2 / 3;
+		char fifo[WM_PATH_SIZE];
+		snprintf(fifo, sizeof(fifo), "%s/dev/hidraw%d", root, mote);
+		int writer = -1;
+		if(BuildDeviceTree(root, count, mote))
+			writer = open(fifo, O_RDWR);
+		if(writer < 0)
+		{
+			printf("Couldn't build the device tree in %s\n", root);
+			nftw(root, RemoveTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+			return 1;
+		}
+
+		WM_SCAN_CONFIG config;
+		CHidDevice::ScanDefaults(&config);
+		snprintf(config.root, sizeof(config.root), "%s", root);
+
+		/* One after another, opening everything: the old way */
+		WM_SCAN_STATS stats[3];
+		double ms[3];
+		config.cacheFile[0] = 0;
+		config.pathIds = false;
+		config.jobs = 1;
+		CHidDevice::Configure(&config);
+		ms[0] = BenchFirstReport(writer, &stats[0]);
+
+		config.pathIds = true;
+		config.jobs = WM_SCAN_JOBS;
+		CHidDevice::Configure(&config);
+		ms[1] = BenchFirstReport(writer, &stats[1]);
+
+		snprintf(config.cacheFile, sizeof(config.cacheFile), "%s/devices", root);
+		CHidDevice::Configure(&config);
+		CHidDevice first;
+		first.Open(WIIMOTE_VID, WIIMOTE_PID); /* fills the cache */
+		first.Close();
+		ms[2] = BenchFirstReport(writer, &stats[2]);
+
+		char cells[3][64];
+		for(int i = 0; i < 3; i++)
+		{
+			if(ms[i] < 0)
+			{
+				snprintf(cells[i], sizeof(cells[i]), "FAILED");
+				failures++;
+			}
+			else
+				snprintf(cells[i], sizeof(cells[i]), "%.3f ms (%d probed)", ms[i], stats[i].probed);
+		}
+		printf("  %5d  %24s  %24s  %24s\n", count, cells[0], cells[1], cells[2]);
+		if(ms[2] >= 0 && !stats[2].cached)
+		{
+			printf("  the warm start enumerated anyway\n");
+			failures++;
+		}
+
+		/* A remembered node that's now something else must not be taken for the mote */
+		FILE *cache = fopen(config.cacheFile, "w");
+		if(cache)
+		{
+			fprintf(cache, "%04x %04x %s/dev/hidraw0\n", WIIMOTE_VID, WIIMOTE_PID, root);
+			fclose(cache);
+		}
+		CHidDevice hid;
+		WM_SCAN_STATS staleStats;
+		bool found = hid.Open(WIIMOTE_VID, WIIMOTE_PID) && strcmp(hid.Path(), fifo) == 0;
+		hid.GetScanStats(&staleStats);
+		if(!found || staleStats.cached)
+		{
+			printf("  a stale cache entry was %s\n", found ? "trusted" : "followed into the wrong device");
+			failures++;
+		}
+
+		close(writer);
+		nftw(root, RemoveTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+
+	WM_SCAN_CONFIG defaults;
+	CHidDevice::ScanDefaults(&defaults);
+	CHidDevice::Configure(&defaults);
+	return failures ? 1 : 0;
+}
+
+#define WM_BENCH_TRACE_RUN_MS 1000
+
+/* Count the events named name in a written trace */
+static int CountTraceEvents(const char *json, const char *name)
+{
+	char key[64];
+	snprintf(key, sizeof(key), "\"name\":\"%s\"", name);
+	int count = 0;
+	for(const char *at = strstr(json, key); at; at = strstr(at + 1, key))
+		count++;
+	return count;
+}
+
+/* Trace a virtual mote from the handshake through a second of streaming
+with presses and pointer motion, write the trace out, and check every
+tracepoint made it into the JSON */
+static int BenchTraceRun()
+{
+	char path[] = "/tmp/wiimouse-trace-XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return 1;
+	close(fd);
+
+	CTracer::Clear();
+	CTracer::Start();
+	CVirtualMote vmote;
+	vmote.SetMotion(true);
+	CWiimote *wiimote = new CWiimote(vmote.StartSocket(), "virtual");
+	if(!wiimote->mote.connected)
+	{
+		printf("virtual mote didn't connect\n");
+		CTracer::Stop();
+		delete wiimote;
+		unlink(path);
+		return 1;
+	}
+	wiimote->idleAfter = 0;
+	wiimote->SetNullOutput(true);
+	std::thread loop(IdleLoopThread, wiimote);
+	for(int i = 0; i < WM_BENCH_TRACE_RUN_MS / 100; i++)
+	{
+		vmote.SetButtons(i & 1 ? 0 : WM_BUT_A);
+		Sleep(100);
+	}
+	wiimote->commands.Post(WM_CMD_QUIT);
+	loop.join();
+	delete wiimote;
+	CTracer::Stop();
+
+	unsigned long long events = CTracer::Recorded();
+	BOOL written = CTracer::Write(path);
+	std::vector<char> json;
+	FILE *file = written ? fopen(path, "r") : NULL;
+	if(file)
+	{
+		char chunk[65536];
+		size_t got;
+		while((got = fread(chunk, 1, sizeof(chunk), file)) > 0)
+			json.insert(json.end(), chunk, chunk + got);
+		fclose(file);
+	}
+	json.push_back(0);
+	unlink(path);
+
+	static const char *names[] = { "read", "decode", "map", "bind", "inject", "write", "handshake" };
+	int failures = json.size() < 8 || strstr(&json[0], "\n]}\n") == NULL;
+	printf("A virtual mote traced for %d ms: %llu events, %.0f KB of JSON\n", WM_BENCH_TRACE_RUN_MS, events, json.size() / 1024.0);
+	for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		int count = CountTraceEvents(&json[0], names[i]);
+		failures += count == 0;
+		printf("  %-10s %6d%s\n", names[i], count, count ? "" : "  MISSING");
+	}
+	CTracer::Clear();
+	return failures ? 1 : 0;
+}
+
+#endif /* !_WIN32 */
+
+/* Run the named bench. Returns the process exit code. */
+int RunBench(const _TCHAR *name)
+{
+	if(_tcscmp(name, _T("pool")) == 0)
+	{
+		BenchPool();
+		return 0;
+	}
+
+	if(_tcscmp(name, _T("net")) == 0)
+		return BenchNet();
+
+	if(_tcscmp(name, _T("clock")) == 0)
+		return BenchClock();
+
+	if(_tcscmp(name, _T("layout")) == 0)
+		return BenchLayout();
+
+	if(_tcscmp(name, _T("derive")) == 0)
+		return BenchDerive();
+
+	if(_tcscmp(name, _T("trace")) == 0)
+		return BenchTrace();
+
+	if(_tcscmp(name, _T("speaker")) == 0)
+	{
+		BenchAdpcm();
+#ifndef _WIN32
+		BenchSpeakerPacing();
+#endif
+		return 0;
+	}
+
+#ifndef _WIN32
+	if(_tcscmp(name, _T("rumble")) == 0)
+		return BenchRumble();
+	if(_tcscmp(name, _T("shm")) == 0)
+		return BenchShm();
+	if(_tcscmp(name, _T("idle")) == 0)
+		return BenchIdle();
+	if(_tcscmp(name, _T("reports")) == 0)
+		return BenchReports();
+	if(_tcscmp(name, _T("memory")) == 0)
+		return BenchMemory();
+	if(_tcscmp(name, _T("ext")) == 0)
+		return BenchExtensions();
+	if(_tcscmp(name, _T("gamepad")) == 0)
+		return BenchGamepad();
+	if(_tcscmp(name, _T("rt")) == 0)
+		return BenchRealTime();
+	if(_tcscmp(name, _T("analyze")) == 0)
+		return BenchAnalytics();
+	if(_tcscmp(name, _T("soak")) == 0)
+		return BenchSoak();
+	if(_tcscmp(name, _T("startup")) == 0)
+		return BenchStartup();
+	if(_tcscmp(name, _T("schedule")) == 0)
+		return BenchSchedule();
+#endif
+
+	printf("Unknown or unsupported bench. Available: clock, derive, layout, net, pool, speaker, trace (encoder only on Windows); Linux: analyze, ext, gamepad, idle, memory, reports, rt, rumble, schedule, shm, soak, startup\n");
+	return 1;
+}
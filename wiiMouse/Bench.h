@@ -0,0 +1,10 @@
+/*************************
+Bench.h
+
+Measurement runs selected with -bench <name>. Each drives the real CWiimote
+code and prints what it measured; most need the virtual mote and so only run on Linux.
+**************************/
+
+#pragma once
+
+int RunBench(const _TCHAR *name);
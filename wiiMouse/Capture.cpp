@@ -0,0 +1,141 @@
+/*************************
+Capture.cpp
+
+Report capture to disk. See Capture.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+/* The file format is fixed, so check nothing has shifted it */
+static_assert(sizeof(WM_CAPTURE_HEADER) == 64, "capture header must be 64 bytes");
+static_assert(sizeof(WM_CAPTURE_RECORD) == 40, "capture record must be 40 bytes");
+
+/* How long the writer thread sleeps once the queue is empty */
+#define WM_CAPTURE_IDLE_MS 20
+
+CReportCapture::CReportCapture(void)
+{
+	file = NULL;
+	running = false;
+	head = tail = 0;
+	written = dropped = 0;
+}
+
+CReportCapture::~CReportCapture(void)
+{
+	Stop();
+}
+
+/* Open path, write the header and start taking reports */
+BOOL CReportCapture::Start(const char *path, const WM_CAPTURE_HEADER *header)
+{
+	if(running)
+		return false;
+
+	file = fopen(path, "wb");
+	if(!file)
+	{
+		printf("Couldn't open %s for the capture\n", path);
+		return false;
+	}
+
+	if(fwrite(header, sizeof(*header), 1, file) != 1)
+	{
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+
+	head = tail = 0;
+	written = dropped = 0;
+	running = true;
+	writer = std::thread(&CReportCapture::Run, this);
+	return true;
+}
+
+/* Write out whatever is queued and close the file.
+Unsubscribe first, so nothing new arrives while this runs. */
+void CReportCapture::Stop()
+{
+	if(!running)
+		return;
+
+	running = false;
+	if(writer.joinable())
+		writer.join();
+
+	fclose(file);
+	file = NULL;
+}
+
+bool CReportCapture::Running() const
+{
+	return running;
+}
+
+/* Read loop thread - queue the slot for the writer, holding a reference */
+void CReportCapture::OnReport(WM_REPORT *report)
+{
+	if(!running)
+		return;
+
+	unsigned t = tail.load(std::memory_order_relaxed);
+	if(t - head.load(std::memory_order_acquire) == WM_CAPTURE_QUEUE)
+	{
+		dropped++;
+		return;
+	}
+
+	ReportAddRef(report);
+	queue[t % WM_CAPTURE_QUEUE] = report;
+	tail.store(t + 1, std::memory_order_release);
+}
+
+/* Write every queued report, releasing each slot as it goes. Each batch is
+flushed, so a capture cut short by a kill still ends on a whole record. */
+void CReportCapture::Drain()
+{
+	unsigned h = head.load(std::memory_order_relaxed);
+	unsigned t = tail.load(std::memory_order_acquire);
+
+	for(; h != t; h++)
+	{
+		WM_REPORT *report = queue[h % WM_CAPTURE_QUEUE];
+
+		WM_CAPTURE_RECORD record;
+		memset(&record, 0, sizeof(record));
+		record.time = report->readDone;
+		record.seq = (DWORD)report->seq;
+		record.length = (unsigned short)report->length;
+		memcpy(record.data, report->data, WM_PACKET_SIZE);
+
+		ReportRelease(report);
+		head.store(h + 1, std::memory_order_release);
+
+		if(fwrite(&record, sizeof(record), 1, file) == 1)
+			written++;
+	}
+
+	fflush(file);
+}
+
+void CReportCapture::Run()
+{
+	while(running)
+	{
+		Drain();
+		Sleep(WM_CAPTURE_IDLE_MS);
+	}
+	Drain();
+}
+
+unsigned long long CReportCapture::Written() const
+{
+	return written;
+}
+
+unsigned long long CReportCapture::Dropped() const
+{
+	return dropped;
+}
@@ -0,0 +1,80 @@
+/*************************
+Capture.h
+
+Capture of raw input reports to disk, for replay and offline analysis.
+
+The file is a WM_CAPTURE_HEADER followed by fixed-size WM_CAPTURE_RECORDs, one
+per input report in arrival order, all little-endian as written by x86.
+The header carries the calibration read during the handshake, so a capture
+can be decoded without the mote that made it.
+
+CReportCapture is a report subscriber: OnReport() only takes a reference and
+queues the slot, and a thread of its own does the writing, so the disk never
+holds up the read loop. If the queue fills, reports are counted as dropped
+rather than waited for.
+**************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include "Timing.h"
+#include "ReportPool.h"
+
+#define WM_CAPTURE_MAGIC "WMCAPT01"
+#define WM_CAPTURE_VERSION 1
+#define WM_CAPTURE_QUEUE 128 /* reports waiting for the disk thread */
+
+struct WM_CAPTURE_HEADER {
+	char magic[8]; /* WM_CAPTURE_MAGIC, not terminated */
+	DWORD version;
+	DWORD recordSize; /* sizeof(WM_CAPTURE_RECORD) */
+	WM_TIME started; /* monotonic ns when the capture began */
+	byte moteZero[3];
+	byte moteScale[3];
+	byte chukZero[3];
+	byte chukScale[3];
+	byte stickMin[2];
+	byte stickMax[2];
+	byte stickCenter[2];
+	byte chukConnected;
+	byte reserved[21]; /* pads the header to 64 bytes */
+};
+
+struct WM_CAPTURE_RECORD {
+	WM_TIME time; /* monotonic ns when the read completed */
+	DWORD seq; /* report number, gaps mean the capture dropped some */
+	unsigned short length; /* bytes of data that came from the device */
+	unsigned short reserved;
+	byte data[WM_PACKET_SIZE]; /* zero-filled past length */
+	byte pad[2]; /* pads the record to 40 bytes */
+};
+
+class CReportCapture : public CReportSubscriber
+{
+public:
+	CReportCapture(void);
+	~CReportCapture(void);
+	BOOL Start(const char *path, const WM_CAPTURE_HEADER *header);
+	void Stop();
+	bool Running() const;
+	void OnReport(WM_REPORT *report);
+	unsigned long long Written() const;
+	unsigned long long Dropped() const;
+private:
+	void Run();
+	void Drain();
+
+	FILE *file;
+	std::thread writer;
+	std::atomic<bool> running;
+
+	/* Single producer (the read loop), single consumer (the writer thread) */
+	WM_REPORT *queue[WM_CAPTURE_QUEUE];
+	std::atomic<unsigned> head; /* next to write to disk */
+	std::atomic<unsigned> tail; /* next free */
+
+	std::atomic<unsigned long long> written;
+	std::atomic<unsigned long long> dropped;
+};
@@ -0,0 +1,40 @@
+/*************************
+CommandQueue.cpp
+
+Commands posted to the read loop. See CommandQueue.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+CCommandQueue::CCommandQueue(void)
+{
+	head = tail = 0;
+}
+
+/* Any thread - returns false if the read loop has fallen WM_COMMAND_QUEUE behind */
+BOOL CCommandQueue::Post(int type, int value)
+{
+	std::lock_guard<std::mutex> guard(posting);
+
+	unsigned t = tail.load(std::memory_order_relaxed);
+	if(t - head.load(std::memory_order_acquire) == WM_COMMAND_QUEUE)
+		return false;
+
+	ring[t % WM_COMMAND_QUEUE].type = type;
+	ring[t % WM_COMMAND_QUEUE].value = value;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+/* Read loop only - the oldest command, or false if there is none */
+bool CCommandQueue::Take(WM_COMMAND *command)
+{
+	unsigned h = head.load(std::memory_order_relaxed);
+	if(h == tail.load(std::memory_order_acquire))
+		return false;
+
+	*command = ring[h % WM_COMMAND_QUEUE];
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
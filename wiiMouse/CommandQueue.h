@@ -0,0 +1,43 @@
+/*************************
+CommandQueue.h
+
+Commands for the read loop from other threads, such as the control socket.
+
+Changing the mode, LEDs or rumble touches state that only the read loop owns,
+so other threads post a WM_COMMAND instead and DebugLoop() applies it between
+reports. Posting takes a lock among the posting threads only. The read loop's
+side never locks: an empty check is two atomic loads, so an idle queue costs
+the loop nothing measurable.
+**************************/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#define WM_COMMAND_QUEUE 64 /* commands waiting for the read loop */
+
+/* Command types */
+#define WM_CMD_MODE 1 /* value is a WM_MY_* mode */
+#define WM_CMD_MODE_STEP 2 /* value is +1 or -1, as the plus and minus buttons do */
+#define WM_CMD_LEDS 3 /* value is a WM_LED_* mask */
+#define WM_CMD_RUMBLE 4 /* value is 0 or 1 */
+#define WM_CMD_QUIT 5 /* leave DebugLoop() */
+
+struct WM_COMMAND {
+	int type;
+	int value;
+};
+
+class CCommandQueue
+{
+public:
+	CCommandQueue(void);
+	BOOL Post(int type, int value = 0);
+	bool Take(WM_COMMAND *command);
+private:
+	std::mutex posting; /* serializes posting threads */
+	WM_COMMAND ring[WM_COMMAND_QUEUE];
+	std::atomic<unsigned> head; /* next for the read loop to take */
+	std::atomic<unsigned> tail; /* next free */
+};
@@ -0,0 +1,379 @@
+/*************************
+ControlSocket.cpp
+
+Daemon control socket. See ControlSocket.h for the commands.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+#include "ControlSocket.h"
+
+#ifndef _WIN32
+
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/select.h>
+
+/* Indexed by WM_MY_* */
+static const char *modeNames[WM_MY_MAX + 1] = { "mouse", "emu", "fps" };
+
+CControlServer::CControlServer(void)
+{
+	mote = NULL;
+	listener = -1;
+	socketPath[0] = 0;
+	running = false;
+	subscribed = false;
+	head = tail = 0;
+	dumpsDropped = 0;
+	for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+		clients[i].fd = -1;
+}
+
+CControlServer::~CControlServer(void)
+{
+	Close();
+}
+
+/* Listen on path and serve commands for device until Close().
+A socket left behind by an earlier run is replaced; anything else at path is not. */
+BOOL CControlServer::Open(const char *path, CWiimote *device)
+{
+	if(running)
+		return false;
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		printf("Control socket path %s is too long\n", path);
+		return false;
+	}
+	strcpy(address.sun_path, path);
+
+	struct stat existing;
+	if(lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode))
+		unlink(path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, WM_CONTROL_CLIENTS) != 0)
+	{
+		printf("Couldn't listen on %s (%s)\n", path, strerror(errno));
+		if(listener >= 0)
+			close(listener);
+		listener = -1;
+		return false;
+	}
+	chmod(path, 0660);
+
+	strcpy(socketPath, path);
+	mote = device;
+	running = true;
+	server = std::thread(&CControlServer::Run, this);
+	return true;
+}
+
+/* Stop serving, hang up on every client and remove the socket */
+void CControlServer::Close()
+{
+	if(!running)
+		return;
+
+	running = false;
+	server.join();
+
+	for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+		if(clients[i].fd >= 0)
+			Disconnect(&clients[i]);
+
+	close(listener);
+	listener = -1;
+	unlink(socketPath);
+	socketPath[0] = 0;
+}
+
+/* Read loop thread - copy the report for the dump, dropping it if the queue is full */
+void CControlServer::OnReport(WM_REPORT *report)
+{
+	unsigned t = tail.load(std::memory_order_relaxed);
+	if(t - head.load(std::memory_order_acquire) == WM_CONTROL_DUMP_QUEUE)
+	{
+		dumpsDropped++;
+		return;
+	}
+
+	WM_DUMP_ENTRY *entry = &dumps[t % WM_CONTROL_DUMP_QUEUE];
+	entry->time = report->readDone;
+	entry->seq = report->seq;
+	entry->length = report->length;
+	memcpy(entry->data, report->data, WM_PACKET_SIZE);
+	tail.store(t + 1, std::memory_order_release);
+}
+
+/* Server thread - wait on the listener and every client, a tick at a time */
+void CControlServer::Run()
+{
+	while(running)
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		int highest = listener;
+		for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+		{
+			if(clients[i].fd < 0)
+				continue;
+			FD_SET(clients[i].fd, &readable);
+			if(clients[i].fd > highest)
+				highest = clients[i].fd;
+		}
+
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = WM_CONTROL_TICK_MS * 1000;
+		int ready = select(highest + 1, &readable, NULL, NULL, &tv);
+
+		if(ready > 0)
+		{
+			if(FD_ISSET(listener, &readable))
+				Accept();
+			for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+				if(clients[i].fd >= 0 && FD_ISSET(clients[i].fd, &readable) && !Serve(&clients[i]))
+					Disconnect(&clients[i]);
+		}
+
+		SendDumps();
+	}
+}
+
+void CControlServer::Accept()
+{
+	int fd = accept(listener, NULL, NULL);
+	if(fd < 0)
+		return;
+
+	for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+	{
+		if(clients[i].fd >= 0)
+			continue;
+		clients[i].fd = fd;
+		clients[i].dumping = false;
+		clients[i].used = 0;
+		return;
+	}
+
+	const char *full = "error: too many connections\n";
+	send(fd, full, strlen(full), MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(fd);
+}
+
+/* Read what the client sent and handle each whole line. False once it has hung up. */
+bool CControlServer::Serve(_client *client)
+{
+	int got = (int)recv(client->fd, client->buffer + client->used, WM_CONTROL_LINE - 1 - client->used, 0);
+	if(got <= 0)
+		return false;
+	client->used += got;
+
+	char *line = client->buffer;
+	char *end;
+	while((end = (char *)memchr(line, '\n', client->used - (line - client->buffer))) != NULL)
+	{
+		*end = 0;
+		if(end > line && end[-1] == '\r')
+			end[-1] = 0;
+		Handle(client, line);
+		if(client->fd < 0)
+			return true;
+		line = end + 1;
+	}
+
+	client->used -= (int)(line - client->buffer);
+	memmove(client->buffer, line, client->used);
+
+	/* A line that fills the buffer will never be handled */
+	if(client->used == WM_CONTROL_LINE - 1)
+	{
+		Reply(client, "error: line too long\n");
+		client->used = 0;
+	}
+	return true;
+}
+
+void CControlServer::Handle(_client *client, char *line)
+{
+	char verb[32], arg[32];
+	verb[0] = arg[0] = 0;
+	if(sscanf(line, "%31s %31s", verb, arg) < 1)
+		return;
+
+	BOOL posted = true;
+	if(strcmp(verb, "mode") == 0)
+	{
+		int mode = -1;
+		for(int i = 0; i <= WM_MY_MAX; i++)
+			if(strcmp(arg, modeNames[i]) == 0)
+				mode = i;
+
+		if(mode >= 0)
+			posted = mote->commands.Post(WM_CMD_MODE, mode);
+		else if(strcmp(arg, "next") == 0 || strcmp(arg, "prev") == 0)
+			posted = mote->commands.Post(WM_CMD_MODE_STEP, arg[0] == 'n' ? 1 : -1);
+		else
+		{
+			Reply(client, "error: mode is mouse, emu, fps, next or prev\n");
+			return;
+		}
+	}
+	else if(strcmp(verb, "leds") == 0)
+	{
+		char *end;
+		long leds = strtol(arg, &end, 0);
+		if(!arg[0] || *end || leds < 0 || leds > 15)
+		{
+			Reply(client, "error: leds takes 0 to 15\n");
+			return;
+		}
+		posted = mote->commands.Post(WM_CMD_LEDS, (int)(leds << 4));
+	}
+	else if(strcmp(verb, "rumble") == 0 || strcmp(verb, "dump") == 0)
+	{
+		bool on = strcmp(arg, "on") == 0;
+		if(!on && strcmp(arg, "off") != 0)
+		{
+			Reply(client, "error: %s is on or off\n", verb);
+			return;
+		}
+		if(verb[0] == 'r')
+			posted = mote->commands.Post(WM_CMD_RUMBLE, on);
+		else
+			SetDumping(client, on);
+	}
+	else if(strcmp(verb, "devices") == 0)
+		Devices(client);
+	else if(strcmp(verb, "stats") == 0)
+		Stats(client);
+	else if(strcmp(verb, "quit") == 0)
+		posted = mote->commands.Post(WM_CMD_QUIT);
+	else if(strcmp(verb, "help") == 0)
+		Reply(client, "mode mouse|emu|fps|next|prev, leds 0-15, rumble on|off, dump on|off, devices, stats, quit\n");
+	else
+	{
+		Reply(client, "error: unknown command %s\n", verb);
+		return;
+	}
+
+	if(posted)
+		Reply(client, "ok\n");
+	else
+		Reply(client, "error: command queue full\n");
+}
+
+/* Write to a client without ever waiting on it. A reply that doesn't fit in
+the socket buffer is cut short; the client had stopped reading anyway. */
+void CControlServer::Reply(_client *client, const char *format, ...)
+{
+	if(client->fd < 0)
+		return;
+
+	char text[512];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	if(length <= 0)
+		return;
+	if(length >= (int)sizeof(text))
+		length = sizeof(text) - 1;
+
+	if(send(client->fd, text, length, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		Disconnect(client);
+}
+
+/* Fields Initialize() sets before the server starts, and the mode the read loop publishes */
+void CControlServer::Devices(_client *client)
+{
+	int mode = mote->Mode();
+	Reply(client, "0 %s extension %s battery %d%% mode %s\n",
+		mote->hid.Path(), CWiimote::ExtensionName(mote->mote.extension), mote->mote.battery,
+		mode >= 0 && mode <= WM_MY_MAX ? modeNames[mode] : "none");
+}
+
+void CControlServer::Stats(_client *client)
+{
+	WM_STATS stats;
+	mote->GetStats(&stats);
+
+	Reply(client, "received %llu drops %llu gaps %llu overruns %llu read errors %llu write errors %llu period %.2f ms jitter %.3f ms\n",
+		stats.received, stats.drops, stats.gaps, stats.overruns, stats.readErrors, stats.writeErrors,
+		(double)stats.period / WM_NS_PER_MS, (double)stats.jitter / WM_NS_PER_MS);
+
+	for(int i = 0; i < WM_STATS_TYPES; i++)
+		if(stats.byType[i])
+			Reply(client, "type 0x%02x %llu\n", WM_STATS_FIRST_TYPE + i, stats.byType[i]);
+	if(stats.otherType)
+		Reply(client, "type other %llu\n", stats.otherType);
+	if(dumpsDropped)
+		Reply(client, "dump lines dropped %llu\n", (unsigned long long)dumpsDropped);
+}
+
+/* The dump subscriber is only attached while someone is dumping */
+void CControlServer::SetDumping(_client *client, bool on)
+{
+	client->dumping = on;
+
+	bool wanted = false;
+	for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+		if(clients[i].fd >= 0 && clients[i].dumping)
+			wanted = true;
+
+	if(wanted && !subscribed)
+	{
+		/* Skip anything left over from the last time */
+		head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+		subscribed = mote->Subscribe(this) != FALSE;
+	}
+	else if(!wanted && subscribed)
+	{
+		mote->Unsubscribe(this);
+		subscribed = false;
+	}
+}
+
+/* Format queued reports as hex, one line each, for every client dumping */
+void CControlServer::SendDumps()
+{
+	unsigned h = head.load(std::memory_order_relaxed);
+	unsigned t = tail.load(std::memory_order_acquire);
+
+	for(; h != t; h++)
+	{
+		const WM_DUMP_ENTRY *entry = &dumps[h % WM_CONTROL_DUMP_QUEUE];
+
+		char text[32 + 3 * WM_PACKET_SIZE];
+		int length = sprintf(text, "report %llu %llu", entry->seq, (unsigned long long)(entry->time / WM_NS_PER_US));
+		for(int i = 0; i < entry->length && i < WM_PACKET_SIZE; i++)
+			length += sprintf(text + length, " %02x", entry->data[i]);
+		text[length++] = '\n';
+
+		head.store(h + 1, std::memory_order_release);
+
+		for(int i = 0; i < WM_CONTROL_CLIENTS; i++)
+			if(clients[i].fd >= 0 && clients[i].dumping)
+				send(clients[i].fd, text, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+}
+
+void CControlServer::Disconnect(_client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+	if(client->dumping)
+		SetDumping(client, false);
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*************************
+ControlSocket.h
+
+Local control socket for running wiiMouse as a daemon (Linux only).
+
+A Unix-domain stream socket takes one text command per line and answers each
+with one or more lines, the last being "ok" or "error: ...":
+	mode mouse|emu|fps|next|prev	switch the WM_MY_* mode
+	leds N				light LEDs 1-4 from the bits of N (0-15)
+	rumble on|off
+	dump on|off			stream raw input reports to this connection
+	devices				the mote, its extension, battery and mode
+	stats				report counters, as in -stats
+	quit				leave the read loop and exit
+	help
+
+The socket is served by a thread of its own. Queries are answered there from
+counters that are safe to read from any thread, and everything that changes
+the mote is posted to CWiimote::commands for the read loop to apply between
+reports, so a control client never blocks report processing. Raw dumps are a
+report subscriber that copies each report into a queue for this thread to
+format; a client that can't keep up loses dump lines, not reports.
+**************************/
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <thread>
+#include "Timing.h"
+#include "ReportPool.h"
+
+#define WM_CONTROL_CLIENTS 8 /* connections served at once */
+#define WM_CONTROL_LINE 256 /* longest command line */
+#define WM_CONTROL_DUMP_QUEUE 256 /* reports waiting to be formatted */
+#define WM_CONTROL_TICK_MS 20 /* how often dumps go out, and how quickly Close() is noticed */
+
+class CWiimote;
+
+/* A raw report, copied out of its pool slot for the dump */
+struct WM_DUMP_ENTRY {
+	WM_TIME time;
+	unsigned long long seq;
+	int length;
+	byte data[WM_PACKET_SIZE];
+};
+
+class CControlServer : public CReportSubscriber
+{
+struct _client {
+	int fd; /* -1 when the slot is free */
+	bool dumping;
+	int used; /* bytes of a partial line in buffer */
+	char buffer[WM_CONTROL_LINE];
+};
+public:
+	CControlServer(void);
+	~CControlServer(void);
+	BOOL Open(const char *path, CWiimote *device);
+	void Close();
+	void OnReport(WM_REPORT *report);
+private:
+	void Run();
+	void Accept();
+	bool Serve(_client *client);
+	void Handle(_client *client, char *line);
+	void Reply(_client *client, const char *format, ...);
+	void Devices(_client *client);
+	void Stats(_client *client);
+	void SetDumping(_client *client, bool on);
+	void SendDumps();
+	void Disconnect(_client *client);
+
+	CWiimote *mote;
+	int listener;
+	char socketPath[108]; /* sun_path */
+	std::thread server;
+	std::atomic<bool> running;
+	_client clients[WM_CONTROL_CLIENTS];
+	bool subscribed;
+
+	/* Single producer (the read loop), single consumer (the server thread) */
+	WM_DUMP_ENTRY dumps[WM_CONTROL_DUMP_QUEUE];
+	std::atomic<unsigned> head; /* next to send */
+	std::atomic<unsigned> tail; /* next free */
+	std::atomic<unsigned long long> dumpsDropped;
+};
+
+#endif
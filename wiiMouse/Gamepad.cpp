@@ -0,0 +1,193 @@
+/*************************
+Gamepad.cpp
+
+Virtual gamepads through uinput. See Gamepad.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+/* evdev codes for the WM_PAD_* buttons and axes, bit by bit */
+static const unsigned short padKeys[WM_PAD_BUTTONS] = {
+	BTN_SOUTH, BTN_EAST, BTN_WEST, BTN_NORTH, BTN_TL, BTN_TR, BTN_TL2, BTN_TR2,
+	BTN_SELECT, BTN_START, BTN_MODE, BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT, BTN_DPAD_RIGHT };
+static const unsigned short padAxes[WM_PAD_AXES] = {
+	ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_TILT_X, ABS_TILT_Y, ABS_Z, ABS_RZ };
+
+std::atomic<int> CGamepad::created(0);
+#endif
+
+CGamepad::CGamepad(void)
+{
+	discard = false;
+	primed = false;
+	memset(&last, 0, sizeof(last));
+	frames = 0;
+	events = 0;
+	discarded = 0;
+#ifndef _WIN32
+	fd = -1;
+	unavailable = false;
+#endif
+}
+
+CGamepad::~CGamepad(void)
+{
+#ifndef _WIN32
+	if(fd >= 0)
+	{
+		ioctl(fd, UI_DEV_DESTROY);
+		close(fd);
+	}
+#endif
+}
+
+/* Create the uinput device on the first frame, as CInputInjector does */
+BOOL CGamepad::Open()
+{
+#ifdef _WIN32
+	return false;
+#else
+	if(fd >= 0)
+		return true;
+	if(unavailable)
+		return false;
+
+	unavailable = true;
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0)
+	{
+		printf("Error opening /dev/uinput (%s), no gamepad will be created\n", strerror(errno));
+		return false;
+	}
+
+	struct uinput_user_dev dev;
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "wiiMouse gamepad %d", created++);
+	dev.id.bustype = BUS_VIRTUAL;
+	dev.id.vendor = WIIMOTE_VID;
+	dev.id.product = WIIMOTE_PID;
+	dev.id.version = 1;
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_EVBIT, EV_ABS);
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+	for(int i = 0; i < WM_PAD_BUTTONS; i++)
+		ioctl(fd, UI_SET_KEYBIT, padKeys[i]);
+	for(int i = 0; i < WM_PAD_AXES; i++)
+	{
+		ioctl(fd, UI_SET_ABSBIT, padAxes[i]);
+		dev.absmin[padAxes[i]] = i == WM_PAD_LT || i == WM_PAD_RT ? 0 : -WM_PAD_AXIS_MAX;
+		dev.absmax[padAxes[i]] = WM_PAD_AXIS_MAX;
+	}
+
+	if(write(fd, &dev, sizeof(dev)) != sizeof(dev) || ioctl(fd, UI_DEV_CREATE) < 0)
+	{
+		printf("Error creating the uinput gamepad (%s)\n", strerror(errno));
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	unavailable = false;
+	return true;
+#endif
+}
+
+/* Swallow frames from now on instead of sending them */
+void CGamepad::SetDiscard(bool on)
+{
+	discard = on;
+}
+
+unsigned long long CGamepad::Discarded() const
+{
+	return discarded.load(std::memory_order_relaxed);
+}
+
+unsigned long long CGamepad::Frames() const
+{
+	return frames.load(std::memory_order_relaxed);
+}
+
+unsigned long long CGamepad::Events() const
+{
+	return events.load(std::memory_order_relaxed);
+}
+
+/* The last frame sent, or all at rest before the first */
+void CGamepad::Last(WM_GAMEPAD_FRAME *out) const
+{
+	*out = last;
+}
+
+/* Show frame on the pad. Returns how many buttons and axes changed, 0 if
+none did, or -1 if it couldn't be written. */
+int CGamepad::Send(const WM_GAMEPAD_FRAME *frame)
+{
+	unsigned changedButtons = primed ? frame->buttons ^ last.buttons : (1u << WM_PAD_BUTTONS) - 1;
+	bool changedAxes[WM_PAD_AXES];
+	int changes = 0;
+	for(int i = 0; i < WM_PAD_BUTTONS; i++)
+		changes += (changedButtons >> i) & 1;
+	for(int i = 0; i < WM_PAD_AXES; i++)
+	{
+		changedAxes[i] = !primed || frame->axes[i] != last.axes[i];
+		changes += changedAxes[i];
+	}
+	if(!changes)
+		return 0;
+
+	if(discard)
+	{
+		discarded.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+#ifdef _WIN32
+		(void)changedAxes;
+		return -1;
+#else
+		if(!Open())
+			return -1;
+
+		struct input_event ev[WM_PAD_BUTTONS + WM_PAD_AXES + 1];
+		int n = 0;
+		memset(ev, 0, sizeof(ev));
+		for(int i = 0; i < WM_PAD_BUTTONS; i++)
+		{
+			if(!((changedButtons >> i) & 1))
+				continue;
+			ev[n].type = EV_KEY;
+			ev[n].code = padKeys[i];
+			ev[n++].value = (frame->buttons >> i) & 1;
+		}
+		for(int i = 0; i < WM_PAD_AXES; i++)
+		{
+			if(!changedAxes[i])
+				continue;
+			ev[n].type = EV_ABS;
+			ev[n].code = padAxes[i];
+			ev[n++].value = frame->axes[i];
+		}
+		ev[n].type = EV_SYN;
+		ev[n++].code = SYN_REPORT;
+
+		ssize_t size = n * sizeof(struct input_event);
+		if(write(fd, ev, size) != size)
+			return -1;
+#endif
+	}
+
+	last = *frame;
+	primed = true;
+	frames.fetch_add(1, std::memory_order_relaxed);
+	events.fetch_add(changes, std::memory_order_relaxed);
+	return changes;
+}
@@ -0,0 +1,91 @@
+/*************************
+Gamepad.h
+
+A virtual gamepad for one mote: absolute sticks, tilt and triggers and a
+gamepad's buttons, instead of the mouse motion and key presses the profiles
+make. On Linux each CGamepad is a uinput device of its own, so games see one
+pad per mote and read the analog values at full resolution.
+
+CWiimote fills a WM_GAMEPAD_FRAME from each report and Send()s it. Only the
+buttons and axes that changed since the last frame are written, all of them
+in one write() closed by a single SYN_REPORT, so a report costs at most one
+call however much it moved. A frame that changes nothing costs none.
+
+Axes run from -WM_PAD_AXIS_MAX to WM_PAD_AXIS_MAX, triggers from 0. Stick Y
+grows downward, as evdev expects:
+	WM_PAD_X, Y		nunchuk stick, or the Classic Controller's left	ABS_X, ABS_Y
+	WM_PAD_RX, RY		Classic Controller right stick			ABS_RX, ABS_RY
+	WM_PAD_TILT_X, Y	the mote's tilt, +-90 degrees at the ends	ABS_TILT_X, ABS_TILT_Y
+	WM_PAD_LT, RT		Classic Controller triggers			ABS_Z, ABS_RZ
+
+Windows has no way to create a gamepad without a third-party bus driver, so
+there Send() only works with discard set.
+**************************/
+
+#pragma once
+
+#include <atomic>
+
+#define WM_PAD_AXIS_MAX 32767
+
+/* Buttons, by position on the pad */
+#define WM_PAD_SOUTH 0x0001 /* mote A, classic B */
+#define WM_PAD_EAST 0x0002 /* mote B, classic A */
+#define WM_PAD_WEST 0x0004 /* mote 1, classic Y */
+#define WM_PAD_NORTH 0x0008 /* mote 2, classic X */
+#define WM_PAD_TL 0x0010 /* nunchuk C, classic L */
+#define WM_PAD_TR 0x0020 /* classic R */
+#define WM_PAD_TL2 0x0040 /* nunchuk Z, classic ZL */
+#define WM_PAD_TR2 0x0080 /* classic ZR */
+#define WM_PAD_SELECT 0x0100 /* minus */
+#define WM_PAD_START 0x0200 /* plus */
+#define WM_PAD_MODE 0x0400 /* home */
+#define WM_PAD_UP 0x0800 /* either d-pad */
+#define WM_PAD_DOWN 0x1000
+#define WM_PAD_LEFT 0x2000
+#define WM_PAD_RIGHT 0x4000
+#define WM_PAD_BUTTONS 15
+
+/* Axes */
+#define WM_PAD_X 0
+#define WM_PAD_Y 1
+#define WM_PAD_RX 2
+#define WM_PAD_RY 3
+#define WM_PAD_TILT_X 4
+#define WM_PAD_TILT_Y 5
+#define WM_PAD_LT 6
+#define WM_PAD_RT 7
+#define WM_PAD_AXES 8
+
+/* Everything the pad shows after one report */
+struct WM_GAMEPAD_FRAME {
+	unsigned buttons; /* WM_PAD_* bits, set while pressed */
+	int axes[WM_PAD_AXES];
+};
+
+class CGamepad
+{
+public:
+	CGamepad(void);
+	~CGamepad(void);
+	int Send(const WM_GAMEPAD_FRAME *frame);
+	void Last(WM_GAMEPAD_FRAME *out) const;
+	void SetDiscard(bool on);
+	unsigned long long Discarded() const;
+	unsigned long long Frames() const;
+	unsigned long long Events() const;
+private:
+	BOOL Open();
+
+	bool discard;
+	bool primed; /* last has been sent, so only changes need to be */
+	WM_GAMEPAD_FRAME last;
+	std::atomic<unsigned long long> frames; /* frames that changed something, written or discarded */
+	std::atomic<unsigned long long> events; /* buttons and axes in them */
+	std::atomic<unsigned long long> discarded;
+#ifndef _WIN32
+	int fd;
+	BOOL unavailable; /* /dev/uinput couldn't be set up, don't keep trying */
+	static std::atomic<int> created; /* pads made so far, for their names */
+#endif
+};
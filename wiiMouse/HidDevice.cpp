@@ -0,0 +1,230 @@
+/*************************
+HidDevice.cpp
+
+Finding a device by VID/PID, the same on both platforms: the cache of paths
+that opened before, enumeration and parallel probing. The platform files
+provide listing, reading a VID/PID from a path or a device, and opening.
+See HidDevice.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#include <atomic>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#define WM_SCAN_CACHE_LINE (WM_PATH_SIZE * 2) /* a cache line holds the IDs and a path */
+
+struct CHidDevice::_probe_work {
+	const std::vector<std::string> *paths;
+	const std::vector<int> *todo; /* indexes into paths */
+	std::vector<unsigned> *ids; /* vid << 16 | pid, or 0 where it couldn't be read */
+	std::atomic<size_t> next; /* next entry of todo to probe */
+};
+
+static WM_SCAN_CONFIG DefaultScanConfig()
+{
+	WM_SCAN_CONFIG defaults;
+	CHidDevice::ScanDefaults(&defaults);
+	return defaults;
+}
+
+WM_SCAN_CONFIG CHidDevice::config = DefaultScanConfig();
+
+void CHidDevice::ScanDefaults(WM_SCAN_CONFIG *defaults)
+{
+	memset(defaults, 0, sizeof(*defaults));
+	defaults->jobs = WM_SCAN_JOBS;
+	defaults->pathIds = true;
+
+	/* The per-user cache directory, where there is one */
+#ifdef _WIN32
+	const char *dir = getenv("LOCALAPPDATA");
+	if(dir && *dir)
+		_snprintf(defaults->cacheFile, sizeof(defaults->cacheFile), "%s\\wiiMouse-devices.txt", dir);
+#else
+	const char *dir = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if(dir && *dir)
+		snprintf(defaults->cacheFile, sizeof(defaults->cacheFile), "%s/wiimouse-devices", dir);
+	else if(home && *home)
+		snprintf(defaults->cacheFile, sizeof(defaults->cacheFile), "%s/.cache/wiimouse-devices", home);
+#endif
+	defaults->cacheFile[sizeof(defaults->cacheFile) - 1] = 0;
+}
+
+/* Set how every later Open() looks for its device. Call it before any are opened. */
+void CHidDevice::Configure(const WM_SCAN_CONFIG *newConfig)
+{
+	config = *newConfig;
+	if(config.jobs < 1)
+		config.jobs = 1;
+}
+
+void CHidDevice::GetScanStats(WM_SCAN_STATS *out) const
+{
+	*out = scan;
+}
+
+/* Open the first device with this VID/PID: one that opened before if it's
+still there, otherwise the first match in enumeration order */
+BOOL CHidDevice::Open(unsigned short vid, unsigned short pid)
+{
+	WM_TIME started = WmNow();
+	unsigned want = (unsigned)vid << 16 | pid;
+	memset(&scan, 0, sizeof(scan));
+	Close();
+
+	/* Warm start. Node names get reused, so each is checked before it's trusted. */
+	std::vector<std::string> paths;
+	LoadCache(vid, pid, &paths);
+	for(size_t i = 0; i < paths.size(); i++)
+	{
+		unsigned devVid, devPid;
+		if(!PathIds(paths[i].c_str(), &devVid, &devPid) && !ProbeIds(paths[i].c_str(), &devVid, &devPid))
+			continue;
+		if(((devVid << 16) | devPid) != want || !OpenPath(paths[i].c_str()))
+			continue;
+
+		scan.cached = true;
+		if(i > 0)
+			SaveCache(vid, pid, paths[i]);
+		scan.elapsed = WmNow() - started;
+		return true;
+	}
+
+	paths.clear();
+	ListInterfaces(&paths);
+	scan.listed = (int)paths.size();
+
+	std::vector<unsigned> ids(paths.size(), 0);
+	std::vector<int> todo;
+	for(size_t i = 0; i < paths.size(); i++)
+	{
+		unsigned devVid, devPid;
+		if(config.pathIds && PathIds(paths[i].c_str(), &devVid, &devPid))
+		{
+			ids[i] = (devVid << 16) | devPid;
+			scan.byPath++;
+		}
+		else
+			todo.push_back((int)i);
+	}
+	scan.probed = (int)todo.size();
+
+	/* Whatever the paths didn't give away, ask the devices, several at once */
+	_probe_work work;
+	work.paths = &paths;
+	work.todo = &todo;
+	work.ids = &ids;
+	work.next = 0;
+	int jobs = config.jobs < (int)todo.size() ? config.jobs : (int)todo.size();
+	if(jobs <= 1)
+		ProbeThread(&work);
+	else
+	{
+		std::vector<std::thread> probes;
+		for(int i = 0; i < jobs; i++)
+			probes.push_back(std::thread(&CHidDevice::ProbeThread, &work));
+		for(int i = 0; i < jobs; i++)
+			probes[i].join();
+	}
+
+	for(size_t i = 0; i < paths.size() && !IsOpen(); i++)
+	{
+		if(ids[i] == want && OpenPath(paths[i].c_str()))
+			SaveCache(vid, pid, paths[i]);
+	}
+
+	scan.elapsed = WmNow() - started;
+	return IsOpen();
+}
+
+void CHidDevice::ProbeThread(_probe_work *work)
+{
+	for(;;)
+	{
+		size_t next = work->next++;
+		if(next >= work->todo->size())
+			return;
+
+		int index = (*work->todo)[next];
+		unsigned devVid, devPid;
+		if(ProbeIds((*work->paths)[index].c_str(), &devVid, &devPid))
+			(*work->ids)[index] = (devVid << 16) | devPid;
+	}
+}
+
+/* The remembered paths for this VID/PID, most recently opened first.
+Each line of the file is "vid pid path", in hex. */
+void CHidDevice::LoadCache(unsigned short vid, unsigned short pid, std::vector<std::string> *paths)
+{
+	if(!config.cacheFile[0])
+		return;
+	FILE *file = fopen(config.cacheFile, "r");
+	if(!file)
+		return;
+
+	char line[WM_SCAN_CACHE_LINE];
+	while(fgets(line, sizeof(line), file))
+	{
+		unsigned lineVid, linePid;
+		int start = 0;
+		if(sscanf(line, "%x %x %n", &lineVid, &linePid, &start) < 2 || !start)
+			continue;
+		if(lineVid != vid || linePid != pid)
+			continue;
+		line[strcspn(line, "\r\n")] = 0;
+		if(line[start])
+			paths->push_back(line + start);
+	}
+	fclose(file);
+}
+
+/* Move devicePath to the front of the cache, keeping WM_SCAN_CACHED paths in all */
+void CHidDevice::SaveCache(unsigned short vid, unsigned short pid, const std::string &devicePath)
+{
+	if(!config.cacheFile[0])
+		return;
+
+	std::vector<std::string> lines;
+	char line[WM_SCAN_CACHE_LINE];
+	_snprintf(line, sizeof(line), "%04x %04x %s", vid, pid, devicePath.c_str());
+	line[sizeof(line) - 1] = 0;
+	lines.push_back(line);
+
+	FILE *file = fopen(config.cacheFile, "r");
+	if(file)
+	{
+		while(lines.size() < WM_SCAN_CACHED && fgets(line, sizeof(line), file))
+		{
+			line[strcspn(line, "\r\n")] = 0;
+			if(line[0] && lines[0] != line)
+				lines.push_back(line);
+		}
+		fclose(file);
+	}
+
+#ifndef _WIN32
+	/* ~/.cache may not be there yet */
+	char dir[WM_PATH_SIZE];
+	snprintf(dir, sizeof(dir), "%s", config.cacheFile);
+	char *slash = strrchr(dir, '/');
+	if(slash && slash != dir)
+	{
+		*slash = 0;
+		mkdir(dir, 0700);
+	}
+#endif
+
+	file = fopen(config.cacheFile, "w");
+	if(!file)
+		return;
+	for(size_t i = 0; i < lines.size(); i++)
+		fprintf(file, "%s\n", lines[i].c_str());
+	fclose(file);
+}
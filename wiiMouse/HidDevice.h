@@ -0,0 +1,117 @@
+/*************************
+HidDevice.h
+
+Raw HID transport to a single mote. The Windows build talks to the HID class
+driver through SetupAPI and overlapped ReadFile/WriteFile, the Linux build to
+/dev/hidraw* with poll and read/write. Both present the same interface, so
+CWiimote never touches a platform handle directly.
+
+Output reports are passed at their real length. Windows pads them to the
+device's output report length because the HID class driver insists on it;
+hidraw sends exactly what it's given.
+
+SetBusyPoll() makes Read() check the device in a tight loop until a report
+arrives or the timeout passes, rather than sleeping in the kernel. That saves
+the wakeup on each report at the cost of a CPU; see RealTime.h.
+
+Wake() cuts a Read() wait short from another thread, so work queued for the
+read loop, such as a rumble effect, doesn't wait for the next report or the
+end of the timeout. The Read() it lands on returns WM_READ_TIMEOUT.
+
+Open() finds a device by VID/PID (HidDevice.cpp). It first tries the paths
+that opened last time, kept in a small cache file, and only enumerates when
+none of them is the device any more. Enumeration lists every HID interface,
+with no limit on their number or path length, and tells most of them apart
+by the VID/PID in their path alone: the hardware ID in a Windows interface
+path, the HID device directory a hidraw node links to in sysfs. Only those
+whose path doesn't say are opened to ask, WM_SCAN_JOBS at a time, since on
+Windows opening some devices can take a long time. Matches are then opened
+in enumeration order.
+**************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Timing.h"
+
+#define WM_PATH_SIZE 512
+#define WM_SCAN_JOBS 8 /* interfaces opened at once to read their VID/PID */
+#define WM_SCAN_CACHED 8 /* device paths remembered */
+
+/* Read() timeouts and results */
+#define WM_WAIT_FOREVER -1
+#define WM_READ_TIMEOUT 0
+#define WM_READ_ERROR -1
+
+/* hidraw keeps this many reports queued per reader (HIDRAW_BUFFER_SIZE in the kernel) */
+#define WM_HIDRAW_RING 64
+
+/* How Open() looks for a device, for the whole process (see CHidDevice::Configure()) */
+struct WM_SCAN_CONFIG {
+	int jobs; /* interfaces probed at once, 1 for one after another */
+	bool pathIds; /* trust the VID/PID in an interface's path rather than opening it */
+	char cacheFile[WM_PATH_SIZE]; /* paths that opened are remembered here; empty for nowhere */
+	char root[WM_PATH_SIZE]; /* Linux only: put in front of /sys and /dev, for a simulated device tree */
+};
+
+/* What the last Open() did */
+struct WM_SCAN_STATS {
+	bool cached; /* a remembered path opened, so nothing was enumerated */
+	int listed; /* HID interfaces enumerated */
+	int byPath; /* of those, told apart by their path alone */
+	int probed; /* opened to ask their VID/PID */
+	WM_TIME elapsed;
+};
+
+class CHidDevice
+{
+public:
+	CHidDevice(void);
+	~CHidDevice(void);
+	BOOL Open(unsigned short vid, unsigned short pid);
+	BOOL OpenPath(const char *devicePath);
+	void Close();
+	BOOL IsOpen() const;
+	int Read(byte *buffer, int size, int timeoutMs);
+	BOOL Write(const byte *report, int length);
+	unsigned long RingSize();
+	void GetStrings(WCHAR *manuf, WCHAR *prod, int size);
+	const char *Path() const;
+	void SetBusyPoll(bool spin);
+	void Wake();
+	void GetScanStats(WM_SCAN_STATS *) const;
+	static void ScanDefaults(WM_SCAN_CONFIG *config);
+	static void Configure(const WM_SCAN_CONFIG *config);
+#ifndef _WIN32
+	BOOL OpenFd(int fd, const char *name);
+#endif
+private:
+	struct _probe_work;
+
+	static void ListInterfaces(std::vector<std::string> *paths);
+	static BOOL PathIds(const char *devicePath, unsigned *vid, unsigned *pid);
+	static BOOL ProbeIds(const char *devicePath, unsigned *vid, unsigned *pid);
+	static void ProbeThread(_probe_work *work);
+	static void LoadCache(unsigned short vid, unsigned short pid, std::vector<std::string> *paths);
+	static void SaveCache(unsigned short vid, unsigned short pid, const std::string &devicePath);
+	static WM_SCAN_CONFIG config;
+
+	char path[WM_PATH_SIZE];
+	bool busyPoll; /* Read() spins on the device instead of sleeping */
+	WM_SCAN_STATS scan;
+#ifdef _WIN32
+	HANDLE handle;
+	HANDLE readEvent;
+	HANDLE writeEvent;
+	HANDLE wakeEvent; /* auto-reset, set by Wake() */
+	OVERLAPPED readOverlapped;
+	BOOL readPending;
+	USHORT inputLength;
+	USHORT outputLength;
+	byte readBuffer[64];
+#else
+	int fd;
+	int wakeFd; /* eventfd, signalled by Wake() */
+#endif
+};
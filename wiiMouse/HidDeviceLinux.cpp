@@ -0,0 +1,301 @@
+/*************************
+HidDeviceLinux.cpp
+
+HID transport for Linux through hidraw.
+
+Motes are found by walking /sys/class/hidraw. Each entry links into the
+device tree through its HID device's directory, whose name carries the
+VID/PID, so no node is opened until we know it's the one we want; an entry
+that isn't a link falls back to the HID_ID line of the device's uevent.
+
+Note the in-kernel hid-wiimote driver also binds to real motes and sends its
+own output reports; unbind it (or blacklist the module) before running, or
+the two will fight over LEDs and reporting modes.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#ifndef _WIN32
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#define WM_SYSFS_HIDRAW "/sys/class/hidraw"
+#define WM_SYSFS_PATH (WM_PATH_SIZE * 2) /* a simulated root, then a path under it */
+
+CHidDevice::CHidDevice(void)
+{
+	fd = -1;
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	path[0] = 0;
+	busyPoll = false;
+}
+
+CHidDevice::~CHidDevice(void)
+{
+	Close();
+	if(wakeFd >= 0)
+		close(wakeFd);
+}
+
+/* The sysfs entry behind a /dev/hidraw* path: <root>/sys/class/hidraw/hidrawN */
+static BOOL SysfsEntry(const char *root, const char *devicePath, char *entry, size_t size)
+{
+	const char *name = strrchr(devicePath, '/');
+	name = name ? name + 1 : devicePath;
+	if(strncmp(name, "hidraw", 6) != 0)
+		return false;
+	snprintf(entry, size, "%s%s/%s", root, WM_SYSFS_HIDRAW, name);
+	return true;
+}
+
+/* Pull the vendor and product out of a hidraw node's uevent file.
+The line looks like HID_ID=0005:0000057E:00000306 (bus:vendor:product). */
+static BOOL ReadHidId(const char *entry, unsigned int *vid, unsigned int *pid)
+{
+	char file[WM_SYSFS_PATH + 16];
+	char line[256];
+	unsigned int bus;
+	BOOL found = false;
+
+	snprintf(file, sizeof(file), "%s/device/uevent", entry);
+	FILE *uevent = fopen(file, "r");
+	if(!uevent)
+		return false;
+
+	while(!found && fgets(line, sizeof(line), uevent))
+	{
+		if(sscanf(line, "HID_ID=%x:%x:%x", &bus, vid, pid) == 3)
+			found = true;
+	}
+
+	fclose(uevent);
+	return found;
+}
+
+/* Warn if hid-wiimote owns the device, since it will talk to the mote as well */
+static void CheckDriver(const char *entry)
+{
+	char link[WM_SYSFS_PATH + 16];
+	char target[WM_PATH_SIZE];
+
+	snprintf(link, sizeof(link), "%s/device/driver", entry);
+	ssize_t len = readlink(link, target, sizeof(target) - 1);
+	if(len <= 0)
+		return;
+	target[len] = 0;
+
+	const char *name = strrchr(target, '/');
+	name = name ? name + 1 : target;
+	if(strcmp(name, "wiimote") == 0)
+		printf("Warning: %s is bound to hid-wiimote, which will also send output reports.\n", strrchr(entry, '/') + 1);
+}
+
+/* Every hidraw node, as its /dev path */
+void CHidDevice::ListInterfaces(std::vector<std::string> *paths)
+{
+	char dirName[WM_SYSFS_PATH];
+	snprintf(dirName, sizeof(dirName), "%s%s", config.root, WM_SYSFS_HIDRAW);
+	DIR *dir = opendir(dirName);
+	if(!dir)
+	{
+		printf("Error opening %s\n", dirName);
+		return;
+	}
+
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		if(strncmp(entry->d_name, "hidraw", 6) != 0)
+			continue;
+		char node[WM_SYSFS_PATH];
+		snprintf(node, sizeof(node), "%s/dev/%s", config.root, entry->d_name);
+		paths->push_back(node);
+	}
+
+	closedir(dir);
+}
+
+/* The class entry links to the node's place in the device tree, which runs
+through the HID device's directory, named bus:vendor:product.instance
+(.../0005:057E:0306.0004/hidraw/hidraw3). Nothing is opened. */
+BOOL CHidDevice::PathIds(const char *devicePath, unsigned *vid, unsigned *pid)
+{
+	char entry[WM_SYSFS_PATH];
+	char target[WM_PATH_SIZE];
+	if(!SysfsEntry(config.root, devicePath, entry, sizeof(entry)))
+		return false;
+	ssize_t len = readlink(entry, target, sizeof(target) - 1);
+	if(len <= 0)
+		return false;
+	target[len] = 0;
+
+	char *save = NULL;
+	for(char *part = strtok_r(target, "/", &save); part; part = strtok_r(NULL, "/", &save))
+	{
+		unsigned bus, instance;
+		int used = 0;
+		if(strlen(part) == 19 && sscanf(part, "%4x:%4x:%4x.%4x%n", &bus, vid, pid, &instance, &used) == 4 && used == 19)
+			return true;
+	}
+	return false;
+}
+
+/* Ask sysfs, for a node whose link doesn't say */
+BOOL CHidDevice::ProbeIds(const char *devicePath, unsigned *vid, unsigned *pid)
+{
+	char entry[WM_SYSFS_PATH];
+	if(!SysfsEntry(config.root, devicePath, entry, sizeof(entry)))
+		return false;
+	return ReadHidId(entry, vid, pid);
+}
+
+BOOL CHidDevice::OpenPath(const char *devicePath)
+{
+	Close();
+	snprintf(path, sizeof(path), "%s", devicePath);
+	fd = open(devicePath, O_RDWR | O_CLOEXEC);
+	if(fd < 0)
+	{
+		printf("Found a mote at %s but couldn't open it (%s)\n", devicePath, strerror(errno));
+		return false;
+	}
+
+	char entry[WM_SYSFS_PATH];
+	if(SysfsEntry(config.root, devicePath, entry, sizeof(entry)))
+		CheckDriver(entry);
+	return true;
+}
+
+/* Use an already open descriptor that carries one report per read/write,
+such as one end of a SOCK_SEQPACKET socketpair. Takes ownership of fd. */
+BOOL CHidDevice::OpenFd(int descriptor, const char *name)
+{
+	Close();
+	fd = descriptor;
+	snprintf(path, sizeof(path), "%s", name);
+	return fd >= 0;
+}
+
+void CHidDevice::Close()
+{
+	if(fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+}
+
+BOOL CHidDevice::IsOpen() const
+{
+	return fd >= 0;
+}
+
+/* Read one input report. Returns its length, WM_READ_TIMEOUT if nothing arrived
+within timeoutMs or Wake() was called, or WM_READ_ERROR. */
+int CHidDevice::Read(byte *buffer, int size, int timeoutMs)
+{
+	struct pollfd pfd[2];
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wakeFd;
+	pfd[1].events = POLLIN;
+	int fds = wakeFd >= 0 ? 2 : 1;
+	WM_TIME deadline = timeoutMs < 0 ? 0 : WmNow() + timeoutMs * WM_NS_PER_MS;
+
+	for(;;)
+	{
+		int ready;
+		if(busyPoll)
+		{
+			/* Never block: come straight back and try again until the deadline */
+			do
+				ready = poll(pfd, fds, 0);
+			while(ready == 0 && (timeoutMs < 0 || WmNow() < deadline));
+		}
+		else
+			ready = poll(pfd, fds, timeoutMs);
+		if(ready < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return WM_READ_ERROR;
+		}
+		if(ready == 0)
+			return WM_READ_TIMEOUT;
+		if(pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			return WM_READ_ERROR;
+		if(!(pfd[0].revents & POLLIN))
+		{
+			/* Woken with no report waiting */
+			eventfd_t count;
+			eventfd_read(wakeFd, &count);
+			return WM_READ_TIMEOUT;
+		}
+
+		ssize_t got = read(fd, buffer, size);
+		if(got < 0)
+		{
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			return WM_READ_ERROR;
+		}
+		if(got == 0)
+			return WM_READ_ERROR;
+		return (int)got;
+	}
+}
+
+/* Cut the current or next Read() wait short. Safe from any thread. */
+void CHidDevice::Wake()
+{
+	if(wakeFd >= 0)
+		eventfd_write(wakeFd, 1);
+}
+
+void CHidDevice::SetBusyPoll(bool spin)
+{
+	busyPoll = spin;
+}
+
+/* Write one output report at its real length */
+BOOL CHidDevice::Write(const byte *report, int length)
+{
+	ssize_t written;
+	do
+		written = write(fd, report, length);
+	while(written < 0 && errno == EINTR);
+
+	return written == length;
+}
+
+unsigned long CHidDevice::RingSize()
+{
+	return WM_HIDRAW_RING;
+}
+
+/* hidraw only knows the device name, so that goes in the product string */
+void CHidDevice::GetStrings(WCHAR *manuf, WCHAR *prod, int size)
+{
+	char name[WM_STRING_SIZE];
+
+	manuf[0] = prod[0] = 0;
+	if(ioctl(fd, HIDIOCGRAWNAME(sizeof(name)), name) < 0)
+		return;
+	name[sizeof(name) - 1] = 0;
+	mbstowcs(prod, name, size);
+	prod[size - 1] = 0;
+}
+
+const char *CHidDevice::Path() const
+{
+	return path;
+}
+
+#endif /* !_WIN32 */
@@ -0,0 +1,322 @@
+/*************************
+HidDeviceWin32.cpp
+
+HID transport for Windows, using SetupAPI to list the HID interfaces (see
+HidDevice.cpp for how the mote is picked out of them) and overlapped
+ReadFile/WriteFile to talk to it.
+
+IMPORTANT
+You'll need these headers
+and lib files from the DDK:
+
+1. hid.lib
+2. setupapi.lib
+3. hidpi.h
+4. hidsdi.h
+5. hidusage.h
+6. setupapi.h
+
+Also, the libs are not
+compiled with safe exception
+handling, so any project
+including them needs to
+specify /SAFEESH:NO.
+In Project Properties, this
+is in the Configuration,
+Linker, Advanced section.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#ifdef _WIN32
+
+extern "C"{
+#include "setupapi.h"		// needs setupapi.lib
+#include "hidsdi.h"			// needs hid.lib
+}
+
+#pragma comment(lib, "hid.lib")
+#pragma comment(lib, "setupapi.lib")
+
+CHidDevice::CHidDevice(void)
+{
+	handle = INVALID_HANDLE_VALUE;
+	readEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	writeEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	readPending = false;
+	inputLength = outputLength = WM_PACKET_SIZE;
+	path[0] = 0;
+	busyPoll = false;
+}
+
+CHidDevice::~CHidDevice(void)
+{
+	Close();
+	CloseHandle(readEvent);
+	CloseHandle(writeEvent);
+	CloseHandle(wakeEvent);
+}
+
+/* Every present HID interface, as its device path. Detail buffers are sized
+to each path, so long ones come through whole. */
+void CHidDevice::ListInterfaces(std::vector<std::string> *paths)
+{
+	struct _GUID GUID;
+	HidD_GetHidGuid(&GUID);
+
+	/* Attach to the Plug and Play node and get devices */
+	HANDLE pnp = SetupDiGetClassDevs(&GUID, 
+				NULL, NULL, 
+				DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+
+	if(pnp == INVALID_HANDLE_VALUE)
+	{
+		printf("Error attaching to PnP node");
+		return;
+	}
+
+	SP_INTERFACE_DEVICE_DATA DeviceInterfaceData; /* holds device interface data for the current device */ 
+	std::vector<byte> detail;
+
+	for(DWORD index = 0; ; index++)
+	{
+		DeviceInterfaceData.cbSize = sizeof(DeviceInterfaceData);
+		if(!SetupDiEnumDeviceInterfaces(pnp, NULL, &GUID, index, &DeviceInterfaceData))
+		{
+			if(GetLastError() == ERROR_NO_MORE_ITEMS)
+				break;
+			continue;
+		}
+
+		/* Ask for the size first, then the path */
+		ULONG needed = 0;
+		SetupDiGetDeviceInterfaceDetailA(pnp, &DeviceInterfaceData, NULL, 0, &needed, NULL);
+		if(needed < sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A))
+			continue;
+		detail.resize(needed);
+		SP_DEVICE_INTERFACE_DETAIL_DATA_A *data = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&detail[0];
+		data->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+		if(SetupDiGetDeviceInterfaceDetailA(pnp, &DeviceInterfaceData, (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)data, needed, NULL, NULL))
+			paths->push_back(data->DevicePath);
+	}
+
+	SetupDiDestroyDeviceInfoList(pnp);
+}
+
+/* The hardware ID is part of the interface path: vid_057e&pid_0306 for USB,
+or _vid&0002057e_pid&0306 for Bluetooth, where the vendor comes after a
+4-digit ID source. Nothing is opened. */
+BOOL CHidDevice::PathIds(const char *devicePath, unsigned *vid, unsigned *pid)
+{
+	char lower[WM_PATH_SIZE];
+	size_t length = strlen(devicePath);
+	if(length >= sizeof(lower))
+		length = sizeof(lower) - 1;
+	for(size_t i = 0; i < length; i++)
+		lower[i] = (char)tolower((unsigned char)devicePath[i]);
+	lower[length] = 0;
+
+	const char *at;
+	if((at = strstr(lower, "vid_")) != NULL && sscanf(at, "vid_%4x&pid_%4x", vid, pid) == 2)
+		return true;
+	unsigned source;
+	if((at = strstr(lower, "vid&")) != NULL && sscanf(at, "vid&%4x%4x_pid&%4x", &source, vid, pid) == 3)
+		return true;
+	return false;
+}
+
+/* Open the interface without asking for read or write access, which any HID
+device allows, and read its attributes */
+BOOL CHidDevice::ProbeIds(const char *devicePath, unsigned *vid, unsigned *pid)
+{
+	HANDLE hDevice = CreateFileA(devicePath, 0,
+		FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if(hDevice == INVALID_HANDLE_VALUE)
+		return false;
+
+	HIDD_ATTRIBUTES HIDAttributes; /* Attributes of the HID device */
+	HIDAttributes.Size = sizeof(HIDAttributes);
+	BOOL success = HidD_GetAttributes(hDevice, &HIDAttributes);
+	CloseHandle(hDevice);
+	if(!success)
+		return false;
+	*vid = HIDAttributes.VendorID;
+	*pid = HIDAttributes.ProductID;
+	return true;
+}
+
+BOOL CHidDevice::OpenPath(const char *devicePath)
+{
+	Close();
+
+	/* Security attributes for opening the device for raw file I/O */
+	SECURITY_ATTRIBUTES SecurityAttributes;
+	SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES); 
+	SecurityAttributes.lpSecurityDescriptor = NULL; 
+	SecurityAttributes.bInheritHandle = false; 
+
+	/* Open the device for overlapped I/O so reads can time out */
+	handle = CreateFileA(devicePath, 
+		GENERIC_READ|GENERIC_WRITE,
+		FILE_SHARE_READ|FILE_SHARE_WRITE, 
+		&SecurityAttributes, 
+		OPEN_EXISTING, 
+		FILE_FLAG_OVERLAPPED, NULL);
+	if(handle == INVALID_HANDLE_VALUE)
+		return false;
+	_snprintf(path, WM_PATH_SIZE, "%s", devicePath);
+	path[WM_PATH_SIZE - 1] = 0;
+
+	/* The class driver wants every read and write at exactly the report lengths
+	from the descriptor, so look them up */
+	inputLength = outputLength = WM_PACKET_SIZE;
+	PHIDP_PREPARSED_DATA preparsed;
+	if(HidD_GetPreparsedData(handle, &preparsed))
+	{
+		HIDP_CAPS caps;
+		if(HidP_GetCaps(preparsed, &caps) == HIDP_STATUS_SUCCESS)
+		{
+			if(caps.InputReportByteLength && caps.InputReportByteLength <= sizeof(readBuffer))
+				inputLength = caps.InputReportByteLength;
+			if(caps.OutputReportByteLength)
+				outputLength = caps.OutputReportByteLength;
+		}
+		HidD_FreePreparsedData(preparsed);
+	}
+
+	return true;
+}
+
+void CHidDevice::Close()
+{
+	if(handle != INVALID_HANDLE_VALUE)
+	{
+		if(readPending)
+		{
+			DWORD unused;
+			CancelIo(handle);
+			GetOverlappedResult(handle, &readOverlapped, &unused, TRUE);
+			readPending = false;
+		}
+		CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+	}
+}
+
+BOOL CHidDevice::IsOpen() const
+{
+	return handle != INVALID_HANDLE_VALUE;
+}
+
+/* Read one input report. Returns its length, WM_READ_TIMEOUT if nothing arrived
+within timeoutMs or Wake() was called, or WM_READ_ERROR. A read that times out stays queued and is
+picked up by the next call, so no report is lost. */
+int CHidDevice::Read(byte *buffer, int size, int timeoutMs)
+{
+	DWORD bytesRead = 0;
+
+	if(!readPending)
+	{
+		memset(&readOverlapped, 0, sizeof(readOverlapped));
+		readOverlapped.hEvent = readEvent;
+		ResetEvent(readEvent);
+
+		if(!ReadFile(handle, readBuffer, inputLength, &bytesRead, &readOverlapped))
+		{
+			if(GetLastError() != ERROR_IO_PENDING)
+				return WM_READ_ERROR;
+			readPending = true;
+		}
+	}
+
+	if(readPending)
+	{
+		HANDLE events[2] = { readEvent, wakeEvent };
+		DWORD wait;
+		if(busyPoll)
+		{
+			/* Check the events without waiting until the read completes or the time is up */
+			WM_TIME deadline = timeoutMs < 0 ? 0 : WmNow() + timeoutMs * WM_NS_PER_MS;
+			do
+				wait = WaitForMultipleObjects(2, events, FALSE, 0);
+			while(wait == WAIT_TIMEOUT && (timeoutMs < 0 || WmNow() < deadline));
+		}
+		else
+			wait = WaitForMultipleObjects(2, events, FALSE, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
+		if(wait == WAIT_TIMEOUT || wait == WAIT_OBJECT_0 + 1)
+			return WM_READ_TIMEOUT;
+
+		readPending = false;
+		if(!GetOverlappedResult(handle, &readOverlapped, &bytesRead, FALSE))
+			return WM_READ_ERROR;
+	}
+
+	if((int)bytesRead > size)
+		bytesRead = size;
+	memcpy(buffer, readBuffer, bytesRead);
+
+	return (int)bytesRead;
+}
+
+/* Cut the current or next Read() wait short. Safe from any thread. */
+void CHidDevice::Wake()
+{
+	SetEvent(wakeEvent);
+}
+
+void CHidDevice::SetBusyPoll(bool spin)
+{
+	busyPoll = spin;
+}
+
+/* Write one output report, padded out to the length the class driver expects */
+BOOL CHidDevice::Write(const byte *report, int length)
+{
+	byte padded[64];
+	DWORD written = 0;
+	OVERLAPPED overlapped;
+
+	int total = outputLength > length ? outputLength : length;
+	if(total > (int)sizeof(padded))
+		return false;
+	memset(padded, 0, total);
+	memcpy(padded, report, length);
+
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = writeEvent;
+	ResetEvent(writeEvent);
+
+	if(!WriteFile(handle, padded, total, &written, &overlapped))
+	{
+		if(GetLastError() != ERROR_IO_PENDING)
+			return false;
+		if(!GetOverlappedResult(handle, &overlapped, &written, TRUE))
+			return false;
+	}
+
+	return true;
+}
+
+/* Size of the class driver's input ring, in reports */
+unsigned long CHidDevice::RingSize()
+{
+	ULONG ringSize = 0;
+	if(!HidD_GetNumInputBuffers(handle, &ringSize))
+		return 0;
+	return ringSize;
+}
+
+void CHidDevice::GetStrings(WCHAR *manuf, WCHAR *prod, int size)
+{
+	HidD_GetManufacturerString(handle, manuf, size);
+	HidD_GetProductString(handle, prod, size);
+}
+
+const char *CHidDevice::Path() const
+{
+	return path;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,79 @@
+/*************************
+Idle.cpp
+
+Idle detection. See Idle.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+CIdleDetector::CIdleDetector(void)
+{
+	Reset(0);
+	memset(settled, 0, sizeof(settled));
+	settledButtons = 0;
+}
+
+/* Forget the history and count now as activity */
+void CIdleDetector::Reset(WM_TIME now)
+{
+	memset(mean, 0, sizeof(mean));
+	variance = 0;
+	lastButtons = 0;
+	primed = false;
+	lastActivity = now;
+}
+
+/* Fold one report in. produced says whether the mapping turned it into input. */
+void CIdleDetector::Observe(const float *sample, unsigned buttons, bool produced, WM_TIME now)
+{
+	if(!primed)
+	{
+		memcpy(mean, sample, sizeof(mean));
+		lastButtons = buttons;
+		primed = true;
+	}
+
+	float spread = 0;
+	for(int i = 0; i < WM_IDLE_SAMPLE; i++)
+	{
+		float delta = sample[i] - mean[i];
+		mean[i] += WM_IDLE_SMOOTHING * delta;
+		spread += delta * delta;
+	}
+	variance += WM_IDLE_SMOOTHING * (spread - variance);
+
+	if(produced || buttons != lastButtons || variance > WM_IDLE_VARIANCE)
+		lastActivity = now;
+	lastButtons = buttons;
+}
+
+/* Has nothing happened for after ns? */
+bool CIdleDetector::Idle(WM_TIME now, WM_TIME after) const
+{
+	return primed && now - lastActivity >= after;
+}
+
+/* Remember where the mote came to rest */
+void CIdleDetector::Settle(const float *sample, unsigned buttons)
+{
+	memcpy(settled, sample, sizeof(settled));
+	settledButtons = buttons;
+}
+
+/* Does a probe's sample differ from where the mote came to rest? */
+bool CIdleDetector::Moved(const float *sample, unsigned buttons) const
+{
+	if(buttons != settledButtons)
+		return true;
+
+	for(int i = 0; i < WM_IDLE_SAMPLE; i++)
+		if(fabs(sample[i] - settled[i]) > WM_IDLE_WAKE_DELTA)
+			return true;
+	return false;
+}
+
+float CIdleDetector::Variance() const
+{
+	return variance;
+}
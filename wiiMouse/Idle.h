@@ -0,0 +1,57 @@
+/*************************
+Idle.h
+
+Idle detection, so a mote left on a desk stops streaming 100 reports a second.
+
+CIdleDetector watches a motion sample from each report: the mote's force,
+the nunchuk's force and its stick. It keeps a smoothed variance of that
+sample and notes when the buttons change or the mapping last produced input.
+Once none of those has happened for the idle time, the mote counts as idle.
+
+CWiimote::UpdateIdle() then drops the mote to non-continuous buttons-only
+reports (0x30), which it only sends when a button changes. Motion can't be
+seen in that mode, so every WM_IDLE_PROBE_MS the loop briefly asks for its
+usual report mode without continuous reporting. The mote answers a mode
+change with one report, which is compared against the sample taken when it
+went idle. A button change or enough movement restores continuous reporting;
+otherwise the mote goes back to buttons only.
+**************************/
+
+#pragma once
+
+#include "Timing.h"
+
+#define WM_IDLE_AFTER_NS (5 * WM_NS_PER_SEC) /* default quiet time before dropping the rate */
+#define WM_IDLE_PROBE_MS 250 /* how often an idle mote is checked for motion */
+#define WM_IDLE_PROBE_TIMEOUT_MS 50 /* give up on a probe's answer after this long */
+#define WM_IDLE_VARIANCE 0.002f /* summed variance below which the sample is still */
+#define WM_IDLE_WAKE_DELTA 0.15f /* change in any component that counts as movement */
+#define WM_IDLE_SMOOTHING 0.1f /* weight of each report in the running mean and variance */
+#define WM_IDLE_SAMPLE 8 /* mote force xyz, nunchuk force xyz, stick xy */
+
+/* UpdateIdle() states */
+#define WM_IDLE_ACTIVE 0 /* continuous reporting */
+#define WM_IDLE_ASLEEP 1 /* buttons only, waiting for a press or the next probe */
+#define WM_IDLE_PROBING 2 /* asked for one full report, waiting for it */
+
+class CIdleDetector
+{
+public:
+	CIdleDetector(void);
+	void Reset(WM_TIME now);
+	void Observe(const float *sample, unsigned buttons, bool produced, WM_TIME now);
+	bool Idle(WM_TIME now, WM_TIME after) const;
+	void Settle(const float *sample, unsigned buttons);
+	bool Moved(const float *sample, unsigned buttons) const;
+	float Variance() const;
+private:
+	float mean[WM_IDLE_SAMPLE];
+	float variance; /* summed over the sample's components */
+	unsigned lastButtons;
+	bool primed; /* mean has been seeded from a real sample */
+	WM_TIME lastActivity;
+
+	/* Taken when the mote went idle, for probes to compare against */
+	float settled[WM_IDLE_SAMPLE];
+	unsigned settledButtons;
+};
@@ -0,0 +1,36 @@
+/*************************
+InputInjector.h
+
+Synthesizes keyboard and mouse input on the host. Takes the same flags and
+virtual key codes as SendInput on both platforms; on Linux they are
+translated into events on a uinput device.
+
+With discard set nothing reaches the host: every call succeeds and is only
+counted. That is the null output the soak benchmark drives whole fleets of
+virtual motes into.
+**************************/
+
+#pragma once
+
+#include <atomic>
+
+class CInputInjector
+{
+public:
+	CInputInjector(void);
+	~CInputInjector(void);
+	UINT Key(byte keyCode, DWORD flags);
+	UINT Mouse(DWORD flags, DWORD dx, DWORD dy, DWORD data, ULONG_PTR extraInfo);
+	void SetDiscard(bool on);
+	unsigned long long Discarded() const;
+private:
+	bool discard;
+	std::atomic<unsigned long long> discarded; /* calls swallowed while discarding */
+#ifdef _WIN32
+	HKL kbLayout;
+#else
+	BOOL Open();
+	int fd;
+	BOOL unavailable; /* /dev/uinput couldn't be set up, don't keep trying */
+#endif
+};
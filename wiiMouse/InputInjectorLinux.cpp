@@ -0,0 +1,206 @@
+/*************************
+InputInjectorLinux.cpp
+
+Keyboard and mouse injection through a uinput device. The virtual key codes
+and SendInput flags from the mappings are translated to evdev codes here, and
+each call is written as one batch of events closed by a SYN_REPORT.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+/* Virtual key code to evdev key code. Zero means unmapped. */
+static unsigned short VkToKey(byte vk)
+{
+	static const unsigned short letters[26] = {
+		KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J, KEY_K, KEY_L, KEY_M,
+		KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z };
+	static const unsigned short digits[10] = {
+		KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9 };
+
+	if(vk >= 'A' && vk <= 'Z')
+		return letters[vk - 'A'];
+	if(vk >= '0' && vk <= '9')
+		return digits[vk - '0'];
+
+	switch(vk)
+	{
+	case VK_BACK: return KEY_BACKSPACE;
+	case VK_TAB: return KEY_TAB;
+	case VK_RETURN: return KEY_ENTER;
+	case VK_SHIFT: return KEY_LEFTSHIFT;
+	case VK_CONTROL: return KEY_LEFTCTRL;
+	case VK_MENU: return KEY_LEFTALT;
+	case VK_ESCAPE: return KEY_ESC;
+	case VK_SPACE: return KEY_SPACE;
+	case VK_LEFT: return KEY_LEFT;
+	case VK_UP: return KEY_UP;
+	case VK_RIGHT: return KEY_RIGHT;
+	case VK_DOWN: return KEY_DOWN;
+	default: return 0;
+	}
+}
+
+static void FillEvent(struct input_event *ev, unsigned short type, unsigned short code, int value)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+CInputInjector::CInputInjector(void)
+{
+	fd = -1;
+	unavailable = false;
+	discard = false;
+	discarded = 0;
+}
+
+CInputInjector::~CInputInjector(void)
+{
+	if(fd >= 0)
+	{
+		ioctl(fd, UI_DEV_DESTROY);
+		close(fd);
+	}
+}
+
+/* Create the uinput device the first time something is injected, so runs
+that never inject (or can't open /dev/uinput) don't need the permission */
+BOOL CInputInjector::Open()
+{
+	if(fd >= 0)
+		return true;
+	if(unavailable)
+		return false;
+
+	unavailable = true;
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0)
+	{
+		printf("Error opening /dev/uinput (%s), input will not be injected\n", strerror(errno));
+		return false;
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_EVBIT, EV_REL);
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+	for(int vk = 0; vk < 256; vk++)
+	{
+		unsigned short key = VkToKey((byte)vk);
+		if(key)
+			ioctl(fd, UI_SET_KEYBIT, key);
+	}
+	ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+	ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+	ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE);
+	ioctl(fd, UI_SET_RELBIT, REL_X);
+	ioctl(fd, UI_SET_RELBIT, REL_Y);
+	ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+
+	struct uinput_user_dev dev;
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "wiiMouse virtual input");
+	dev.id.bustype = BUS_VIRTUAL;
+	dev.id.vendor = WIIMOTE_VID;
+	dev.id.product = WIIMOTE_PID;
+	dev.id.version = 1;
+
+	if(write(fd, &dev, sizeof(dev)) != sizeof(dev) || ioctl(fd, UI_DEV_CREATE) < 0)
+	{
+		printf("Error creating the uinput device (%s)\n", strerror(errno));
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	unavailable = false;
+	return true;
+}
+
+/* Swallow everything from now on instead of injecting it */
+void CInputInjector::SetDiscard(bool on)
+{
+	discard = on;
+}
+
+unsigned long long CInputInjector::Discarded() const
+{
+	return discarded.load(std::memory_order_relaxed);
+}
+
+UINT CInputInjector::Key(byte keyCode, DWORD flags)
+{
+	struct input_event ev[2];
+	unsigned short key = VkToKey(keyCode);
+
+	if(discard)
+	{
+		discarded.fetch_add(1, std::memory_order_relaxed);
+		return 1;
+	}
+
+	if(!key || !Open())
+		return 0;
+
+	FillEvent(&ev[0], EV_KEY, key, (flags & KEYEVENTF_KEYUP) ? 0 : 1);
+	FillEvent(&ev[1], EV_SYN, SYN_REPORT, 0);
+
+	return write(fd, ev, sizeof(ev)) == sizeof(ev) ? 1 : 0;
+}
+
+/* dx, dy and data carry signed values in DWORDs, as they do for SendInput */
+UINT CInputInjector::Mouse(DWORD flags, DWORD dx, DWORD dy, DWORD data, ULONG_PTR extraInfo)
+{
+	struct input_event ev[12];
+	int n = 0;
+	(void)extraInfo; /* SendInput's tag for the event; evdev has nowhere to put it */
+
+	if(discard)
+	{
+		discarded.fetch_add(1, std::memory_order_relaxed);
+		return 1;
+	}
+
+	if(!Open())
+		return 0;
+
+	if(flags & MOUSEEVENTF_MOVE)
+	{
+		if((int)dx)
+			FillEvent(&ev[n++], EV_REL, REL_X, (int)dx);
+		if((int)dy)
+			FillEvent(&ev[n++], EV_REL, REL_Y, (int)dy);
+	}
+	if(flags & MOUSEEVENTF_WHEEL)
+		FillEvent(&ev[n++], EV_REL, REL_WHEEL, (int)data / 120);
+	if(flags & MOUSEEVENTF_LEFTDOWN)
+		FillEvent(&ev[n++], EV_KEY, BTN_LEFT, 1);
+	if(flags & MOUSEEVENTF_LEFTUP)
+		FillEvent(&ev[n++], EV_KEY, BTN_LEFT, 0);
+	if(flags & MOUSEEVENTF_RIGHTDOWN)
+		FillEvent(&ev[n++], EV_KEY, BTN_RIGHT, 1);
+	if(flags & MOUSEEVENTF_RIGHTUP)
+		FillEvent(&ev[n++], EV_KEY, BTN_RIGHT, 0);
+	if(flags & MOUSEEVENTF_MIDDLEDOWN)
+		FillEvent(&ev[n++], EV_KEY, BTN_MIDDLE, 1);
+	if(flags & MOUSEEVENTF_MIDDLEUP)
+		FillEvent(&ev[n++], EV_KEY, BTN_MIDDLE, 0);
+
+	if(n == 0)
+		return 1;
+	FillEvent(&ev[n++], EV_SYN, SYN_REPORT, 0);
+
+	ssize_t size = n * sizeof(struct input_event);
+	return write(fd, ev, size) == size ? 1 : 0;
+}
+
+#endif /* !_WIN32 */
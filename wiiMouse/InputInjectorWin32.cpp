@@ -0,0 +1,80 @@
+/*************************
+InputInjectorWin32.cpp
+
+Keyboard and mouse injection through SendInput.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#ifdef _WIN32
+
+CInputInjector::CInputInjector(void)
+{
+	kbLayout = GetKeyboardLayout(NULL);
+	discard = false;
+	discarded = 0;
+}
+
+CInputInjector::~CInputInjector(void)
+{
+}
+
+/* Swallow everything from now on instead of injecting it */
+void CInputInjector::SetDiscard(bool on)
+{
+	discard = on;
+}
+
+unsigned long long CInputInjector::Discarded() const
+{
+	return discarded.load(std::memory_order_relaxed);
+}
+
+/* Send a keyboard event using SendInput.
+Accepts a key and a flag value */
+UINT CInputInjector::Key(byte keyCode, DWORD flags)
+{
+	INPUT key;
+
+	if(discard)
+	{
+		discarded.fetch_add(1, std::memory_order_relaxed);
+		return 1;
+	}
+
+	key.type = INPUT_KEYBOARD;
+	key.ki.wVk = keyCode;
+	key.ki.dwFlags = flags;
+	key.ki.time = 0;
+	key.ki.wScan = MapVirtualKeyEx(keyCode, 0, kbLayout); /* 2nd param is MAPVK_VK_TO_VSC, PSDK guys didn't
+														  feel it necessary to include this in winuser.h...*/
+	key.ki.dwExtraInfo = 0;
+
+	// Send a single key using the keyCode and flags provided
+	return SendInput(1, &key, sizeof(INPUT));
+}
+
+/* Sends a mouse event using SendInput. */
+UINT CInputInjector::Mouse(DWORD flags, DWORD dx, DWORD dy, DWORD data, ULONG_PTR extraInfo)
+{
+	INPUT key;
+
+	if(discard)
+	{
+		discarded.fetch_add(1, std::memory_order_relaxed);
+		return 1;
+	}
+
+	key.type = INPUT_MOUSE;
+	key.mi.dwFlags = flags;
+	key.mi.dwExtraInfo = extraInfo;
+	key.mi.dx = dx;
+	key.mi.dy = dy;
+	key.mi.mouseData = data;
+	key.mi.time = 0;
+	
+	return SendInput(1, &key, sizeof(INPUT));
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,189 @@
+/*************************
+Latency.cpp
+
+Lock-free latency histograms. Record() is only ever called from the read loop
+of the owning device; Dump() and the query functions may run on any thread and
+see a slightly torn but always usable snapshot.
+**************************/
+
+#include "stdafx.h"
+#include "Latency.h"
+
+#define WM_HIST_LINEAR (1 << WM_HIST_SUB_BITS)
+#define WM_HIST_HALF (1 << (WM_HIST_SUB_BITS - 1))
+
+static const char *stageNames[WM_STAGE_COUNT] = { "decode", "map", "inject", "total" };
+
+CLatencyHistogram::CLatencyHistogram(void)
+{
+	Reset();
+}
+
+void CLatencyHistogram::Reset()
+{
+	for(int i = 0; i < WM_HIST_BUCKETS; i++)
+		buckets[i].store(0, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+/* Map a value in ns to its bucket */
+int CLatencyHistogram::BucketIndex(WM_TIME ns)
+{
+	if(ns < WM_HIST_LINEAR)
+		return (int)ns;
+
+	/* Find the most significant bit with a short binary search */
+	int msb = 0;
+	WM_TIME v = ns;
+	if(v >> 32) { v >>= 32; msb += 32; }
+	if(v >> 16) { v >>= 16; msb += 16; }
+	if(v >> 8) { v >>= 8; msb += 8; }
+	if(v >> 4) { v >>= 4; msb += 4; }
+	if(v >> 2) { v >>= 2; msb += 2; }
+	if(v >> 1) { msb += 1; }
+
+	if(msb >= WM_HIST_MAX_BITS)
+		return WM_HIST_BUCKETS - 1;
+
+	int shift = msb - WM_HIST_SUB_BITS + 1;
+	return WM_HIST_LINEAR + (msb - WM_HIST_SUB_BITS) * WM_HIST_HALF + (int)(ns >> shift) - WM_HIST_HALF;
+}
+
+/* The midpoint of the values that fall into a bucket */
+WM_TIME CLatencyHistogram::BucketValue(int index)
+{
+	if(index < WM_HIST_LINEAR)
+		return (WM_TIME)index;
+
+	int k = index - WM_HIST_LINEAR;
+	int shift = k / WM_HIST_HALF + 1;
+	WM_TIME lower = (WM_TIME)(WM_HIST_HALF + k % WM_HIST_HALF) << shift;
+	return lower + ((1ULL << shift) >> 1);
+}
+
+void CLatencyHistogram::Record(WM_TIME ns)
+{
+	buckets[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(ns, std::memory_order_relaxed);
+
+	/* Single writer per histogram, so a plain compare is enough for the max */
+	if(ns > max.load(std::memory_order_relaxed))
+		max.store(ns, std::memory_order_relaxed);
+}
+
+/* Fold another histogram into this one, to see several devices as one.
+other may still be recording, but nothing may Record() into this one meanwhile. */
+void CLatencyHistogram::Add(const CLatencyHistogram &other)
+{
+	for(int i = 0; i < WM_HIST_BUCKETS; i++)
+		buckets[i].fetch_add(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	count.fetch_add(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	WM_TIME otherMax = other.max.load(std::memory_order_relaxed);
+	if(otherMax > max.load(std::memory_order_relaxed))
+		max.store(otherMax, std::memory_order_relaxed);
+}
+
+unsigned long long CLatencyHistogram::Count() const
+{
+	return count.load(std::memory_order_relaxed);
+}
+
+WM_TIME CLatencyHistogram::Max() const
+{
+	return max.load(std::memory_order_relaxed);
+}
+
+WM_TIME CLatencyHistogram::Mean() const
+{
+	unsigned long long n = count.load(std::memory_order_relaxed);
+	return n ? sum.load(std::memory_order_relaxed) / n : 0;
+}
+
+/* Value at the given percentile (0 to 100) */
+WM_TIME CLatencyHistogram::Percentile(double pct) const
+{
+	unsigned long long total = 0;
+	for(int i = 0; i < WM_HIST_BUCKETS; i++)
+		total += buckets[i].load(std::memory_order_relaxed);
+	if(total == 0)
+		return 0;
+
+	unsigned long long target = (unsigned long long)(pct / 100.0 * (double)total + 0.5);
+	if(target < 1)
+		target = 1;
+
+	unsigned long long seen = 0;
+	for(int i = 0; i < WM_HIST_BUCKETS; i++)
+	{
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if(seen >= target)
+			return BucketValue(i);
+	}
+
+	return Max();
+}
+
+/* Turn the stamps for one report into stage latencies and clear them for the next.
+A report that didn't inject anything still counts towards decode and map. */
+void CLatencyStats::Commit(WM_LAT_STAMPS &stamps)
+{
+	if(stamps.read && stamps.decode)
+	{
+		stage[WM_STAGE_DECODE].Record(stamps.decode - stamps.read);
+
+		WM_TIME mapped = stamps.map ? stamps.map : WmNow();
+		stage[WM_STAGE_MAP].Record(mapped - stamps.decode);
+
+		if(stamps.inject)
+		{
+			stage[WM_STAGE_INJECT].Record(stamps.inject - mapped);
+			stage[WM_STAGE_TOTAL].Record(stamps.inject - stamps.read);
+		}
+	}
+
+	stamps.read = stamps.decode = stamps.map = stamps.inject = 0;
+}
+
+void CLatencyStats::Reset()
+{
+	for(int i = 0; i < WM_STAGE_COUNT; i++)
+		stage[i].Reset();
+}
+
+void CLatencyStats::Add(const CLatencyStats &other)
+{
+	for(int i = 0; i < WM_STAGE_COUNT; i++)
+		stage[i].Add(other.stage[i]);
+}
+
+/* Print one line per stage, all values in microseconds */
+/* The name a WM_STAGE_* goes by in dumps and reports */
+const char *CLatencyStats::StageName(int stage)
+{
+	return stage >= 0 && stage < WM_STAGE_COUNT ? stageNames[stage] : "unknown";
+}
+
+void CLatencyStats::Dump(FILE *out, const char *name) const
+{
+	fprintf(out, "Latency for %s (us)\n", name);
+	fprintf(out, "  %-8s %10s %9s %9s %9s %9s %9s %9s\n",
+		"stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+	for(int i = 0; i < WM_STAGE_COUNT; i++)
+	{
+		const CLatencyHistogram &h = stage[i];
+		fprintf(out, "  %-8s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+			StageName(i), h.Count(),
+			h.Mean() / 1000.0,
+			h.Percentile(50.0) / 1000.0,
+			h.Percentile(90.0) / 1000.0,
+			h.Percentile(99.0) / 1000.0,
+			h.Percentile(99.9) / 1000.0,
+			h.Max() / 1000.0);
+	}
+}
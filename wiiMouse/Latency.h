@@ -0,0 +1,85 @@
+/*************************
+Latency.h
+
+Per-device latency histograms for the motion-to-photon path.
+Each report is stamped when ReadFile returns, when it has been decoded, when the
+mapping has decided what to inject and when the last SendInput call returns.
+The differences feed log-linear (HDR-style) histograms whose buckets are plain
+atomic counters, so the read loop never takes a lock and another thread can dump
+them at any time.
+
+Define WM_NO_LATENCY to compile the instrumentation out. The stamp macros then
+expand to nothing and the stamp members go away with them.
+**************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include "Timing.h"
+
+/* Histogram layout - values below 2^WM_HIST_SUB_BITS ns get a bucket each,
+above that every power of two is split into 2^(WM_HIST_SUB_BITS-1) linear
+sub-buckets (roughly 3% precision). Anything at or beyond 2^WM_HIST_MAX_BITS ns
+(about 18 minutes) lands in the last bucket. */
+#define WM_HIST_SUB_BITS 5
+#define WM_HIST_MAX_BITS 40
+#define WM_HIST_BUCKETS ((1 << WM_HIST_SUB_BITS) + (WM_HIST_MAX_BITS - WM_HIST_SUB_BITS) * (1 << (WM_HIST_SUB_BITS - 1)))
+
+/* Latency stages */
+#define WM_STAGE_DECODE 0 /* read completion to decode done */
+#define WM_STAGE_MAP 1 /* decode done to mapping decision */
+#define WM_STAGE_INJECT 2 /* mapping decision to the last SendInput returning */
+#define WM_STAGE_TOTAL 3 /* read completion to the last SendInput returning */
+#define WM_STAGE_COUNT 4
+
+/* Timestamps taken for the report currently in flight. Zero means not taken. */
+struct WM_LAT_STAMPS {
+	WM_TIME read; /* ReadFile returned */
+	WM_TIME decode; /* report dissected */
+	WM_TIME map; /* mapping decided, first injection about to go out */
+	WM_TIME inject; /* last SendInput returned */
+};
+
+class CLatencyHistogram
+{
+public:
+	CLatencyHistogram(void);
+	void Record(WM_TIME ns);
+	void Reset();
+	void Add(const CLatencyHistogram &other);
+	unsigned long long Count() const;
+	WM_TIME Max() const;
+	WM_TIME Mean() const;
+	WM_TIME Percentile(double pct) const;
+private:
+	static int BucketIndex(WM_TIME ns);
+	static WM_TIME BucketValue(int index);
+	std::atomic<unsigned int> buckets[WM_HIST_BUCKETS];
+	std::atomic<unsigned long long> count;
+	std::atomic<unsigned long long> sum;
+	std::atomic<unsigned long long> max;
+};
+
+class CLatencyStats
+{
+public:
+	void Commit(WM_LAT_STAMPS &stamps);
+	void Reset();
+	void Add(const CLatencyStats &other);
+	void Dump(FILE *out, const char *name) const;
+	static const char *StageName(int stage);
+	CLatencyHistogram stage[WM_STAGE_COUNT];
+};
+
+#ifndef WM_NO_LATENCY
+#define WM_LAT_STAMP(field) (latStamps.field = WmNow())
+#define WM_LAT_SET(field, t) (latStamps.field = (t))
+#define WM_LAT_STAMP_ONCE(field) do { if(!latStamps.field) latStamps.field = WmNow(); } while(0)
+#define WM_LAT_COMMIT() cold->latency.Commit(latStamps)
+#else
+#define WM_LAT_STAMP(field) ((void)0)
+#define WM_LAT_SET(field, t) ((void)0)
+#define WM_LAT_STAMP_ONCE(field) ((void)0)
+#define WM_LAT_COMMIT() ((void)0)
+#endif
@@ -0,0 +1,284 @@
+/*************************
+MemoryAccess.cpp
+
+Chunked EEPROM and register transfers. See MemoryAccess.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+CMemoryAccess::CMemoryAccess(COutputQueue *queue)
+{
+	output = queue;
+	head = tail = NULL;
+}
+
+CMemoryAccess::~CMemoryAccess(void)
+{
+	Cancel();
+}
+
+/* Queue a transfer behind any already running. Safe to call from any thread;
+poll transfer->state, or use CWiimote::WaitTransfer(). */
+BOOL CMemoryAccess::Start(WM_TRANSFER *transfer)
+{
+	WM_TIME now = WmNow();
+
+	transfer->error = WM_MEM_OK;
+	transfer->requests = transfer->retries = 0;
+	transfer->started = now;
+	transfer->finished = 0;
+	transfer->next = NULL;
+	transfer->sent = transfer->acked = 0;
+	transfer->stalls = 0;
+	transfer->requestEnd = 0;
+
+	if(transfer->length <= 0 || transfer->length > WM_MEM_MAX_LENGTH || !transfer->data
+		|| (transfer->space != WM_MEM_EEPROM && transfer->space != WM_MEM_REGISTERS))
+	{
+		transfer->error = WM_MEM_BAD_REQUEST;
+		transfer->finished = now;
+		transfer->state = WM_XFER_FAILED;
+		return false;
+	}
+
+	transfer->missing = (transfer->length + WM_MEM_CHUNK - 1) / WM_MEM_CHUNK;
+	transfer->chunks.assign(transfer->write ? 0 : transfer->missing, 0);
+	transfer->state = WM_XFER_QUEUED;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if(tail)
+		tail->next = transfer;
+	else
+		head = transfer;
+	tail = transfer;
+
+	if(head == transfer)
+		Issue(transfer, now);
+	return true;
+}
+
+/* Fail everything still queued or running, so no transfer outlives the mote */
+void CMemoryAccess::Cancel()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	WM_TIME now = WmNow();
+	while(head)
+	{
+		WM_TRANSFER *transfer = head;
+		head = head->next;
+		transfer->error = WM_MEM_TIMED_OUT;
+		transfer->finished = now;
+		transfer->state = WM_XFER_FAILED;
+	}
+	tail = NULL;
+}
+
+/* Take a 0x21 or 0x22 report. Returns true if it belonged to a transfer. */
+bool CMemoryAccess::OnReport(const byte *report, int length)
+{
+	/* 0x21 has at least the address, 0x22 the acked report and error */
+	if((report[0] == WM_MODE_READ_DATA && length < 6) || (report[0] == WM_MODE_WRITE_DATA && length < 5))
+		return false;
+
+	std::lock_guard<std::mutex> guard(lock);
+	WM_TRANSFER *transfer = head;
+	if(!transfer)
+		return false;
+
+	WM_TIME now = WmNow();
+	if(report[0] == WM_MODE_READ_DATA && !transfer->write)
+	{
+		OnReadData(transfer, report, now);
+		return true;
+	}
+	/* Only acks for 0x16 writes */
+	if(report[0] == WM_MODE_WRITE_DATA && report[3] == WM_OUT_WRITE_DATA && transfer->write
+		&& transfer->acked < transfer->sent)
+	{
+		OnWriteAck(transfer, report, now);
+		return true;
+	}
+	return false;
+}
+
+/* Retry the running transfer if it has gone quiet for too long */
+void CMemoryAccess::Tick(WM_TIME now)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(head && now >= head->deadline)
+		Retry(head, now);
+}
+
+/* When Tick() next has something to do, or 0 if nothing is running */
+WM_TIME CMemoryAccess::NextDeadline()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return head ? head->deadline : 0;
+}
+
+/* Start the transfer now at the head of the queue. Called with the lock held. */
+void CMemoryAccess::Issue(WM_TRANSFER *transfer, WM_TIME now)
+{
+	transfer->state = WM_XFER_RUNNING;
+	if(transfer->write)
+		PumpWrites(transfer, now);
+	else
+		IssueRead(transfer, now);
+}
+
+/* Ask for everything from the first missing piece to the last in one request */
+void CMemoryAccess::IssueRead(WM_TRANSFER *transfer, WM_TIME now)
+{
+	int first = 0;
+	int last = (int)transfer->chunks.size() - 1;
+	while(transfer->chunks[first])
+		first++;
+	while(transfer->chunks[last])
+		last--;
+
+	int offset = first * WM_MEM_CHUNK;
+	int end = (last + 1) * WM_MEM_CHUNK;
+	if(end > transfer->length)
+		end = transfer->length;
+	DWORD address = transfer->address + offset;
+	int size = end - offset;
+
+	byte request[7];
+	request[0] = WM_OUT_READ_DATA;
+	request[1] = transfer->space;
+	request[2] = (byte)(address >> 16);
+	request[3] = (byte)(address >> 8);
+	request[4] = (byte)address;
+	request[5] = (byte)(size >> 8);
+	request[6] = (byte)size;
+
+	transfer->requestEnd = end;
+	transfer->deadline = now + WM_MEM_TIMEOUT_MS * WM_NS_PER_MS;
+	if(output->Submit(request, sizeof(request)))
+		transfer->requests++;
+}
+
+/* Send writes until the window is full or everything is out */
+void CMemoryAccess::PumpWrites(WM_TRANSFER *transfer, WM_TIME now)
+{
+	while(transfer->sent < transfer->length && transfer->sent - transfer->acked < WM_MEM_WRITE_WINDOW * WM_MEM_CHUNK)
+	{
+		int size = transfer->length - transfer->sent;
+		if(size > WM_MEM_CHUNK)
+			size = WM_MEM_CHUNK;
+		DWORD address = transfer->address + transfer->sent;
+
+		byte request[WM_PACKET_SIZE];
+		memset(request, 0, sizeof(request));
+		request[0] = WM_OUT_WRITE_DATA;
+		request[1] = transfer->space;
+		request[2] = (byte)(address >> 16);
+		request[3] = (byte)(address >> 8);
+		request[4] = (byte)address;
+		request[5] = (byte)size;
+		memcpy(&request[6], transfer->data + transfer->sent, size);
+
+		/* A full output queue leaves the rest for the retry */
+		if(!output->Submit(request, sizeof(request)))
+			break;
+		transfer->requests++;
+		transfer->sent += size;
+	}
+	transfer->deadline = now + WM_MEM_TIMEOUT_MS * WM_NS_PER_MS;
+}
+
+/* A 0x21 for the running read: buttons, size and error nibbles, the low
+16 bits of the address, then up to 16 bytes */
+void CMemoryAccess::OnReadData(WM_TRANSFER *transfer, const byte *report, WM_TIME now)
+{
+	int error = report[3] & 0x0f;
+	int size = (report[3] >> 4) + 1;
+	int offset = (int)((((report[4] << 8) | report[5]) - transfer->address) & 0xffff);
+
+	if(error == WM_MEM_WRITE_ONLY || error == WM_MEM_NONEXISTENT)
+	{
+		Finish(transfer, error, now);
+		return;
+	}
+	if(error)
+	{
+		Retry(transfer, now);
+		return;
+	}
+
+	/* Pieces always start on a 16-byte boundary of the transfer; anything
+	else is left over from a request that has since been retried */
+	if(offset % WM_MEM_CHUNK || offset >= transfer->length)
+		return;
+
+	int chunk = offset / WM_MEM_CHUNK;
+	if(size > transfer->length - offset)
+		size = transfer->length - offset;
+	if(transfer->chunks[chunk])
+		return;
+
+	memcpy(transfer->data + offset, &report[6], size);
+	transfer->chunks[chunk] = 1;
+	transfer->missing--;
+	transfer->stalls = 0;
+	transfer->deadline = now + WM_MEM_TIMEOUT_MS * WM_NS_PER_MS;
+
+	if(!transfer->missing)
+		Finish(transfer, WM_MEM_OK, now);
+	else if(offset + size >= transfer->requestEnd)
+		Retry(transfer, now); /* the request is answered and pieces are still missing */
+}
+
+/* A 0x22 ack for the oldest write in flight: buttons, the report it acks, error */
+void CMemoryAccess::OnWriteAck(WM_TRANSFER *transfer, const byte *report, WM_TIME now)
+{
+	if(report[4] != WM_MEM_OK)
+	{
+		Finish(transfer, report[4], now);
+		return;
+	}
+
+	int size = transfer->length - transfer->acked;
+	transfer->acked += size > WM_MEM_CHUNK ? WM_MEM_CHUNK : size;
+	transfer->stalls = 0;
+
+	if(transfer->acked == transfer->length)
+		Finish(transfer, WM_MEM_OK, now);
+	else
+		PumpWrites(transfer, now);
+}
+
+/* Ask again for what hasn't arrived, or send again what hasn't been acked */
+void CMemoryAccess::Retry(WM_TRANSFER *transfer, WM_TIME now)
+{
+	if(++transfer->stalls > WM_MEM_RETRIES)
+	{
+		Finish(transfer, WM_MEM_TIMED_OUT, now);
+		return;
+	}
+
+	transfer->retries++;
+	if(transfer->write)
+	{
+		transfer->sent = transfer->acked;
+		PumpWrites(transfer, now);
+	}
+	else
+		IssueRead(transfer, now);
+}
+
+/* Hand the transfer back and start the next. Called with the lock held. */
+void CMemoryAccess::Finish(WM_TRANSFER *transfer, int error, WM_TIME now)
+{
+	head = transfer->next;
+	if(!head)
+		tail = NULL;
+
+	transfer->error = error;
+	transfer->finished = now;
+	transfer->state = error == WM_MEM_OK ? WM_XFER_DONE : WM_XFER_FAILED;
+
+	if(head)
+		Issue(head, now);
+}
@@ -0,0 +1,118 @@
+/*************************
+MemoryAccess.h
+
+Reads and writes of any length to the mote's EEPROM and register space,
+run in the background while reports keep flowing.
+
+The mote serves memory in 16-byte pieces. A 0x17 read request names an
+address and a size of up to 64 KB and the mote answers with one 0x21 report
+per 16 bytes, back to back, so a single request keeps a whole transfer in
+flight: the 5.5 KB EEPROM comes back in one round trip. Each 0x21 carries
+the low 16 bits of its address, which places it in the transfer, and an
+error nibble (7 for a write-only register, 8 for an address that doesn't
+exist - both final). Pieces lost on the way are asked for again in one
+request covering the first to the last missing one.
+
+Writes go out as 0x16 reports of up to 16 bytes, each answered by a 0x22
+ack. Acks carry no address, so they are matched in order; up to
+WM_MEM_WRITE_WINDOW writes are sent ahead of their acks, and on a timeout
+everything after the last ack is sent again (writes are idempotent).
+
+A transfer that makes no progress for WM_MEM_TIMEOUT_MS is retried, up to
+WM_MEM_RETRIES times in a row. Transfers run one at a time in the order
+they were started, since the mote only serves one request at a time.
+
+CMemoryAccess is fed by whoever reads reports: OnReport() with each 0x21
+and 0x22, and Tick() after every read or read timeout. CWiimote does both
+from Poll(), and wraps the whole thing as ReadMemory(), WriteMemory() and
+StartTransfer(). CWiimote::WriteRegister() writes behind the engine's back;
+its ack can be taken for one of a bulk write's if both run at once.
+**************************/
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include "Timing.h"
+
+/* Address spaces, the first byte of a 0x16 or 0x17 request */
+#define WM_MEM_EEPROM 0x00
+#define WM_MEM_REGISTERS 0x04
+
+#define WM_MEM_CHUNK 16 /* bytes in one 0x21 report or 0x16 write */
+#define WM_MEM_MAX_LENGTH 0xffff /* the most one transfer can move - a read's size field */
+#define WM_MEM_EEPROM_SIZE 0x1700 /* user EEPROM, 0x0000 - 0x16ff */
+#define WM_MEM_WRITE_WINDOW 4 /* writes sent ahead of their acks */
+#define WM_MEM_TIMEOUT_MS 100 /* no progress for this long and the transfer is retried */
+#define WM_MEM_RETRIES 3 /* retries in a row before a transfer fails */
+
+/* Error nibbles of the 0x21 and 0x22 reports */
+#define WM_MEM_OK 0x00
+#define WM_MEM_WRITE_ONLY 0x07
+#define WM_MEM_NONEXISTENT 0x08
+/* and the engine's own */
+#define WM_MEM_TIMED_OUT -1
+#define WM_MEM_BAD_REQUEST -2
+#define WM_MEM_NOT_SENT -3 /* the output queue wouldn't take it */
+
+/* Transfer states */
+#define WM_XFER_IDLE 0
+#define WM_XFER_QUEUED 1
+#define WM_XFER_RUNNING 2
+#define WM_XFER_DONE 3
+#define WM_XFER_FAILED 4
+
+class COutputQueue;
+
+/* One read or write. The caller owns it and its buffer, and fills in the
+first five fields; the rest belongs to the engine until state is DONE or FAILED. */
+struct WM_TRANSFER {
+	bool write;
+	byte space; /* WM_MEM_EEPROM or WM_MEM_REGISTERS */
+	DWORD address; /* 24 bits in register space, 16 in EEPROM */
+	int length;
+	byte *data; /* length bytes, read into or written from */
+
+	std::atomic<int> state; /* WM_XFER_*, set last */
+	int error; /* WM_MEM_* */
+	int requests; /* 0x17 or 0x16 reports sent, retries included */
+	int retries;
+	WM_TIME started;
+	WM_TIME finished;
+
+	/* Engine bookkeeping */
+	WM_TRANSFER *next;
+	std::vector<byte> chunks; /* read: which pieces have arrived */
+	int missing; /* read: pieces still to come */
+	int requestEnd; /* read: offset the outstanding request ends at */
+	int sent; /* write: offset sent up to */
+	int acked; /* write: offset acknowledged up to */
+	int stalls; /* timeouts since the last progress */
+	WM_TIME deadline;
+};
+
+class CMemoryAccess
+{
+public:
+	CMemoryAccess(COutputQueue *output);
+	~CMemoryAccess(void);
+	BOOL Start(WM_TRANSFER *transfer);
+	bool OnReport(const byte *report, int length);
+	void Tick(WM_TIME now);
+	WM_TIME NextDeadline();
+	void Cancel();
+private:
+	void Issue(WM_TRANSFER *transfer, WM_TIME now);
+	void IssueRead(WM_TRANSFER *transfer, WM_TIME now);
+	void PumpWrites(WM_TRANSFER *transfer, WM_TIME now);
+	void OnReadData(WM_TRANSFER *transfer, const byte *report, WM_TIME now);
+	void OnWriteAck(WM_TRANSFER *transfer, const byte *report, WM_TIME now);
+	void Retry(WM_TRANSFER *transfer, WM_TIME now);
+	void Finish(WM_TRANSFER *transfer, int error, WM_TIME now);
+
+	COutputQueue *output;
+	std::mutex lock;
+	WM_TRANSFER *head; /* running */
+	WM_TRANSFER *tail;
+};
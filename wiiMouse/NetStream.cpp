@@ -0,0 +1,537 @@
+/*************************
+NetStream.cpp
+
+Delta-encoded state over UDP. See NetStream.h for the wire format.
+**************************/
+
+#include "stdafx.h"
+#include "NetStream.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define WM_BAD_SOCKET INVALID_SOCKET
+typedef int socklen_t;
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/select.h>
+#define WM_BAD_SOCKET -1
+#define closesocket close
+#endif
+
+/* Bytes each field takes on the wire, by field bit */
+static const int fieldSize[WM_NET_FIELDS] = {
+	2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 2,
+	1, 1,
+	4, 4, 4, 4 };
+
+/* Biggest a frame can get: device, flags, sequence, time and its keyframe high word, a 4-byte mask and every field */
+#define WM_NET_MAX_FRAME (1 + 1 + 2 + 4 + 4 + 4 + 47)
+
+/* Winsock wants starting once per process */
+static BOOL NetStartup()
+{
+#ifdef _WIN32
+	static bool started = false;
+	if(!started)
+	{
+		WSADATA wsa;
+		if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+			return false;
+		started = true;
+	}
+#endif
+	return true;
+}
+
+static int Quantize(float value, float scale, int low, int high)
+{
+	int q = (int)floor(value * scale + 0.5f);
+	return q < low ? low : (q > high ? high : q);
+}
+
+void NetQuantize(const WM_SHARED_STATE *state, WM_NET_QSTATE *out)
+{
+	int *v = out->value;
+
+	v[0] = state->buttons;
+	v[1] = state->chukButtons;
+	v[2] = state->flags;
+	v[3] = state->battery < 0 ? 0 : (state->battery > 255 ? 255 : state->battery);
+
+	for(int i = 0; i < 3; i++)
+	{
+		v[4 + i] = Quantize(state->force[i], 1000.f, -32768, 32767);
+		v[7 + i] = Quantize(state->tilt[i], 100.f, -32768, 32767);
+		v[10 + i] = Quantize(state->chukForce[i], 1000.f, -32768, 32767);
+		v[13 + i] = Quantize(state->chukTilt[i], 100.f, -32768, 32767);
+	}
+
+	v[16] = Quantize(state->stick[0], 127.f, -127, 127);
+	v[17] = Quantize(state->stick[1], 127.f, -127, 127);
+
+	for(int i = 0; i < 4; i++)
+	{
+		const WM_SHARED_IR &dot = state->ir[i];
+		v[18 + i] = (dot.x & 0x3ff) | (dot.y & 0x3ff) << 10 | (dot.size & 0x0f) << 20 | (dot.visible ? 1 << 24 : 0);
+	}
+}
+
+/* Rebuild the state fields; time and report are left to the caller */
+void NetExpand(const WM_NET_QSTATE *fields, WM_SHARED_STATE *out)
+{
+	const int *v = fields->value;
+
+	out->buttons = (unsigned short)v[0];
+	out->chukButtons = (byte)v[1];
+	out->flags = (byte)v[2];
+	out->battery = v[3];
+
+	for(int i = 0; i < 3; i++)
+	{
+		out->force[i] = v[4 + i] / 1000.f;
+		out->tilt[i] = v[7 + i] / 100.f;
+		out->chukForce[i] = v[10 + i] / 1000.f;
+		out->chukTilt[i] = v[13 + i] / 100.f;
+	}
+
+	out->stick[0] = v[16] / 127.f;
+	out->stick[1] = v[17] / 127.f;
+
+	for(int i = 0; i < 4; i++)
+	{
+		out->ir[i].x = (unsigned short)(v[18 + i] & 0x3ff);
+		out->ir[i].y = (unsigned short)((v[18 + i] >> 10) & 0x3ff);
+		out->ir[i].size = (byte)((v[18 + i] >> 20) & 0x0f);
+		out->ir[i].visible = (byte)((v[18 + i] >> 24) & 1);
+	}
+}
+
+/* Little-endian field writer; the value is truncated to size bytes */
+static byte *Put(byte *p, unsigned value, int size)
+{
+	for(int i = 0; i < size; i++)
+		*p++ = (byte)(value >> (8 * i));
+	return p;
+}
+
+/* Read size bytes, sign-extending the 16 and 8 bit axis fields */
+static int Get(const byte *p, int size, bool sign)
+{
+	unsigned value = 0;
+	for(int i = 0; i < size; i++)
+		value |= (unsigned)p[i] << (8 * i);
+
+	if(sign && size < 4 && (value & (1u << (8 * size - 1))))
+		value |= ~0u << (8 * size);
+	return (int)value;
+}
+
+/* Field bits holding signed values */
+static bool Signed(int field)
+{
+	return field >= 4 && field <= 17;
+}
+
+CStateSender::CStateSender(void)
+{
+	sock = WM_BAD_SOCKET;
+	addressLength = 0;
+	devices = 1;
+	length = frames = 0;
+	pendingMask = 0;
+	batchStarted = 0;
+	memset(last, 0, sizeof(last));
+	memset(sequence, 0, sizeof(sequence));
+	memset(sinceKeyframe, 0, sizeof(sinceKeyframe));
+	memset(&stats, 0, sizeof(stats));
+}
+
+CStateSender::~CStateSender(void)
+{
+	Close();
+}
+
+/* Send to host:port. devices is how many frames make a full batch;
+fewer go out after WM_NET_MAX_BATCH_NS anyway. */
+BOOL CStateSender::Open(const char *host, int port, int deviceCount)
+{
+	if(!NetStartup())
+		return false;
+
+	struct addrinfo hints;
+	struct addrinfo *found = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	char service[16];
+	_snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &found) != 0 || !found)
+	{
+		printf("Couldn't resolve %s\n", host);
+		return false;
+	}
+
+	memcpy(address, found->ai_addr, found->ai_addrlen);
+	addressLength = (int)found->ai_addrlen;
+	freeaddrinfo(found);
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(sock == WM_BAD_SOCKET)
+		return false;
+
+	devices = deviceCount < 1 ? 1 : (deviceCount > WM_NET_MAX_DEVICES ? WM_NET_MAX_DEVICES : deviceCount);
+	return true;
+}
+
+void CStateSender::Close()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(sock == WM_BAD_SOCKET)
+		return;
+
+	FlushLocked();
+	closesocket(sock);
+	sock = WM_BAD_SOCKET;
+}
+
+bool CStateSender::IsOpen() const
+{
+	return sock != WM_BAD_SOCKET;
+}
+
+/* Add a device's latest state to the batch. The batch goes out once every
+device has a frame in it, when a device comes round again, or once the
+oldest frame has waited WM_NET_MAX_BATCH_NS. */
+void CStateSender::Queue(int device, const WM_SHARED_STATE *state)
+{
+	if(device < 0 || device >= WM_NET_MAX_DEVICES)
+		return;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if(sock == WM_BAD_SOCKET)
+		return;
+
+	WM_TIME now = WmNow();
+	if((pendingMask & (1u << device)) || length + WM_NET_MAX_FRAME > WM_NET_DATAGRAM)
+		FlushLocked();
+
+	WM_NET_QSTATE q;
+	NetQuantize(state, &q);
+
+	bool key = sinceKeyframe[device] == 0;
+	unsigned mask = 0;
+	for(int i = 0; i < WM_NET_FIELDS; i++)
+	{
+		if(key || q.value[i] != last[device].value[i])
+			mask |= 1u << i;
+	}
+
+	if(!frames)
+	{
+		datagram[0] = 'W';
+		datagram[1] = 'N';
+		datagram[2] = WM_NET_VERSION;
+		datagram[3] = 0;
+		length = 4;
+		batchStarted = now;
+	}
+
+	byte *p = datagram + length;
+	*p++ = (byte)device;
+	*p++ = key ? WM_NET_KEYFRAME : 0;
+	p = Put(p, ++sequence[device], 2);
+	/* The sample time in us: the low word always, the high word on keyframes */
+	WM_TIME sampleUs = state->time / WM_NS_PER_US;
+	p = Put(p, (unsigned)sampleUs, 4);
+	if(key)
+		p = Put(p, (unsigned)(sampleUs >> 32), 4);
+
+	/* LEB128 mask - usually a byte or two, since the low fields change most */
+	unsigned m = mask;
+	do
+	{
+		*p++ = (byte)((m & 0x7f) | (m > 0x7f ? 0x80 : 0));
+		m >>= 7;
+	} while(m);
+
+	for(int i = 0; i < WM_NET_FIELDS; i++)
+	{
+		if(mask & (1u << i))
+			p = Put(p, (unsigned)q.value[i], fieldSize[i]);
+	}
+
+	length = (int)(p - datagram);
+	frames++;
+	pendingMask |= 1u << device;
+	last[device] = q;
+	stats.frames++;
+	if(key)
+		stats.keyframes++;
+
+	if(++sinceKeyframe[device] >= WM_NET_KEYFRAME_INTERVAL)
+		sinceKeyframe[device] = 0;
+
+	if(frames >= devices || now - batchStarted >= WM_NET_MAX_BATCH_NS)
+		FlushLocked();
+}
+
+/* Send whatever is batched */
+void CStateSender::Flush()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	FlushLocked();
+}
+
+void CStateSender::FlushLocked()
+{
+	if(!frames || sock == WM_BAD_SOCKET)
+		return;
+
+	datagram[3] = (byte)frames;
+	if(sendto(sock, (const char *)datagram, length, 0, (const struct sockaddr *)address, addressLength) == length)
+	{
+		stats.datagrams++;
+		stats.bytes += length;
+	}
+
+	length = frames = 0;
+	pendingMask = 0;
+}
+
+/* Send a datagram as-is, outside the frame format */
+BOOL CStateSender::SendRaw(const void *data, int size)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(sock == WM_BAD_SOCKET)
+		return false;
+	return sendto(sock, (const char *)data, size, 0, (const struct sockaddr *)address, addressLength) == size;
+}
+
+void CStateSender::GetStats(WM_NET_STATS *out)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	*out = stats;
+}
+
+CStateReceiver::CStateReceiver(void)
+{
+	sock = WM_BAD_SOCKET;
+	memset(fields, 0, sizeof(fields));
+	memset(states, 0, sizeof(states));
+	memset(sequence, 0, sizeof(sequence));
+	memset(seen, 0, sizeof(seen));
+	memset(synced, 0, sizeof(synced));
+	memset(sampleUs, 0, sizeof(sampleUs));
+	memset(&stats, 0, sizeof(stats));
+}
+
+CStateReceiver::~CStateReceiver(void)
+{
+	Close();
+}
+
+/* Listen on port, all interfaces */
+BOOL CStateReceiver::Open(int port)
+{
+	if(!NetStartup())
+		return false;
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(sock == WM_BAD_SOCKET)
+		return false;
+
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons((unsigned short)port);
+
+	if(bind(sock, (struct sockaddr *)&local, sizeof(local)) != 0)
+	{
+		printf("Couldn't listen on UDP port %d\n", port);
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void CStateReceiver::Close()
+{
+	if(sock != WM_BAD_SOCKET)
+		closesocket(sock);
+	sock = WM_BAD_SOCKET;
+}
+
+/* Wait up to timeoutMs for a datagram and decode it.
+Returns the number of frames in it, 0 on timeout, -1 on error. */
+int CStateReceiver::Receive(int timeoutMs)
+{
+	byte buffer[WM_NET_DATAGRAM];
+	int got = ReceiveRaw(buffer, sizeof(buffer), timeoutMs);
+	if(got <= 0)
+		return got;
+
+	return Decode(buffer, got);
+}
+
+/* Wait up to timeoutMs for a datagram and copy it out undecoded.
+Returns its length, 0 on timeout, -1 on error. */
+int CStateReceiver::ReceiveRaw(void *buffer, int size, int timeoutMs)
+{
+	if(sock == WM_BAD_SOCKET)
+		return -1;
+
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(sock, &readable);
+
+	struct timeval tv;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = (timeoutMs % 1000) * 1000;
+
+	int ready = select((int)sock + 1, &readable, NULL, NULL, timeoutMs < 0 ? NULL : &tv);
+	if(ready < 0)
+		return -1;
+	if(ready == 0)
+		return 0;
+
+	int got = (int)recv(sock, (char *)buffer, size, 0);
+	return got > 0 ? got : -1;
+}
+
+/* Apply one datagram. Returns frames applied, or -1 if it didn't parse. */
+int CStateReceiver::Decode(const byte *datagram, int length)
+{
+	if(length < 4 || datagram[0] != 'W' || datagram[1] != 'N' || datagram[2] != WM_NET_VERSION)
+	{
+		stats.malformed++;
+		return -1;
+	}
+
+	stats.datagrams++;
+	stats.bytes += length;
+
+	int count = datagram[3];
+	const byte *p = datagram + 4;
+	const byte *end = datagram + length;
+
+	for(int f = 0; f < count; f++)
+	{
+		if(end - p < 8)
+		{
+			stats.malformed++;
+			return -1;
+		}
+
+		int device = p[0];
+		bool key = (p[1] & WM_NET_KEYFRAME) != 0;
+		unsigned short seq = (unsigned short)Get(p + 2, 2, false);
+		unsigned low = (unsigned)Get(p + 4, 4, false);
+		p += 8;
+
+		unsigned high = 0;
+		if(key)
+		{
+			if(end - p < 4)
+			{
+				stats.malformed++;
+				return -1;
+			}
+			high = (unsigned)Get(p, 4, false);
+			p += 4;
+		}
+
+		unsigned mask = 0;
+		for(int shift = 0; ; shift += 7)
+		{
+			if(p >= end || shift > 28)
+			{
+				stats.malformed++;
+				return -1;
+			}
+			mask |= (unsigned)(*p & 0x7f) << shift;
+			if(!(*p++ & 0x80))
+				break;
+		}
+
+		if(device >= WM_NET_MAX_DEVICES)
+		{
+			stats.malformed++;
+			return -1;
+		}
+
+		/* A keyframe brings the whole time; in between, the low word is
+		taken as the time nearest the last, so it survives wrapping */
+		WM_TIME at = key ? ((WM_TIME)high << 32) | low
+			: sampleUs[device] + (WM_TIME)(long long)(int)(low - (unsigned)sampleUs[device]);
+
+		WM_NET_QSTATE &q = fields[device];
+		for(int i = 0; i < WM_NET_FIELDS; i++)
+		{
+			if(!(mask & (1u << i)))
+				continue;
+			if(end - p < fieldSize[i])
+			{
+				stats.malformed++;
+				return -1;
+			}
+			q.value[i] = Get(p, fieldSize[i], Signed(i));
+			p += fieldSize[i];
+		}
+
+		/* A gap means some changes never arrived; state is suspect until the next keyframe */
+		if(seen[device] && seq != (unsigned short)(sequence[device] + 1))
+		{
+			stats.lost += (unsigned short)(seq - sequence[device] - 1);
+			synced[device] = false;
+		}
+		if(key)
+		{
+			synced[device] = true;
+			stats.keyframes++;
+		}
+
+		seen[device] = true;
+		sequence[device] = seq;
+		stats.frames++;
+
+		NetExpand(&q, &states[device]);
+		sampleUs[device] = at;
+		states[device].time = at * WM_NS_PER_US;
+		states[device].report++;
+	}
+
+	return count;
+}
+
+/* Latest state for a device. Fails if nothing has arrived for it yet. */
+BOOL CStateReceiver::GetState(int device, WM_SHARED_STATE *out, unsigned short *seq)
+{
+	if(device < 0 || device >= WM_NET_MAX_DEVICES || !seen[device])
+		return false;
+
+	*out = states[device];
+	if(seq)
+		*seq = sequence[device];
+	return true;
+}
+
+/* Has the device had a keyframe, with nothing lost since? */
+bool CStateReceiver::Synced(int device) const
+{
+	return device >= 0 && device < WM_NET_MAX_DEVICES && synced[device];
+}
+
+void CStateReceiver::GetStats(WM_NET_STATS *out) const
+{
+	*out = stats;
+}
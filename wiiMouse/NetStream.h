@@ -0,0 +1,131 @@
+/*************************
+NetStream.h
+
+Mote state over UDP, for machines other than the one the motes are paired to.
+
+Each datagram batches one frame per device. A frame carries only the fields
+that changed since the last frame sent for that device, quantized to fixed
+point; a keyframe with every field goes out every WM_NET_KEYFRAME_INTERVAL
+frames (and first), so a receiver joining late or losing a datagram is back
+in step within a second.
+
+Datagram (little-endian):
+	'W' 'N' version count
+	count frames of:
+		device, flags (WM_NET_KEYFRAME), sequence (16 bits, per device),
+		sample time (low 32 bits of WM_SHARED_STATE::time in us, then on
+		keyframes the high 32 bits), field mask (LEB128 varint),
+		then each field whose bit is set, in bit order:
+	bit 0      buttons, 16 bits
+	bit 1      nunchuk buttons, 8 bits
+	bit 2      flags, 8 bits
+	bit 3      battery, 8 bits
+	bits 4-6   force x/y/z, signed 16 bits in mG
+	bits 7-9   tilt x/y/z, signed 16 bits in 0.01 degrees
+	bits 10-12 nunchuk force, as force
+	bits 13-15 nunchuk tilt, as tilt
+	bits 16-17 stick x/y, signed 8 bits in 1/127
+	bits 18-21 IR point 0-3, 32 bits: x (10), y (10), size (4), visible (1)
+
+CStateReceiver is the receiver library; it rebuilds a WM_SHARED_STATE per
+device, time included, so it reads on the sender's clock.
+**************************/
+
+#pragma once
+
+#include <mutex>
+#include "Timing.h"
+#include "SharedState.h"
+
+#define WM_NET_PORT 4710 /* default UDP port */
+#define WM_NET_VERSION 2
+#define WM_NET_MAX_DEVICES 16
+#define WM_NET_KEYFRAME_INTERVAL 100 /* frames, one second at 100 Hz */
+#define WM_NET_MAX_BATCH_NS (4 * WM_NS_PER_MS) /* longest a frame waits for the rest of its batch */
+#define WM_NET_DATAGRAM 1400 /* stays under a typical MTU */
+#define WM_NET_FIELDS 22
+
+#define WM_NET_KEYFRAME 0x01
+
+#ifdef _WIN32
+typedef UINT_PTR WM_SOCKET;
+#else
+typedef int WM_SOCKET;
+#endif
+
+/* Quantized copy of a state, one value per field bit */
+struct WM_NET_QSTATE {
+	int value[WM_NET_FIELDS];
+};
+
+struct WM_NET_STATS {
+	unsigned long long datagrams;
+	unsigned long long frames;
+	unsigned long long keyframes;
+	unsigned long long bytes;
+	unsigned long long lost; /* receiver: frames missing from the sequence */
+	unsigned long long malformed; /* receiver: datagrams that didn't parse */
+};
+
+class CStateSender
+{
+public:
+	CStateSender(void);
+	~CStateSender(void);
+	BOOL Open(const char *host, int port, int devices = 1);
+	void Close();
+	bool IsOpen() const;
+	void Queue(int device, const WM_SHARED_STATE *state);
+	void Flush();
+	BOOL SendRaw(const void *data, int length);
+	void GetStats(WM_NET_STATS *out);
+private:
+	void FlushLocked();
+
+	std::mutex lock; /* several read loops can share one sender */
+	WM_SOCKET sock;
+	byte address[32]; /* sockaddr_in, kept opaque here */
+	int addressLength;
+	int devices;
+
+	byte datagram[WM_NET_DATAGRAM];
+	int length;
+	int frames;
+	unsigned pendingMask; /* devices in the datagram being built */
+	WM_TIME batchStarted;
+
+	/* Per device */
+	WM_NET_QSTATE last[WM_NET_MAX_DEVICES];
+	unsigned short sequence[WM_NET_MAX_DEVICES];
+	int sinceKeyframe[WM_NET_MAX_DEVICES];
+
+	WM_NET_STATS stats;
+};
+
+class CStateReceiver
+{
+public:
+	CStateReceiver(void);
+	~CStateReceiver(void);
+	BOOL Open(int port);
+	void Close();
+	int Receive(int timeoutMs);
+	int ReceiveRaw(void *buffer, int size, int timeoutMs);
+	int Decode(const byte *datagram, int length);
+	BOOL GetState(int device, WM_SHARED_STATE *out, unsigned short *sequence = NULL);
+	bool Synced(int device) const;
+	void GetStats(WM_NET_STATS *out) const;
+private:
+	WM_SOCKET sock;
+	WM_NET_QSTATE fields[WM_NET_MAX_DEVICES];
+	WM_SHARED_STATE states[WM_NET_MAX_DEVICES];
+	unsigned short sequence[WM_NET_MAX_DEVICES];
+	bool seen[WM_NET_MAX_DEVICES];
+	bool synced[WM_NET_MAX_DEVICES]; /* had a keyframe and nothing lost since */
+	WM_TIME sampleUs[WM_NET_MAX_DEVICES]; /* last frame's sample time, to unwrap the next one's low word against */
+	WM_NET_STATS stats;
+};
+
+/* Fixed-point conversions shared by both ends */
+void NetQuantize(const WM_SHARED_STATE *state, WM_NET_QSTATE *out);
+void NetExpand(const WM_NET_QSTATE *fields, WM_SHARED_STATE *out);
@@ -0,0 +1,396 @@
+/*************************
+OutputQueue.cpp
+
+Desired-state output writer. See OutputQueue.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+#include <chrono>
+
+COutputQueue::COutputQueue(CHidDevice *device, CReportStats *counters)
+{
+	hid = device;
+	stats = counters;
+	running = stopping = false;
+	minInterval = WM_OUTPUT_MIN_INTERVAL;
+	nextWrite = 0;
+	writes = 0;
+
+	leds = sentLeds = WM_LED_NONE;
+	rumble = sentRumble = false;
+	mode = sentMode = 0;
+	continuous = sentContinuous = WM_MODE_NONCONT;
+	ledsRequested = false;
+	stateKnown = false;
+	modeKnown = false;
+
+	head = count = 0;
+
+	audioPos = 0;
+	audioPeriod = audioNext = 0;
+	audioReports = audioUnderruns = 0;
+	audioLateSum = audioLateMax = 0;
+}
+
+COutputQueue::~COutputQueue(void)
+{
+	Stop();
+}
+
+/* Length of an output report, including the report ID */
+int COutputQueue::ReportSize(byte reportId)
+{
+	switch(reportId)
+	{
+	case WM_OUT_REPORT_TYPE:
+		return 3;
+	case WM_OUT_WRITE_DATA:
+	case WM_OUT_SPKR_DATA:
+		return WM_PACKET_SIZE;
+	case WM_OUT_READ_DATA:
+		return 7;
+	default:
+		/* LEDs, IR, speaker enable/mute and status are all one byte of payload */
+		return 2;
+	}
+}
+
+/* Hand writing over to the writer thread */
+void COutputQueue::Start()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(running)
+		return;
+	running = true;
+	stopping = false;
+	writer = std::thread(&COutputQueue::Run, this);
+}
+
+/* Send whatever is still pending, then stop the writer thread */
+void COutputQueue::Stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(!running)
+			return;
+		stopping = true;
+		audio.clear();
+		audioPos = 0;
+	}
+	wake.notify_all();
+	writer.join();
+
+	std::lock_guard<std::mutex> guard(lock);
+	running = false;
+}
+
+void COutputQueue::SetMinInterval(WM_TIME interval)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	minInterval = interval;
+}
+
+unsigned long long COutputQueue::Writes() const
+{
+	return writes;
+}
+
+/* The setters return false only if an inline write failed */
+BOOL COutputQueue::SetLeds(byte mask)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(ledsRequested && mask == leds && stateKnown)
+			return true;
+		leds = mask;
+		ledsRequested = true;
+		stateKnown = false;
+	}
+	return Pump();
+}
+
+BOOL COutputQueue::SetRumble(bool on)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(on == rumble)
+			return true;
+		rumble = on;
+	}
+	return Pump();
+}
+
+BOOL COutputQueue::SetReportMode(byte reportMode, byte cont)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(reportMode == mode && cont == continuous && modeKnown)
+			return true;
+		mode = reportMode;
+		continuous = cont;
+		modeKnown = false;
+	}
+	return Pump();
+}
+
+/* Queue a report that has to go out exactly as written, in order.
+Returns false if the queue is full, or if an inline write failed. */
+BOOL COutputQueue::Submit(const byte *report, int length)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(count == WM_OUTPUT_FIFO)
+			return false;
+
+		int slot = (head + count) % WM_OUTPUT_FIFO;
+		memset(fifo[slot], 0, WM_PACKET_SIZE);
+		memcpy(fifo[slot], report, length > WM_PACKET_SIZE ? WM_PACKET_SIZE : length);
+		fifoLength[slot] = length;
+		count++;
+	}
+	return Pump();
+}
+
+/* Stream ADPCM audio to the speaker as 0x18 reports, one every period, starting now.
+Replaces any clip already playing. Needs the writer thread, so fails before Start(). */
+BOOL COutputQueue::PlayAudio(const byte *adpcm, int length, WM_TIME period)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(!running || stopping || length <= 0 || !period)
+			return false;
+
+		audio.assign(adpcm, adpcm + length);
+		audioPos = 0;
+		audioPeriod = period;
+		audioNext = WmNow();
+		audioReports = audioUnderruns = 0;
+		audioLateSum = audioLateMax = 0;
+	}
+	wake.notify_one();
+	return true;
+}
+
+void COutputQueue::StopAudio()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	audio.clear();
+	audioPos = 0;
+}
+
+bool COutputQueue::AudioPlaying()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return audioPos < audio.size();
+}
+
+/* How the current (or last) clip's reports kept to their schedule */
+void COutputQueue::GetAudioStats(WM_AUDIO_STATS *out)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	out->reports = audioReports;
+	out->underruns = audioUnderruns;
+	out->meanLate = audioReports ? audioLateSum / audioReports : 0;
+	out->maxLate = audioLateMax;
+}
+
+/* Before Start(), write everything pending right here. Afterwards just wake the writer. */
+BOOL COutputQueue::Pump()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	if(running)
+	{
+		guard.unlock();
+		wake.notify_one();
+		return true;
+	}
+
+	BOOL success = true;
+	byte report[WM_PACKET_SIZE];
+	int length;
+	while(NextReport(report, &length))
+	{
+		guard.unlock();
+		success = Write(report, length);
+		guard.lock();
+	}
+	return success;
+}
+
+/* Is anything waiting to go out? Called with the lock held. */
+bool COutputQueue::Pending() const
+{
+	return count
+		|| (mode && !modeKnown)
+		|| (ledsRequested && (!stateKnown || leds != sentLeds))
+		|| rumble != sentRumble;
+}
+
+/* Pick the next report to send and mark it as sent. Called with the lock held.
+One-shot reports keep their order and go first, then the report mode, then LEDs.
+The current rumble bit goes on every report, so a rumble change needs its own
+0x11 only when nothing else is going out. */
+bool COutputQueue::NextReport(byte *report, int *length)
+{
+	if(!Pending())
+		return false;
+
+	if(count)
+	{
+		memcpy(report, fifo[head], WM_PACKET_SIZE);
+		*length = fifoLength[head];
+		head = (head + 1) % WM_OUTPUT_FIFO;
+		count--;
+	}
+	else if(mode && !modeKnown)
+	{
+		report[0] = WM_OUT_REPORT_TYPE;
+		report[1] = continuous;
+		report[2] = mode;
+		*length = ReportSize(WM_OUT_REPORT_TYPE);
+		sentMode = mode;
+		sentContinuous = continuous;
+		modeKnown = true;
+	}
+	else
+	{
+		report[0] = WM_OUT_LEDFF;
+		report[1] = leds;
+		*length = ReportSize(WM_OUT_LEDFF);
+		sentLeds = leds;
+		stateKnown = true;
+	}
+
+	if(rumble)
+		report[1] |= WM_OUT_RUMBLE;
+	else
+		report[1] &= ~WM_OUT_RUMBLE;
+	sentRumble = rumble;
+
+	return true;
+}
+
+/* Build the next 0x18 report from the clip and move its deadline on by one period.
+A report more than a period late counts as an underrun, and the schedule restarts
+from now rather than bursting to catch up. Called with the lock held. */
+void COutputQueue::NextAudioReport(byte *report, int *length, WM_TIME now)
+{
+	WM_TIME late = now - audioNext;
+	if(late > audioPeriod)
+	{
+		audioUnderruns++;
+		audioNext = now;
+	}
+	audioReports++;
+	audioLateSum += late;
+	if(late > audioLateMax)
+		audioLateMax = late;
+
+	size_t chunk = audio.size() - audioPos;
+	if(chunk > WM_SPKR_BYTES)
+		chunk = WM_SPKR_BYTES;
+
+	memset(report, 0, WM_PACKET_SIZE);
+	report[0] = WM_OUT_SPKR_DATA;
+	report[1] = (byte)(chunk << 3);
+	memcpy(report + 2, &audio[audioPos], chunk);
+	*length = ReportSize(WM_OUT_SPKR_DATA);
+	audioPos += chunk;
+	audioNext += audioPeriod;
+
+	if(rumble)
+		report[1] |= WM_OUT_RUMBLE;
+	sentRumble = rumble;
+}
+
+/* Gap kept between an audio report and any other write, so a slow write can't
+make audio late. Never more than a third of the audio period, so other
+reports always get a window. */
+WM_TIME COutputQueue::AudioSpacing() const
+{
+	return minInterval < audioPeriod / 3 ? minInterval : audioPeriod / 3;
+}
+
+/* Write one report, counting failures. A failed state report is marked
+unknown so the writer tries again. */
+BOOL COutputQueue::Write(byte *report, int length)
+{
+	WM_TRACE_BEGIN(write);
+	BOOL success = hid->Write(report, length);
+	WM_TRACE_END(write, report[0], length);
+
+	if(success)
+		writes++;
+	else
+	{
+		stats->OnWriteError();
+
+		std::lock_guard<std::mutex> guard(lock);
+		if(report[0] == WM_OUT_LEDFF)
+			stateKnown = false;
+		else if(report[0] == WM_OUT_REPORT_TYPE)
+			modeKnown = false;
+		sentRumble = !rumble;
+	}
+
+	return success;
+}
+
+/* Writer thread - send pending reports no faster than minInterval */
+void COutputQueue::Run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	byte report[WM_PACKET_SIZE];
+	int length;
+
+	for(;;)
+	{
+		WM_TIME now = WmNow();
+		bool streaming = audioPos < audio.size();
+
+		/* Audio goes out on its own clock, ahead of anything else */
+		if(streaming && now >= audioNext)
+		{
+			NextAudioReport(report, &length, now);
+			guard.unlock();
+			Write(report, length);
+			guard.lock();
+
+			nextWrite = WmNow() + AudioSpacing();
+			continue;
+		}
+
+		if(!Pending())
+		{
+			if(streaming)
+				wake.wait_for(guard, std::chrono::nanoseconds(audioNext - now));
+			else if(stopping)
+				break;
+			else
+				wake.wait(guard);
+			continue;
+		}
+
+		/* Hold other reports back if they would finish too close to the next audio report */
+		WM_TIME start = now > nextWrite ? now : nextWrite;
+		if(streaming && start + AudioSpacing() > audioNext)
+		{
+			wake.wait_for(guard, std::chrono::nanoseconds(audioNext - now));
+			continue;
+		}
+
+		if(now < nextWrite)
+		{
+			wake.wait_for(guard, std::chrono::nanoseconds(nextWrite - now));
+			continue;
+		}
+
+		NextReport(report, &length);
+		guard.unlock();
+		Write(report, length);
+		guard.lock();
+
+		nextWrite = WmNow() + minInterval;
+	}
+}
@@ -0,0 +1,116 @@
+/*************************
+OutputQueue.h
+
+Output reports to the mote, kept as desired state and flushed by a writer thread.
+
+LEDs, rumble and the report mode are state: setting them records what the mote
+should look like, and the writer sends whatever differs from what the mote was
+last told. LEDs and rumble share one 0x11 report, and a rumble change rides on
+whatever report goes out next. Requests that must go out as written, in order
+(status requests, memory reads and writes), are queued as one-shot reports.
+Writes are spaced at least minInterval apart so bursts of changes collapse
+instead of flooding the link, and each report goes out at its real length.
+
+Speaker audio is a stream rather than state: PlayAudio() hands over a whole
+clip, and the writer sends it as 0x18 reports on a fixed clock. Audio goes out
+the moment it is due whatever else is waiting, and other reports are only
+started when they can't push the next audio report late.
+
+Before Start() everything is written inline on the caller's thread, which is
+what the request/response handshake in CWiimote::Initialize() needs.
+**************************/
+
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "Timing.h"
+
+/* One-shot reports that can be waiting at once */
+#define WM_OUTPUT_FIFO 32
+
+/* Default spacing between output reports */
+#define WM_OUTPUT_MIN_INTERVAL (5 * WM_NS_PER_MS)
+
+class CHidDevice;
+class CReportStats;
+
+struct WM_AUDIO_STATS {
+	unsigned long long reports; /* 0x18 reports sent for the current clip */
+	unsigned long long underruns; /* reports sent more than a period late */
+	WM_TIME meanLate; /* how far behind schedule reports went out */
+	WM_TIME maxLate;
+};
+
+class COutputQueue
+{
+public:
+	COutputQueue(CHidDevice *hid, CReportStats *stats);
+	~COutputQueue(void);
+	void Start();
+	void Stop();
+	BOOL SetLeds(byte mask);
+	BOOL SetRumble(bool on);
+	BOOL SetReportMode(byte mode, byte continuous);
+	BOOL Submit(const byte *report, int length);
+	BOOL PlayAudio(const byte *adpcm, int length, WM_TIME period);
+	void StopAudio();
+	bool AudioPlaying();
+	void GetAudioStats(WM_AUDIO_STATS *out);
+	void SetMinInterval(WM_TIME interval);
+	unsigned long long Writes() const;
+	static int ReportSize(byte reportId);
+private:
+	void Run();
+	bool Pending() const;
+	bool NextReport(byte *report, int *length);
+	void NextAudioReport(byte *report, int *length, WM_TIME now);
+	WM_TIME AudioSpacing() const;
+	BOOL Pump();
+	BOOL Write(byte *report, int length);
+
+	CHidDevice *hid;
+	CReportStats *stats;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread writer;
+	bool running;
+	bool stopping;
+	WM_TIME minInterval;
+	WM_TIME nextWrite;
+	std::atomic<unsigned long long> writes;
+
+	/* What the mote should look like */
+	byte leds;
+	bool rumble;
+	byte mode;
+	byte continuous;
+
+	/* What it was last told */
+	byte sentLeds;
+	bool sentRumble;
+	byte sentMode;
+	byte sentContinuous;
+	bool ledsRequested; /* nobody has set the LEDs yet, so leave them alone */
+	bool stateKnown; /* sentLeds matches the mote */
+	bool modeKnown; /* sentMode matches the mote */
+
+	/* One-shot reports, oldest at head */
+	byte fifo[WM_OUTPUT_FIFO][WM_PACKET_SIZE];
+	int fifoLength[WM_OUTPUT_FIFO];
+	int head;
+	int count;
+
+	/* Speaker audio being streamed */
+	std::vector<byte> audio;
+	size_t audioPos;
+	WM_TIME audioPeriod;
+	WM_TIME audioNext; /* when the next 0x18 report is due */
+	unsigned long long audioReports;
+	unsigned long long audioUnderruns;
+	WM_TIME audioLateSum;
+	WM_TIME audioLateMax;
+};
@@ -0,0 +1,164 @@
+/*************************
+PointerScheduler.cpp
+
+Spreading pointer motion over output ticks. See PointerScheduler.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#include <math.h>
+#include <float.h>
+
+CPointerScheduler::CPointerScheduler(void)
+{
+	Defaults(&config);
+	tickPeriod = WM_NS_PER_SEC / WM_SCHED_RATE;
+	Reset();
+}
+
+/* Off, with the rate and span it would use if switched on */
+void CPointerScheduler::Defaults(WM_SCHED_CONFIG *defaults)
+{
+	defaults->mode = WM_SCHED_OFF;
+	defaults->rate = WM_SCHED_RATE;
+	defaults->span = 0;
+}
+
+void CPointerScheduler::Configure(const WM_SCHED_CONFIG *newConfig)
+{
+	config = *newConfig;
+	if(config.rate < 1)
+		config.rate = 1;
+	if(config.rate > WM_SCHED_MAX_RATE)
+		config.rate = WM_SCHED_MAX_RATE;
+	tickPeriod = WM_NS_PER_SEC / config.rate;
+	Reset();
+}
+
+bool CPointerScheduler::Enabled() const
+{
+	return config.mode != WM_SCHED_OFF;
+}
+
+/* Forget any motion not sent yet */
+void CPointerScheduler::Reset()
+{
+	nextTick = 0;
+	started = false;
+	span = config.span ? config.span : WM_REPORT_PERIOD_NS;
+	times[0] = times[1] = 0;
+	memset(position, 0, sizeof(position));
+	sent[0] = sent[1] = 0;
+}
+
+/* A report sampled at sample moved the pointer by dx, dy. period is the
+report period as the sample clock has it. Motion that isn't a finite number
+is dropped, since the running position would never recover from it. */
+void CPointerScheduler::Add(WM_TIME sample, WM_TIME period, float dx, float dy)
+{
+	if(!(fabs(dx) <= FLT_MAX && fabs(dy) <= FLT_MAX))
+		return;
+
+	if(!config.span && period)
+		span = period;
+
+	/* Keep the numbers small: only differences from sent matter */
+	for(int axis = 0; axis < 2; axis++)
+	{
+		double whole = floor(sent[axis]);
+		sent[axis] -= whole;
+		position[0][axis] -= whole;
+		position[1][axis] -= whole;
+	}
+
+	if(started && sample <= times[1])
+	{
+		/* No time between them to spread over: it's part of the last one */
+		position[1][0] += dx;
+		position[1][1] += dy;
+	}
+	else
+	{
+		/* After a pause the line starts at the position the pointer was
+		left at, one period before this report, rather than reaching back
+		across the whole pause */
+		bool restart = !started || sample - times[1] > WM_SCHED_RESTART_PERIODS * span;
+		times[0] = restart ? sample - span : times[1];
+		position[0][0] = position[1][0];
+		position[0][1] = position[1][1];
+		times[1] = sample;
+		position[1][0] += dx;
+		position[1][1] += dy;
+		started = true;
+	}
+
+	/* Tick as soon as the loop gets to it, then every tickPeriod from there */
+	if(!nextTick && (dx || dy || fabs(position[1][0] - sent[0]) >= 1 || fabs(position[1][1] - sent[1]) >= 1))
+		nextTick = sample;
+}
+
+/* When Tick() next has something to send, or 0 for not until more motion is added */
+WM_TIME CPointerScheduler::NextTick() const
+{
+	return Enabled() ? nextTick : 0;
+}
+
+/* Where the pointer should be on axis at time at */
+double CPointerScheduler::Target(int axis, WM_TIME at) const
+{
+	WM_TIME point = at;
+	if(config.mode == WM_SCHED_INTERPOLATE)
+		point = at > span ? at - span : 0;
+
+	if(point <= times[0])
+		return position[0][axis];
+	if(point <= times[1])
+		return position[0][axis] + (position[1][axis] - position[0][axis]) * (double)(point - times[0]) / (times[1] - times[0]);
+	if(config.mode != WM_SCHED_EXTRAPOLATE)
+		return position[1][axis];
+
+	WM_TIME ahead = point - times[1] < span ? point - times[1] : span;
+	double speed = (position[1][axis] - position[0][axis]) / (times[1] - times[0]);
+	return position[1][axis] + speed * ahead;
+}
+
+/* If a tick is due by now, the whole counts owed on each axis go in dx and
+dy. Returns true if there is any motion to send. */
+bool CPointerScheduler::Tick(WM_TIME now, int *dx, int *dy)
+{
+	*dx = *dy = 0;
+	if(!Enabled() || !nextTick || now < nextTick)
+		return false;
+
+	double owed[2];
+	int counts[2];
+	for(int axis = 0; axis < 2; axis++)
+	{
+		owed[axis] = Target(axis, now) - sent[axis];
+		if(!(fabs(owed[axis]) <= DBL_MAX))
+		{
+			/* Nothing sane to send; drop the line rather than tick on it forever */
+			Reset();
+			return false;
+		}
+		double clamped = owed[axis] > WM_SCHED_MAX_COUNTS ? WM_SCHED_MAX_COUNTS : owed[axis] < -WM_SCHED_MAX_COUNTS ? -WM_SCHED_MAX_COUNTS : owed[axis];
+		counts[axis] = (int)clamped;
+		sent[axis] += counts[axis];
+	}
+	*dx = counts[0];
+	*dy = counts[1];
+
+	/* Done once the line has run out and less than a count is left */
+	WM_TIME end = times[1] + span;
+	if(now >= end && fabs(owed[0] - counts[0]) < 1 && fabs(owed[1] - counts[1]) < 1)
+		nextTick = 0;
+	else
+	{
+		nextTick += tickPeriod;
+		if(nextTick <= now)
+			nextTick = now + tickPeriod;
+	}
+
+	return counts[0] || counts[1];
+}
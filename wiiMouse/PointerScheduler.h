@@ -0,0 +1,71 @@
+/*************************
+PointerScheduler.h
+
+Pointer motion on a clock of its own. The mote reports at 100 Hz, so moving
+the pointer once per report shows as steps on a faster display. With a
+schedule, MapReport() hands each report's motion to CPointerScheduler
+instead of sending it, and DebugLoop() sends whatever is due on every output
+tick, several times per report. Buttons, keys and the wheel still go out the
+moment their report is mapped.
+
+Each report's motion is added to a running position stamped with the
+report's sample time (see SampleClock.h), and a tick sends the difference
+between where the pointer should be by then and where it has been sent:
+	WM_SCHED_INTERPOLATE	draws straight lines between the last two
+				positions, span behind the ticks. Smooth, span late.
+	WM_SCHED_EXTRAPOLATE	runs on from the last position at the last
+				report's speed, for at most span. On time at steady
+				speed, but overshoots by up to span's worth when the
+				pointer stops or turns, and takes it back on the next
+				report.
+span is one report period unless set. Fractions of a count are carried to
+the next tick rather than dropped, so slow motion adds up. Once the pointer
+has arrived the ticks stop, and they start again with the next motion, so a
+still pointer costs no wakeups.
+
+CCaptureAnalyzer::Smoothness() replays captures through a schedule to
+measure how much it smooths and how much it delays (see Analytics.h).
+**************************/
+
+#pragma once
+
+#include "Timing.h"
+
+#define WM_SCHED_OFF 0 /* the pointer moves with each report, as it always has */
+#define WM_SCHED_INTERPOLATE 1
+#define WM_SCHED_EXTRAPOLATE 2
+
+#define WM_SCHED_RATE 240 /* default ticks per second, for 240 Hz displays */
+#define WM_SCHED_MAX_RATE 2000
+#define WM_SCHED_RESTART_PERIODS 4 /* a report this many periods after the last starts the line over */
+#define WM_SCHED_MAX_COUNTS 32767 /* most one tick sends on an axis */
+
+struct WM_SCHED_CONFIG {
+	int mode; /* WM_SCHED_* */
+	int rate; /* output ticks per second */
+	WM_TIME span; /* how far behind or ahead, in ns; 0 for one report period */
+};
+
+class CPointerScheduler
+{
+public:
+	CPointerScheduler(void);
+	static void Defaults(WM_SCHED_CONFIG *config);
+	void Configure(const WM_SCHED_CONFIG *newConfig);
+	bool Enabled() const;
+	void Reset();
+	void Add(WM_TIME sample, WM_TIME period, float dx, float dy);
+	WM_TIME NextTick() const;
+	bool Tick(WM_TIME now, int *dx, int *dy);
+private:
+	double Target(int axis, WM_TIME at) const;
+
+	WM_SCHED_CONFIG config;
+	WM_TIME tickPeriod;
+	WM_TIME span; /* config.span, or the last report period */
+	WM_TIME nextTick; /* 0 while the pointer has arrived */
+	bool started; /* a report has been added since Reset() */
+	WM_TIME times[2]; /* sample times of the last two reports, older first */
+	double position[2][2]; /* [report][axis]: all the motion up to each */
+	double sent[2]; /* motion sent so far, per axis */
+};
@@ -0,0 +1,67 @@
+/*************************
+PosixCompat.h
+
+The Win32 type names, SendInput flags and virtual key codes that the shared
+code uses, for building on Linux. Only included when _WIN32 isn't defined.
+The flag and key values match winuser.h so mappings read the same on both.
+**************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <wchar.h>
+#include <stdint.h>
+#include <unistd.h>
+
+typedef int BOOL;
+typedef unsigned char byte;
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned short USHORT;
+typedef uint32_t DWORD;
+typedef unsigned int UINT;
+typedef unsigned long ULONG;
+typedef uintptr_t ULONG_PTR;
+typedef wchar_t WCHAR;
+typedef char _TCHAR;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define _tmain main
+#define _T(x) x
+#define _tcscmp strcmp
+#define _ttoi atoi
+#define _snprintf snprintf
+
+inline void Sleep(DWORD ms) { usleep((useconds_t)ms * 1000); }
+
+/* SendInput flags, translated to uinput events by CInputInjector */
+#define KEYEVENTF_KEYUP 0x0002
+#define MOUSEEVENTF_MOVE 0x0001
+#define MOUSEEVENTF_LEFTDOWN 0x0002
+#define MOUSEEVENTF_LEFTUP 0x0004
+#define MOUSEEVENTF_RIGHTDOWN 0x0008
+#define MOUSEEVENTF_RIGHTUP 0x0010
+#define MOUSEEVENTF_MIDDLEDOWN 0x0020
+#define MOUSEEVENTF_MIDDLEUP 0x0040
+#define MOUSEEVENTF_WHEEL 0x0800
+
+/* Virtual key codes. Letters and digits are their ASCII values, as on Windows. */
+#define VK_BACK 0x08
+#define VK_TAB 0x09
+#define VK_RETURN 0x0D
+#define VK_SHIFT 0x10
+#define VK_CONTROL 0x11
+#define VK_MENU 0x12
+#define VK_ESCAPE 0x1B
+#define VK_SPACE 0x20
+#define VK_LEFT 0x25
+#define VK_UP 0x26
+#define VK_RIGHT 0x27
+#define VK_DOWN 0x28
@@ -0,0 +1,623 @@
+/*************************
+Profile.cpp
+
+Mapping profile parser and watcher. See Profile.h for the file format.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+#include <float.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+/* The original DebugLoop() modes, indexed by WM_MY_* */
+static const char *builtinProfiles[WM_MY_MAX + 1] = {
+	/* WM_MY_MOUSE */
+	"# Tilt steers the pointer, A and B are the mouse buttons, the pad scrolls\n"
+	"pointer tilt.x 0.25 tilt.y 0.5\n"
+	"button down wheel -120\n"
+	"button up wheel 120\n"
+	"button a mouse left\n"
+	"button b mouse right\n",
+
+	/* WM_MY_EMU */
+	"# Held on its side: buttons and the pad become keys\n"
+	"button a key A\n"
+	"button b key B\n"
+	"button one key 1\n"
+	"button two key 2\n"
+	"button down key RIGHT\n"
+	"button up key LEFT\n"
+	"button left key DOWN\n"
+	"button right key UP\n",
+
+	/* WM_MY_FPS */
+	"# Nunchuk stick aims, nunchuk tilt walks, B shoots and A zooms\n"
+	"pointer chuk.stick.x 18 chuk.stick.y 18 deadzone 2\n"
+	"button a mouse right\n"
+	"button b mouse left\n"
+	"range chuk.tilt.x -90 -20 key A\n"
+	"range chuk.tilt.x 20 90 key D\n"
+	"range chuk.tilt.y 20 60 key W\n"
+	"range chuk.tilt.y -60 -20 key S\n"
+	"button chuk.z key SHIFT\n"
+	"button chuk.c key C\n"
+	"below chuk.force.z -2 key SPACE\n"
+	"button one key R\n"
+	"button two key F\n"
+	"button down key G\n"
+	"button up key E\n"
+	"button left key Q\n"
+	"button right key Q\n"
+	"below force.z -2 key G\n"
+};
+
+static const char *modeNames[WM_MY_MAX + 1] = { "mouse", "emu", "fps" };
+
+/* Indexed by WM_IN_* */
+static const char *inputNames[WM_IN_COUNT] = {
+	"a", "b", "one", "two", "up", "down", "left", "right", "chuk.c", "chuk.z",
+	"tilt.x", "tilt.y", "tilt.z", "force.x", "force.y", "force.z",
+	"chuk.tilt.x", "chuk.tilt.y", "chuk.tilt.z", "chuk.force.x", "chuk.force.y", "chuk.force.z",
+	"chuk.stick.x", "chuk.stick.y"
+};
+
+struct _keyname {
+	const char *name;
+	byte code;
+};
+
+static const _keyname keyNames[] = {
+	{ "SPACE", VK_SPACE }, { "SHIFT", VK_SHIFT }, { "CONTROL", VK_CONTROL }, { "ALT", VK_MENU },
+	{ "RETURN", VK_RETURN }, { "ESCAPE", VK_ESCAPE }, { "TAB", VK_TAB }, { "BACK", VK_BACK },
+	{ "LEFT", VK_LEFT }, { "RIGHT", VK_RIGHT }, { "UP", VK_UP }, { "DOWN", VK_DOWN }
+};
+
+static int InputByName(const char *word)
+{
+	for(int i = 0; i < WM_IN_COUNT; i++)
+		if(strcmp(word, inputNames[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* Letters and digits are their own virtual key codes */
+static int KeyByName(const char *word)
+{
+	if(word[0] && !word[1] && ((word[0] >= 'A' && word[0] <= 'Z') || (word[0] >= '0' && word[0] <= '9')))
+		return word[0];
+
+	for(int i = 0; i < (int)(sizeof(keyNames) / sizeof(keyNames[0])); i++)
+		if(strcmp(word, keyNames[i].name) == 0)
+			return keyNames[i].code;
+
+	char *end;
+	long code = strtol(word, &end, 16);
+	if(word[0] == '0' && word[1] == 'x' && !*end && code > 0 && code < 0xff)
+		return (int)code;
+	return -1;
+}
+
+static bool ParseNumber(const char *word, float *out)
+{
+	char *end;
+	double value = strtod(word, &end);
+	if(!word[0] || *end)
+		return false;
+	*out = (float)value;
+	return true;
+}
+
+CProfile::CProfile(void)
+{
+	name[0] = error[0] = 0;
+	count = 0;
+	memset(&pointer, 0, sizeof(pointer));
+	derived = 0;
+}
+
+/* A fresh copy of the built-in profile for mode, or NULL for an unknown mode */
+CProfile *CProfile::Builtin(int mode)
+{
+	if(mode < 0 || mode > WM_MY_MAX)
+		return NULL;
+
+	CProfile *profile = new CProfile();
+	profile->Parse(builtinProfiles[mode], modeNames[mode]);
+	return profile;
+}
+
+const char *CProfile::ModeName(int mode)
+{
+	return mode >= 0 && mode <= WM_MY_MAX ? modeNames[mode] : "none";
+}
+
+/* The WM_DERIVE_* bit of one input */
+static unsigned DerivedInput(int source)
+{
+	if(source >= WM_IN_CHUK_STICK_X)
+		return WM_DERIVE_STICK;
+	if(source >= WM_IN_CHUK_FORCE_X)
+		return WM_DERIVE_CHUK_FORCE;
+	if(source >= WM_IN_CHUK_TILT_X)
+		return WM_DERIVE_CHUK_TILT;
+	if(source >= WM_IN_FORCE_X)
+		return WM_DERIVE_FORCE;
+	if(source >= WM_IN_TILT_X)
+		return WM_DERIVE_TILT;
+	return 0;
+}
+
+/* Replace the bindings with those in text. On failure Error() says which line
+was wrong and why, and the bindings are left empty. */
+BOOL CProfile::Parse(const char *text, const char *profileName)
+{
+	_snprintf(name, sizeof(name), "%s", profileName);
+	name[sizeof(name) - 1] = 0;
+	error[0] = 0;
+	count = 0;
+	memset(&pointer, 0, sizeof(pointer));
+	derived = 0;
+
+	int lineNumber = 0;
+	while(*text)
+	{
+		const char *end = strchr(text, '\n');
+		size_t length = end ? (size_t)(end - text) : strlen(text);
+
+		char line[256];
+		lineNumber++;
+		if(length >= sizeof(line))
+		{
+			_snprintf(error, sizeof(error), "line %d is too long", lineNumber);
+			count = 0;
+			return false;
+		}
+		memcpy(line, text, length);
+		line[length] = 0;
+
+		if(!ParseLine(line))
+		{
+			char reason[WM_PROFILE_ERROR];
+			strcpy(reason, error);
+			_snprintf(error, sizeof(error), "line %d: %.140s", lineNumber, reason);
+			error[sizeof(error) - 1] = 0;
+			count = 0;
+			memset(&pointer, 0, sizeof(pointer));
+			return false;
+		}
+
+		text += length;
+		if(*text)
+			text++;
+	}
+
+	if(pointer.enabled)
+		derived |= DerivedInput(pointer.sourceX) | DerivedInput(pointer.sourceY);
+	for(int i = 0; i < count; i++)
+		derived |= DerivedInput(bindings[i].source);
+	return true;
+}
+
+/* Parse the file at path. Profiles are small, so it is read whole. */
+BOOL CProfile::Load(const char *path, const char *profileName)
+{
+	FILE *file = fopen(path, "rb");
+	if(!file)
+	{
+		_snprintf(error, sizeof(error), "can't open %s", path);
+		return false;
+	}
+
+	char text[WM_PROFILE_BINDINGS * 64];
+	size_t length = fread(text, 1, sizeof(text) - 1, file);
+	bool tooLong = !feof(file);
+	fclose(file);
+	text[length] = 0;
+
+	if(tooLong)
+	{
+		_snprintf(error, sizeof(error), "%s is too long", path);
+		return false;
+	}
+	return Parse(text, profileName);
+}
+
+BOOL CProfile::ParseLine(char *line)
+{
+	char *hash = strchr(line, '#');
+	if(hash)
+		*hash = 0;
+
+	char *words[12];
+	int wordCount = 0;
+	/* Split in place. Not strtok, which the watcher and read loop threads would share. */
+	for(char *at = line; *at; )
+	{
+		while(*at == ' ' || *at == '\t' || *at == '\r')
+			*at++ = 0;
+		if(!*at)
+			break;
+		if(wordCount == 12)
+		{
+			_snprintf(error, sizeof(error), "too many words");
+			return false;
+		}
+		words[wordCount++] = at;
+		while(*at && *at != ' ' && *at != '\t' && *at != '\r')
+			at++;
+	}
+	if(!wordCount)
+		return true;
+
+	if(strcmp(words[0], "pointer") == 0)
+	{
+		WM_POINTER parsed;
+		parsed.enabled = true;
+		parsed.deadzone = 0;
+		parsed.sourceX = wordCount > 1 ? InputByName(words[1]) : -1;
+		parsed.sourceY = wordCount > 3 ? InputByName(words[3]) : -1;
+		if(wordCount != 5 && wordCount != 7)
+		{
+			_snprintf(error, sizeof(error), "pointer takes X SX Y SY [deadzone N]");
+			return false;
+		}
+		if(parsed.sourceX < WM_IN_BUTTONS || parsed.sourceY < WM_IN_BUTTONS
+			|| !ParseNumber(words[2], &parsed.scaleX) || !ParseNumber(words[4], &parsed.scaleY))
+		{
+			_snprintf(error, sizeof(error), "pointer needs two axes, each with a scale");
+			return false;
+		}
+		if(wordCount == 7)
+		{
+			float deadzone;
+			if(strcmp(words[5], "deadzone") != 0 || !ParseNumber(words[6], &deadzone) || deadzone < 0)
+			{
+				_snprintf(error, sizeof(error), "expected deadzone N after the pointer axes");
+				return false;
+			}
+			parsed.deadzone = (int)deadzone;
+		}
+		pointer = parsed;
+		return true;
+	}
+
+	if(count == WM_PROFILE_BINDINGS)
+	{
+		_snprintf(error, sizeof(error), "more than %d bindings", WM_PROFILE_BINDINGS);
+		return false;
+	}
+
+	WM_BINDING binding;
+	binding.source = wordCount > 1 ? InputByName(words[1]) : -1;
+	binding.low = -FLT_MAX;
+	binding.high = FLT_MAX;
+	int actionAt;
+
+	if(strcmp(words[0], "button") == 0)
+	{
+		if(binding.source < 0 || binding.source >= WM_IN_BUTTONS)
+		{
+			_snprintf(error, sizeof(error), "%s is not a button", wordCount > 1 ? words[1] : "nothing");
+			return false;
+		}
+		binding.low = 0.5f;
+		actionAt = 2;
+	}
+	else if(strcmp(words[0], "range") == 0 || strcmp(words[0], "below") == 0 || strcmp(words[0], "above") == 0)
+	{
+		if(binding.source < WM_IN_BUTTONS)
+		{
+			_snprintf(error, sizeof(error), "%s is not an axis", wordCount > 1 ? words[1] : "nothing");
+			return false;
+		}
+
+		bool parsed;
+		if(words[0][0] == 'r')
+		{
+			parsed = wordCount > 3 && ParseNumber(words[2], &binding.low) && ParseNumber(words[3], &binding.high)
+				&& binding.low < binding.high;
+			actionAt = 4;
+		}
+		else
+		{
+			parsed = wordCount > 2 && ParseNumber(words[2], words[0][0] == 'b' ? &binding.high : &binding.low);
+			actionAt = 3;
+		}
+		if(!parsed)
+		{
+			_snprintf(error, sizeof(error), "bad limits for %s", words[0]);
+			return false;
+		}
+	}
+	else
+	{
+		_snprintf(error, sizeof(error), "unknown binding %s", words[0]);
+		return false;
+	}
+
+	if(!ParseAction(words + actionAt, wordCount - actionAt, &binding))
+		return false;
+
+	bindings[count++] = binding;
+	return true;
+}
+
+BOOL CProfile::ParseAction(char **words, int wordCount, WM_BINDING *binding)
+{
+	binding->code = binding->amount = 0;
+
+	if(wordCount == 2 && strcmp(words[0], "key") == 0)
+	{
+		binding->action = WM_ACT_KEY;
+		binding->code = KeyByName(words[1]);
+		if(binding->code < 0)
+		{
+			_snprintf(error, sizeof(error), "unknown key %s", words[1]);
+			return false;
+		}
+		return true;
+	}
+
+	if(wordCount == 2 && strcmp(words[0], "mouse") == 0)
+	{
+		binding->action = WM_ACT_MOUSE;
+		if(strcmp(words[1], "left") == 0)
+			binding->code = MOUSEEVENTF_LEFTDOWN;
+		else if(strcmp(words[1], "right") == 0)
+			binding->code = MOUSEEVENTF_RIGHTDOWN;
+		else if(strcmp(words[1], "middle") == 0)
+			binding->code = MOUSEEVENTF_MIDDLEDOWN;
+		else
+		{
+			_snprintf(error, sizeof(error), "mouse button is left, right or middle");
+			return false;
+		}
+		return true;
+	}
+
+	float amount;
+	if(wordCount == 2 && strcmp(words[0], "wheel") == 0 && ParseNumber(words[1], &amount))
+	{
+		binding->action = WM_ACT_WHEEL;
+		binding->amount = (int)amount;
+		return true;
+	}
+
+	_snprintf(error, sizeof(error), "expected key NAME, mouse BUTTON or wheel N");
+	return false;
+}
+
+const char *CProfile::Name() const
+{
+	return name;
+}
+
+const char *CProfile::Error() const
+{
+	return error;
+}
+
+int CProfile::Count() const
+{
+	return count;
+}
+
+const WM_BINDING *CProfile::Binding(int index) const
+{
+	return &bindings[index];
+}
+
+const WM_POINTER *CProfile::Pointer() const
+{
+	return &pointer;
+}
+
+/* The WM_NEED_* bits of one input */
+static unsigned NeedsInput(int source)
+{
+	if(source == WM_IN_CHUK_C || source == WM_IN_CHUK_Z || source >= WM_IN_CHUK_TILT_X)
+		return WM_NEED_EXT;
+	if(source >= WM_IN_BUTTONS)
+		return WM_NEED_ACC;
+	return 0;
+}
+
+/* WM_DERIVE_* bits for everything the bindings and pointer read */
+unsigned CProfile::Derived() const
+{
+	return derived;
+}
+
+/* WM_NEED_* bits for everything the bindings and pointer read */
+unsigned CProfile::Needs() const
+{
+	unsigned needs = 0;
+
+	if(pointer.enabled)
+		needs |= NeedsInput(pointer.sourceX) | NeedsInput(pointer.sourceY) | WM_NEED_REPEAT;
+
+	for(int i = 0; i < count; i++)
+	{
+		needs |= NeedsInput(bindings[i].source);
+		if(bindings[i].action == WM_ACT_WHEEL)
+			needs |= WM_NEED_REPEAT;
+	}
+
+	return needs;
+}
+
+CProfileWatcher::CProfileWatcher(void)
+{
+	dir[0] = 0;
+	running = false;
+	for(int i = 0; i <= WM_MY_MAX; i++)
+	{
+		pending[i] = NULL;
+#ifdef _WIN32
+		modified[i] = 0;
+#endif
+	}
+#ifndef _WIN32
+	notify = -1;
+#endif
+}
+
+CProfileWatcher::~CProfileWatcher(void)
+{
+	Stop();
+	for(int i = 0; i <= WM_MY_MAX; i++)
+		delete pending[i].exchange(NULL);
+}
+
+/* Load whatever profiles directory has now, then watch it for changes */
+BOOL CProfileWatcher::Start(const char *directory)
+{
+	if(running)
+		return false;
+
+	_snprintf(dir, sizeof(dir), "%s", directory);
+	dir[sizeof(dir) - 1] = 0;
+
+#ifndef _WIN32
+	notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(notify < 0 || inotify_add_watch(notify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		printf("Can't watch %s for profiles (%s)\n", dir, strerror(errno));
+		if(notify >= 0)
+			close(notify);
+		notify = -1;
+		return false;
+	}
+#endif
+
+	for(int mode = 0; mode <= WM_MY_MAX; mode++)
+		Reload(mode);
+
+	running = true;
+	watcher = std::thread(&CProfileWatcher::Run, this);
+	return true;
+}
+
+void CProfileWatcher::Stop()
+{
+	if(!running)
+		return;
+
+	running = false;
+	watcher.join();
+#ifndef _WIN32
+	close(notify);
+	notify = -1;
+#endif
+}
+
+/* Read loop - a newly loaded profile for mode, now owned by the caller, or NULL.
+Costs one atomic load when nothing has changed. */
+CProfile *CProfileWatcher::Take(int mode)
+{
+	if(!pending[mode].load(std::memory_order_relaxed))
+		return NULL;
+	return pending[mode].exchange(NULL);
+}
+
+/* Parse <dir>/<mode>.profile and queue it for the read loop. A missing file
+is left alone, so that mode keeps what it has. */
+void CProfileWatcher::Reload(int mode)
+{
+	char path[WM_PROFILE_PATH];
+	PathFor(mode, path);
+
+	struct stat info;
+	if(stat(path, &info) != 0)
+		return;
+#ifdef _WIN32
+	modified[mode] = info.st_mtime;
+#endif
+
+	CProfile *profile = new CProfile();
+	if(!profile->Load(path, CProfile::ModeName(mode)))
+	{
+		printf("Profile %s rejected, keeping the one in use: %s\n", path, profile->Error());
+		delete profile;
+		return;
+	}
+
+	printf("Profile %s loaded, %d bindings\n", path, profile->Count());
+	delete pending[mode].exchange(profile);
+}
+
+void CProfileWatcher::PathFor(int mode, char *path) const
+{
+	_snprintf(path, WM_PROFILE_PATH, "%s/%s%s", dir, CProfile::ModeName(mode), WM_PROFILE_EXTENSION);
+	path[WM_PROFILE_PATH - 1] = 0;
+}
+
+/* WM_MY_* for a file name in the directory, or -1 */
+int CProfileWatcher::ModeForFile(const char *file) const
+{
+	for(int mode = 0; mode <= WM_MY_MAX; mode++)
+	{
+		char expected[WM_PROFILE_NAME + sizeof(WM_PROFILE_EXTENSION)];
+		_snprintf(expected, sizeof(expected), "%s%s", CProfile::ModeName(mode), WM_PROFILE_EXTENSION);
+		if(strcmp(file, expected) == 0)
+			return mode;
+	}
+	return -1;
+}
+
+#ifdef _WIN32
+
+/* Watcher thread - no inotify, so compare modification times */
+void CProfileWatcher::Run()
+{
+	while(running)
+	{
+		Sleep(WM_PROFILE_POLL_MS);
+		for(int mode = 0; mode <= WM_MY_MAX; mode++)
+		{
+			char path[WM_PROFILE_PATH];
+			PathFor(mode, path);
+
+			struct stat info;
+			if(stat(path, &info) == 0 && info.st_mtime != modified[mode])
+				Reload(mode);
+		}
+	}
+}
+
+#else
+
+/* Watcher thread - reload a profile whenever it is written or moved into place */
+void CProfileWatcher::Run()
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while(running)
+	{
+		struct pollfd ready;
+		ready.fd = notify;
+		ready.events = POLLIN;
+		if(poll(&ready, 1, WM_PROFILE_POLL_MS) <= 0)
+			continue;
+
+		int got = (int)read(notify, events, sizeof(events));
+		for(int at = 0; at < got; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *)(events + at);
+			at += sizeof(struct inotify_event) + event->len;
+
+			int mode = event->len ? ModeForFile(event->name) : -1;
+			if(mode >= 0)
+				Reload(mode);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*************************
+Profile.h
+
+Mapping profiles: what each WM_MY_* mode does with the mote's buttons and motion.
+
+A profile is a text file of bindings, one per line, # starting a comment:
+	pointer X SX Y SY [deadzone N]	move the mouse by X*SX, Y*SY every report,
+					moves smaller than N counting as none
+	button SRC ACTION		ACTION while button SRC is held
+	range AXIS LO HI ACTION		ACTION while LO < AXIS < HI
+	below AXIS V ACTION		ACTION while AXIS < V
+	above AXIS V ACTION		ACTION while AXIS > V
+where ACTION is one of
+	key NAME			press on the way in, release on the way out
+	mouse left|right|middle		the same, for a mouse button
+	wheel N				scroll by N on every report while held
+Buttons are a b one two up down left right chuk.c chuk.z. Plus, minus and
+home stay reserved for switching modes and quitting. Axes are tilt.x/y/z,
+force.x/y/z, chuk.tilt.x/y/z, chuk.force.x/y/z and chuk.stick.x/y. Keys are
+A-Z, 0-9, SPACE SHIFT CONTROL ALT RETURN ESCAPE TAB BACK LEFT RIGHT UP DOWN,
+or a virtual key code in hex such as 0x70.
+
+Parse() compiles a file into flat WM_BINDINGs; every condition becomes an
+open interval on one input, so the read loop tests each binding with two
+compares and no string handling. The built-in profiles are written in the
+same language and reproduce the original hard-coded modes.
+
+Needs() sums up which of the mote's data a profile reads, so the read loop
+can ask for the smallest report that carries it: a profile of plain buttons
+gets by on 0x30, sent only when a button changes. Derived() does the same
+for the values CWiimote works out from the raw axes, so it only spends the
+divisions and asin() calls on tilt, force and the stick when a binding or the
+pointer reads them.
+
+CProfileWatcher loads <dir>/mouse.profile, emu.profile and fps.profile and
+keeps watching them (inotify on Linux, modification times on Windows). A
+changed file is parsed on the watcher's thread and handed over whole through
+an atomic pointer, which the read loop picks up between reports. A file that
+doesn't parse is reported and ignored, and the profile in use stays.
+**************************/
+
+#pragma once
+
+#include <time.h>
+#include <atomic>
+#include <thread>
+
+#define WM_PROFILE_BINDINGS 64 /* most bindings one profile can hold */
+#define WM_PROFILE_NAME 32
+#define WM_PROFILE_ERROR 160
+#define WM_PROFILE_POLL_MS 500 /* how often the watcher checks without inotify */
+#define WM_PROFILE_EXTENSION ".profile"
+#define WM_PROFILE_PATH (WM_PATH_SIZE + WM_PROFILE_NAME + 16) /* directory, mode name and extension */
+
+/* Inputs a binding can test, sampled once per report */
+#define WM_IN_A 0
+#define WM_IN_B 1
+#define WM_IN_ONE 2
+#define WM_IN_TWO 3
+#define WM_IN_UP 4
+#define WM_IN_DOWN 5
+#define WM_IN_LEFT 6
+#define WM_IN_RIGHT 7
+#define WM_IN_CHUK_C 8
+#define WM_IN_CHUK_Z 9
+#define WM_IN_BUTTONS 10 /* inputs below this are buttons, 0 or 1 */
+#define WM_IN_TILT_X 10 /* tilt through force.z are consecutive x, y, z */
+#define WM_IN_FORCE_X 13
+#define WM_IN_CHUK_TILT_X 16
+#define WM_IN_CHUK_FORCE_X 19
+#define WM_IN_CHUK_STICK_X 22
+#define WM_IN_CHUK_STICK_Y 23
+#define WM_IN_COUNT 24
+
+/* Binding actions */
+#define WM_ACT_KEY 0 /* code is a virtual key */
+#define WM_ACT_MOUSE 1 /* code is the MOUSEEVENTF_*DOWN flag, release is code << 1 */
+#define WM_ACT_WHEEL 2 /* amount is the wheel delta */
+
+/* What a profile reads from the mote, see CProfile::Needs(). Buttons always come. */
+#define WM_NEED_ACC 0x01 /* the mote's accelerometer */
+#define WM_NEED_EXT 0x02 /* anything on the nunchuk, its buttons included */
+#define WM_NEED_REPEAT 0x04 /* a report even when nothing changed - a pointer or wheel acts on every one */
+
+/* Values worked out from the raw axes, see CProfile::Derived() and CWiimote::Derive() */
+#define WM_DERIVE_TILT 0x01 /* WM_IN_TILT_* */
+#define WM_DERIVE_FORCE 0x02
+#define WM_DERIVE_CHUK_TILT 0x04
+#define WM_DERIVE_CHUK_FORCE 0x08
+#define WM_DERIVE_STICK 0x10
+#define WM_DERIVE_ALL 0x1f
+
+struct WM_BINDING {
+	int source; /* WM_IN_* */
+	float low; /* active while low < value < high */
+	float high;
+	int action; /* WM_ACT_* */
+	int code;
+	int amount;
+};
+
+struct WM_POINTER {
+	bool enabled;
+	int sourceX; /* WM_IN_* */
+	int sourceY;
+	float scaleX;
+	float scaleY;
+	int deadzone; /* moves with a smaller magnitude are dropped */
+};
+
+class CProfile
+{
+public:
+	CProfile(void);
+	BOOL Parse(const char *text, const char *profileName);
+	BOOL Load(const char *path, const char *profileName);
+	static CProfile *Builtin(int mode);
+	static const char *ModeName(int mode);
+	const char *Name() const;
+	const char *Error() const;
+	int Count() const;
+	const WM_BINDING *Binding(int index) const;
+	const WM_POINTER *Pointer() const;
+	unsigned Needs() const;
+	unsigned Derived() const;
+private:
+	BOOL ParseLine(char *line);
+	BOOL ParseAction(char **words, int count, WM_BINDING *binding);
+
+	char name[WM_PROFILE_NAME];
+	char error[WM_PROFILE_ERROR];
+	WM_BINDING bindings[WM_PROFILE_BINDINGS];
+	int count;
+	WM_POINTER pointer;
+	unsigned derived; /* WM_DERIVE_* bits, summed up by Parse() */
+};
+
+class CProfileWatcher
+{
+public:
+	CProfileWatcher(void);
+	~CProfileWatcher(void);
+	BOOL Start(const char *directory);
+	void Stop();
+	CProfile *Take(int mode);
+private:
+	void Run();
+	void Reload(int mode);
+	void PathFor(int mode, char *path) const;
+	int ModeForFile(const char *file) const;
+
+	char dir[WM_PATH_SIZE];
+	std::thread watcher;
+	std::atomic<bool> running;
+	std::atomic<CProfile *> pending[WM_MY_MAX + 1]; /* parsed, waiting for the read loop */
+#ifdef _WIN32
+	time_t modified[WM_MY_MAX + 1];
+#else
+	int notify; /* inotify descriptor */
+#endif
+};
@@ -0,0 +1,146 @@
+/*************************
+RealTime.cpp
+
+Real-time scheduling, CPU pinning and busy-poll for the read loop. See RealTime.h.
+**************************/
+
+#include "stdafx.h"
+#include "RealTime.h"
+
+#ifdef _WIN32
+#include <avrt.h>
+#pragma comment(lib, "avrt.lib")
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+CRealTime::CRealTime(void)
+{
+	elevated = pinned = busyPoll = false;
+#ifdef _WIN32
+	task = NULL;
+	oldAffinity = 0;
+#endif
+}
+
+CRealTime::~CRealTime(void)
+{
+	Leave();
+}
+
+void CRealTime::Defaults(WM_RT_CONFIG *config)
+{
+	config->priority = 0;
+	config->cpu = -1;
+	config->busyPoll = false;
+}
+
+bool CRealTime::Elevated() const { return elevated; }
+bool CRealTime::Pinned() const { return pinned; }
+bool CRealTime::BusyPoll() const { return busyPoll; }
+
+/* Apply config to the calling thread, printing whatever couldn't be done */
+void CRealTime::Enter(const WM_RT_CONFIG *config)
+{
+	Leave();
+
+	int cpus = CpuCount();
+	if(config->cpu >= cpus)
+		printf("Can't pin to CPU %d, there are only %d.\n", config->cpu, cpus);
+
+#ifdef _WIN32
+	if(config->priority > 0)
+	{
+		DWORD taskIndex = 0;
+		task = AvSetMmThreadCharacteristicsW(L"Games", &taskIndex);
+		if(task)
+		{
+			if(config->priority > WM_RT_MMCSS_HIGH)
+				AvSetMmThreadPriority(task, AVRT_PRIORITY_HIGH);
+			elevated = true;
+		}
+		else
+			printf("Couldn't join the MMCSS Games task (error %lu), running at normal priority.\n", GetLastError());
+	}
+
+	if(config->cpu >= 0 && config->cpu < cpus && config->cpu < (int)(sizeof(DWORD_PTR) * 8))
+	{
+		oldAffinity = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << config->cpu);
+		if(oldAffinity)
+			pinned = true;
+		else
+			printf("Couldn't pin the read loop to CPU %d (error %lu).\n", config->cpu, GetLastError());
+	}
+#else
+	if(config->priority > 0)
+	{
+		pthread_getschedparam(pthread_self(), &oldPolicy, &oldParam);
+
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = config->priority > WM_RT_MAX_PRIORITY ? WM_RT_MAX_PRIORITY : config->priority;
+		int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(error == 0)
+			elevated = true;
+		else if(error == EPERM)
+			printf("No permission for SCHED_FIFO (needs CAP_SYS_NICE or an rtprio limit), running at normal priority.\n");
+		else
+			printf("Couldn't switch to SCHED_FIFO: %s\n", strerror(error));
+	}
+
+	if(config->cpu >= 0 && config->cpu < cpus && config->cpu < CPU_SETSIZE)
+	{
+		pthread_getaffinity_np(pthread_self(), sizeof(oldAffinity), &oldAffinity);
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(config->cpu, &set);
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(error == 0)
+			pinned = true;
+		else
+			printf("Couldn't pin the read loop to CPU %d: %s\n", config->cpu, strerror(error));
+	}
+#endif
+
+	if(config->busyPoll)
+	{
+		/* A real-time spinner owns its CPU outright */
+		if(elevated && (!pinned || cpus < 2))
+			printf("Busy-polling at real-time priority needs the loop pinned and another CPU free, so it stays off.\n");
+		else
+			busyPoll = true;
+	}
+}
+
+/* Put the thread back the way Enter() found it */
+void CRealTime::Leave()
+{
+#ifdef _WIN32
+	if(task)
+		AvRevertMmThreadCharacteristics(task);
+	task = NULL;
+	if(pinned)
+		SetThreadAffinityMask(GetCurrentThread(), oldAffinity);
+#else
+	if(elevated)
+		pthread_setschedparam(pthread_self(), oldPolicy, &oldParam);
+	if(pinned)
+		pthread_setaffinity_np(pthread_self(), sizeof(oldAffinity), &oldAffinity);
+#endif
+	elevated = pinned = busyPoll = false;
+}
+
+/* CPUs online */
+int CRealTime::CpuCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
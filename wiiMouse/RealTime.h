@@ -0,0 +1,63 @@
+/*************************
+RealTime.h
+
+Scheduling for the thread that reads and decodes reports. A mote reports
+every 10 ms, and on a loaded machine the read loop can sit runnable behind
+other threads for longer than that, so each report reaches the pointer late
+and bunched up with the next.
+
+CRealTime moves the calling thread into a real-time class for as long as it
+runs the loop: SCHED_FIFO at the given priority on Linux, the MMCSS "Games"
+task on Windows (its priority is raised to high above 50, otherwise left
+normal). It can also pin the thread to one CPU, so it isn't migrated away
+from a warm cache, and ask CHidDevice to busy-poll instead of sleeping in
+the read, which saves the wakeup but keeps a CPU spinning.
+
+Everything is off by default. Asking for a real-time class without the right
+to it (CAP_SYS_NICE or an rtprio limit on Linux) only prints a warning. A
+real-time thread that spins can starve everything else on its CPU, so
+busy-polling together with a priority is only allowed pinned to a CPU on a
+machine with another one to spare; otherwise busy-polling is turned off.
+**************************/
+
+#pragma once
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define WM_RT_MAX_PRIORITY 99 /* SCHED_FIFO's range is 1 - 99 */
+#define WM_RT_MMCSS_HIGH 50 /* priorities above this get AVRT_PRIORITY_HIGH on Windows */
+
+struct WM_RT_CONFIG {
+	int priority; /* 0 leaves the thread's scheduling alone */
+	int cpu; /* CPU to pin to, or -1 for anywhere */
+	bool busyPoll; /* spin in CHidDevice::Read() instead of sleeping */
+};
+
+class CRealTime
+{
+public:
+	CRealTime(void);
+	~CRealTime(void);
+	void Enter(const WM_RT_CONFIG *config);
+	void Leave();
+	bool Elevated() const;
+	bool Pinned() const;
+	bool BusyPoll() const;
+	static int CpuCount();
+	static void Defaults(WM_RT_CONFIG *config);
+private:
+	bool elevated;
+	bool pinned;
+	bool busyPoll;
+#ifdef _WIN32
+	HANDLE task; /* MMCSS registration */
+	DWORD_PTR oldAffinity;
+#else
+	int oldPolicy;
+	struct sched_param oldParam;
+	cpu_set_t oldAffinity;
+#endif
+};
@@ -0,0 +1,124 @@
+/*************************
+ReportPool.cpp
+
+Report slot pool and subscriber fan-out. See ReportPool.h.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+
+#define WM_POOL_EMPTY 0xffffffffULL
+
+CReportPool::CReportPool(void)
+{
+	top = WM_POOL_EMPTY;
+	available = 0;
+	exhausted = 0;
+	subscriberCount = 0;
+
+	for(int i = WM_POOL_SLOTS - 1; i >= 0; i--)
+	{
+		memset(slots[i].data, 0, WM_PACKET_SIZE);
+		slots[i].length = 0;
+		slots[i].readStart = slots[i].readDone = 0;
+		slots[i].seq = 0;
+		slots[i].refs = 0;
+		slots[i].owner = this;
+		slots[i].index = i;
+		Push(i);
+	}
+}
+
+void CReportPool::Push(int index)
+{
+	unsigned long long old = top.load(std::memory_order_relaxed);
+	unsigned long long replacement;
+	do
+	{
+		next[index].store((int)(old & WM_POOL_EMPTY), std::memory_order_relaxed);
+		replacement = ((old >> 32) + 1) << 32 | (unsigned)index;
+	} while(!top.compare_exchange_weak(old, replacement, std::memory_order_release, std::memory_order_relaxed));
+
+	available++;
+}
+
+/* Returns -1 if the pool is empty */
+int CReportPool::Pop()
+{
+	unsigned long long old = top.load(std::memory_order_acquire);
+	unsigned long long replacement;
+	do
+	{
+		if((old & WM_POOL_EMPTY) == WM_POOL_EMPTY)
+			return -1;
+		int index = (int)(old & WM_POOL_EMPTY);
+		replacement = ((old >> 32) + 1) << 32 | (unsigned)next[index].load(std::memory_order_relaxed);
+	} while(!top.compare_exchange_weak(old, replacement, std::memory_order_acquire, std::memory_order_acquire));
+
+	available--;
+	return (int)(old & WM_POOL_EMPTY);
+}
+
+/* Take a free slot holding one reference, or NULL if every slot is held -
+some consumer is falling behind */
+WM_REPORT *CReportPool::Acquire()
+{
+	int index = Pop();
+	if(index < 0)
+	{
+		exhausted++;
+		return NULL;
+	}
+
+	WM_REPORT *report = &slots[index];
+	report->refs.store(1, std::memory_order_relaxed);
+	return report;
+}
+
+/* Called by ReportRelease() once the last reference is gone */
+void CReportPool::Release(WM_REPORT *report)
+{
+	Push(report->index);
+}
+
+/* Returns false if there are already WM_MAX_SUBSCRIBERS */
+BOOL CReportPool::Subscribe(CReportSubscriber *subscriber)
+{
+	std::lock_guard<std::mutex> guard(subscriberLock);
+	if(subscriberCount == WM_MAX_SUBSCRIBERS)
+		return false;
+	subscribers[subscriberCount++] = subscriber;
+	return true;
+}
+
+/* Once this returns, the subscriber won't be called again */
+void CReportPool::Unsubscribe(CReportSubscriber *subscriber)
+{
+	std::lock_guard<std::mutex> guard(subscriberLock);
+	for(int i = 0; i < subscriberCount; i++)
+	{
+		if(subscribers[i] == subscriber)
+		{
+			subscribers[i] = subscribers[--subscriberCount];
+			return;
+		}
+	}
+}
+
+/* Show a report to every subscriber. The caller keeps its own reference. */
+void CReportPool::Publish(WM_REPORT *report)
+{
+	std::lock_guard<std::mutex> guard(subscriberLock);
+	for(int i = 0; i < subscriberCount; i++)
+		subscribers[i]->OnReport(report);
+}
+
+int CReportPool::Available() const
+{
+	return available;
+}
+
+unsigned long long CReportPool::Exhausted() const
+{
+	return exhausted;
+}
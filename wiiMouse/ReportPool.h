@@ -0,0 +1,90 @@
+/*************************
+ReportPool.h
+
+Pooled input report slots, shared between everyone who wants to see a report.
+
+The read loop reads each report straight into a slot taken from a fixed pool,
+then publishes it to the subscribers. A subscriber that only looks at the
+report during OnReport() needs nothing more; one that wants to keep it (the
+capture writer queues it for a disk thread) takes a reference with
+ReportAddRef() and drops it with ReportRelease() when done. The slot goes back
+to the pool when the last reference goes, from whichever thread drops it.
+
+The free list is a lock-free stack, so acquiring and releasing never blocks
+and nothing is allocated once the pool is built.
+**************************/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include "Timing.h"
+
+#define WM_POOL_SLOTS 256 /* reports that can be held at once */
+#define WM_MAX_SUBSCRIBERS 8
+
+class CReportPool;
+
+struct WM_REPORT {
+	byte data[WM_PACKET_SIZE]; /* zero-filled past length */
+	int length;
+	WM_TIME readStart; /* when the read that produced it was started */
+	WM_TIME readDone; /* when it completed */
+	unsigned long long seq; /* per-device report number, from 1 */
+
+	/* Pool bookkeeping */
+	std::atomic<int> refs;
+	CReportPool *owner; /* NULL for a slot that isn't pooled */
+	int index;
+};
+
+/* Anything that wants to see every input report. OnReport() runs on the read
+loop's thread, so it has to be quick; take a reference to hold on to the report. */
+class CReportSubscriber
+{
+public:
+	virtual ~CReportSubscriber(void) {}
+	virtual void OnReport(WM_REPORT *report) = 0;
+};
+
+class CReportPool
+{
+public:
+	CReportPool(void);
+	WM_REPORT *Acquire();
+	void Release(WM_REPORT *report);
+	BOOL Subscribe(CReportSubscriber *subscriber);
+	void Unsubscribe(CReportSubscriber *subscriber);
+	void Publish(WM_REPORT *report);
+	int Available() const;
+	unsigned long long Exhausted() const;
+private:
+	void Push(int index);
+	int Pop();
+
+	WM_REPORT slots[WM_POOL_SLOTS];
+	std::atomic<int> next[WM_POOL_SLOTS];
+
+	/* Top of the free stack in the low 32 bits, a change count in the high 32 bits
+	so a slot popped and pushed back between our load and CAS can't fool us */
+	std::atomic<unsigned long long> top;
+	std::atomic<int> available;
+	std::atomic<unsigned long long> exhausted;
+
+	std::mutex subscriberLock; /* Held across Publish(), so don't subscribe from OnReport() */
+	CReportSubscriber *subscribers[WM_MAX_SUBSCRIBERS];
+	int subscriberCount;
+};
+
+/* Hold on to a report past OnReport() */
+inline void ReportAddRef(WM_REPORT *report)
+{
+	report->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Drop a reference; the last one hands the slot back to its pool */
+inline void ReportRelease(WM_REPORT *report)
+{
+	if(report->refs.fetch_sub(1, std::memory_order_acq_rel) == 1 && report->owner)
+		report->owner->Release(report);
+}
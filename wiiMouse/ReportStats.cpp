@@ -0,0 +1,189 @@
+/*************************
+ReportStats.cpp
+
+Report-rate, jitter, gap and error counters for one device.
+
+Drops can't be seen directly since reports carry no sequence number, so they
+are estimated from arrival times: an interval of several report periods means
+reports were lost, unless the missing reports turn up straight afterwards as a
+burst (Bluetooth delivering late rather than not at all).
+**************************/
+
+#include "stdafx.h"
+#include "ReportStats.h"
+
+CReportStats::CReportStats(void)
+{
+	ringSize = 0;
+	Reset();
+}
+
+void CReportStats::Reset()
+{
+	received.store(0);
+	for(int i = 0; i < WM_STATS_TYPES; i++)
+		byType[i].store(0);
+	otherType.store(0);
+	drops.store(0);
+	gaps.store(0);
+	overruns.store(0);
+	readErrors.store(0);
+	writeErrors.store(0);
+	initUnexpected.store(0);
+	jitter.store(0);
+	period.store(WM_REPORT_PERIOD_NS);
+
+	streaming = false;
+	queuedRun = 0;
+	lastArrival = 0;
+	pendingMissing = 0;
+	periodEst = (double)WM_REPORT_PERIOD_NS;
+	jitterEst = 0.0;
+
+	Snapshot(&last);
+}
+
+/* Number of input buffers in the HID ring, used to recognise overruns */
+void CReportStats::SetRingSize(unsigned long size)
+{
+	ringSize = size;
+}
+
+/* Gap detection only makes sense while the mote is in continuous mode */
+void CReportStats::SetStreaming(bool on)
+{
+	streaming = on;
+	lastArrival = 0;
+	pendingMissing = 0;
+}
+
+/* Count one input report. readStart is when ReadFile was called, readDone when it returned. */
+void CReportStats::OnReport(byte reportType, WM_TIME readStart, WM_TIME readDone)
+{
+	received.fetch_add(1, std::memory_order_relaxed);
+	if(reportType >= WM_STATS_FIRST_TYPE && reportType < WM_STATS_FIRST_TYPE + WM_STATS_TYPES)
+		byType[reportType - WM_STATS_FIRST_TYPE].fetch_add(1, std::memory_order_relaxed);
+	else
+		otherType.fetch_add(1, std::memory_order_relaxed);
+
+	/* A full ring's worth of reads that never had to wait means the ring
+	was full before we got to it, and the driver has been discarding reports */
+	bool queued = (readDone - readStart) < WM_QUEUED_READ_NS;
+	if(queued)
+	{
+		if(ringSize && ++queuedRun == ringSize)
+			overruns.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+		queuedRun = 0;
+
+	if(!streaming)
+		return;
+
+	if(lastArrival)
+	{
+		double interval = (double)(readDone - lastArrival);
+
+		if(interval < periodEst / 2)
+		{
+			/* Part of a burst - a report we thought missing arrived late */
+			if(pendingMissing)
+				pendingMissing--;
+		}
+		else
+		{
+			/* Whatever the burst didn't make up for is really gone */
+			if(pendingMissing)
+			{
+				drops.fetch_add(pendingMissing, std::memory_order_relaxed);
+				pendingMissing = 0;
+			}
+
+			if(interval * 8 > periodEst * WM_GAP_THRESHOLD_EIGHTHS)
+			{
+				gaps.fetch_add(1, std::memory_order_relaxed);
+				pendingMissing = (unsigned long)(interval / periodEst + 0.5) - 1;
+			}
+			else
+			{
+				/* Normal interval - track the period and RFC 3550 style jitter */
+				periodEst += (interval - periodEst) / 64.0;
+				double deviation = interval - periodEst;
+				if(deviation < 0)
+					deviation = -deviation;
+				jitterEst += (deviation - jitterEst) / 16.0;
+
+				period.store((unsigned long long)periodEst, std::memory_order_relaxed);
+				jitter.store((unsigned long long)jitterEst, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	lastArrival = readDone;
+}
+
+void CReportStats::OnReadError()
+{
+	readErrors.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CReportStats::OnWriteError()
+{
+	writeErrors.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Initialize() got a report other than the one it was waiting for */
+void CReportStats::OnInitUnexpected()
+{
+	initUnexpected.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Copy the counters out. Cheap enough to call every report. */
+void CReportStats::Snapshot(WM_STATS *out) const
+{
+	out->received = received.load(std::memory_order_relaxed);
+	for(int i = 0; i < WM_STATS_TYPES; i++)
+		out->byType[i] = byType[i].load(std::memory_order_relaxed);
+	out->otherType = otherType.load(std::memory_order_relaxed);
+	out->drops = drops.load(std::memory_order_relaxed);
+	out->gaps = gaps.load(std::memory_order_relaxed);
+	out->overruns = overruns.load(std::memory_order_relaxed);
+	out->readErrors = readErrors.load(std::memory_order_relaxed);
+	out->writeErrors = writeErrors.load(std::memory_order_relaxed);
+	out->initUnexpected = initUnexpected.load(std::memory_order_relaxed);
+	out->jitter = jitter.load(std::memory_order_relaxed);
+	out->period = period.load(std::memory_order_relaxed);
+	out->taken = WmNow();
+}
+
+/* Print a one line summary of what happened since the previous call */
+void CReportStats::Summary(FILE *out, const char *name)
+{
+	WM_STATS now;
+	Snapshot(&now);
+
+	double secs = (double)(now.taken - last.taken) / WM_NS_PER_SEC;
+	double rate = secs > 0 ? (now.received - last.received) / secs : 0.0;
+
+	fprintf(out, "Stats %s: %.1f Hz, %llu reports (", name, rate, now.received - last.received);
+	bool first = true;
+	for(int i = 0; i < WM_STATS_TYPES; i++)
+	{
+		if(now.byType[i] != last.byType[i])
+		{
+			fprintf(out, "%s0x%02x %llu", first ? "" : " ", i + WM_STATS_FIRST_TYPE, now.byType[i] - last.byType[i]);
+			first = false;
+		}
+	}
+	if(now.otherType != last.otherType)
+		fprintf(out, "%sother %llu", first ? "" : " ", now.otherType - last.otherType);
+
+	fprintf(out, "), period %.2f ms, jitter %.2f ms, drops %llu in %llu gaps, overruns %llu, "
+		"read errors %llu, write errors %llu, init unexpected %llu\n",
+		now.period / 1e6, now.jitter / 1e6,
+		now.drops - last.drops, now.gaps - last.gaps, now.overruns - last.overruns,
+		now.readErrors - last.readErrors, now.writeErrors - last.writeErrors,
+		now.initUnexpected - last.initUnexpected);
+
+	last = now;
+}
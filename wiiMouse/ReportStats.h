@@ -0,0 +1,85 @@
+/*************************
+ReportStats.h
+
+Per-device report counters, so dropped or late reports show up as numbers
+instead of just a stale packet in ParseReport().
+
+The read loop is the only writer. Every counter is an atomic, so Snapshot()
+can be called from any thread without stopping the loop.
+**************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include "Timing.h"
+
+/* Input report IDs 0x20 through 0x3f are counted individually, anything else
+lands in the "other" bucket */
+#define WM_STATS_FIRST_TYPE 0x20
+#define WM_STATS_TYPES 0x20
+
+/* Continuous reporting runs at about 100Hz */
+#define WM_REPORT_PERIOD_NS (10 * WM_NS_PER_MS)
+
+/* An interval longer than this many periods (in eighths) is counted as a gap */
+#define WM_GAP_THRESHOLD_EIGHTHS 12
+
+/* A ReadFile that returns faster than this was served from the HID ring buffer
+rather than waiting on the device */
+#define WM_QUEUED_READ_NS (200 * WM_NS_PER_US)
+
+/* Plain copy of the counters, taken with CReportStats::Snapshot() */
+struct WM_STATS {
+	unsigned long long received; /* All input reports */
+	unsigned long long byType[WM_STATS_TYPES]; /* Indexed by report ID - WM_STATS_FIRST_TYPE */
+	unsigned long long otherType; /* Report IDs outside 0x20 - 0x3f */
+	unsigned long long drops; /* Reports estimated lost from timing gaps */
+	unsigned long long gaps; /* Number of gaps seen */
+	unsigned long long overruns; /* Times the HID ring buffer was found full */
+	unsigned long long readErrors; /* Failed ReadFile calls */
+	unsigned long long writeErrors; /* Failed WriteFile calls */
+	unsigned long long initUnexpected; /* Wrong report types seen during Initialize() */
+	WM_TIME jitter; /* Smoothed inter-arrival jitter, ns */
+	WM_TIME period; /* Smoothed inter-arrival period, ns */
+	WM_TIME taken; /* When the snapshot was taken */
+};
+
+class CReportStats
+{
+public:
+	CReportStats(void);
+	void Reset();
+	void SetRingSize(unsigned long size);
+	void SetStreaming(bool on);
+	void OnReport(byte reportType, WM_TIME readStart, WM_TIME readDone);
+	void OnReadError();
+	void OnWriteError();
+	void OnInitUnexpected();
+	void Snapshot(WM_STATS *out) const;
+	void Summary(FILE *out, const char *name);
+private:
+	std::atomic<unsigned long long> received;
+	std::atomic<unsigned long long> byType[WM_STATS_TYPES];
+	std::atomic<unsigned long long> otherType;
+	std::atomic<unsigned long long> drops;
+	std::atomic<unsigned long long> gaps;
+	std::atomic<unsigned long long> overruns;
+	std::atomic<unsigned long long> readErrors;
+	std::atomic<unsigned long long> writeErrors;
+	std::atomic<unsigned long long> initUnexpected;
+	std::atomic<unsigned long long> jitter;
+	std::atomic<unsigned long long> period;
+
+	/* Read loop only */
+	bool streaming; /* Only continuous reporting has a period to measure gaps against */
+	unsigned long ringSize; /* Input buffers in the HID ring */
+	unsigned long queuedRun; /* Back-to-back reads that came straight out of the ring */
+	unsigned long pendingMissing; /* Reports a gap says are missing, until a burst proves otherwise */
+	WM_TIME lastArrival;
+	double periodEst;
+	double jitterEst;
+
+	/* Summary() only */
+	WM_STATS last;
+};
@@ -0,0 +1,217 @@
+/*************************
+RumbleFx.cpp
+
+Rumble effect building and playback. See RumbleFx.h.
+**************************/
+
+#include "stdafx.h"
+#include "RumbleFx.h"
+#include "HidDevice.h"
+
+CRumbleEffect::CRumbleEffect(void)
+{
+	length = 0;
+	state = false;
+}
+
+/* Append a stretch of the given state. Only a change of state adds a step,
+so back-to-back stretches of the same state cost nothing. */
+void CRumbleEffect::Add(int ms, bool on)
+{
+	if(ms <= 0)
+		return;
+
+	if(on != state)
+	{
+		WM_RUMBLE_STEP step;
+		step.at = length;
+		step.on = on;
+		steps.push_back(step);
+		state = on;
+	}
+
+	length += (WM_TIME)ms * WM_NS_PER_MS;
+}
+
+/* count pulses of onMs rumble followed by offMs quiet */
+CRumbleEffect &CRumbleEffect::Pulse(int onMs, int offMs, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		Add(onMs, true);
+		Add(offMs, false);
+	}
+	return *this;
+}
+
+/* A lub-dub double pulse per beat */
+CRumbleEffect &CRumbleEffect::Heartbeat(int beats, int bpm)
+{
+	int beatMs = bpm > 0 ? 60000 / bpm : 1000;
+	int rest = beatMs - 60 - 90 - 50;
+
+	for(int i = 0; i < beats; i++)
+	{
+		Add(60, true);
+		Add(90, false);
+		Add(50, true);
+		Add(rest, false);
+	}
+	return *this;
+}
+
+/* Emulate a motor speed between 0 and 1 by switching the bit on for that
+fraction of every period. Stretches too short to send round to all on or all off. */
+CRumbleEffect &CRumbleEffect::Intensity(float level, int durationMs, int periodMs)
+{
+	if(level < 0.f)
+		level = 0.f;
+	if(level > 1.f)
+		level = 1.f;
+	if(periodMs < 2 * WM_FX_MIN_SEGMENT_MS)
+		periodMs = 2 * WM_FX_MIN_SEGMENT_MS;
+
+	int onMs = (int)(level * periodMs + 0.5f);
+	if(onMs < WM_FX_MIN_SEGMENT_MS)
+		onMs = 0;
+	if(periodMs - onMs < WM_FX_MIN_SEGMENT_MS)
+		onMs = periodMs;
+
+	for(int done = 0; done < durationMs; done += periodMs)
+	{
+		int period = durationMs - done < periodMs ? durationMs - done : periodMs;
+		int on = onMs < period ? onMs : period;
+		Add(on, true);
+		Add(period - on, false);
+	}
+	return *this;
+}
+
+CRumbleEffect &CRumbleEffect::Pause(int ms)
+{
+	Add(ms, false);
+	return *this;
+}
+
+size_t CRumbleEffect::Steps() const
+{
+	return steps.size();
+}
+
+const WM_RUMBLE_STEP &CRumbleEffect::Step(size_t index) const
+{
+	return steps[index];
+}
+
+/* Total length. The motor is always off once the effect is over. */
+WM_TIME CRumbleEffect::Length() const
+{
+	return length;
+}
+
+CRumbleScheduler::CRumbleScheduler(void)
+{
+	pending = NULL;
+	wake = NULL;
+	current = NULL;
+	started = 0;
+	next = 0;
+	state = false;
+}
+
+CRumbleScheduler::~CRumbleScheduler(void)
+{
+	delete pending.exchange(NULL);
+	delete current;
+}
+
+/* The device the read loop waits on, to be woken when an effect is queued */
+void CRumbleScheduler::WakeOnPlay(CHidDevice *device)
+{
+	wake = device;
+}
+
+/* Start an effect, replacing whatever is playing. Safe to call from any thread;
+the read loop is woken and picks it up on its next Tick(). */
+void CRumbleScheduler::Play(const CRumbleEffect &effect, bool loop)
+{
+	_playing *playing = new _playing;
+	playing->effect = effect;
+	playing->loop = loop;
+
+	delete pending.exchange(playing);
+	if(wake)
+		wake->Wake();
+}
+
+/* Stop the current effect and turn the motor off */
+void CRumbleScheduler::Stop()
+{
+	Play(CRumbleEffect());
+}
+
+/* Advance playback to now. Returns WM_FX_ON or WM_FX_OFF when the motor
+should change, WM_FX_UNCHANGED otherwise. Read loop only. */
+int CRumbleScheduler::Tick(WM_TIME now)
+{
+	bool wanted = state;
+
+	_playing *incoming = pending.exchange(NULL);
+	if(incoming)
+	{
+		delete current;
+		current = incoming;
+		started = now;
+		next = 0;
+		wanted = false;
+	}
+
+	while(current)
+	{
+		const CRumbleEffect &fx = current->effect;
+
+		if(next < fx.Steps() && started + fx.Step(next).at <= now)
+		{
+			wanted = fx.Step(next).on;
+			next++;
+		}
+		else if(next >= fx.Steps() && started + fx.Length() <= now)
+		{
+			/* Finished - go round again, or switch off and forget it */
+			wanted = false;
+			if(current->loop && fx.Length() > 0)
+			{
+				started += fx.Length();
+				next = 0;
+			}
+			else
+			{
+				delete current;
+				current = NULL;
+			}
+		}
+		else
+			break;
+	}
+
+	if(wanted == state)
+		return WM_FX_UNCHANGED;
+
+	state = wanted;
+	return state ? WM_FX_ON : WM_FX_OFF;
+}
+
+/* When Tick() next has something to do, or 0 if nothing is playing. An
+effect waiting to start is due now. Read loop only. */
+WM_TIME CRumbleScheduler::NextTransition() const
+{
+	if(pending.load())
+		return WmNow();
+	if(!current)
+		return 0;
+
+	const CRumbleEffect &fx = current->effect;
+	if(next < fx.Steps())
+		return started + fx.Step(next).at;
+	return started + fx.Length();
+}
@@ -0,0 +1,85 @@
+/*************************
+RumbleFx.h
+
+Timed rumble effects. The mote's motor is a single on/off bit, so every
+pattern - pulses, a heartbeat, PWM-style intensity - comes down to a list of
+times at which the bit flips.
+
+CRumbleEffect builds that list, merging runs of the same state so only real
+transitions are kept. CRumbleScheduler plays it against the monotonic clock:
+the read loop calls Tick() after every report (or read timeout) and hands any
+change to the output queue, which carries the bit on the next report out.
+Nothing ever sleeps, so effects can't hold up input processing. Play() from
+another thread wakes the loop's read through WakeOnPlay()'s device, so a new
+effect starts at once rather than after the next report.
+**************************/
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include "Timing.h"
+
+class CHidDevice;
+
+/* Shortest on or off stretch worth sending - anything shorter can't survive
+the output queue's spacing between reports */
+#define WM_FX_MIN_SEGMENT_MS 5
+
+/* PWM period for Intensity() */
+#define WM_FX_PWM_PERIOD_MS 40
+
+struct WM_RUMBLE_STEP {
+	WM_TIME at; /* offset from the start of the effect */
+	bool on;
+};
+
+class CRumbleEffect
+{
+public:
+	CRumbleEffect(void);
+	CRumbleEffect &Pulse(int onMs, int offMs, int count);
+	CRumbleEffect &Heartbeat(int beats, int bpm);
+	CRumbleEffect &Intensity(float level, int durationMs, int periodMs = WM_FX_PWM_PERIOD_MS);
+	CRumbleEffect &Pause(int ms);
+	size_t Steps() const;
+	const WM_RUMBLE_STEP &Step(size_t index) const;
+	WM_TIME Length() const;
+private:
+	void Add(int ms, bool on);
+	std::vector<WM_RUMBLE_STEP> steps;
+	WM_TIME length;
+	bool state; /* state at the end of the effect so far */
+};
+
+class CRumbleScheduler
+{
+public:
+	CRumbleScheduler(void);
+	~CRumbleScheduler(void);
+	void WakeOnPlay(CHidDevice *device);
+	void Play(const CRumbleEffect &effect, bool loop = false);
+	void Stop();
+	int Tick(WM_TIME now);
+	WM_TIME NextTransition() const;
+private:
+	struct _playing {
+		CRumbleEffect effect;
+		bool loop;
+	};
+
+	/* Handed over from Play() to the read loop */
+	std::atomic<_playing *> pending;
+	CHidDevice *wake; /* whose Read() the loop is waiting in */
+
+	/* Read loop only */
+	_playing *current;
+	WM_TIME started;
+	size_t next;
+	bool state;
+};
+
+/* Tick() results */
+#define WM_FX_UNCHANGED -1
+#define WM_FX_OFF 0
+#define WM_FX_ON 1
@@ -0,0 +1,132 @@
+/*************************
+SampleClock.cpp
+
+Sample time reconstruction for input reports. See SampleClock.h.
+**************************/
+
+#include "stdafx.h"
+#include "SampleClock.h"
+
+CSampleClock::CSampleClock(void)
+{
+	period = WM_REPORT_PERIOD_NS;
+	streaming = false;
+	Reset();
+}
+
+/* Forget the stream, but keep the period learned so far */
+void CSampleClock::Reset()
+{
+	locked = false;
+	last = lastArrival = previous = delta = 0;
+	anchor = 0;
+	window = 0;
+	lateRun = 0;
+	lateMin = 0;
+	respaced = steps = 0;
+}
+
+/* Whether the mote is reporting continuously, so reports come on its clock */
+void CSampleClock::SetStreaming(bool on)
+{
+	if(on != streaming)
+		locked = false;
+	streaming = on;
+}
+
+WM_TIME CSampleClock::Period() const { return period; }
+WM_TIME CSampleClock::Delta() const { return delta; }
+unsigned long long CSampleClock::Respaced() const { return respaced; }
+unsigned long long CSampleClock::Steps() const { return steps; }
+
+void CSampleClock::Anchor(WM_TIME at)
+{
+	anchor = at;
+	window = 0;
+}
+
+/* Sample time of a report read at arrival. periodic says it belongs to the
+continuous stream (a 0x30 - 0x3f data report) rather than answering a request. */
+WM_TIME CSampleClock::Stamp(WM_TIME arrival, bool periodic)
+{
+	WM_TIME sample = arrival;
+
+	if(!streaming || !periodic)
+	{
+		/* Nothing to predict from; the read time is all there is */
+	}
+	else if(!locked)
+	{
+		locked = true;
+		lateRun = 0;
+		Anchor(arrival);
+		steps++;
+	}
+	else
+	{
+		WM_TIME predicted = last + period;
+		bool restart = false;
+		if(arrival <= predicted)
+			lateRun = 0; /* it can't have been sampled after it arrived */
+		else
+		{
+			WM_TIME late = arrival - predicted;
+			if(late > WM_CLOCK_RESYNC_PERIODS * period)
+			{
+				lateRun = 0;
+				restart = true;
+				steps++;
+			}
+			else
+			{
+				/* Reports bunched up behind a stall are a burst, not a phase change */
+				if(late > period / 2 && arrival - lastArrival > period / 2)
+				{
+					if(lateRun == 0 || late < lateMin)
+						lateMin = late;
+					lateRun++;
+				}
+				else if(late <= period / 2)
+					lateRun = 0;
+
+				if(lateRun >= WM_CLOCK_LATE_RUN)
+				{
+					/* Late every time for a while: the mote's phase has moved */
+					sample = predicted + lateMin;
+					lateRun = 0;
+					restart = true;
+					steps++;
+				}
+				else
+				{
+					sample = predicted + late / WM_CLOCK_PULL;
+					if(late > period / 4)
+						respaced++;
+				}
+			}
+		}
+
+		/* Slope of the corrected times across the window */
+		if(restart)
+			Anchor(sample);
+		else if(++window >= WM_CLOCK_MIN_SPAN)
+		{
+			double estimate = (double)(sample - anchor) / window;
+			double low = WM_REPORT_PERIOD_NS * (1 - WM_CLOCK_TOLERANCE);
+			double high = WM_REPORT_PERIOD_NS * (1 + WM_CLOCK_TOLERANCE);
+			if(sample > anchor)
+				period = (WM_TIME)(estimate < low ? low : estimate > high ? high : estimate);
+			if(window >= WM_CLOCK_WINDOW)
+				Anchor(sample);
+		}
+	}
+
+	if(streaming && periodic)
+	{
+		last = sample;
+		lastArrival = arrival;
+	}
+	delta = previous && sample > previous ? sample - previous : 0;
+	previous = sample;
+	return sample;
+}
@@ -0,0 +1,67 @@
+/*************************
+SampleClock.h
+
+Reconstructs when the mote actually sampled each report from when the read
+loop got it. Bluetooth doesn't deliver reports evenly: they sit in the radio
+or the HID stack and come out in bursts, so read times alone make a steady
+100Hz stream look like a stutter of 0 ms and 30 ms steps.
+
+In continuous mode the mote samples on its own steady clock, so each report
+is predicted one period after the last. A report can only arrive after it
+was sampled, so one arriving earlier than predicted pulls the clock forward
+to its arrival. One arriving later is taken as delayed: its time is moved
+only a 1/WM_CLOCK_PULL share of the way towards the arrival, which spaces out
+a burst at the period and slowly follows the host clock's drift. Reports late
+by more than half a period several times running, without bunching up behind
+each other, mean the mote's phase really moved (a lost report, or the stream
+restarting), so the clock steps by the smallest of those delays. After a
+gap of WM_CLOCK_RESYNC_PERIODS it starts over.
+
+The period itself comes from the slope of the corrected times over a long
+window, kept within WM_CLOCK_TOLERANCE of nominal. Outside continuous mode,
+or for reports that aren't part of the stream, the read time is used as is.
+
+Times are on the WmNow() clock, so they include the smallest delivery delay
+seen; only differences between them are exact.
+**************************/
+
+#pragma once
+
+#include "Timing.h"
+#include "ReportStats.h"
+
+#define WM_CLOCK_TOLERANCE 0.05 /* the mote's clock is trusted to be within 5% of nominal */
+#define WM_CLOCK_PULL 32 /* a late report moves the clock 1/32 of its lateness */
+#define WM_CLOCK_LATE_RUN 4 /* reports in a row over half a period late before the clock steps */
+#define WM_CLOCK_RESYNC_PERIODS 10 /* later than this and the clock starts over */
+#define WM_CLOCK_MIN_SPAN 64 /* reports before the period is estimated */
+#define WM_CLOCK_WINDOW 4096 /* reports the period is estimated over before starting a new window */
+
+class CSampleClock
+{
+public:
+	CSampleClock(void);
+	void Reset();
+	void SetStreaming(bool on);
+	WM_TIME Stamp(WM_TIME arrival, bool periodic);
+	WM_TIME Period() const;
+	WM_TIME Delta() const;
+	unsigned long long Respaced() const;
+	unsigned long long Steps() const;
+private:
+	void Anchor(WM_TIME at);
+
+	bool streaming;
+	bool locked; /* last is a periodic sample to predict from */
+	WM_TIME last; /* the last periodic sample */
+	WM_TIME lastArrival; /* and when it was read */
+	WM_TIME previous; /* the last stamp of any kind */
+	WM_TIME delta; /* between the last two stamps */
+	WM_TIME period;
+	WM_TIME anchor; /* start of the period window */
+	unsigned window; /* periodic samples since anchor */
+	int lateRun;
+	WM_TIME lateMin; /* smallest lateness in the current run */
+	unsigned long long respaced; /* late reports moved back onto the period */
+	unsigned long long steps; /* times the clock stepped or started over */
+};
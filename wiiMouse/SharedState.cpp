@@ -0,0 +1,340 @@
+/*************************
+SharedState.cpp
+
+Shared-memory state segment, writer and reader. See SharedState.h.
+**************************/
+
+#include "stdafx.h"
+#include "SharedState.h"
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/* How many times a reader retries a copy the writer keeps tearing
+before it gives up (a writer killed mid-update leaves the sequence odd) */
+#define WM_SHM_READ_TRIES 10000
+
+#ifndef _WIN32
+/* Shared (not process-private) futex, since the word lives in a shared mapping */
+static int Futex(std::atomic<unsigned> *word, int op, unsigned value, const struct timespec *timeout)
+{
+	return (int)syscall(SYS_futex, (unsigned *)word, op, value, timeout, NULL, 0);
+}
+#endif
+
+CStatePublisher::CStatePublisher(void)
+{
+	segment = NULL;
+	name[0] = 0;
+#ifdef _WIN32
+	mapping = wake = NULL;
+#endif
+}
+
+CStatePublisher::~CStatePublisher(void)
+{
+	Close();
+}
+
+/* Create (or take over) the segment for device N */
+BOOL CStatePublisher::Open(int device)
+{
+	if(segment)
+		return true;
+
+	_snprintf(name, sizeof(name), WM_SHM_NAME, device);
+
+#ifdef _WIN32
+	mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(WM_SHARED_SEGMENT), name);
+	if(!mapping)
+	{
+		printf("Couldn't create shared state %s (error %lu)\n", name, (unsigned long)GetLastError());
+		return false;
+	}
+	segment = (WM_SHARED_SEGMENT *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(WM_SHARED_SEGMENT));
+
+	char wakeName[64];
+	_snprintf(wakeName, sizeof(wakeName), WM_SHM_WAKE_NAME, device);
+	wake = CreateSemaphoreA(NULL, 0, 0x7fffffff, wakeName);
+
+	if(!segment || !wake)
+	{
+		Close();
+		return false;
+	}
+#else
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+	if(fd < 0)
+	{
+		printf("Couldn't create shared state %s (%s)\n", name, strerror(errno));
+		return false;
+	}
+
+	/* Readers write the waiter count, so they need write access whatever the umask says */
+	fchmod(fd, 0666);
+	if(ftruncate(fd, sizeof(WM_SHARED_SEGMENT)) < 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *view = mmap(NULL, sizeof(WM_SHARED_SEGMENT), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(view == MAP_FAILED)
+		return false;
+	segment = (WM_SHARED_SEGMENT *)view;
+#endif
+
+	segment->magic = WM_SHM_MAGIC;
+	segment->version = WM_SHM_VERSION;
+	segment->stateSize = sizeof(WM_SHARED_STATE);
+
+	/* A writer that died mid-update leaves the sequence odd; readers spin until it's even */
+	unsigned s = segment->sequence.load();
+	if(s & 1)
+		segment->sequence.store(s + 1);
+	segment->live = 1;
+
+	return true;
+}
+
+/* Mark the segment dead, wake anyone waiting and remove it */
+void CStatePublisher::Close()
+{
+	if(segment)
+	{
+		segment->live = 0;
+		segment->sequence.fetch_add(2);
+#ifdef _WIN32
+		if(wake && segment->waiters)
+			ReleaseSemaphore(wake, segment->waiters, NULL);
+		UnmapViewOfFile(segment);
+#else
+		Futex(&segment->sequence, FUTEX_WAKE, INT_MAX, NULL);
+		munmap(segment, sizeof(WM_SHARED_SEGMENT));
+		shm_unlink(name);
+#endif
+		segment = NULL;
+	}
+
+#ifdef _WIN32
+	if(wake)
+		CloseHandle(wake);
+	if(mapping)
+		CloseHandle(mapping);
+	wake = mapping = NULL;
+#endif
+}
+
+bool CStatePublisher::IsOpen() const
+{
+	return segment != NULL;
+}
+
+/* Copy a new state in. Readers that copy while this runs see the sequence
+change and copy again. */
+void CStatePublisher::Publish(const WM_SHARED_STATE *state)
+{
+	if(!segment)
+		return;
+
+	unsigned s = segment->sequence.load(std::memory_order_relaxed);
+	segment->sequence.store(s + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	memcpy((void *)&segment->state, state, sizeof(WM_SHARED_STATE));
+
+	segment->sequence.store(s + 2, std::memory_order_release);
+
+	/* Pairs with the reader bumping waiters before it checks the sequence,
+	so one side always sees the other */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	unsigned waiting = segment->waiters.load(std::memory_order_relaxed);
+	if(waiting)
+	{
+#ifdef _WIN32
+		ReleaseSemaphore(wake, waiting, NULL);
+#else
+		Futex(&segment->sequence, FUTEX_WAKE, INT_MAX, NULL);
+#endif
+	}
+}
+
+CStateReader::CStateReader(void)
+{
+	segment = NULL;
+#ifdef _WIN32
+	mapping = wake = NULL;
+#endif
+}
+
+CStateReader::~CStateReader(void)
+{
+	Close();
+}
+
+/* Attach to device N's segment. Fails if nobody has published one,
+or it was written by an incompatible version. */
+BOOL CStateReader::Open(int device)
+{
+	if(segment)
+		return true;
+
+	char name[64];
+	_snprintf(name, sizeof(name), WM_SHM_NAME, device);
+
+#ifdef _WIN32
+	mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if(!mapping)
+		return false;
+	segment = (WM_SHARED_SEGMENT *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(WM_SHARED_SEGMENT));
+
+	char wakeName[64];
+	_snprintf(wakeName, sizeof(wakeName), WM_SHM_WAKE_NAME, device);
+	wake = OpenSemaphoreA(SYNCHRONIZE, FALSE, wakeName);
+#else
+	int fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(WM_SHARED_SEGMENT))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *view = mmap(NULL, sizeof(WM_SHARED_SEGMENT), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(view != MAP_FAILED)
+		segment = (WM_SHARED_SEGMENT *)view;
+#endif
+
+	if(!segment || segment->magic != WM_SHM_MAGIC || segment->version != WM_SHM_VERSION
+		|| segment->stateSize != sizeof(WM_SHARED_STATE))
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void CStateReader::Close()
+{
+	if(segment)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(segment);
+#else
+		munmap(segment, sizeof(WM_SHARED_SEGMENT));
+#endif
+		segment = NULL;
+	}
+
+#ifdef _WIN32
+	if(wake)
+		CloseHandle(wake);
+	if(mapping)
+		CloseHandle(mapping);
+	wake = mapping = NULL;
+#endif
+}
+
+bool CStateReader::IsOpen() const
+{
+	return segment != NULL;
+}
+
+/* Is a writer still publishing? */
+bool CStateReader::Live() const
+{
+	return segment && segment->live;
+}
+
+unsigned CStateReader::Sequence() const
+{
+	return segment ? segment->sequence.load(std::memory_order_acquire) : 0;
+}
+
+/* Copy out the latest state, and the sequence it was published under.
+Fails only if the writer keeps the state torn for WM_SHM_READ_TRIES attempts. */
+BOOL CStateReader::Read(WM_SHARED_STATE *out, unsigned *sequence)
+{
+	if(!segment)
+		return false;
+
+	for(int tries = 0; tries < WM_SHM_READ_TRIES; tries++)
+	{
+		unsigned before = segment->sequence.load(std::memory_order_acquire);
+		if(before & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		memcpy(out, (const void *)&segment->state, sizeof(WM_SHARED_STATE));
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if(segment->sequence.load(std::memory_order_relaxed) == before)
+		{
+			if(sequence)
+				*sequence = before;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Block until the sequence moves past the one given (from Read()), or timeoutMs
+passes. Returns false on timeout. */
+BOOL CStateReader::Wait(unsigned sequence, int timeoutMs)
+{
+	if(!segment)
+		return false;
+
+	WM_TIME deadline = WmNow() + (WM_TIME)timeoutMs * WM_NS_PER_MS;
+
+	for(;;)
+	{
+		segment->waiters.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		unsigned now = segment->sequence.load(std::memory_order_relaxed);
+		if(now != sequence && !(now & 1))
+		{
+			segment->waiters.fetch_sub(1);
+			return true;
+		}
+
+		WM_TIME t = WmNow();
+		if(t >= deadline)
+		{
+			segment->waiters.fetch_sub(1);
+			return false;
+		}
+		WM_TIME left = deadline - t;
+
+#ifdef _WIN32
+		WaitForSingleObject(wake, (DWORD)((left + WM_NS_PER_MS - 1) / WM_NS_PER_MS));
+#else
+		/* Sleeps only while the sequence still holds the value we saw */
+		struct timespec ts;
+		ts.tv_sec = (time_t)(left / WM_NS_PER_SEC);
+		ts.tv_nsec = (long)(left % WM_NS_PER_SEC);
+		Futex(&segment->sequence, FUTEX_WAIT, now, &ts);
+#endif
+		segment->waiters.fetch_sub(1);
+	}
+}
@@ -0,0 +1,118 @@
+/*************************
+SharedState.h
+
+Decoded mote state in shared memory, for overlays, telemetry and anything else
+on the same machine that wants it without going through synthesized input.
+
+Each device gets its own named segment (see WM_SHM_NAME). The mote's read loop
+is the only writer; any number of processes can read. The state is guarded by a
+sequence lock: the writer makes the sequence odd, copies the state in and makes
+it even again, and a reader that sees the sequence change under it simply copies
+again. Neither side takes a lock or makes a system call to move data.
+
+Readers can poll Read(), or block in Wait() until the sequence moves on. Waking
+blocked readers costs the writer one system call per update, and only while
+someone is actually waiting (a futex on Linux, a named semaphore on Windows).
+
+This header and SharedState.cpp are all a reader needs.
+**************************/
+
+#pragma once
+
+#include <atomic>
+#include "Timing.h"
+
+#define WM_SHM_MAGIC 0x4d53574d /* "WMSM" */
+#define WM_SHM_VERSION 1
+#define WM_SHM_IR_DOTS 4
+
+/* Segment name for device N, and its wake semaphore on Windows */
+#ifdef _WIN32
+#define WM_SHM_NAME "Local\\wiimouse-state-%d"
+#define WM_SHM_WAKE_NAME "Local\\wiimouse-state-%d-wake"
+#else
+#define WM_SHM_NAME "/wiimouse-state-%d"
+#endif
+
+/* Flags in WM_SHARED_STATE.flags */
+#define WM_SHM_CONNECTED 0x01
+#define WM_SHM_CHUK 0x02
+#define WM_SHM_RUMBLING 0x04
+
+/* Nunchuk buttons in WM_SHARED_STATE.chukButtons, 1 when pressed */
+#define WM_SHM_CHUK_C 0x01
+#define WM_SHM_CHUK_Z 0x02
+
+struct WM_SHARED_IR {
+	unsigned short x; /* 0 to 1023 */
+	unsigned short y; /* 0 to 767 */
+	byte size; /* 0 to 15, only in extended IR mode */
+	byte visible;
+	byte reserved[2];
+};
+
+/* One snapshot of a mote. Fixed-size types only, so any compiler lays it out the same. */
+struct WM_SHARED_STATE {
+	WM_TIME time; /* monotonic ns when the mote sampled the report behind this state (see SampleClock.h) */
+	unsigned long long report; /* sequence number of that report */
+	unsigned short buttons; /* WM_BUT_* mask, 1 when pressed */
+	byte chukButtons; /* WM_SHM_CHUK_* */
+	byte flags; /* WM_SHM_* */
+	int battery; /* 0 to 100 */
+	float force[3]; /* G's */
+	float tilt[3]; /* degrees */
+	float chukForce[3];
+	float chukTilt[3];
+	float stick[2]; /* -1 to 1 */
+	WM_SHARED_IR ir[WM_SHM_IR_DOTS];
+};
+
+struct WM_SHARED_SEGMENT {
+	unsigned magic;
+	unsigned version;
+	unsigned stateSize; /* sizeof(WM_SHARED_STATE) */
+	std::atomic<unsigned> live; /* 1 while a writer is publishing */
+	std::atomic<unsigned> sequence; /* odd while the state is being written */
+	std::atomic<unsigned> waiters; /* readers blocked in Wait() */
+	WM_SHARED_STATE state;
+};
+
+/* Writer side - owned by the device's read loop */
+class CStatePublisher
+{
+public:
+	CStatePublisher(void);
+	~CStatePublisher(void);
+	BOOL Open(int device);
+	void Close();
+	bool IsOpen() const;
+	void Publish(const WM_SHARED_STATE *state);
+private:
+	WM_SHARED_SEGMENT *segment;
+	char name[64];
+#ifdef _WIN32
+	HANDLE mapping;
+	HANDLE wake;
+#endif
+};
+
+/* Reader side - use from any process */
+class CStateReader
+{
+public:
+	CStateReader(void);
+	~CStateReader(void);
+	BOOL Open(int device);
+	void Close();
+	bool IsOpen() const;
+	bool Live() const;
+	unsigned Sequence() const;
+	BOOL Read(WM_SHARED_STATE *out, unsigned *sequence = NULL);
+	BOOL Wait(unsigned sequence, int timeoutMs);
+private:
+	WM_SHARED_SEGMENT *segment;
+#ifdef _WIN32
+	HANDLE mapping;
+	HANDLE wake;
+#endif
+};
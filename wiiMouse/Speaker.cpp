@@ -0,0 +1,93 @@
+/*************************
+Speaker.cpp
+
+Yamaha ADPCM for the mote's speaker. See Speaker.h.
+
+Each 4-bit code is a sign bit and a 3-bit magnitude of the difference from the
+running prediction, in units of a quarter step; the step then grows or shrinks
+with the magnitude. Two codes go in a byte, high nibble first.
+**************************/
+
+#include "stdafx.h"
+#include "Speaker.h"
+
+/* Step scaling and prediction change for each code, indexed by the full nibble */
+static const int stepScale[16] = {
+	230, 230, 230, 230, 307, 409, 512, 614,
+	230, 230, 230, 230, 307, 409, 512, 614 };
+static const int stepDiff[16] = {
+	1, 3, 5, 7, 9, 11, 13, 15,
+	-1, -3, -5, -7, -9, -11, -13, -15 };
+
+#define WM_ADPCM_STEP_MIN 127
+#define WM_ADPCM_STEP_MAX 24576
+
+static inline int Clamp(int value, int low, int high)
+{
+	return value < low ? low : (value > high ? high : value);
+}
+
+/* Move the prediction and step on by one code. Shared by the encoder and decoder
+so the two can't drift apart. */
+static inline void Advance(int nibble, int *predictor, int *step)
+{
+	*predictor = Clamp(*predictor + (*step * stepDiff[nibble]) / 8, -32768, 32767);
+	*step = Clamp((*step * stepScale[nibble]) >> 8, WM_ADPCM_STEP_MIN, WM_ADPCM_STEP_MAX);
+}
+
+CAdpcmEncoder::CAdpcmEncoder(void)
+{
+	Reset();
+}
+
+/* Start a new stream. The speaker resets its decoder when it's configured. */
+void CAdpcmEncoder::Reset()
+{
+	predictor = 0;
+	step = WM_ADPCM_STEP_MIN;
+}
+
+/* Encode samples of 16-bit PCM into (samples + 1) / 2 bytes. Returns the byte count.
+Every code depends on the one before, so this is one tight loop with no
+branches beyond the clamps rather than anything parallel. */
+int CAdpcmEncoder::Encode(const short *pcm, int samples, byte *out)
+{
+	int bytes = (samples + 1) / 2;
+
+	for(int i = 0; i < samples; i++)
+	{
+		int delta = pcm[i] - predictor;
+		int sign = delta < 0 ? 8 : 0;
+		int magnitude = (sign ? -delta : delta) * 4 / step;
+		int nibble = (magnitude > 7 ? 7 : magnitude) | sign;
+
+		Advance(nibble, &predictor, &step);
+
+		if(i & 1)
+			out[i >> 1] |= (byte)nibble;
+		else
+			out[i >> 1] = (byte)(nibble << 4);
+	}
+
+	return bytes;
+}
+
+/* Decode what Encode() produced, starting from a reset state. Used for checking the encoder. */
+void AdpcmDecode(const byte *adpcm, int samples, short *out)
+{
+	int predictor = 0;
+	int step = WM_ADPCM_STEP_MIN;
+
+	for(int i = 0; i < samples; i++)
+	{
+		int nibble = (i & 1) ? adpcm[i >> 1] & 0x0f : adpcm[i >> 1] >> 4;
+		Advance(nibble, &predictor, &step);
+		out[i] = (short)predictor;
+	}
+}
+
+/* Time between 0x18 reports that keeps the speaker fed at sampleRate */
+WM_TIME SpeakerPeriod(int sampleRate)
+{
+	return (WM_TIME)WM_SPKR_SAMPLES * WM_NS_PER_SEC / sampleRate;
+}
@@ -0,0 +1,35 @@
+/*************************
+Speaker.h
+
+Speaker support: the 4-bit Yamaha ADPCM the mote's speaker plays, and the
+numbers for pacing it.
+
+The speaker has a tiny buffer, so audio has to arrive as a steady stream of
+0x18 reports, each carrying 20 bytes (40 samples). At the default 3000 Hz that
+is one report every 13.3 ms. A whole clip is encoded up front, and the output
+queue's writer thread sends it on that schedule - see COutputQueue::PlayAudio().
+**************************/
+
+#pragma once
+
+#include "Timing.h"
+
+#define WM_SPKR_BYTES 20 /* ADPCM bytes per 0x18 report */
+#define WM_SPKR_SAMPLES (WM_SPKR_BYTES * 2) /* samples per 0x18 report */
+#define WM_SPKR_RATE 3000 /* default sample rate, Hz */
+#define WM_SPKR_VOLUME 0x40 /* default volume, 0x00 to 0xff */
+#define WM_SPKR_CLOCK 6000000 /* the speaker's rate register divides this */
+
+class CAdpcmEncoder
+{
+public:
+	CAdpcmEncoder(void);
+	void Reset();
+	int Encode(const short *pcm, int samples, byte *out);
+private:
+	int predictor;
+	int step;
+};
+
+void AdpcmDecode(const byte *adpcm, int samples, short *out);
+WM_TIME SpeakerPeriod(int sampleRate);
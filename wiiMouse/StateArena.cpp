@@ -0,0 +1,92 @@
+/*************************
+StateArena.cpp
+
+Cache-line-aligned per-device state blocks. See StateArena.h.
+**************************/
+
+#include "stdafx.h"
+#include "StateArena.h"
+
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+static byte *AllocLines(size_t bytes)
+{
+#ifdef _WIN32
+	return (byte *)_aligned_malloc(bytes, WM_CACHE_LINE);
+#else
+	void *memory = NULL;
+	return posix_memalign(&memory, WM_CACHE_LINE, bytes) == 0 ? (byte *)memory : NULL;
+#endif
+}
+
+static void FreeLines(byte *memory)
+{
+#ifdef _WIN32
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
+}
+
+CStateArena::CStateArena(size_t size)
+{
+	blockSize = (size + WM_CACHE_LINE - 1) / WM_CACHE_LINE * WM_CACHE_LINE;
+}
+
+/* Blocks still out at this point go with their chunks */
+CStateArena::~CStateArena(void)
+{
+	for(size_t i = 0; i < chunks.size(); i++)
+		FreeLines(chunks[i]);
+}
+
+size_t CStateArena::BlockSize() const
+{
+	return blockSize;
+}
+
+/* Another chunk's worth of free blocks. Called with the lock held. */
+void CStateArena::Grow()
+{
+	byte *chunk = AllocLines(blockSize * WM_ARENA_CHUNK);
+	if(!chunk)
+		return;
+	chunks.push_back(chunk);
+	for(int i = WM_ARENA_CHUNK - 1; i >= 0; i--)
+		freeBlocks.push_back(chunk + i * blockSize);
+	std::sort(freeBlocks.begin(), freeBlocks.end(), std::greater<byte *>());
+}
+
+/* A zeroed block of the arena's size. Throws std::bad_alloc, as new would, if memory ran out. */
+void *CStateArena::Acquire()
+{
+	std::lock_guard<std::mutex> hold(lock);
+	if(freeBlocks.empty())
+		Grow();
+	if(freeBlocks.empty())
+		throw std::bad_alloc();
+
+	byte *block = freeBlocks.back();
+	freeBlocks.pop_back();
+	memset(block, 0, blockSize);
+	return block;
+}
+
+void CStateArena::Release(void *block)
+{
+	if(!block)
+		return;
+
+	std::lock_guard<std::mutex> hold(lock);
+	freeBlocks.push_back((byte *)block);
+	std::sort(freeBlocks.begin(), freeBlocks.end(), std::greater<byte *>());
+}
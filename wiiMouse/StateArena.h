@@ -0,0 +1,40 @@
+/*************************
+StateArena.h
+
+Fixed-size, cache-line-aligned blocks, for objects there is one of per device
+and that the read loop goes through on every report. CWiimote allocates
+itself from here (its buffers, pools, queues and strings are kept apart in
+CWiimote::_cold, so what is left is a few KB of state the loop actually uses).
+
+Blocks are rounded up to whole cache lines and carved from chunks of
+WM_ARENA_CHUNK, so with many devices in a process their live state is packed
+together in a few pages rather than spread one per page, and no two devices
+ever share a line. Freed blocks are handed out again before new chunks are
+allocated, lowest address first. Acquire() and Release() take a lock; they
+only run when a device is created or destroyed.
+**************************/
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#define WM_CACHE_LINE 64
+#define WM_ARENA_CHUNK 64 /* blocks allocated at a time */
+
+class CStateArena
+{
+public:
+	CStateArena(size_t size);
+	~CStateArena(void);
+	void *Acquire();
+	void Release(void *block);
+	size_t BlockSize() const;
+private:
+	void Grow();
+
+	size_t blockSize; /* size rounded up to whole cache lines */
+	std::mutex lock;
+	std::vector<byte *> chunks;
+	std::vector<byte *> freeBlocks; /* popped from the back, so kept highest address first */
+};
@@ -0,0 +1,34 @@
+/*************************
+Timing.cpp
+
+Monotonic clock backed by the performance counter on Windows and
+CLOCK_MONOTONIC everywhere else.
+**************************/
+
+#include "stdafx.h"
+#include "Timing.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+WM_TIME WmNow()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER now;
+
+	if(freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	/* Split into whole seconds and remainder so the multiply can't overflow */
+	WM_TIME secs = (WM_TIME)(now.QuadPart / freq.QuadPart);
+	WM_TIME rem = (WM_TIME)(now.QuadPart % freq.QuadPart);
+	return secs * WM_NS_PER_SEC + (rem * WM_NS_PER_SEC) / (WM_TIME)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (WM_TIME)ts.tv_sec * WM_NS_PER_SEC + (WM_TIME)ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,18 @@
+/*************************
+Timing.h
+
+Monotonic clock used to timestamp reports as they move through the
+read/decode/map/inject path. Values are nanoseconds from an arbitrary
+origin, so only differences are meaningful.
+**************************/
+
+#pragma once
+
+typedef unsigned long long WM_TIME;
+
+#define WM_NS_PER_US 1000ULL
+#define WM_NS_PER_MS 1000000ULL
+#define WM_NS_PER_SEC 1000000000ULL
+
+/* Current monotonic time in nanoseconds */
+WM_TIME WmNow();
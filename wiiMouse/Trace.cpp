@@ -0,0 +1,163 @@
+/*************************
+Trace.cpp
+
+Per-thread event rings and the Chrome trace writer. See Trace.h.
+**************************/
+
+#include "stdafx.h"
+#include "Trace.h"
+
+#include <string.h>
+#include <new>
+
+#ifdef _WIN32
+#define getpid GetCurrentProcessId
+#else
+#include <unistd.h>
+#endif
+
+std::atomic<bool> CTracer::on(false);
+WM_THREAD_LOCAL CTracer::_ring *CTracer::mine = NULL;
+std::mutex CTracer::lock;
+std::vector<CTracer::_ring *> CTracer::rings;
+WM_TIME CTracer::epoch = 0;
+
+/* What each tracepoint's two arguments are, for the JSON */
+static const struct {
+	const char *name;
+	const char *a;
+	const char *b;
+} traceArgs[] = {
+	{ "read", "seq", "type" },
+	{ "decode", "seq", "type" },
+	{ "map", "seq", "produced" },
+	{ "bind", "code", "pressed" },
+	{ "inject", "device", "code" },
+	{ "write", "report", "length" },
+	{ "handshake", "step", "ok" },
+};
+
+void CTracer::Start()
+{
+	if(!epoch)
+		epoch = WmNow();
+	on = true;
+}
+
+void CTracer::Stop()
+{
+	on = false;
+}
+
+/* Forget what has been recorded. Only while stopped, since the rings are
+written without a lock. Rings stay allocated for their threads. */
+void CTracer::Clear()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for(size_t i = 0; i < rings.size(); i++)
+		rings[i]->head = 0;
+	epoch = on ? WmNow() : 0;
+}
+
+/* Events Write() would write out */
+unsigned long long CTracer::Recorded()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	unsigned long long total = 0;
+	for(size_t i = 0; i < rings.size(); i++)
+	{
+		unsigned long long head = rings[i]->head;
+		total += head < WM_TRACE_RING ? head : WM_TRACE_RING;
+	}
+	return total;
+}
+
+/* The calling thread's ring, made on its first event and kept for the
+life of the process so its events outlive it */
+CTracer::_ring *CTracer::Ring()
+{
+	if(mine)
+		return mine;
+
+	_ring *ring = new(std::nothrow) _ring;
+	if(!ring)
+		return NULL;
+	ring->head = 0;
+
+	std::lock_guard<std::mutex> guard(lock);
+	ring->thread = (int)rings.size() + 1;
+	rings.push_back(ring);
+	mine = ring;
+	return ring;
+}
+
+/* Add an event to the calling thread's ring. Spans (phase X) carry their own
+times; everything else happens now. */
+void CTracer::Record(char phase, const char *name, unsigned long long a, unsigned long long b, WM_TIME start, WM_TIME end)
+{
+	_ring *ring = Ring();
+	if(!ring)
+		return;
+
+	unsigned long long n = ring->head.load(std::memory_order_relaxed);
+	WM_TRACE_EVENT *event = &ring->events[n % WM_TRACE_RING];
+	event->time = phase == 'X' ? start : WmNow();
+	event->duration = phase == 'X' && end > start ? end - start : 0;
+	event->name = name;
+	event->a = a;
+	event->b = b;
+	event->phase = phase;
+	ring->head.store(n + 1, std::memory_order_release);
+}
+
+/* Every ring, oldest event first, as Chrome trace JSON. Meant for after
+Stop(): a thread still recording can overwrite an event as it is written out. */
+BOOL CTracer::Write(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if(!out)
+	{
+		printf("Couldn't write the trace to %s\n", path);
+		return false;
+	}
+
+	int pid = (int)getpid();
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"wiiMouse\"}}", pid);
+
+	std::lock_guard<std::mutex> guard(lock);
+	for(size_t r = 0; r < rings.size(); r++)
+	{
+		_ring *ring = rings[r];
+		unsigned long long head = ring->head.load(std::memory_order_acquire);
+		unsigned long long first = head > WM_TRACE_RING ? head - WM_TRACE_RING : 0;
+		for(unsigned long long n = first; n < head; n++)
+		{
+			const WM_TRACE_EVENT *event = &ring->events[n % WM_TRACE_RING];
+			const char *argA = "a";
+			const char *argB = "b";
+			for(size_t i = 0; i < sizeof(traceArgs) / sizeof(traceArgs[0]); i++)
+			{
+				if(strcmp(traceArgs[i].name, event->name) == 0)
+				{
+					argA = traceArgs[i].a;
+					argB = traceArgs[i].b;
+					break;
+				}
+			}
+
+			double ts = event->time > epoch ? (double)(event->time - epoch) / 1000.0 : 0.0;
+			fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", event->name, event->phase, ts, pid, ring->thread);
+			if(event->phase == 'X')
+				fprintf(out, ",\"dur\":%.3f", event->duration / 1000.0);
+			if(event->phase == 'i')
+				fprintf(out, ",\"s\":\"t\"");
+			if(event->phase != 'B')
+				fprintf(out, ",\"args\":{\"%s\":%llu,\"%s\":%llu}", argA, event->a, argB, event->b);
+			fprintf(out, "}");
+		}
+	}
+
+	fprintf(out, "\n]}\n");
+	return fclose(out) == 0;
+}
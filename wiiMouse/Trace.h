@@ -0,0 +1,119 @@
+/*************************
+Trace.h
+
+Static tracepoints on the read, decode, map and inject cycle, output report
+writes and the handshake, for lining them up with the rest of the system in
+perf or a trace viewer.
+
+Each tracepoint feeds two things:
+
+1. A USDT probe, provider wiimouse, when built on Linux with WM_USDT defined
+and <sys/sdt.h> (systemtap-sdt-dev) installed. perf (perf probe
+sdt_wiimouse:*), bpftrace, SystemTap and LTTng (enable-event
+--userspace-probe=sdt:...) all attach to these. An unattached probe is a
+single nop. Spans and points are probes named after the tracepoint; begin and
+end pairs are name__begin and name__end.
+
+2. The built-in recorder, while CTracer::Start() has it on. Events go into a
+ring per thread that only that thread writes, so recording takes no lock;
+Write() turns the rings into Chrome trace JSON (chrome://tracing, Perfetto).
+While it is off a tracepoint costs one load of CTracer::on and a branch that
+is always predicted.
+
+Define WM_NO_TRACE to compile the recorder out as well; the macros then leave
+only the USDT probes, or nothing.
+
+Tracepoints, with their two arguments:
+	read		seq, report type		a span from the read starting to the report arriving
+	decode		seq, report type
+	map			seq, input produced
+	bind		key or mouse code, pressed	a binding changing state
+	inject		0 key / 1 mouse / 2 gamepad, code, flags or buttons
+	write		report ID, length		an output report going to the device
+	handshake	step, succeeded			WM_HS_* steps of CWiimote::Initialize()
+**************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "Timing.h"
+
+#define WM_TRACE_RING 65536 /* events each thread keeps; older ones are overwritten */
+
+/* Handshake steps */
+#define WM_HS_MODE 1 /* buttons-only mode confirmed */
+#define WM_HS_STATUS 2 /* status report read */
+#define WM_HS_CALIBRATE 3 /* accelerometer calibration read */
+#define WM_HS_EXTENSION 4 /* extension identified and set up */
+
+#ifdef _WIN32
+#define WM_THREAD_LOCAL __declspec(thread)
+#else
+#define WM_THREAD_LOCAL __thread
+#endif
+
+struct WM_TRACE_EVENT {
+	WM_TIME time;
+	WM_TIME duration; /* spans only */
+	const char *name;
+	unsigned long long a;
+	unsigned long long b;
+	char phase; /* Chrome trace phase: B, E, X or i */
+};
+
+class CTracer
+{
+public:
+	static void Start();
+	static void Stop();
+	static void Clear();
+	static BOOL Write(const char *path);
+	static unsigned long long Recorded();
+	static void Record(char phase, const char *name, unsigned long long a, unsigned long long b, WM_TIME start = 0, WM_TIME end = 0);
+	static std::atomic<bool> on; /* the one thing a tracepoint reads when tracing is off */
+private:
+	struct _ring {
+		int thread; /* numbered in order of each thread's first event */
+		std::atomic<unsigned long long> head; /* events written so far */
+		WM_TRACE_EVENT events[WM_TRACE_RING];
+	};
+
+	static _ring *Ring();
+	static WM_THREAD_LOCAL _ring *mine;
+	static std::mutex lock; /* guards rings, taken once per thread */
+	static std::vector<_ring *> rings;
+	static WM_TIME epoch; /* Start(), which Chrome time 0 is */
+};
+
+#if defined(WM_USDT) && !defined(_WIN32)
+#include <sys/sdt.h>
+#define WM_USDT_POINT(name, a, b) DTRACE_PROBE2(wiimouse, name, a, b)
+#define WM_USDT_BEGIN(name) DTRACE_PROBE(wiimouse, name##__begin)
+#define WM_USDT_END(name, a, b) DTRACE_PROBE2(wiimouse, name##__end, a, b)
+#define WM_USDT_SPAN(name, start, end, a, b) DTRACE_PROBE4(wiimouse, name, a, b, start, end)
+#else
+#define WM_USDT_POINT(name, a, b) ((void)0)
+#define WM_USDT_BEGIN(name) ((void)0)
+#define WM_USDT_END(name, a, b) ((void)0)
+#define WM_USDT_SPAN(name, start, end, a, b) ((void)0)
+#endif
+
+#ifndef WM_NO_TRACE
+#define WM_TRACE_ON() CTracer::on.load(std::memory_order_relaxed)
+#define WM_TRACE(name, a, b) do { WM_USDT_POINT(name, a, b); \
+	if(WM_TRACE_ON()) CTracer::Record('i', #name, (unsigned long long)(a), (unsigned long long)(b)); } while(0)
+#define WM_TRACE_BEGIN(name) do { WM_USDT_BEGIN(name); \
+	if(WM_TRACE_ON()) CTracer::Record('B', #name, 0, 0); } while(0)
+#define WM_TRACE_END(name, a, b) do { WM_USDT_END(name, a, b); \
+	if(WM_TRACE_ON()) CTracer::Record('E', #name, (unsigned long long)(a), (unsigned long long)(b)); } while(0)
+#define WM_TRACE_SPAN(name, start, end, a, b) do { WM_USDT_SPAN(name, start, end, a, b); \
+	if(WM_TRACE_ON()) CTracer::Record('X', #name, (unsigned long long)(a), (unsigned long long)(b), start, end); } while(0)
+#else
+#define WM_TRACE(name, a, b) WM_USDT_POINT(name, a, b)
+#define WM_TRACE_BEGIN(name) WM_USDT_BEGIN(name)
+#define WM_TRACE_END(name, a, b) WM_USDT_END(name, a, b)
+#define WM_TRACE_SPAN(name, start, end, a, b) WM_USDT_SPAN(name, start, end, a, b)
+#endif
@@ -0,0 +1,873 @@
+/*************************
+VirtualMote.cpp
+
+Emulated Wiimote. See VirtualMote.h for what it covers.
+
+The memory map follows what the real mote exposes:
+	EEPROM 0x0000 - 0x16ff, with the accelerometer calibration at 0x16
+	0xa2xxxx speaker, 0xa4xxxx extension, 0xa6xxxx MotionPlus, 0xb0xxxx IR camera
+An extension's calibration sits at 0xa40020 and its ID at 0xa400fa; a MotionPlus
+starts out at 0xa600fa and moves to 0xa4 once 0x04 is written to 0xa600fe.
+Extension bytes, including register reads from 0xa4, go out encrypted after the
+old style 0x00 to 0xa40040 init, and in the clear after the 0x55 to 0xa400f0 one.
+**************************/
+
+#include "stdafx.h"
+#include "Wiimote.h"
+#include "VirtualMote.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/uhid.h>
+
+/* Continuous reporting period */
+#define WM_VMOTE_PERIOD_NS (10 * WM_NS_PER_MS)
+
+/* Calibration the emulated mote and nunchuk report */
+#define WM_VMOTE_ZERO 0x80
+#define WM_VMOTE_ONE_G 0x9a
+#define WM_VMOTE_CHUK_ONE_G 0xb3
+#define WM_VMOTE_BALANCE_ZERO 1000 /* raw reading of an empty Balance Board sensor */
+#define WM_VMOTE_BALANCE_PER_KG 100
+
+/* Layout of each input report - which parts follow the report ID */
+struct _report_layout {
+	byte id;
+	int buttons; /* 2 or 0 (0x3d has none) */
+	int accel; /* 3 or 0 */
+	int ir; /* IR camera bytes */
+	int ext; /* extension bytes */
+};
+
+static const _report_layout reportLayouts[] = {
+	{ WM_MODE_DEFAULT, 2, 0, 0, 0 },
+	{ WM_MODE_ACC, 2, 3, 0, 0 },
+	{ WM_MODE_IR, 2, 0, 0, 8 }, /* really buttons plus 8 extension bytes */
+	{ WM_MODE_ACC_IR, 2, 3, 12, 0 },
+	{ WM_MODE_EXT, 2, 0, 0, 19 },
+	{ WM_MODE_ACC_EXT, 2, 3, 0, 16 },
+	{ WM_MODE_IR_EXT, 2, 0, 10, 9 },
+	{ WM_MODE_ACC_IR_EXT, 2, 3, 10, 6 },
+	{ 0x3d, 0, 0, 0, 21 },
+};
+
+/* Report descriptor with every report ID the real mote declares, so hid-core
+passes them all through to hidraw. Output reports first, then input reports,
+each a run of vendor-defined bytes. */
+static const byte outputReports[][2] = {
+	{ 0x10, 1 }, { 0x11, 1 }, { 0x12, 2 }, { 0x13, 1 }, { 0x14, 1 }, { 0x15, 1 },
+	{ 0x16, 21 }, { 0x17, 6 }, { 0x18, 21 }, { 0x19, 1 }, { 0x1a, 1 } };
+static const byte inputReports[][2] = {
+	{ 0x20, 6 }, { 0x21, 21 }, { 0x22, 4 }, { 0x30, 2 }, { 0x31, 5 }, { 0x32, 10 },
+	{ 0x33, 17 }, { 0x34, 21 }, { 0x35, 21 }, { 0x36, 21 }, { 0x37, 21 }, { 0x3d, 21 },
+	{ 0x3e, 21 }, { 0x3f, 21 } };
+
+static int BuildDescriptor(byte *rd)
+{
+	int n = 0;
+	rd[n++] = 0x05; rd[n++] = 0x01; /* Usage Page (Generic Desktop) */
+	rd[n++] = 0x09; rd[n++] = 0x05; /* Usage (Game Pad) */
+	rd[n++] = 0xa1; rd[n++] = 0x01; /* Collection (Application) */
+	rd[n++] = 0x06; rd[n++] = 0x00; rd[n++] = 0xff; /* Usage Page (Vendor) */
+	rd[n++] = 0x15; rd[n++] = 0x00; /* Logical Minimum (0) */
+	rd[n++] = 0x26; rd[n++] = 0xff; rd[n++] = 0x00; /* Logical Maximum (255) */
+	rd[n++] = 0x75; rd[n++] = 0x08; /* Report Size (8) */
+
+	for(size_t i = 0; i < sizeof(outputReports) / sizeof(outputReports[0]); i++)
+	{
+		rd[n++] = 0x85; rd[n++] = outputReports[i][0]; /* Report ID */
+		rd[n++] = 0x95; rd[n++] = outputReports[i][1]; /* Report Count */
+		rd[n++] = 0x09; rd[n++] = 0x01; /* Usage (Vendor 1) */
+		rd[n++] = 0x91; rd[n++] = 0x00; /* Output (Data, Array) */
+	}
+	for(size_t i = 0; i < sizeof(inputReports) / sizeof(inputReports[0]); i++)
+	{
+		rd[n++] = 0x85; rd[n++] = inputReports[i][0];
+		rd[n++] = 0x95; rd[n++] = inputReports[i][1];
+		rd[n++] = 0x09; rd[n++] = 0x01;
+		rd[n++] = 0x81; rd[n++] = 0x00; /* Input (Data, Array) */
+	}
+
+	rd[n++] = 0xc0; /* End Collection */
+	return n;
+}
+
+CVirtualMote::CVirtualMote(void)
+{
+	carrier = WM_VMOTE_SOCKET;
+	fd = -1;
+	running = false;
+	opened = false;
+
+	scriptButtons = 0;
+	scriptMotion = true;
+	scriptExtButtons = 0;
+	scriptExtHold = 0.f;
+	extension = WM_EXT_NUNCHUK;
+	cloneInit = false;
+	plusActive = false;
+	readLoss = 0;
+	readPieces = 0;
+
+	leds = WM_LED_NONE;
+	rumble = false;
+	mode = WM_MODE_DEFAULT;
+	continuous = false;
+	sent = 0;
+	sentBytes = 0;
+	rumbleChanges = 0;
+	audioReports = 0;
+	emitReports = 0;
+	CRealTime::Defaults(&realTime);
+	speakerRate = 0;
+	audioBytes = audioIgnored = 0;
+	speakerEnabled = false;
+	speakerMuted = true;
+
+	buttons = 0;
+	accel[0] = accel[1] = WM_VMOTE_ZERO;
+	accel[2] = WM_VMOTE_ONE_G;
+	extEncrypted = true;
+	streaming = false;
+	lastLength = 0;
+	start = nextReport = 0;
+
+	ResetMemory();
+}
+
+CVirtualMote::~CVirtualMote(void)
+{
+	Stop();
+}
+
+/* Fill EEPROM and register space with what a mote and its extension would hold */
+void CVirtualMote::ResetMemory()
+{
+	memset(eeprom, 0, sizeof(eeprom));
+	memset(regs, 0, sizeof(regs));
+
+	/* Accelerometer calibration at 0x16, repeated at 0x20 like the real thing */
+	for(int base = 0x16; base <= 0x20; base += 0x0a)
+	{
+		eeprom[base + 0] = eeprom[base + 1] = eeprom[base + 2] = WM_VMOTE_ZERO;
+		eeprom[base + 4] = eeprom[base + 5] = eeprom[base + 6] = WM_VMOTE_ONE_G;
+	}
+
+	LoadExtension();
+}
+
+/* Fill the extension registers with the ID and calibration of whatever is plugged in */
+void CVirtualMote::LoadExtension()
+{
+	byte *ext = regs[1];
+	memset(regs[1], 0, sizeof(regs[1]));
+	memset(regs[2], 0, sizeof(regs[2]));
+
+	static const byte ids[][2] = { { 0x00, 0x00 }, { 0x00, 0x00 }, { 0x01, 0x01 }, { 0x04, 0x05 }, { 0x04, 0x02 } };
+	int type = extension;
+	if(type == WM_EXT_NONE || type > WM_EXT_BALANCE)
+		return;
+
+	if(type == WM_EXT_MOTIONPLUS && !plusActive)
+	{
+		/* Waiting at 0xa6 to be switched on */
+		regs[2][0xfc] = 0xa6; regs[2][0xfd] = 0x20; regs[2][0xfe] = 0x00; regs[2][0xff] = 0x05;
+		return;
+	}
+
+	ext[0xfc] = 0xa4; ext[0xfd] = 0x20; ext[0xfe] = ids[type][0]; ext[0xff] = ids[type][1];
+
+	switch(type)
+	{
+	case WM_EXT_NUNCHUK:
+		ext[0x20] = ext[0x21] = ext[0x22] = WM_VMOTE_ZERO;
+		ext[0x24] = ext[0x25] = ext[0x26] = WM_VMOTE_CHUK_ONE_G;
+		ext[0x28] = 0xe0; ext[0x29] = 0x20; ext[0x2a] = 0x80; /* stick x max, min, center */
+		ext[0x2b] = 0xe0; ext[0x2c] = 0x20; ext[0x2d] = 0x80; /* stick y max, min, center */
+		break;
+	case WM_EXT_CLASSIC:
+		/* Max, min and center of each stick axis, left x and y then right, in 8-bit units */
+		for(int i = 0; i < 4; i++)
+		{
+			ext[0x20 + i * 3] = 0xfc;
+			ext[0x21 + i * 3] = 0x04;
+			ext[0x22 + i * 3] = 0x80;
+		}
+		break;
+	case WM_EXT_BALANCE:
+		/* Every sensor reads WM_VMOTE_BALANCE_ZERO empty and WM_VMOTE_BALANCE_PER_KG more for each kg */
+		for(int i = 0; i < 12; i++)
+		{
+			int raw = WM_VMOTE_BALANCE_ZERO + (i / 4) * 17 * WM_VMOTE_BALANCE_PER_KG;
+			ext[0x24 + i * 2] = (byte)(raw >> 8);
+			ext[0x25 + i * 2] = (byte)raw;
+		}
+		break;
+	}
+}
+
+/* Whether the extension shows up in the port - a MotionPlus only once it's switched on */
+bool CVirtualMote::ExtensionPlugged() const
+{
+	return extension != WM_EXT_NONE && (extension != WM_EXT_MOTIONPLUS || plusActive);
+}
+
+/* Create the mote as a kernel HID device. Uses BUS_VIRTUAL rather than
+BUS_BLUETOOTH so hid-wiimote leaves it alone and hid-generic binds instead. */
+BOOL CVirtualMote::StartUhid()
+{
+	struct uhid_event ev;
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if(fd < 0)
+	{
+		printf("Error opening /dev/uhid (%s)\n", strerror(errno));
+		return false;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "Nintendo RVL-CNT-01 (virtual)");
+	ev.u.create2.rd_size = BuildDescriptor(ev.u.create2.rd_data);
+	ev.u.create2.bus = BUS_VIRTUAL;
+	ev.u.create2.vendor = WIIMOTE_VID;
+	ev.u.create2.product = WIIMOTE_PID;
+
+	if(write(fd, &ev, sizeof(ev)) != sizeof(ev))
+	{
+		printf("Error creating the virtual mote (%s)\n", strerror(errno));
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	carrier = WM_VMOTE_UHID;
+	opened = false;
+	running = true;
+	worker = std::thread(&CVirtualMote::Run, this);
+	return true;
+}
+
+/* Run the mote over a socketpair. Returns the host's end, to be passed to
+CHidDevice::OpenFd(), or -1 on failure. */
+int CVirtualMote::StartSocket()
+{
+	int pair[2];
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+	{
+		printf("Error creating the virtual mote socketpair (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	fd = pair[1];
+	carrier = WM_VMOTE_SOCKET;
+	opened = true;
+	running = true;
+	worker = std::thread(&CVirtualMote::Run, this);
+	return pair[0];
+}
+
+void CVirtualMote::Stop()
+{
+	running = false;
+	if(worker.joinable())
+		worker.join();
+
+	if(fd >= 0)
+	{
+		if(carrier == WM_VMOTE_UHID)
+		{
+			struct uhid_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.type = UHID_DESTROY;
+			if(write(fd, &ev, sizeof(ev)) < 0)
+				printf("Error destroying the virtual mote (%s)\n", strerror(errno));
+		}
+		close(fd);
+		fd = -1;
+	}
+}
+
+void CVirtualMote::SetButtons(unsigned short b) { scriptButtons = b; }
+void CVirtualMote::SetMotion(bool moving) { scriptMotion = moving; }
+void CVirtualMote::SetExtButtons(unsigned short b) { scriptExtButtons = b; }
+void CVirtualMote::SetExtHold(float amount) { scriptExtHold = amount; }
+void CVirtualMote::SetNunchuk(bool present) { SetExtension(present ? WM_EXT_NUNCHUK : WM_EXT_NONE); }
+void CVirtualMote::SetCloneInit(bool clone) { cloneInit = clone; }
+
+void CVirtualMote::SetExtension(int type)
+{
+	extension = type;
+	plusActive = false;
+	LoadExtension();
+}
+void CVirtualMote::SetReadLoss(int every) { readLoss = every; }
+void CVirtualMote::SetRealTime(const WM_RT_CONFIG *config) { realTime = *config; }
+byte CVirtualMote::Leds() const { return leds; }
+bool CVirtualMote::Rumbling() const { return rumble; }
+byte CVirtualMote::ReportMode() const { return mode; }
+bool CVirtualMote::Continuous() const { return continuous; }
+unsigned long long CVirtualMote::ReportsSent() const { return sent; }
+unsigned long long CVirtualMote::BytesSent() const { return sentBytes; }
+
+/* Copy up to max logged rumble transitions, oldest first. Returns how many were copied.
+Entries are written before the count is bumped, so this is safe while running. */
+int CVirtualMote::RumbleLog(WM_VMOTE_RUMBLE *out, int max) const
+{
+	int count = rumbleChanges;
+	if(count > max)
+		count = max;
+
+	for(int i = 0; i < count; i++)
+		out[i] = rumbleLog[i];
+
+	return count;
+}
+
+/* Copy up to max speaker report arrival times, oldest first. Same rules as RumbleLog(). */
+int CVirtualMote::AudioLog(WM_TIME *out, int max) const
+{
+	int count = audioReports;
+	if(count > max)
+		count = max;
+
+	for(int i = 0; i < count; i++)
+		out[i] = audioLog[i];
+
+	return count;
+}
+
+/* Copy up to max input report send times, in the order sent, so entry N-1 is
+the report the host reads as its Nth. Same rules as RumbleLog(). */
+int CVirtualMote::EmitLog(WM_TIME *out, int max) const
+{
+	int count = emitReports;
+	if(count > max)
+		count = max;
+
+	for(int i = 0; i < count; i++)
+		out[i] = emitLog[i];
+
+	return count;
+}
+
+int CVirtualMote::SpeakerRate() const { return speakerRate; }
+unsigned long long CVirtualMote::AudioBytes() const { return audioBytes; }
+unsigned long long CVirtualMote::AudioIgnored() const { return audioIgnored; }
+
+/* Worker thread - wait for output reports until the next input report is due */
+void CVirtualMote::Run()
+{
+	CRealTime rt;
+	rt.Enter(&realTime);
+
+	start = WmNow();
+	nextReport = start + WM_VMOTE_PERIOD_NS;
+
+	while(running)
+	{
+		WM_TIME now = WmNow();
+		WM_TIME wait = nextReport > now ? nextReport - now : 0;
+		if(wait > 50 * WM_NS_PER_MS)
+			wait = 50 * WM_NS_PER_MS;
+
+		struct timespec ts;
+		ts.tv_sec = (time_t)(wait / WM_NS_PER_SEC);
+		ts.tv_nsec = (long)(wait % WM_NS_PER_SEC);
+
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		int ready = ppoll(&pfd, 1, &ts, NULL);
+		if(ready < 0 && errno != EINTR)
+			break;
+
+		if(ready > 0)
+		{
+			if(pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+				break; /* host went away */
+
+			if(carrier == WM_VMOTE_UHID)
+			{
+				if(!ReadUhidEvent())
+					break;
+			}
+			else
+			{
+				byte report[WM_PACKET_SIZE + 2];
+				ssize_t got = read(fd, report, sizeof(report));
+				if(got <= 0)
+					break;
+				HandleOutput(report, (int)got);
+			}
+		}
+
+		Service(WmNow());
+	}
+
+	running = false;
+}
+
+/* Handle one event from /dev/uhid */
+BOOL CVirtualMote::ReadUhidEvent()
+{
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+
+	if(read(fd, &ev, sizeof(ev)) <= 0)
+		return errno == EINTR || errno == EAGAIN;
+
+	switch(ev.type)
+	{
+	case UHID_OPEN:
+		opened = true;
+		break;
+	case UHID_CLOSE:
+		opened = false;
+		break;
+	case UHID_OUTPUT:
+		HandleOutput(ev.u.output.data, ev.u.output.size);
+		break;
+	case UHID_GET_REPORT:
+	{
+		/* The mote has no feature reports */
+		struct uhid_event reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		if(write(fd, &reply, sizeof(reply)) < 0)
+			return false;
+		break;
+	}
+	case UHID_SET_REPORT:
+	{
+		struct uhid_event reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		reply.u.set_report_reply.err = EIO;
+		if(write(fd, &reply, sizeof(reply)) < 0)
+			return false;
+		break;
+	}
+	default:
+		break;
+	}
+
+	return true;
+}
+
+/* Send the next input report if one is due. Continuous mode sends every period,
+non-continuous mode only when something changed. */
+void CVirtualMote::Service(WM_TIME now)
+{
+	if(now < nextReport)
+		return;
+
+	nextReport += WM_VMOTE_PERIOD_NS;
+	if(nextReport <= now)
+		nextReport = now + WM_VMOTE_PERIOD_NS;
+
+	Synthesize(now);
+
+	if(streaming && opened)
+		SendInputReport();
+}
+
+/* Round a synthesized reading to a whole count inside its field */
+static int Quantize(double value, int max)
+{
+	int rounded = (int)floor(value + 0.5);
+	return rounded < 0 ? 0 : rounded > max ? max : rounded;
+}
+
+/* Advance the synthetic motion and pick up the scripted buttons.
+
+On top of the motion, SetExtHold() holds the extension steady away from
+rest: both sticks pushed amount of the way right and amount down, the left
+trigger amount of the way in and the right half that, the gyros turning at
+amount * 100, 200 and 300 deg/s in yaw, roll and pitch, and amount * 10, 20,
+30 and 40 kg more on the board's four sensors. */
+void CVirtualMote::Synthesize(WM_TIME now)
+{
+	buttons = scriptButtons;
+	unsigned short extButtons = scriptExtButtons;
+	double h = scriptExtHold;
+
+	/* Slow circles on the mote and the sticks, a rock back and forth on the
+	nunchuk, turns on the gyros and a sway on the board - or all at rest */
+	double t = (double)(now - start) / WM_NS_PER_SEC;
+	double m = scriptMotion ? 1.0 : 0.0;
+	accel[0] = (byte)(WM_VMOTE_ZERO + m * 10.0 * sin(2.0 * M_PI * t / 4.0));
+	accel[1] = (byte)(WM_VMOTE_ZERO + m * 10.0 * cos(2.0 * M_PI * t / 4.0));
+	accel[2] = WM_VMOTE_ONE_G;
+
+	byte *ext = regs[1];
+	switch(extension)
+	{
+	case WM_EXT_NUNCHUK:
+		/* The stick's calibration puts full travel 0x60 either side of 0x80 */
+		ext[0] = (byte)Quantize(0x80 + m * 0x40 * sin(2.0 * M_PI * t / 3.0) + h * 0x60, 0xff); /* stick x */
+		ext[1] = (byte)Quantize(0x80 + m * 0x40 * cos(2.0 * M_PI * t / 3.0) - h * 0x60, 0xff); /* stick y */
+		ext[2] = (byte)(WM_VMOTE_ZERO + m * 20.0 * sin(2.0 * M_PI * t / 5.0));
+		ext[3] = WM_VMOTE_ZERO;
+		ext[4] = WM_VMOTE_CHUK_ONE_G;
+		ext[5] = (byte)(0x03 & ~extButtons); /* C and Z, active low */
+		break;
+
+	case WM_EXT_CLASSIC:
+	{
+		/* Left stick circling, the rest where the hold puts them. The
+		calibration spans 0x04-0xfc around 0x80 in 8-bit units, which is 31
+		steps either side of 32 on the left's 6-bit axes and 15.5 of 16 on the
+		right's 5-bit ones. Buttons are an active-low word. */
+		int lx = Quantize(32 + m * 16 * sin(2.0 * M_PI * t / 3.0) + h * 31, 0x3f);
+		int ly = Quantize(32 + m * 16 * cos(2.0 * M_PI * t / 3.0) - h * 31, 0x3f);
+		int rx = Quantize(16 + h * 15.5, 0x1f), ry = Quantize(16 - h * 15.5, 0x1f);
+		int lt = Quantize(h * 31, 0x1f), rt = Quantize(h * 31 / 2, 0x1f);
+		ext[0] = (byte)(lx | ((rx & 0x18) << 3));
+		ext[1] = (byte)(ly | ((rx & 0x06) << 5));
+		ext[2] = (byte)(((rx & 0x01) << 7) | ((lt & 0x18) << 2) | ry);
+		ext[3] = (byte)(((lt & 0x07) << 5) | rt);
+		ext[4] = (byte)~(extButtons >> 8);
+		ext[5] = (byte)~extButtons;
+		break;
+	}
+
+	case WM_EXT_MOTIONPLUS:
+	{
+		/* Yaw, roll and pitch as 14-bit rates, all in the slow range */
+		int rate[3];
+		for(int i = 0; i < 3; i++)
+			rate[i] = Quantize(WM_MPLUS_ZERO + m * 2000.0 * sin(2.0 * M_PI * t / (2.0 + i)) + h * 100.0 * (i + 1) * WM_MPLUS_SLOW_SCALE, 0x3fff);
+		ext[0] = (byte)rate[0];
+		ext[1] = (byte)rate[1];
+		ext[2] = (byte)rate[2];
+		ext[3] = (byte)(((rate[0] >> 6) & 0xfc) | 0x02 | 0x01); /* yaw slow, pitch slow */
+		ext[4] = (byte)(((rate[1] >> 6) & 0xfc) | 0x02); /* roll slow, nothing plugged in behind */
+		ext[5] = (byte)(((rate[2] >> 6) & 0xfc) | 0x02); /* MotionPlus data, not passthrough */
+		break;
+	}
+
+	case WM_EXT_BALANCE:
+		/* About 20 kg on each sensor, swaying between them */
+		for(int i = 0; i < 4; i++)
+		{
+			double kg = 20.0 + m * 5.0 * sin(2.0 * M_PI * t / 2.0 + i) + h * 10.0 * (i + 1);
+			int raw = Quantize(WM_VMOTE_BALANCE_ZERO + kg * WM_VMOTE_BALANCE_PER_KG, 0xffff);
+			ext[i * 2] = (byte)(raw >> 8);
+			ext[i * 2 + 1] = (byte)raw;
+		}
+		break;
+	}
+}
+
+/* Extension bytes are sent encrypted unless the extension was initialized in the clear */
+byte CVirtualMote::ExtByte(byte value) const
+{
+	if(!extEncrypted)
+		return value;
+	return (byte)((byte)(value - 0x17) ^ 0x17);
+}
+
+/* Build and send an input report in the current mode */
+void CVirtualMote::SendInputReport()
+{
+	const _report_layout *layout = &reportLayouts[0];
+	for(size_t i = 0; i < sizeof(reportLayouts) / sizeof(reportLayouts[0]); i++)
+	{
+		if(reportLayouts[i].id == mode)
+			layout = &reportLayouts[i];
+	}
+
+	byte report[WM_PACKET_SIZE];
+	int n = 0;
+	memset(report, 0, sizeof(report));
+
+	report[n++] = layout->id;
+	if(layout->buttons)
+	{
+		report[n++] = (byte)(buttons >> 8);
+		report[n++] = (byte)(buttons & 0xff);
+	}
+	for(int i = 0; i < layout->accel; i++)
+		report[n++] = accel[i];
+	for(int i = 0; i < layout->ir; i++)
+		report[n++] = 0xff; /* no IR dots */
+	for(int i = 0; i < layout->ext; i++)
+		report[n++] = ExtensionPlugged() ? ExtByte(regs[1][i]) : 0x00;
+
+	/* Non-continuous mode only reports changes */
+	if(!continuous && n == lastLength && memcmp(report, lastReport, n) == 0)
+		return;
+	memcpy(lastReport, report, n);
+	lastLength = n;
+
+	Emit(report, n);
+}
+
+/* Controller status, 0x20 */
+void CVirtualMote::SendStatus()
+{
+	byte report[7];
+	report[0] = WM_MODE_EXP_PORT;
+	report[1] = (byte)(buttons >> 8);
+	report[2] = (byte)(buttons & 0xff);
+	report[3] = (byte)(leds | (ExtensionPlugged() ? 0x02 : 0x00));
+	report[4] = 0x00;
+	report[5] = 0x00;
+	report[6] = 0xc0; /* battery */
+	Emit(report, sizeof(report));
+}
+
+/* Acknowledge an output report, 0x22 */
+void CVirtualMote::SendAck(byte reportId, byte error)
+{
+	byte report[5];
+	report[0] = WM_MODE_WRITE_DATA;
+	report[1] = (byte)(buttons >> 8);
+	report[2] = (byte)(buttons & 0xff);
+	report[3] = reportId;
+	report[4] = error;
+	Emit(report, sizeof(report));
+}
+
+/* Find the backing store for a read or write, or set the error nibble */
+byte *CVirtualMote::Memory(bool registers, DWORD address, int length, byte *error)
+{
+	*error = WM_MEM_OK;
+
+	if(!registers)
+	{
+		DWORD offset = address & 0xffff;
+		if(offset + length > WM_VMOTE_EEPROM_SIZE)
+		{
+			*error = WM_MEM_NONEXISTENT;
+			return NULL;
+		}
+		return &eeprom[offset];
+	}
+
+	int block;
+	switch((address >> 16) & 0xff)
+	{
+	case 0xa2: block = 0; break;
+	case 0xa4: block = 1; break;
+	case 0xa6: block = 2; break;
+	case 0xb0: block = 3; break;
+	default:
+		*error = WM_MEM_NONEXISTENT;
+		return NULL;
+	}
+
+	DWORD offset = address & 0xff;
+	bool absent = (block == 1 && !ExtensionPlugged()) || (block == 2 && (extension != WM_EXT_MOTIONPLUS || plusActive));
+	if(offset + length > 256 || absent)
+	{
+		*error = WM_MEM_WRITE_ONLY;
+		return NULL;
+	}
+	return &regs[block][offset];
+}
+
+/* 0x17 - send the requested bytes back as 0x21 reports of up to 16 bytes each */
+void CVirtualMote::HandleRead(const byte *report)
+{
+	bool registers = (report[1] & 0x04) != 0;
+	DWORD address = (report[2] << 16) | (report[3] << 8) | report[4];
+	int size = (report[5] << 8) | report[6];
+	byte error;
+
+	byte *data = Memory(registers, address, size, &error);
+
+	for(int done = 0; done < size || (done == 0 && error); done += 16)
+	{
+		int chunk = size - done > 16 ? 16 : size - done;
+		DWORD chunkAddress = address + done;
+		byte reply[WM_PACKET_SIZE];
+
+		memset(reply, 0, sizeof(reply));
+		reply[0] = WM_MODE_READ_DATA;
+		reply[1] = (byte)(buttons >> 8);
+		reply[2] = (byte)(buttons & 0xff);
+		reply[3] = (byte)(((chunk - 1) << 4) | error);
+		reply[4] = (byte)((chunkAddress >> 8) & 0xff);
+		reply[5] = (byte)(chunkAddress & 0xff);
+
+		if(data)
+		{
+			bool encrypt = registers && ((address >> 16) & 0xff) == 0xa4;
+			for(int i = 0; i < chunk; i++)
+				reply[6 + i] = encrypt ? ExtByte(data[done + i]) : data[done + i];
+		}
+
+		/* Lose the odd piece on the way, if asked to */
+		int loss = readLoss;
+		if(!error && loss && ++readPieces % loss == 0)
+			continue;
+
+		Emit(reply, sizeof(reply));
+
+		if(error)
+			break;
+	}
+}
+
+/* 0x16 - store up to 16 bytes and acknowledge */
+void CVirtualMote::HandleWrite(const byte *report)
+{
+	bool registers = (report[1] & 0x04) != 0;
+	DWORD address = (report[2] << 16) | (report[3] << 8) | report[4];
+	int size = report[5] > 16 ? 16 : report[5];
+	byte error;
+
+	byte *data = Memory(registers, address, size, &error);
+	if(data)
+	{
+		memcpy(data, &report[6], size);
+
+		/* Extension init - old encrypted style, or the newer one in the clear */
+		if(registers && address == 0xa40040 && report[6] == 0x00)
+			extEncrypted = true;
+		if(registers && address == 0xa400f0 && report[6] == 0x55 && !cloneInit)
+			extEncrypted = false;
+
+		/* Switching a MotionPlus on moves it to 0xa4, where it shows up as plugged in */
+		if(registers && address == 0xa600fe && report[6] == 0x04 && extension == WM_EXT_MOTIONPLUS && !plusActive)
+		{
+			plusActive = true;
+			LoadExtension();
+			SendAck(WM_OUT_WRITE_DATA, error);
+			SendStatus();
+			return;
+		}
+	}
+
+	SendAck(WM_OUT_WRITE_DATA, error);
+}
+
+/* Take a 0x18 report of ADPCM. It only plays if the speaker was enabled,
+unmuted and configured through 0xa20001-0xa20009 first, as on a real mote. */
+void CVirtualMote::HandleAudio(const byte *report)
+{
+	const byte *speaker = regs[0];
+	int divider = speaker[3] | (speaker[4] << 8);
+	bool ready = speakerEnabled && !speakerMuted && speaker[8] == 0x01 && speaker[9] == 0x01 && divider;
+
+	speakerRate = ready ? WM_SPKR_CLOCK / divider : 0;
+	if(!ready)
+	{
+		audioIgnored++;
+		return;
+	}
+
+	audioBytes += report[1] >> 3;
+
+	int n = audioReports;
+	if(n < WM_VMOTE_AUDIO_LOG)
+	{
+		audioLog[n] = WmNow();
+		audioReports = n + 1;
+	}
+}
+
+/* React to an output report from the host. Every output report carries the rumble bit. */
+void CVirtualMote::HandleOutput(const byte *report, int length)
+{
+	if(length < 2)
+		return;
+
+	bool on = (report[1] & WM_OUT_RUMBLE) != 0;
+	if(on != rumble)
+	{
+		/* Log the moment the motor would have switched, for checking effect timing */
+		int n = rumbleChanges;
+		if(n < WM_VMOTE_RUMBLE_LOG)
+		{
+			rumbleLog[n].at = WmNow();
+			rumbleLog[n].on = on;
+			rumbleChanges = n + 1;
+		}
+	}
+	rumble = on;
+
+	switch(report[0])
+	{
+	case WM_OUT_LEDFF:
+		leds = report[1] & 0xf0;
+		break;
+	case WM_OUT_REPORT_TYPE:
+		if(length < 3)
+			return;
+		continuous = (report[1] & WM_MODE_CONT) != 0;
+		mode = report[2];
+		streaming = true;
+		/* The mote answers a mode change with a report in the new mode */
+		lastLength = 0;
+		SendInputReport();
+		break;
+	case WM_OUT_CTRLSTAT:
+		SendStatus();
+		break;
+	case WM_OUT_SPKR_ENABLE:
+		speakerEnabled = (report[1] & 0x04) != 0;
+		break;
+	case WM_OUT_SPKR_MUTE:
+		speakerMuted = (report[1] & 0x04) != 0;
+		break;
+	case WM_OUT_SPKR_DATA:
+		HandleAudio(report);
+		break;
+	case WM_OUT_WRITE_DATA:
+		if(length >= 7)
+			HandleWrite(report);
+		break;
+	case WM_OUT_READ_DATA:
+		if(length >= 7)
+			HandleRead(report);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Hand one input report to the host */
+void CVirtualMote::Emit(const byte *report, int length)
+{
+	WM_TIME now = WmNow();
+
+	if(carrier == WM_VMOTE_UHID)
+	{
+		struct uhid_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = (unsigned short)length;
+		memcpy(ev.u.input2.data, report, length);
+		if(write(fd, &ev, sizeof(ev)) < 0)
+			return;
+	}
+	else
+	{
+		if(write(fd, report, length) < 0)
+			return;
+	}
+
+	sent++;
+	sentBytes += length;
+
+	int n = emitReports;
+	if(n < WM_VMOTE_EMIT_LOG)
+	{
+		emitLog[n] = now;
+		emitReports = n + 1;
+	}
+}
+
+#endif /* !_WIN32 */
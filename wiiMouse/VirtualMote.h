@@ -0,0 +1,145 @@
+/*************************
+VirtualMote.h
+
+An emulated Wiimote for exercising the whole stack without hardware (Linux only).
+
+It answers the handshake CWiimote::Initialize() goes through - report mode
+changes, status requests, EEPROM and register reads and writes - and streams
+synthetic buttons, accelerometer and extension data in whatever report mode
+the host selects, honouring continuous and non-continuous reporting. The
+extension can be a nunchuk (the default), Classic Controller, MotionPlus or
+Balance Board, and can be made to refuse the unencrypted init like a clone.
+
+Two carriers are available:
+	StartUhid() creates a kernel HID device through /dev/uhid, so the mote shows
+	up under /dev/hidraw* and CHidDevice::Open() finds it like real hardware.
+	StartSocket() hands back one end of a SOCK_SEQPACKET socketpair for
+	CHidDevice::OpenFd(), for machines without /dev/uhid or for many motes at once.
+**************************/
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <thread>
+#include "Timing.h"
+#include "RealTime.h"
+
+#define WM_VMOTE_UHID 0
+#define WM_VMOTE_SOCKET 1
+
+#define WM_VMOTE_EEPROM_SIZE 0x1700 /* 5.5KB of user EEPROM */
+#define WM_VMOTE_REG_BLOCKS 4 /* 0xa2 speaker, 0xa4 extension, 0xa6 MotionPlus, 0xb0 IR camera */
+#define WM_VMOTE_RUMBLE_LOG 1024 /* Rumble transitions remembered for timing checks */
+#define WM_VMOTE_AUDIO_LOG 8192 /* Speaker report arrival times remembered for pacing checks */
+#define WM_VMOTE_EMIT_LOG 8192 /* Input report send times remembered for latency checks */
+
+struct WM_VMOTE_RUMBLE {
+	WM_TIME at; /* when the report that flipped the bit arrived */
+	bool on;
+};
+
+class CVirtualMote
+{
+public:
+	CVirtualMote(void);
+	~CVirtualMote(void);
+	BOOL StartUhid();
+	int StartSocket();
+	void Stop();
+
+	/* Synthetic input - safe to change while running */
+	void SetButtons(unsigned short buttons);
+	void SetMotion(bool moving);
+	void SetNunchuk(bool present);
+	void SetExtButtons(unsigned short buttons); /* extension buttons held, WM_CHUK_BUT_* or WM_CLASSIC_* bits */
+	void SetExtHold(float amount); /* see Synthesize() */
+	void SetExtension(int extension); /* WM_EXT_*, before the mote starts */
+	void SetCloneInit(bool clone); /* ignore the 0x55 init, like clones that only do encrypted */
+	void SetReadLoss(int every); /* drop every Nth 0x21 piece, 0 for none */
+	void SetRealTime(const WM_RT_CONFIG *config); /* scheduling for the worker, before the mote starts */
+
+	/* What the host has asked of the mote so far */
+	byte Leds() const;
+	bool Rumbling() const;
+	byte ReportMode() const;
+	bool Continuous() const;
+	unsigned long long ReportsSent() const;
+	unsigned long long BytesSent() const;
+	int RumbleLog(WM_VMOTE_RUMBLE *out, int max) const;
+	int AudioLog(WM_TIME *out, int max) const;
+	int EmitLog(WM_TIME *out, int max) const;
+	int SpeakerRate() const;
+	unsigned long long AudioBytes() const;
+	unsigned long long AudioIgnored() const;
+private:
+	void Run();
+	void Service(WM_TIME now);
+	void HandleOutput(const byte *report, int length);
+	void HandleRead(const byte *report);
+	void HandleWrite(const byte *report);
+	void HandleAudio(const byte *report);
+	void SendStatus();
+	void SendAck(byte reportId, byte error);
+	void SendInputReport();
+	void Synthesize(WM_TIME now);
+	void Emit(const byte *report, int length);
+	byte *Memory(bool registers, DWORD address, int length, byte *error);
+	byte ExtByte(byte value) const;
+	bool ExtensionPlugged() const;
+	void ResetMemory();
+	void LoadExtension();
+	BOOL ReadUhidEvent();
+
+	int carrier;
+	int fd;
+	std::thread worker;
+	std::atomic<bool> running;
+	bool opened; /* someone has the hidraw node open */
+
+	/* Script */
+	std::atomic<unsigned short> scriptButtons;
+	std::atomic<bool> scriptMotion;
+	std::atomic<unsigned short> scriptExtButtons;
+	std::atomic<float> scriptExtHold;
+	std::atomic<int> extension; /* WM_EXT_* */
+	std::atomic<bool> cloneInit;
+	std::atomic<int> readLoss;
+	WM_RT_CONFIG realTime;
+	unsigned readPieces; /* 0x21 pieces made, counted for readLoss */
+
+	/* Output state set by the host */
+	std::atomic<byte> leds;
+	std::atomic<bool> rumble;
+	std::atomic<byte> mode;
+	std::atomic<bool> continuous;
+	std::atomic<unsigned long long> sent;
+	std::atomic<unsigned long long> sentBytes; /* input reports, report ID included */
+	WM_VMOTE_RUMBLE rumbleLog[WM_VMOTE_RUMBLE_LOG];
+	std::atomic<int> rumbleChanges;
+	WM_TIME audioLog[WM_VMOTE_AUDIO_LOG];
+	std::atomic<int> audioReports;
+	WM_TIME emitLog[WM_VMOTE_EMIT_LOG];
+	std::atomic<int> emitReports;
+	std::atomic<int> speakerRate; /* Hz, or 0 unless the speaker is on, unmuted and configured */
+	std::atomic<unsigned long long> audioBytes;
+	std::atomic<unsigned long long> audioIgnored; /* 0x18 reports sent while the speaker was off */
+
+	/* Device state, worker thread only */
+	unsigned short buttons;
+	byte accel[3];
+	bool extEncrypted;
+	bool plusActive; /* a MotionPlus has been switched on and moved from 0xa6 to 0xa4 */
+	bool streaming;
+	bool speakerEnabled;
+	bool speakerMuted;
+	byte lastReport[WM_PACKET_SIZE];
+	int lastLength;
+	WM_TIME start;
+	WM_TIME nextReport;
+	byte eeprom[WM_VMOTE_EEPROM_SIZE];
+	byte regs[WM_VMOTE_REG_BLOCKS][256];
+};
+
+#endif /* !_WIN32 */
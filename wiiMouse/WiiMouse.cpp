@@ -8,18 +8,405 @@ In this particular implementation, the debug loop is used to drive the keyboard
 
 #include "stdafx.h"
 #include "Wiimote.h"
+#include "Bench.h"
+#include "Analytics.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <thread>
+#include "VirtualMote.h"
+#include "ControlSocket.h"
+#endif
+
+static CWiimote *active_device = NULL;
+
+#ifdef _WIN32
+/* Ctrl+Break dumps the latency histograms and report counters on demand without stopping the loop.
+The handler runs on its own thread, and both are safe to read from there. */
+static BOOL WINAPI ConsoleHandler(DWORD ctrlType)
+{
+	if(ctrlType == CTRL_BREAK_EVENT && active_device)
+	{
+		active_device->DumpLatency();
+		active_device->PrintStats();
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+/* SIGQUIT (Ctrl+\) does the same on Linux. The signal is blocked everywhere
+and picked up by this thread with sigwait, so the dump runs outside signal context.
+A daemon also blocks SIGTERM and SIGINT, which end the read loop cleanly. */
+static void SignalThread(sigset_t set)
+{
+	for(;;)
+	{
+		int sig;
+		if(sigwait(&set, &sig) != 0)
+			continue;
+
+		if(sig != SIGQUIT)
+		{
+			if(active_device)
+				active_device->commands.Post(WM_CMD_QUIT);
+			else
+				_exit(1);
+		}
+		else if(active_device)
+		{
+			active_device->DumpLatency();
+			active_device->PrintStats();
+			fflush(stdout);
+		}
+	}
+}
+#endif
+
+/* -watch: follow another instance's shared state and print it ten times a second */
+static int WatchState(int device)
+{
+	CStateReader reader;
+	if(!reader.Open(device))
+	{
+		printf("No shared state for device %d - is wiiMouse running with -share %d?\n", device, device);
+		return 1;
+	}
+
+	WM_SHARED_STATE state;
+	unsigned sequence = 0;
+	while(reader.Live())
+	{
+		if(!reader.Wait(sequence, 1000) || !reader.Read(&state, &sequence))
+			continue;
+
+		printf("report %llu buttons %04x tilt %6.1f %6.1f %6.1f force %5.2f %5.2f %5.2f stick %5.2f %5.2f ir %s battery %i%%\n",
+			state.report, state.buttons, state.tilt[0], state.tilt[1], state.tilt[2],
+			state.force[0], state.force[1], state.force[2], state.stick[0], state.stick[1],
+			state.ir[0].visible ? "yes" : "no", state.battery);
+		fflush(stdout);
+		Sleep(100);
+	}
+
+	printf("Writer went away\n");
+	return 0;
+}
+
+/* -listen: print the state arriving from another instance's -stream */
+static int ListenState(int port)
+{
+	CStateReceiver receiver;
+	if(!receiver.Open(port))
+		return 1;
+
+	printf("Listening for mote state on UDP port %d\n", port);
+	WM_TIME nextPrint = 0;
+	for(;;)
+	{
+		if(receiver.Receive(1000) < 0)
+			continue;
+
+		WM_TIME now = WmNow();
+		if(now < nextPrint)
+			continue;
+		nextPrint = now + 100 * WM_NS_PER_MS;
+
+		WM_NET_STATS stats;
+		receiver.GetStats(&stats);
+		for(int device = 0; device < WM_NET_MAX_DEVICES; device++)
+		{
+			WM_SHARED_STATE state;
+			if(!receiver.GetState(device, &state))
+				continue;
+			printf("device %d%s buttons %04x tilt %6.1f %6.1f %6.1f stick %5.2f %5.2f (%llu frames, %llu lost, %llu bytes)\n",
+				device, receiver.Synced(device) ? "" : " (resyncing)", state.buttons,
+				state.tilt[0], state.tilt[1], state.tilt[2], state.stick[0], state.stick[1],
+				stats.frames, stats.lost, stats.bytes);
+		}
+		fflush(stdout);
+	}
+}
+
+/* -analyze: statistics over capture files, decoded on jobs threads */
+static int AnalyzeCaptures(int count, _TCHAR **paths, int jobs)
+{
+	CCaptureAnalyzer analyzer;
+	for(int i = 0; i < count; i++)
+		if(!analyzer.Add(paths[i]))
+			return 1;
+
+	WM_ANALYTICS summary;
+	WM_TIME started = WmNow();
+	analyzer.Run(jobs, &summary);
+	double seconds = (double)(WmNow() - started) / WM_NS_PER_SEC;
+
+	CCaptureAnalyzer::Print(stdout, &summary);
+	printf("Decoded %llu records on %d thread%s in %.2f s (%.1f M records/s, %.0f MB/s)\n",
+		summary.records, jobs, jobs == 1 ? "" : "s", seconds, summary.records / seconds / 1e6,
+		analyzer.Bytes() / seconds / (1024 * 1024));
+	return 0;
+}
+
+/* -replay: how smooth and how late each pointer schedule is over captures */
+static int ReplayCaptures(int count, _TCHAR **paths, int rate)
+{
+	CCaptureAnalyzer analyzer;
+	for(int i = 0; i < count; i++)
+		if(!analyzer.Add(paths[i]))
+			return 1;
+
+	static const int schedules[] = { WM_SCHED_OFF, WM_SCHED_INTERPOLATE, WM_SCHED_EXTRAPOLATE };
+	static const char *names[] = { "per report", "interpolate", "extrapolate" };
+	static const int pointerModes[] = { WM_MY_MOUSE, WM_MY_FPS };
+	WM_SMOOTHNESS baseline = {};
+	printf("Pointer on a %d Hz display, ticking at %d Hz:\n", rate, rate);
+	for(int p = 0; p < 2; p++)
+	{
+		for(int m = 0; m < 3; m++)
+		{
+			WM_SCHED_CONFIG schedule;
+			CPointerScheduler::Defaults(&schedule);
+			schedule.mode = schedules[m];
+			schedule.rate = rate;
+
+			WM_SMOOTHNESS result;
+			analyzer.Smoothness(pointerModes[p], &schedule, rate, &result);
+			if(m == 0)
+				baseline = result;
+			printf("  %-5s %-12s %6.1f moves/s  step variance %7.2f  lag %6.2f ms (%+6.2f)  drift %4.1f\n",
+				CProfile::ModeName(pointerModes[p]), names[m], result.seconds > 0 ? result.moves / result.seconds : 0.0,
+				result.stepVariance, result.lagMs, result.lagMs - baseline.lagMs, result.drift);
+		}
+	}
+	printf("%llu reports, %.1f s\n", baseline.reports, baseline.seconds);
+	return 0;
+}
 
 int _tmain(int argc, _TCHAR* argv[])
 {
 	int retCode = 0;
 	CWiimote * wiimote_device;
+	WM_TIME latencyInterval = 0;
+	WM_TIME statsInterval = 0;
+	WM_TIME idleAfter = WM_IDLE_AFTER_NS;
+	bool useVirtual = false;
+	bool useGamepad = false;
+	const char *capturePath = NULL;
+	const char *tracePath = NULL;
+	int shareDevice = -1;
+	const char *streamTarget = NULL;
+	const char *controlPath = NULL;
+	const char *profileDir = NULL;
+	WM_RT_CONFIG realTime;
+	CRealTime::Defaults(&realTime);
+	int jobs = CCaptureAnalyzer::DefaultJobs();
+	WM_SCAN_CONFIG scan;
+	CHidDevice::ScanDefaults(&scan);
+	WM_SCHED_CONFIG schedule;
+	CPointerScheduler::Defaults(&schedule);
+
+	/* -latency N dumps the latency histograms every N seconds,
+	-stats N prints a report counter summary every N seconds,
+	-idle N drops to buttons-only reports after N quiet seconds, 0 never does,
+	-virtual runs against an emulated mote (Linux only),
+	-outrate N moves the pointer N times a second, interpolating between reports (see PointerScheduler.h),
+	-predict runs the pointer ahead of the last report instead of interpolating,
+	-gamepad shows the mote as a virtual gamepad instead of driving the keyboard and mouse (Linux only),
+	-capture FILE records every input report to FILE,
+	-trace FILE records the tracepoints (see Trace.h) and writes them to FILE as Chrome trace JSON on exit,
+	-share N publishes decoded state as shared-memory device N,
+	-watch N prints the state another instance is sharing as device N,
+	-stream HOST[:PORT] sends decoded state over UDP,
+	-listen PORT prints state arriving from -stream,
+	-profiles DIR loads mouse.profile, emu.profile and fps.profile from DIR and reloads them on change,
+	-rt N reads and decodes at real-time priority N (SCHED_FIFO 1-99; MMCSS on Windows),
+	-cpu N pins the read loop to CPU N,
+	-busypoll spins on the device instead of sleeping between reports,
+	-nodevcache always enumerates devices, rather than trying the path that opened last time first,
+	-jobs N sets the threads -analyze uses, one per CPU by default,
+	-analyze FILE... prints statistics over captures and exits (must come last),
+	-replay FILE... prints how smooth and late each pointer schedule is over captures at the -outrate rate and exits (must come last),
+	-daemon SOCKET keeps running until told to quit on a control socket (Linux only),
+	-bench NAME runs a measurement and exits */
+	for(int i = 1; i < argc; i++)
+	{
+		if(_tcscmp(argv[i], _T("-latency")) == 0 && i + 1 < argc)
+			latencyInterval = (WM_TIME)_ttoi(argv[++i]) * WM_NS_PER_SEC;
+		else if(_tcscmp(argv[i], _T("-stats")) == 0 && i + 1 < argc)
+			statsInterval = (WM_TIME)_ttoi(argv[++i]) * WM_NS_PER_SEC;
+		else if(_tcscmp(argv[i], _T("-idle")) == 0 && i + 1 < argc)
+			idleAfter = (WM_TIME)_ttoi(argv[++i]) * WM_NS_PER_SEC;
+		else if(_tcscmp(argv[i], _T("-virtual")) == 0)
+			useVirtual = true;
+		else if(_tcscmp(argv[i], _T("-outrate")) == 0 && i + 1 < argc)
+		{
+			schedule.rate = _ttoi(argv[++i]);
+			if(schedule.rate <= 0)
+				schedule.mode = WM_SCHED_OFF;
+			else if(schedule.mode == WM_SCHED_OFF)
+				schedule.mode = WM_SCHED_INTERPOLATE;
+		}
+		else if(_tcscmp(argv[i], _T("-predict")) == 0)
+			schedule.mode = WM_SCHED_EXTRAPOLATE;
+		else if(_tcscmp(argv[i], _T("-gamepad")) == 0)
+			useGamepad = true;
+		else if(_tcscmp(argv[i], _T("-capture")) == 0 && i + 1 < argc)
+			capturePath = argv[++i];
+		else if(_tcscmp(argv[i], _T("-trace")) == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else if(_tcscmp(argv[i], _T("-share")) == 0 && i + 1 < argc)
+			shareDevice = _ttoi(argv[++i]);
+		else if(_tcscmp(argv[i], _T("-watch")) == 0 && i + 1 < argc)
+			return WatchState(_ttoi(argv[i + 1]));
+		else if(_tcscmp(argv[i], _T("-stream")) == 0 && i + 1 < argc)
+			streamTarget = argv[++i];
+		else if(_tcscmp(argv[i], _T("-listen")) == 0 && i + 1 < argc)
+			return ListenState(_ttoi(argv[i + 1]));
+		else if(_tcscmp(argv[i], _T("-profiles")) == 0 && i + 1 < argc)
+			profileDir = argv[++i];
+		else if(_tcscmp(argv[i], _T("-rt")) == 0 && i + 1 < argc)
+			realTime.priority = _ttoi(argv[++i]);
+		else if(_tcscmp(argv[i], _T("-cpu")) == 0 && i + 1 < argc)
+			realTime.cpu = _ttoi(argv[++i]);
+		else if(_tcscmp(argv[i], _T("-busypoll")) == 0)
+			realTime.busyPoll = true;
+		else if(_tcscmp(argv[i], _T("-nodevcache")) == 0)
+			scan.cacheFile[0] = 0;
+		else if(_tcscmp(argv[i], _T("-jobs")) == 0 && i + 1 < argc)
+			jobs = _ttoi(argv[++i]);
+		else if(_tcscmp(argv[i], _T("-analyze")) == 0 && i + 1 < argc)
+			return AnalyzeCaptures(argc - i - 1, &argv[i + 1], jobs);
+		else if(_tcscmp(argv[i], _T("-replay")) == 0 && i + 1 < argc)
+			return ReplayCaptures(argc - i - 1, &argv[i + 1], schedule.rate > 0 ? schedule.rate : WM_SCHED_RATE);
+		else if(_tcscmp(argv[i], _T("-daemon")) == 0 && i + 1 < argc)
+			controlPath = argv[++i];
+		else if(_tcscmp(argv[i], _T("-bench")) == 0 && i + 1 < argc)
+			return RunBench(argv[i + 1]);
+	}
+	CHidDevice::Configure(&scan);
+	if(tracePath)
+		CTracer::Start();
+
+#ifdef _WIN32
+	if(useVirtual)
+		printf("The virtual mote needs /dev/uhid and is only available on Linux.\n");
+	if(controlPath)
+		printf("The control socket is a Unix-domain socket and is only available on Linux.\n");
+	if(useGamepad)
+	{
+		printf("Virtual gamepads need uinput and are only available on Linux; using the keyboard and mouse.\n");
+		useGamepad = false;
+	}
+
 	wiimote_device = new CWiimote();
+#else
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGQUIT);
+	if(controlPath)
+	{
+		sigaddset(&set, SIGTERM);
+		sigaddset(&set, SIGINT);
+	}
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	std::thread(SignalThread, set).detach();
 
-	if(wiimote_device->mote.connected)
+	CVirtualMote virtual_mote;
+	if(useVirtual)
+	{
+		if(virtual_mote.StartUhid())
+		{
+			/* The hidraw node shows up asynchronously once the kernel has bound the device */
+			wiimote_device = new CWiimote();
+			for(int tries = 0; !wiimote_device->mote.connected && tries < 20; tries++)
+			{
+				delete wiimote_device;
+				Sleep(100);
+				wiimote_device = new CWiimote();
+			}
+		}
+		else
+		{
+			printf("Falling back to a socketpair for the virtual mote.\n");
+			wiimote_device = new CWiimote(virtual_mote.StartSocket(), "virtual");
+		}
+	}
+	else
+		wiimote_device = new CWiimote();
+#endif
+
+	wiimote_device->latencyDumpInterval = latencyInterval;
+	wiimote_device->statsSummaryInterval = statsInterval;
+	wiimote_device->idleAfter = idleAfter;
+	wiimote_device->realTime = realTime;
+	wiimote_device->gamepadOutput = useGamepad;
+	wiimote_device->pointerSchedule = schedule;
+
+	active_device = wiimote_device;
+#ifdef _WIN32
+	SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+#endif
+
+	if(wiimote_device->mote.connected && capturePath)
+		wiimote_device->StartCapture(capturePath);
+	if(wiimote_device->mote.connected && shareDevice >= 0)
+		wiimote_device->StartSharing(shareDevice);
+
+	CStateSender sender;
+	if(wiimote_device->mote.connected && streamTarget)
+	{
+		char host[256];
+		int port = WM_NET_PORT;
+		_snprintf(host, sizeof(host), "%s", streamTarget);
+		host[sizeof(host) - 1] = 0;
+		char *colon = strrchr(host, ':');
+		if(colon)
+		{
+			*colon = 0;
+			port = atoi(colon + 1);
+		}
+		if(sender.Open(host, port))
+			wiimote_device->StreamTo(&sender, 0);
+	}
+
+	CProfileWatcher profiles;
+	if(wiimote_device->mote.connected && profileDir && profiles.Start(profileDir))
+		wiimote_device->WatchProfiles(&profiles);
+
+#ifndef _WIN32
+	CControlServer control;
+	if(wiimote_device->mote.connected && controlPath)
+	{
+		if(control.Open(controlPath, wiimote_device))
+		{
+			wiimote_device->quitOnHome = false;
+			printf("Listening for commands on %s\n", controlPath);
+		}
+		else
+			retCode = 1;
+	}
+#endif
+
+	if(wiimote_device->mote.connected && !retCode)
 		retCode = wiimote_device->DebugLoop();
 
+#ifndef _WIN32
+	control.Close();
+#endif
+	profiles.Stop();
+
+#ifdef _WIN32
+	SetConsoleCtrlHandler(ConsoleHandler, FALSE);
+#endif
+	active_device = NULL;
+	wiimote_device->DumpLatency();
 	delete wiimote_device;
 
+	if(tracePath)
+	{
+		CTracer::Stop();
+		if(CTracer::Write(tracePath))
+			printf("Wrote %llu trace events to %s\n", CTracer::Recorded(), tracePath);
+	}
+
 	return retCode;
 }
-
@@ -9,150 +9,162 @@ magic numbers in the header file wiimote.h.
 
 In this particular implementation, the debug loop is used to drive the keyboard and mouse.
 
-NOTE: You'll need to point to the location of your hid.lib and setupapi.lib from the DDK.
-	See WiiMote.h for more information.
+NOTE: On Windows you'll need to point to the location of your hid.lib and setupapi.lib from the DDK.
+	See HidDeviceWin32.cpp for more information.
 
 TODO: This should use more STL, exception handling, and other best practices. It was used
 	as a quick demo and hack while exploring the use of Bluetooth HID devices.
 
 **************************/
 
-#include "StdAfx.h"
+#include "stdafx.h"
 #include "Wiimote.h"
+#include <float.h>
 
 
 
-CWiimote::CWiimote(void)
+CWiimote::CWiimote(void) : cold(new _cold(&hid, &stats)), commands(cold->commands)
 {
-	/* initialize vars and then go find the device */
-	memset(sManuf, 0, WM_STRING_SIZE);
-	memset(sProd, 0, WM_STRING_SIZE);
-	
-	ClearPackets();
-	rdPkt.success = wrPkt.success = false;
-	mote.connected = mote.chuk.connected = false;
-	mote.rumbling = false;
-	mote.button.a = mote.button.b = mote.button.home = mote.button.minus = mote.button.one = mote.button.plus = mote.button.two = false;
-	mote.dpad.down = mote.dpad.left = mote.dpad.right = mote.dpad.up = false;
-	mote.force.x = mote.force.y = mote.force.z = 0.f;
-	mote.axis.x = mote.axis.y = mote.axis.z = 0;
-	mote.tilt.x = mote.tilt.y = mote.tilt.z = 0.f;
-	mote.scale.x = mote.scale.y = mote.scale.z = 0;
-	mote.zero.x = mote.zero.y = mote.zero.z = 0;
-	disconnect = false; /* Intend to disconnect the Class from the mote, but doesn't explicitely call the destructor */
-	mote.battery = 0;
+	Reset();
 
-	kbLayout = GetKeyboardLayout(NULL);
-	HidD_GetHidGuid(&GUID);
-	PnPHandle = AttachToPnP();
-	
-	if(PnPHandle != INVALID_HANDLE_VALUE)
-	{
-		HIDHandle = GetDeviceHandle();
+	/* Go find the device */
+	if(hid.Open(WIIMOTE_VID, WIIMOTE_PID))
+		Connect();
+}
 
-		if(HIDHandle != INVALID_HANDLE_VALUE)
-		{
-			mote.connected = Initialize();
-			HidD_GetManufacturerString(HIDHandle, sManuf, WM_STRING_SIZE);
-			HidD_GetProductString(HIDHandle, sProd, WM_STRING_SIZE);
-		} // end if valid device handle
-	} // end if valid PnP handle
+#ifndef _WIN32
+/* Talk to a mote over an already open descriptor, such as the host end of
+CVirtualMote::StartSocket(). Takes ownership of fd. */
+CWiimote::CWiimote(int fd, const char *name) : cold(new _cold(&hid, &stats)), commands(cold->commands)
+{
+	Reset();
+
+	if(hid.OpenFd(fd, name))
+		Connect();
+}
+#endif
+
+/* A decoder with no mote behind it, calibrated from a capture's header.
+Recorded reports go in through DecodeReport(). */
+CWiimote::CWiimote(const WM_CAPTURE_HEADER *header) : cold(new _cold(&hid, &stats)), commands(cold->commands)
+{
+	Reset();
+	LoadCalibration(header);
 }
 
 CWiimote::~CWiimote(void)
 {	
-	if(HIDHandle != INVALID_HANDLE_VALUE)
-		CloseHandle(HIDHandle);
-	if(PnPHandle != INVALID_HANDLE_VALUE)
-		SetupDiDestroyDeviceInfoList(PnPHandle);
+	StopCapture();
+	StopSharing();
+
+	/* Nothing will answer a transfer still waiting */
+	cold->memory.Cancel();
+
+	/* Let the writer finish anything still queued before the handle goes */
+	cold->output.Stop();
+	ReleaseReport();
+	hid.Close();
 
 	mote.connected = false;
+	delete cold;
 }
 
-/* Using the GUID, attach to the Plug'n'Play node on the system */
-HANDLE CWiimote::AttachToPnP()
+/* The output queue's writer thread and the memory transfers only keep
+pointers to what they're given, so hid and stats need not be built yet */
+CWiimote::_cold::_cold(CHidDevice *hid, CReportStats *stats) : output(hid, stats), memory(&output)
 {
-	/* Attach to the Plug and Play node and get devices */
-	HANDLE pnp = SetupDiGetClassDevs(&GUID, 
-				NULL, NULL, 
-				DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+}
 
-	if(pnp == INVALID_HANDLE_VALUE)
-		printf("Error attaching to PnP node");
+CStateArena CWiimote::arena(sizeof(CWiimote));
 
-	return pnp;
+/* Motes made with new come out of one arena, so with many of them in a
+process they sit next to each other, each starting on its own cache line.
+Anything bigger than a block, such as a class made from CWiimote, comes from
+the heap instead, and delete sends it back by the same test. */
+void *CWiimote::operator new(size_t size)
+{
+	if(size > arena.BlockSize())
+		return ::operator new(size);
+	return arena.Acquire();
 }
 
-/* Using the GUID and Plug'n'Play handle, loop through the available HID device handles
-until a match is found */
-HANDLE CWiimote::GetDeviceHandle()
+void CWiimote::operator delete(void *block, size_t size)
 {
-	HANDLE hDevice = NULL;
-	struct{ 
-		DWORD cbSize; 
-		char DevicePath[WM_STRING_SIZE];
-	} MyHIDDeviceData; /* Device class location for opening */
+	if(size > arena.BlockSize())
+		::operator delete(block);
+	else
+		arena.Release(block);
+}
 
-	HIDD_ATTRIBUTES HIDAttributes; /* Attributes of the HID device */
-	SP_INTERFACE_DEVICE_DATA DeviceInterfaceData; /* holds device interface data for the current device */ 
+/* initialize vars */
+void CWiimote::Reset()
+{
+	memset(cold->sManuf, 0, sizeof(cold->sManuf));
+	memset(cold->sProd, 0, sizeof(cold->sProd));
 	
-	int iHIDdev = 0; /* used for looping through all the devices */
-	BOOL success;
-	ULONG bRet; /* how many bytes were returned from the device interface detail request? */
-
-	/* Security attributes for opening the device for raw file I/O */
-	SECURITY_ATTRIBUTES SecurityAttributes;
-	SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES); 
-	SecurityAttributes.lpSecurityDescriptor = NULL; 
-	SecurityAttributes.bInheritHandle = false; 
-
-	/* Cycle through, up to max devices, looking for the one we want to talk to */
-	for (iHIDdev = 0; (iHIDdev < WM_MAX_DEVICES); iHIDdev++)
-	{
-		DeviceInterfaceData.cbSize = sizeof(DeviceInterfaceData);
-
-		/* Test for a device at this index */
-		success = SetupDiEnumDeviceInterfaces(PnPHandle, 
-			NULL, 
-			&GUID, 
-			iHIDdev, 
-			&DeviceInterfaceData);
+	ClearPackets();
+	rdPkt.slot = NULL;
+	ReleaseReport();
+	memset(cold->spare.data, 0, WM_PACKET_SIZE);
+	cold->spare.refs = 0;
+	cold->spare.owner = NULL;
+	cold->spare.index = -1;
+	reportSeq = 0;
+	rumbleFx.WakeOnPlay(&hid);
+	mote.connected = mote.chuk.connected = false;
+	mote.extension = WM_EXT_NONE;
+	mote.extEncrypted = false;
+	memset(&mote.classic, 0, sizeof(mote.classic));
+	memset(&mote.motionPlus, 0, sizeof(mote.motionPlus));
+	memset(&mote.balance, 0, sizeof(mote.balance));
+	mote.rumbling = false;
+	speakerRate = 0;
+	mote.button.a = mote.button.b = mote.button.home = mote.button.minus = mote.button.one = mote.button.plus = mote.button.two = false;
+	mote.dpad.down = mote.dpad.left = mote.dpad.right = mote.dpad.up = false;
+	mote.force.x = mote.force.y = mote.force.z = 0.f;
+	mote.axis.x = mote.axis.y = mote.axis.z = 0;
+	mote.tilt.x = mote.tilt.y = mote.tilt.z = 0.f;
+	stale = 0;
+	memset(&calibration, 0, sizeof(calibration));
+	memset(mote.ir, 0, sizeof(mote.ir));
+	mote.sampleTime = mote.sampleDt = 0;
+	netSender = NULL;
+	netDevice = 0;
+	currentMode = -1;
+	quitOnHome = true;
+	profileWatcher = NULL;
+	idleAfter = WM_IDLE_AFTER_NS;
+	idleState = WM_IDLE_ACTIVE;
+	idleDeadline = 0;
+	streamMode = WM_MODE_ACC;
+	streamCont = WM_MODE_CONT;
+	minimalReports = true;
+	gamepadOutput = false;
+	CRealTime::Defaults(&realTime);
+	CPointerScheduler::Defaults(&pointerSchedule);
+	wakeups = 0;
+	memset(profiles, 0, sizeof(profiles));
+	memset(held, 0, sizeof(held));
+	disconnect = false; /* Intend to disconnect the Class from the mote, but doesn't explicitely call the destructor */
+	mote.battery = 0;
+	latencyDumpInterval = 0;
+	statsSummaryInterval = 0;
+#ifndef WM_NO_LATENCY
+	latStamps.read = latStamps.decode = latStamps.map = latStamps.inject = 0;
+#endif
+}
 
-		if(success)
-		{
-			/* Found a device, so get the name */
-			MyHIDDeviceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
-			success = SetupDiGetDeviceInterfaceDetail(PnPHandle, 
-						&DeviceInterfaceData, 
-						(PSP_INTERFACE_DEVICE_DETAIL_DATA)&MyHIDDeviceData, 
-						WM_STRING_SIZE, 
-						&bRet, 
-						NULL);
-
-			/* Open the device */
-			hDevice = CreateFile((LPWSTR)&MyHIDDeviceData.DevicePath, 
-				GENERIC_READ|GENERIC_WRITE,
-				FILE_SHARE_READ|FILE_SHARE_WRITE, 
-				&SecurityAttributes, 
-				OPEN_EXISTING, 
-				0, NULL);
-			
-			if(hDevice != INVALID_HANDLE_VALUE)
-			{
-				/* Get the information about this HID */
-				success = HidD_GetAttributes(hDevice, &HIDAttributes);
-				
-				/* If it matches, return the handle */
-				if (success && HIDAttributes.VendorID == WIIMOTE_VID && HIDAttributes.ProductID == WIIMOTE_PID)
-					return hDevice;
-				
-				CloseHandle(hDevice);
-			} /* fi valid handle */
-		} /* fi successful enum interfaces */
+/* With the transport open, run the handshake and collect the device strings */
+void CWiimote::Connect()
+{
+	stats.SetRingSize(hid.RingSize());
 
-	} /* for (iHIDdev = 0; (iHIDdev < 20); iHIDdev++) */
+	mote.connected = Initialize();
+	hid.GetStrings(cold->sManuf, cold->sProd, WM_STRING_SIZE);
 
-	return INVALID_HANDLE_VALUE;
+	/* The handshake is done, from here on output reports are written asynchronously */
+	if(mote.connected)
+		cold->output.Start();
 }
 
 /* Initialize the mote and any extension controllers connected.
@@ -194,16 +206,12 @@ BOOL CWiimote::Initialize()
 					0x40 	LED 3
 					0x80 	LED 4
 			The BB byte is the battery level indicator. Divide by 2 and save as a percentage indicator.
-		5. IF the FF byte mask contains 0x02 (extension controller connected), let's assume it's 
-			a chuk controller, but future TODO is figure out how to interpret the write-ack packet to decypher
-			exactly which controller is connected. 
-		6. Calibrate the mote - send the read EEPROM packet, and immediately get the response, parsing it
+		5. IF the FF byte mask contains 0x02 (extension controller connected), InitExtension() reads
+			its ID to find out which controller it is.
+		6. Calibrate the mote - read the EEPROM calibration block (see MemoryAccess.h), parsing it
 			into the mote's calibration data fields.
-		7. Enable the chuk
-			Note that this function doesn't interpret the write-ack packet response, so we don't really know if
-			gets enabled or not, at least until we attempt to read calibration data.
-		8. If chuk connected, immediately calibrate the chuk - send the read config space packet, and
-			immediately get the response, parsing it into the mote's calibration data fields.
+		7. Enable the extension - in the clear if it can, encrypted if it has to.
+		8. Read its calibration into the fields for that kind of extension.
 		
 		TODO: Rebuild the class' constructor to comprehend device skipping, so you can have multiple
 				class instantiations, each tied to a different mote. Then the LED settings could correspond.
@@ -212,12 +220,15 @@ BOOL CWiimote::Initialize()
 // DISABLE CONTINUOUS REPORTING
 
 	/* Turn off continuous reporting by setting button-only mode */
+	WM_TRACE_BEGIN(handshake);
 	SetReportMode(WM_MODE_DEFAULT);
 	/* Read the first packet confirming button-only mode */
 	ClearPackets();
 	ReadPacket();
+	WM_TRACE_END(handshake, WM_HS_MODE, rdPkt.buffer[0] == WM_MODE_DEFAULT);
 	if(rdPkt.buffer[0] != WM_MODE_DEFAULT)
 	{
+		stats.OnInitUnexpected();
 		/* This confirmation step may be overkill (by returning false). Are there cases where 
 		immediately after connecting to the device and sending a request for a reporting mode
 		the mote would NOT send a confirmation packet? Need to test a variety of scenarios to 
@@ -229,826 +240,1708 @@ BOOL CWiimote::Initialize()
 // REQUEST CONTROLLER STATUS
 
 	/* Send the request for controller status */
+	WM_TRACE_BEGIN(handshake);
 	ClearPackets();
-	wrPkt.buffer[0] = WM_OUT_CTRLSTAT;
-	wrPkt.buffer[1] = 0x00;
+	cold->wrPkt.buffer[0] = WM_OUT_CTRLSTAT;
+	cold->wrPkt.buffer[1] = 0x00;
 	WritePacket();
 	/* Read the response of the controller status */
 	ClearPackets();
 	ReadPacket();
 	/* Test the response for the presence of an extension controller */
+	bool extensionPresent = false;
 	if(rdPkt.buffer[0] == WM_MODE_EXP_PORT)
 	{
 		printf("Received the packet response with Controller Status\n");
 
 		/* fourth byte contains our status mask.
-		0x02 is the bit test for extension presence (the chuk for now) */
+		0x02 is the bit test for extension presence */
 		if(rdPkt.buffer[3] & 0x02)
 		{
 			printf("Controller status indicates an extension is connected.\n");
-			mote.chuk.connected = true;
+			extensionPresent = true;
 		}
-		else
-			mote.chuk.connected = false;
 
 		/* Save the battery level.
 		Note that battery level will be between 0 and 200. Need to divide by 2 so 
 		that it's a percentage stored in the battery value. */
 		mote.battery = rdPkt.buffer[6] / 2;
 
-		printf("Current battery level is %i%\n", mote.battery);
+		printf("Current battery level is %i%%\n", mote.battery);
 	} /* end if WM_MODE_EXP_PORT */
+	else
+		stats.OnInitUnexpected();
+	WM_TRACE_END(handshake, WM_HS_STATUS, rdPkt.buffer[0] == WM_MODE_EXP_PORT);
 
 // CALIBRATE THE MOTE
 
-	/* Send the request for calibration of the mote */
-	ClearPackets();
-	wrPkt.buffer[0] = WM_OUT_READ_DATA;
-	wrPkt.buffer[1] = 0x00; /* don't care about the RUMBLE flag */
-	wrPkt.buffer[2] = 0x00; /* address bytes - unused in this case */
-	wrPkt.buffer[3] = 0x00;	/* address bytes - unused in this case */
-	wrPkt.buffer[4] = 0x16; /* 0x16 is the start of the 7-byte calibration data block */
-	wrPkt.buffer[5] = 0x00; /* HIBYTE of num bytes to read */
-	wrPkt.buffer[6] = 0x07; /* LOBYTE of num bytes to read - 7 in this case for the cal block */
-
-	/* Send the packet to read data from the calibration block */
-	WritePacket();
+	/* Calibration data is stored in EEPROM at the 0x16 offset, and includes:
+	0x16      zero point for X axis
+	0x17      zero point for Y axis
+	0x18      zero point for Z axis
+	0x19      unknown
+	0x1A      +1G point for X axis
+	0x1B      +1G point for Y axis
+	0x1C      +1G point for Z axis
+	*/
+	byte cal[7];
+	WM_TRACE_BEGIN(handshake);
+	BOOL calibrated = ReadMemory(WM_MEM_EEPROM, 0x16, cal, sizeof(cal));
+	WM_TRACE_END(handshake, WM_HS_CALIBRATE, calibrated);
+	if(calibrated)
+	{
+		calibration.zero.x = cal[0];
+		calibration.zero.y = cal[1];
+		calibration.zero.z = cal[2];
+		/* skip cal[3] because it's unknown (offset 0x19) */
+		calibration.scale.x = cal[4];
+		calibration.scale.y = cal[5];
+		calibration.scale.z = cal[6];
+	}
+	else
+		stats.OnInitUnexpected();
 
-	/* Read the mote calibration packet */
-	ClearPackets();
-	ReadPacket();
-	if(rdPkt.buffer[0] == WM_MODE_READ_DATA)
+// IDENTIFY AND CALIBRATE THE EXTENSION
+
+	WM_TRACE_BEGIN(handshake);
+	BOOL extensionReady = InitExtension(extensionPresent);
+	WM_TRACE_END(handshake, WM_HS_EXTENSION, extensionReady);
+	if(!extensionReady)
+		stats.OnInitUnexpected();
+
+	return true;
+}
+
+/* Which extension a 6-byte ID read from 0xa400fa belongs to */
+static int ExtensionType(const byte *id)
+{
+	if(id[2] != 0xa4 || id[3] != 0x20)
+		return WM_EXT_UNKNOWN;
+	if(id[4] == 0x00 && id[5] == 0x00)
+		return WM_EXT_NUNCHUK;
+	if(id[4] == 0x01 && id[5] == 0x01)
+		return WM_EXT_CLASSIC;
+	if(id[4] == 0x04 && id[5] == 0x05)
+		return WM_EXT_MOTIONPLUS;
+	if(id[4] == 0x04 && id[5] == 0x02)
+		return WM_EXT_BALANCE;
+	return WM_EXT_UNKNOWN;
+}
+
+static const char *extensionNames[] = { "none", "nunchuk", "classic", "motionplus", "balance", "unknown" };
+
+const char *CWiimote::ExtensionName(int extension)
+{
+	return extension >= WM_EXT_NONE && extension <= WM_EXT_UNKNOWN ? extensionNames[extension] : "unknown";
+}
+
+/* Find out what is in the extension port and get it ready. Extensions are
+initialized in the clear (0x55 to 0xa400f0, then 0x00 to 0xa400fb), so their
+reports need no decrypting. A clone that ignores that still reads as
+garbage, and gets the old init (0x00 to 0xa40040) with its bytes decrypted
+from then on. With nothing plugged in, a MotionPlus may still be waiting
+at 0xa6, and is switched on. Returns false if the port couldn't be set up. */
+BOOL CWiimote::InitExtension(bool present)
+{
+	byte id[6];
+	byte init = 0x55;
+	byte zero = 0x00;
+
+	mote.extension = WM_EXT_NONE;
+	mote.extEncrypted = false;
+	mote.chuk.connected = mote.classic.connected = mote.motionPlus.connected = mote.balance.connected = false;
+
+	if(!present)
 	{
-			/* Calibration data is stored at the 0x16 offset, and includes:
-			0x16      zero point for X axis
-			0x17      zero point for Y axis
-			0x18      zero point for Z axis
-			0x19      unknown
-			0x1A      +1G point for X axis
-			0x1B      +1G point for Y axis
-			0x1C      +1G point for Z axis
-			
-			...BUT the first 6 bytes of the packet are other details like
-			report type, button state, error flag, and the offset read from.
-			*/
-
-			/* Note that we still need to test if this is the right offset
-			we requested the mote calibration data read from... */
-			if(rdPkt.buffer[5] == 0x16)
-			{
-				mote.zero.x = rdPkt.buffer[6];
-				mote.zero.y = rdPkt.buffer[7];
-				mote.zero.z = rdPkt.buffer[8];
-				/* skip rdPkt.buffer[9] because it's unknown (offset 0x19) */
-				mote.scale.x = rdPkt.buffer[10];
-				mote.scale.y = rdPkt.buffer[11];
-				mote.scale.z = rdPkt.buffer[12];
-			}
-	} /* end if WM_MODE_READ_DATA for the mote calibration data */
+		/* An inactive MotionPlus answers at 0xa600fa with xx xx a6 20 00 05 */
+		if(!ReadMemory(WM_MEM_REGISTERS, 0xa600fa, id, sizeof(id)) || id[2] != 0xa6 || id[3] != 0x20 || id[5] != 0x05)
+			return true;
+
+		printf("Inactive MotionPlus found. Activating it.\n");
+		byte activate = 0x04;
+		if(!WriteMemory(WM_MEM_REGISTERS, 0xa600f0, &init, 1) || !WriteMemory(WM_MEM_REGISTERS, 0xa600fe, &activate, 1))
+			return false;
+	}
+
+	mote.extension = WM_EXT_UNKNOWN;
+	if(WriteMemory(WM_MEM_REGISTERS, 0xa400f0, &init, 1) && WriteMemory(WM_MEM_REGISTERS, 0xa400fb, &zero, 1)
+		&& ReadMemory(WM_MEM_REGISTERS, 0xa400fa, id, sizeof(id)))
+		mote.extension = ExtensionType(id);
 
-// CALIBRATE THE CHUK
+	if(mote.extension == WM_EXT_UNKNOWN
+		&& WriteMemory(WM_MEM_REGISTERS, 0xa40040, &zero, 1) && ReadMemory(WM_MEM_REGISTERS, 0xa400fa, id, sizeof(id)))
+	{
+		for(int i = 0; i < (int)sizeof(id); i++)
+			id[i] = WiiDecrypt(id[i]);
+		mote.extension = ExtensionType(id);
+		mote.extEncrypted = mote.extension != WM_EXT_UNKNOWN;
+	}
+
+	printf("Extension: %s%s. Calibrating it.\n", ExtensionName(mote.extension), mote.extEncrypted ? " (encrypted)" : "");
+
+	/* Calibration sits at 0xa40020, in the extension's own layout */
+	byte cal[28];
+	int calLength = mote.extension == WM_EXT_BALANCE ? 28 : 16;
+	if(mote.extension == WM_EXT_MOTIONPLUS)
+		calLength = 0; /* the gyros use fixed scales */
+	else if(mote.extension == WM_EXT_UNKNOWN)
+		return false;
+	else if(!ReadMemory(WM_MEM_REGISTERS, 0xa40020, cal, calLength))
+		return false;
+
+	if(mote.extEncrypted)
+	{
+		for(int i = 0; i < calLength; i++)
+			cal[i] = WiiDecrypt(cal[i]);
+	}
 
-	if(mote.chuk.connected == true)
+	switch(mote.extension)
 	{
-		printf("Nunchuk connected. Enabling it.\n");
-		/* Note: Requesting chuk config data without the chuk enabled returns foxes */
-		// ENABLE THE CHUK
-		/* Sending a 0x00 byte to address 0x04a40040 to enable the chuk */
-		ClearPackets();
-		wrPkt.buffer[0] = WM_OUT_WRITE_DATA;
-		wrPkt.buffer[1] = 0x04; /* address byte, ignoring RUMBLE flag */
-		wrPkt.buffer[2] = 0xa4; /* address byte */
-		wrPkt.buffer[3] = 0x00;	/* address byte */
-		wrPkt.buffer[4] = 0x40; /* 0x40 is the last part of the address */
-		wrPkt.buffer[5] = 0x01; /* only writing one byte */
-		wrPkt.buffer[6] = 0x00; /* the one byte of data is 0x00 to enable the chuk */
-
-		/* Send the packet to enable the chuk */
-		WritePacket();
-
-		/* Read the write-ack packet.
-		TODO: Fix this later when write-ack packets are understood. For now just ignore it. */
-		ClearPackets();
-		ReadPacket();
-
-		printf("Nunchuk enabled. Calibrating it.\n");
-		/* Send a request for calibration data on the chuk */
-		ClearPackets();
-		wrPkt.buffer[0] = WM_OUT_READ_DATA;
-		wrPkt.buffer[1] = 0x04; /* 0x00 is EEPROM read, 0x04 is control register space, ignoring rumble */
-		wrPkt.buffer[2] = 0xa4; /* address byte - corresponds to chuk data */
-		wrPkt.buffer[3] = 0x00;	/* address byte - unused/ignored */
-		wrPkt.buffer[4] = 0x20; /* 0x20 is the start of the 14-byte calibration data block */
-		wrPkt.buffer[5] = 0x00; /* HIBYTE of num bytes to read */
-		wrPkt.buffer[6] = 0x0E; /* LOBYTE of num bytes to read - 14 in this case for chuk cal block */
-
-		/* Send the packet to read data from the calibration block */
-		WritePacket();
-
-		/* Read the chuk calibration packet */
-		ClearPackets();
-		ReadPacket();
-
-		/* If the packet was the response to a read data request... */
-		if(rdPkt.buffer[0] == WM_MODE_READ_DATA)
+	case WM_EXT_NUNCHUK:
+		calibration.chuk.zero.x = cal[0];
+		calibration.chuk.zero.y = cal[1];
+		calibration.chuk.zero.z = cal[2];
+		/* cal[3] has some LSB info */
+		calibration.chuk.scale.x = cal[4];
+		calibration.chuk.scale.y = cal[5];
+		calibration.chuk.scale.z = cal[6];
+		/* cal[7] has some LSB info */
+		calibration.chuk.stickMax.x = cal[8];
+		calibration.chuk.stickMin.x = cal[9];
+		calibration.chuk.stickCenter.x = cal[10];
+		calibration.chuk.stickMax.y = cal[11];
+		calibration.chuk.stickMin.y = cal[12];
+		calibration.chuk.stickCenter.y = cal[13];
+		mote.chuk.connected = true;
+		break;
+
+	case WM_EXT_CLASSIC:
+		/* Max, min and center for left x, left y, right x, right y, then the triggers' rest points */
+		for(int i = 0; i < 4; i++)
 		{
-			/* a read packet coming from address 0x04a40020 contains chuk data.
-			Note that the read packet returned does not contain the 0x04 or 0xa4.
-			These must be known from the previous read request - thus requiring sequential 
-			pairing of a read request with a read response. */
-			if(rdPkt.buffer[4] == 0x00 && rdPkt.buffer[5] == 0x20)
-			{
-				/* If the high nibble of byte 4 is 0xd, it's a calib read
-				because this the (number_of_bytes_requested - 1).
-				If the low nibble of byte 4 is 0x0, there were no errors during
-				the read operation, so we're clear to use the data provided. */
-				if(rdPkt.buffer[3] == 0xd0)
-				{
-					mote.chuk.zero.x = WiiDecrypt(rdPkt.buffer[6]);
-					mote.chuk.zero.y = WiiDecrypt(rdPkt.buffer[7]);
-					mote.chuk.zero.z = WiiDecrypt(rdPkt.buffer[8]);
-					/* rdPkt.buffer[9] has some LSB info */
-					mote.chuk.scale.x = WiiDecrypt(rdPkt.buffer[10]);
-					mote.chuk.scale.y = WiiDecrypt(rdPkt.buffer[11]);
-					mote.chuk.scale.z = WiiDecrypt(rdPkt.buffer[12]);
-					/* rdPkt.buffer[13] has some LSB info */
-					mote.chuk.stickMax.x = WiiDecrypt(rdPkt.buffer[14]);
-					mote.chuk.stickMin.x = WiiDecrypt(rdPkt.buffer[15]);
-					mote.chuk.stickCenter.x = WiiDecrypt(rdPkt.buffer[16]);
-					mote.chuk.stickMax.y = WiiDecrypt(rdPkt.buffer[17]);
-					mote.chuk.stickMin.y = WiiDecrypt(rdPkt.buffer[18]);
-					mote.chuk.stickCenter.y = WiiDecrypt(rdPkt.buffer[19]);
-				} /* end if chuk byte size test */
-			} /* end if chuk config space test */
-		} /* end if READ_DATA packet */
-	} /* end if chuk connected */
+			calibration.classic.stickMax[i] = cal[i * 3];
+			calibration.classic.stickMin[i] = cal[i * 3 + 1];
+			calibration.classic.stickCenter[i] = cal[i * 3 + 2];
+		}
+		mote.classic.connected = true;
+		break;
+
+	case WM_EXT_MOTIONPLUS:
+		mote.motionPlus.connected = true;
+		break;
+
+	case WM_EXT_BALANCE:
+		/* 4 unknown bytes, then each sensor's reading at 0, 17 and 34 kg, big-endian */
+		for(int i = 0; i < 12; i++)
+			calibration.balance[i / 4][i % 4] = (unsigned short)((cal[4 + i * 2] << 8) | cal[5 + i * 2]);
+		mote.balance.connected = true;
+		break;
+	}
 
 	return true;
 }
 
+/* The mode after mode, stepping forwards or backwards and wrapping round */
+static int StepMode(int mode, int step)
+{
+	if(step < 0)
+		return mode > 0 ? mode - 1 : WM_MY_MAX;
+	return mode == WM_MY_MAX ? 0 : mode + 1;
+}
+
+/* The cheapest report carrying the WM_NEED_* data asked for */
+static byte ReportModeFor(unsigned needs)
+{
+	if(needs & WM_NEED_EXT)
+		return needs & WM_NEED_ACC ? WM_MODE_ACC_EXT : WM_MODE_EXT;
+	return needs & WM_NEED_ACC ? WM_MODE_ACC : WM_MODE_DEFAULT;
+}
+
+/* The LEDs that show which mode is running */
+static byte ModeLeds(int mode)
+{
+	switch(mode)
+	{
+	case WM_MY_MOUSE:
+		return WM_LED_ONE;
+	case WM_MY_EMU:
+		return WM_LED_TWO;
+	case WM_MY_FPS:
+		return WM_LED_THREE;
+	default:
+		return WM_LED_NONE;
+	}
+}
+
 /* Enter into a debug loop, doing something that seems useful at the time. 
  Returns 0 on success.
  Read the comments inside this function for more details on what this is used for.
 */
 int CWiimote::DebugLoop()
 {
-	/* Continuous reporting, with mote, chuk and acceleration data */
-	if(mote.chuk.connected == true)
-		SetReportMode(WM_MODE_ACC_EXT, WM_MODE_CONT);
-	else /* Otherwise just get mote and acceleration data */
-		SetReportMode(WM_MODE_ACC, WM_MODE_CONT);
-
 	/* Start out in mouse mode */
 	int myMode = WM_MY_MOUSE;
-	bool myModeChanged = false;
+	int modeStep = 0; /* plus or minus held at the last report */
+	WM_TIME modeRepeatAt = 0;
 	
 	EnableLED(WM_LED_ONE);
 
-	/* used for mouse mode */
-	DWORD mouse_x, mouse_y;
-	mouse_x = mouse_y = 0;
-	bool lmbDown, rmbDown;
-	lmbDown = rmbDown = false;
+	/* Each mode's bindings start out built in, and whatever the profile
+	watcher has loaded replaces them below */
+	for(int mode = 0; mode <= WM_MY_MAX; mode++)
+		profiles[mode] = CProfile::Builtin(mode);
+	memset(held, 0, sizeof(held));
 
-	/* track last button states...
-	TODO: clean this up with a struct or something. */
-	bool last_a, last_b, last_one, last_two,
-		last_up, last_down, last_right, last_left, jumping;
-	last_a = last_b = last_one = last_two = last_up = last_down = last_right = last_left = jumping = false;
+	/* Ask for just what mouse mode's bindings read */
+	NegotiateReports(myMode);
+	scheduler.Configure(&pointerSchedule);
 
-	bool last_moveleft, last_moveright, last_moveforward, last_movebackward, last_running, last_anchor, last_throw;
-	last_moveleft = last_moveright = last_moveforward = last_movebackward = last_running = last_anchor = last_throw = false;
+	/* Reads and decoding run on this thread from here on */
+	CRealTime rt;
+	rt.Enter(&realTime);
+	hid.SetBusyPoll(rt.BusyPoll());
+
+	WM_TIME lastLatencyDump = WmNow();
+	WM_TIME lastStatsSummary = lastLatencyDump;
+	currentMode = myMode;
 
 	while(!disconnect)
 	{
-		ParseReport();
-
-		switch(myMode)
-		{
-		case WM_MY_MOUSE:
-			mouse_x = (int) (mote.tilt.x / 4);
-			mouse_y = (int) (mote.tilt.y / 2);
-			MouseEvent(MOUSEEVENTF_MOVE, mouse_x, mouse_y);
-			if(mote.dpad.down)
-				MouseEvent(MOUSEEVENTF_WHEEL, NULL, NULL, -120);
-			else if(mote.dpad.up)
-				MouseEvent(MOUSEEVENTF_WHEEL, NULL, NULL, 120);
-			if(mote.button.a && !lmbDown)
-			{
-				MouseEvent(MOUSEEVENTF_LEFTDOWN);
-				lmbDown = true;
-			}
-			else if(!mote.button.a)
-				if(lmbDown)
-			{
-				{
-					MouseEvent(MOUSEEVENTF_LEFTUP);
-					lmbDown = false;
-				}
-			}
-			if(mote.button.b && !rmbDown)
-			{
-				MouseEvent(MOUSEEVENTF_RIGHTDOWN);
-				rmbDown = true;
-			}
-			else if(!mote.button.b)
-			{
-				if(rmbDown)
-				{
-					MouseEvent(MOUSEEVENTF_RIGHTUP);
-					rmbDown = false;
-				}
-			}
-			break;
-		case WM_MY_EMU:
-			if(mote.chuk.connected == true)
-			{
-//				system("cls");
-//				printf("Chuk: Sx: %f\t Sy %f\n",
-//					mote.chuk.stick.x, mote.chuk.stick.y);
-/*				printf("Chuk: Xt: %2.2f\t Yt: %2.2f\t Zt: %2.2f\n", 
-					mote.chuk.tilt.x, mote.chuk.tilt.y, mote.chuk.tilt.z);
-				printf("Chuk: Xf: %2.2f\t Yf: %2.2f\t Zf: %2.2f\n", 
-					mote.chuk.force.x, mote.chuk.force.y, mote.chuk.force.z);
-				if(mote.chuk.button.c)
-					printf("Chuk button C pressed.\n");
-				if(mote.chuk.button.z)
-					printf("Chuk button Z pressed.\n");
-*/			}
-
-			if(mote.button.a && !last_a)
-				KeyboardEvent('A');
-			if(!mote.button.a && last_a)
-				KeyboardEvent('A', KEYEVENTF_KEYUP);
-			
-			if(mote.button.b && !last_b)
-				KeyboardEvent('B');
-			if(!mote.button.b && last_b)
-				KeyboardEvent('B', KEYEVENTF_KEYUP);
-			
-			if(mote.button.one && !last_one)
-				KeyboardEvent('1');
-			if(!mote.button.one && last_one)
-				KeyboardEvent('1', KEYEVENTF_KEYUP);
-			
-			if(mote.button.two && !last_two)
-				KeyboardEvent('2');
-			if(!mote.button.two && last_two)
-				KeyboardEvent('2', KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.down && !last_down)
-				KeyboardEvent(VK_RIGHT);
-			if(!mote.dpad.down && last_down)
-				KeyboardEvent(VK_RIGHT, KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.up && !last_up)
-				KeyboardEvent(VK_LEFT);
-			if(!mote.dpad.up && last_up)
-				KeyboardEvent(VK_LEFT, KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.left && !last_left)
-				KeyboardEvent(VK_DOWN);
-			if(!mote.dpad.left && last_left)
-				KeyboardEvent(VK_DOWN, KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.right && !last_right)
-				KeyboardEvent(VK_UP);
-			if(!mote.dpad.right && last_right) 
-				KeyboardEvent(VK_UP, KEYEVENTF_KEYUP);
-
-			/* Save off the current button states as the last_* for 
-			comparison on the next pass */
-			last_a = mote.button.a;
-			last_b = mote.button.b;
-			last_one = mote.button.one;
-			last_two = mote.button.two;
-			last_up = mote.dpad.up;
-			last_down = mote.dpad.down;
-			last_left = mote.dpad.left;
-			last_right = mote.dpad.right;
+		/* Commands from other threads go in between reports, so they arrive
+		with at most one poll wait of delay even when the mote is quiet */
+		if(ApplyCommands(&myMode))
+			EnableLED(ModeLeds(myMode));
+		if(disconnect)
 			break;
-		case WM_MY_FPS:
-			/* First person shooter configuration */
-
-			/* Tilt-based mouse movement */
-/*			if(mote.tilt.x < -8.f || mote.tilt.x > 8.f) // Setting a dead zone
-			{
-				if(mote.tilt.x > 0.f)
-					mouse_x = (mote.tilt.x - 8.f) / 3.f; // Subtract the dead zone and apply sensitivity
-				else
-					mouse_x = (mote.tilt.x + 8.f) / 3.f;
-			}
-			else
-				mouse_x = 0.f;
-			if(mote.tilt.y > 8.f || mote.tilt.y < -8.f) // Setting a dead zone
-			{
-				if(mote.tilt.y > 0.f)
-					mouse_y = (mote.tilt.y - 8.f) / 4.f;
-				else
-					mouse_y = (mote.tilt.y + 8.f) / 4.f;
-			}
-			else
-				mouse_y = 0.f;
-	*/
-			/* Chukstick-based mouse movement */
-			if(mote.chuk.connected)
-			{
-				mouse_x = (int)(mote.chuk.stick.x * 18.f);
-				mouse_y = (int)(mote.chuk.stick.y * 18.f);
-
-				if(mouse_x < 2)
-					mouse_x = 0;
-				if(mouse_y < 2)
-					mouse_y = 0;
-			}
-			MouseEvent(MOUSEEVENTF_MOVE, mouse_x, mouse_y);
-			
-			/* Remap the A button on the wiimote to the right mouse button,
-			which is typically a zoom modifier */
-			if(mote.button.a && !rmbDown)
-			{
-				MouseEvent(MOUSEEVENTF_RIGHTDOWN);
-				rmbDown = true;
-			}
-			else if(!mote.button.a)
-			{
-				if(rmbDown)
-				{
-					MouseEvent(MOUSEEVENTF_RIGHTUP);
-					rmbDown = false;
-				}
-			}
+		if(profileWatcher)
+			SwapProfiles(myMode);
 
-			/* Remap the B (trigger) button on the wiimote to the right mouse button,
-			which is typically the "shoot" button */
-			if(mote.button.b && !lmbDown)
-			{
-				MouseEvent(MOUSEEVENTF_LEFTDOWN);
-				lmbDown = true;
-			}
-			else if(!mote.button.b)
-			{
-				if(lmbDown)
-				{
-					MouseEvent(MOUSEEVENTF_LEFTUP);
-					lmbDown = false;
-				}
-			}
-			
-			if(mote.chuk.connected)
-			{
-				/* Stick-based WASD */
-/*				if(mote.chuk.stick.x < -0.5f && !last_moveleft)
-					KeyboardEvent('A');
-				if(!(mote.chuk.stick.x < -0.5f) && last_moveleft)
-					KeyboardEvent('A', KEYEVENTF_KEYUP);
-				if(mote.chuk.stick.x > 0.5f && !last_moveright)
-					KeyboardEvent('D');
-				if(!(mote.chuk.stick.x > 0.5f) && last_moveright)
-					KeyboardEvent('D', KEYEVENTF_KEYUP);
-				if(mote.chuk.stick.y > 0.5f && !last_moveforward)
-					KeyboardEvent('W');
-				if(!(mote.chuk.stick.y > 0.5f) && last_moveforward)
-					KeyboardEvent('W', KEYEVENTF_KEYUP);
-				if(mote.chuk.stick.y < -0.5f && !last_movebackward)
-					KeyboardEvent('S');
-				if(!(mote.chuk.stick.y < -0.5f) && last_movebackward)
-					KeyboardEvent('S', KEYEVENTF_KEYUP);
-*/
-				/* Tilt-based WASD */
-				if(mote.chuk.tilt.x < -20.f && mote.chuk.tilt.x > -90.f && !last_moveleft)
-					KeyboardEvent('A');
-				if(!(mote.chuk.tilt.x < -20.f && mote.chuk.tilt.x > -90.f) && last_moveleft)
-					KeyboardEvent('A', KEYEVENTF_KEYUP);
-				if(mote.chuk.tilt.x > 20.f && mote.chuk.tilt.x < 90.f && !last_moveright)
-					KeyboardEvent('D');
-				if(!(mote.chuk.tilt.x > 20.f && mote.chuk.tilt.x < 90.f) && last_moveright)
-					KeyboardEvent('D', KEYEVENTF_KEYUP);
-				if(mote.chuk.tilt.y > 20.f && mote.chuk.tilt.y < 60.f && !last_moveforward)
-					KeyboardEvent('W');
-				if(!(mote.chuk.tilt.y > 20.f && mote.chuk.tilt.y < 60.f) && last_moveforward)
-					KeyboardEvent('W', KEYEVENTF_KEYUP);
-				if(mote.chuk.tilt.y < -20.f && mote.chuk.tilt.y > -60.f && !last_movebackward)
-					KeyboardEvent('S');
-				if(!(mote.chuk.tilt.y < -20.f && mote.chuk.tilt.y > -60.f) && last_movebackward)
-					KeyboardEvent('S', KEYEVENTF_KEYUP);
-
-				if(mote.chuk.button.z && !last_running)
-					KeyboardEvent(VK_SHIFT);
-				if(!mote.chuk.button.z && last_running)
-					KeyboardEvent(VK_SHIFT, KEYEVENTF_KEYUP);
-
-				if(mote.chuk.button.c && !last_anchor)
-					KeyboardEvent('C');
-				if(!mote.chuk.button.c && last_anchor)
-					KeyboardEvent('C', KEYEVENTF_KEYUP);
-
-				if(mote.chuk.force.z < -2.0f && !jumping)
-					KeyboardEvent(VK_SPACE);
-				if(!(mote.chuk.force.z < -2.0f) && jumping)
-					KeyboardEvent(VK_SPACE, KEYEVENTF_KEYUP);
-
-				/* Tilt-based WASD */
-				last_moveleft = (mote.chuk.tilt.x < -20.f && mote.chuk.tilt.x > -90.f);
-				last_moveright = (mote.chuk.tilt.x > 20.f && mote.chuk.tilt.x < 90.f);
-				last_moveforward = (mote.chuk.tilt.y > 20.f && mote.chuk.tilt.y < 60.f);
-				last_movebackward = (mote.chuk.tilt.y < -20.f && mote.chuk.tilt.y > -60.f);
-				
-				/* Stick-based WASD */
-/*				last_moveleft = mote.chuk.stick.x < -0.5f;
-				last_moveright = mote.chuk.stick.x > 0.5f;
-				last_moveforward = mote.chuk.stick.y > 0.5f;
-				last_movebackward = mote.chuk.stick.y < -0.5f;
-*/
-				last_running = mote.chuk.button.z;
-				last_anchor = mote.chuk.button.c;
-				jumping = (mote.chuk.force.z < -2.0f);
-			}
+		BOOL got = Poll(IdleWaitMs());
+		wakeups++;
+		if(!got)
+		{
+			UpdateIdle(false, false);
+			continue;
+		}
 
-			if(mote.button.one && !last_one)
-				KeyboardEvent('R'); /* r key */
-			if(!mote.button.one && last_one)
-				KeyboardEvent('R', KEYEVENTF_KEYUP);
-			
-			if(mote.button.two && !last_two)
-				KeyboardEvent('F');
-			if(!mote.button.two && last_two)
-				KeyboardEvent('F', KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.down && !last_down)
-				KeyboardEvent('G');
-			if(!mote.dpad.down && last_down)
-				KeyboardEvent('G', KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.up && !last_up)
-				KeyboardEvent('E');
-			if(!mote.dpad.up && last_up)
-				KeyboardEvent('E', KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.left && !last_left)
-				KeyboardEvent('Q');
-			if(!mote.dpad.left && last_left)
-				KeyboardEvent('Q', KEYEVENTF_KEYUP);
-			
-			if(mote.dpad.right && !last_right)
-				KeyboardEvent('Q');
-			if(!mote.dpad.right && last_right) 
-				KeyboardEvent('Q', KEYEVENTF_KEYUP);
-
-			if(mote.force.z < -2.f && !last_throw)
-				KeyboardEvent('G');
-			if(!(mote.force.z < -2.f) && last_throw)
-				KeyboardEvent('G', KEYEVENTF_KEYUP);
-
-			/* Save off the current button states as the last_* for 
-			comparison on the next pass */
-			last_a = mote.button.a;
-			last_b = mote.button.b;
-			last_one = mote.button.one;
-			last_two = mote.button.two;
-			last_up = mote.dpad.up;
-			last_down = mote.dpad.down;
-			last_left = mote.dpad.left;
-			last_right = mote.dpad.right;
-
-			last_throw = (mote.force.z < -2.f);
+		WM_TRACE_BEGIN(map);
+		bool produced = gamepadOutput ? MapGamepad() : MapReport(profiles[myMode]);
+		WM_TRACE_END(map, rdPkt.slot ? rdPkt.slot->seq : 0, produced);
+		UpdateIdle(true, produced);
 
-			break;
-		default:
-			break;
-		}
+		/* Turn this report's stamps into stage latencies */
+		WM_LAT_COMMIT();
 
-		/* If minus is pressed, cycle to the next mode type */
-		if(mote.button.minus)
+		if(latencyDumpInterval && WmNow() - lastLatencyDump >= latencyDumpInterval)
 		{
-			/* Rotating backwards, so long as we're at a mode higher than zero */
-			if(myMode > 0)
-				myMode--;
-			else
-				myMode = WM_MY_MAX;
-		
-			myModeChanged = true;
+			DumpLatency();
+			lastLatencyDump = WmNow();
 		}
-		
-		if(mote.button.plus)
-		{
-			/* Rotate forwards, so long as we're at a mode lower than max */
-			if(myMode == WM_MY_MAX)
-				myMode = 0;
-			else
-				myMode++;
 
-			myModeChanged = true;
+		if(statsSummaryInterval && WmNow() - lastStatsSummary >= statsSummaryInterval)
+		{
+			stats.Summary(stdout, "wiimote");
+			lastStatsSummary = WmNow();
 		}
 
-		/* Change the LED display to show you the mode it's running */
-		if(myModeChanged)
+		/* Plus and minus step the mode when pressed, and again each
+		WM_MODE_REPEAT_NS they stay held, timed by the mote's own clock.
+		A gamepad passes them on as start and select instead. */
+		int step = gamepadOutput ? 0 : (mote.button.plus ? 1 : 0) - (mote.button.minus ? 1 : 0);
+		if(step && (step != modeStep || mote.sampleTime >= modeRepeatAt))
 		{
-			switch(myMode)
-			{
-			case WM_MY_MOUSE:
-				EnableLED(WM_LED_ONE);
-				break;
-			case WM_MY_EMU:
-				EnableLED(WM_LED_TWO);
-				break;
-			case WM_MY_FPS:
-				EnableLED(WM_LED_THREE);
-				break;
-			default:
-				EnableLED(WM_LED_NONE);
-				break;
-			}
-
-			myModeChanged = false;
-
-			// Slow things down a bit so packets aren't continuously
-			// processed in this loop (without this, pressing the mode
-			// switch button cycles modes really, really quickly
-			Sleep(1000);
+			SwitchMode(&myMode, StepMode(myMode, step));
+			EnableLED(ModeLeds(myMode));
+			modeRepeatAt = mote.sampleTime + WM_MODE_REPEAT_NS;
 		}
+		modeStep = step;
 
-		if(mote.button.home)
+		if(mote.button.home && quitOnHome)
 			disconnect = true;
 	}
 
+	ReleaseHeld(profiles[myMode]);
+	if(gamepadOutput)
+	{
+		/* Leave the pad at rest, nothing held */
+		WM_GAMEPAD_FRAME rest;
+		memset(&rest, 0, sizeof(rest));
+		GamepadEvent(&rest);
+	}
+	for(int mode = 0; mode <= WM_MY_MAX; mode++)
+	{
+		delete profiles[mode];
+		profiles[mode] = NULL;
+	}
+
+	currentMode = -1;
+	idleState = WM_IDLE_ACTIVE;
+	WM_SCHED_CONFIG off;
+	CPointerScheduler::Defaults(&off);
+	scheduler.Configure(&off);
+	hid.SetBusyPoll(false);
+	rt.Leave();
 	SetReportMode(WM_MODE_DEFAULT);		
 
-	return 0;
-}
+	if(statsSummaryInterval)
+		stats.Summary(stdout, "wiimote");
 
-/* Self explanatory */
-void CWiimote::ClearPackets()
-{
-	rdPkt.success = wrPkt.success = false;
-	rdPkt.bytesTransferred = wrPkt.bytesTransferred = 0;
-	memset(&rdPkt.buffer,0,WM_PACKET_SIZE);
-	memset(&wrPkt.buffer,0,WM_PACKET_SIZE);
+	return 0;
 }
 
-/* Given an input mask with button states, save the 
-individual button states into the booleans of the class */
-void CWiimote::UpdateButtonStates(unsigned short buttons)
+/* Apply whatever other threads have posted to commands. Returns true if the
+mode changed, so the caller can show it. Unlike the plus and minus buttons
+there is no held button to debounce, so nothing here waits. */
+bool CWiimote::ApplyCommands(int *myMode)
 {
-	mote.dpad.up = (buttons & WM_BUT_UP) != 0; // Avoiding C4800 warning
-	mote.dpad.down = (buttons & WM_BUT_DOWN) != 0;
-	mote.dpad.left = (buttons & WM_BUT_LEFT) != 0;
-	mote.dpad.right = (buttons & WM_BUT_RIGHT) != 0;
+	bool modeChanged = false;
+	WM_COMMAND command;
 
-	mote.button.minus = (buttons & WM_BUT_MINUS) != 0;
-	mote.button.plus = (buttons & WM_BUT_PLUS) != 0;
-	mote.button.home = (buttons & WM_BUT_HOME) != 0;
-	mote.button.a = (buttons & WM_BUT_A) != 0;
+	while(commands.Take(&command))
+	{
+		switch(command.type)
+		{
+		case WM_CMD_MODE:
+			if(command.value >= 0 && command.value <= WM_MY_MAX)
+			{
+				SwitchMode(myMode, command.value);
+				modeChanged = true;
+			}
+			break;
+		case WM_CMD_MODE_STEP:
+			SwitchMode(myMode, StepMode(*myMode, command.value));
+			modeChanged = true;
+			break;
+		case WM_CMD_LEDS:
+			EnableLED((byte)command.value);
+			break;
+		case WM_CMD_RUMBLE:
+			Rumble(command.value != 0);
+			break;
+		case WM_CMD_QUIT:
+			disconnect = true;
+			break;
+		}
+	}
 
-	mote.button.b = (buttons & WM_BUT_B) != 0;
-	mote.button.one = (buttons & WM_BUT_ONE) != 0;
-	mote.button.two = (buttons & WM_BUT_TWO) != 0;
+	return modeChanged;
 }
 
-/* Read a packet from the device. 
-Assumes the caller has set up the read packet buffer with appropriate contents.
-Relies on the _packet struct's various data to store succcess, bytes read, etc. */
-void CWiimote::ReadPacket()
-{ 
-	rdPkt.success = ReadFile(HIDHandle, &rdPkt.buffer, WM_PACKET_SIZE, &rdPkt.bytesTransferred, NULL);
+/* Leave the current mode for another, letting go of anything its profile holds */
+void CWiimote::SwitchMode(int *myMode, int mode)
+{
+	ReleaseHeld(profiles[*myMode]);
+	*myMode = mode;
+	currentMode = mode;
+	NegotiateReports(mode);
 }
 
-/* Write a packet to the device.
-Assumes the caller has set up the read packet buffer with appropriate contents. */
-void CWiimote::WritePacket()
-{ 
-	wrPkt.success = WriteFile(HIDHandle, &wrPkt.buffer, WM_PACKET_SIZE, &wrPkt.bytesTransferred, NULL);
+/* Take any profiles the watcher has reloaded. The mode in use lets go of
+whatever the old profile was holding first, so no key is left stuck down
+by a binding that no longer exists. */
+void CWiimote::SwapProfiles(int myMode)
+{
+	for(int mode = 0; mode <= WM_MY_MAX; mode++)
+	{
+		CProfile *fresh = profileWatcher->Take(mode);
+		if(!fresh)
+			continue;
+
+		bool renegotiate = mode == myMode && fresh->Needs() != profiles[mode]->Needs();
+		if(mode == myMode)
+			ReleaseHeld(profiles[mode]);
+		delete profiles[mode];
+		profiles[mode] = fresh;
+		if(renegotiate)
+			NegotiateReports(myMode);
+	}
 }
 
-/* Read a report from the wiimote and dissect
-it, saving the reports data */
-void CWiimote::ParseReport()
+/* Ask the mote for the cheapest report that carries what myMode's profile
+reads: the accelerometer, the nunchuk, both or neither. Without a pointer
+or wheel binding nothing acts on a report that repeats the last one, so the
+mote only reports changes. Called whenever the mode or its profile changes;
+it also ends any idle throttling, since the streamed mode is what a probe
+asks for. */
+void CWiimote::NegotiateReports(int myMode)
 {
-	unsigned short buttons = 0;
-
-	/* MAJOR TODO: Rewrite this section to do better breakdowns of the different types of reports.
-	Maybe break out the button mask checks into separate functions for cleanliness...*/
-	ClearPackets();
-	ReadPacket();
-	if(rdPkt.success)
+	if(minimalReports)
 	{
-		byte reportType = rdPkt.buffer[0];
-		
-		/* Depending on the report type, dissect the packets appropriately */
-		if(reportType == WM_MODE_DEFAULT)
-		{
-			/* WM_MODE_DEFAULT contains only 2 bytes of relevent payload.
-			These need to be combined into a 16-bit value and then bit-tested
-			with each of the button masks. */
+		unsigned needs = profiles[myMode]->Needs();
+		if(!mote.chuk.connected)
+			needs &= ~WM_NEED_EXT;
+		/* A gamepad shows tilt and whichever sticks are plugged in, and its
+		axes hold their value, so it never needs a repeat */
+		if(gamepadOutput)
+			needs = WM_NEED_ACC | (mote.chuk.connected || mote.extension == WM_EXT_CLASSIC ? WM_NEED_EXT : 0);
+		streamMode = ReportModeFor(needs);
+		streamCont = needs & WM_NEED_REPEAT ? WM_MODE_CONT : WM_MODE_NONCONT;
+	}
+	else
+	{
+		/* Continuous reporting, with mote, extension (if any) and acceleration data */
+		streamMode = mote.extension != WM_EXT_NONE ? WM_MODE_ACC_EXT : WM_MODE_ACC;
+		streamCont = WM_MODE_CONT;
+	}
 
-			// Combine the buffer bytes into the unsigned shot
-			buttons = rdPkt.buffer[1] << 8;
-			buttons |= rdPkt.buffer[2];
+	SetReportMode(streamMode, streamCont);
+	idleState = WM_IDLE_ACTIVE;
+	idle.Reset(WmNow());
+}
 
-			// Update button state based on the bytes provided
-			UpdateButtonStates(buttons);
-		}
+/* The report's buttons and motion, indexed by WM_IN_*. Only the WM_DERIVE_*
+values in groups are brought up to date; the rest are left as they were. */
+void CWiimote::SampleInputs(float *inputs, unsigned groups)
+{
+	Derive(groups);
+
+	inputs[WM_IN_A] = mote.button.a;
+	inputs[WM_IN_B] = mote.button.b;
+	inputs[WM_IN_ONE] = mote.button.one;
+	inputs[WM_IN_TWO] = mote.button.two;
+	inputs[WM_IN_UP] = mote.dpad.up;
+	inputs[WM_IN_DOWN] = mote.dpad.down;
+	inputs[WM_IN_LEFT] = mote.dpad.left;
+	inputs[WM_IN_RIGHT] = mote.dpad.right;
+	inputs[WM_IN_CHUK_C] = mote.chuk.button.c;
+	inputs[WM_IN_CHUK_Z] = mote.chuk.button.z;
+
+	const _float3 *axes[4] = { &mote.tilt, &mote.force, &mote.chuk.tilt, &mote.chuk.force };
+	for(int i = 0; i < 4; i++)
+	{
+		inputs[WM_IN_TILT_X + 3 * i] = axes[i]->x;
+		inputs[WM_IN_TILT_X + 3 * i + 1] = axes[i]->y;
+		inputs[WM_IN_TILT_X + 3 * i + 2] = axes[i]->z;
+	}
+	inputs[WM_IN_CHUK_STICK_X] = mote.chuk.stick.x;
+	inputs[WM_IN_CHUK_STICK_Y] = mote.chuk.stick.y;
+}
 
-		if(reportType == WM_MODE_ACC)
-		{
-			/* WM_MODE_ACC contains 5 bytes of relevent payload.
-			As before, the first 2 payload bytes are combined and bit-tested against masks.
-			The last 3 payload bytes are raw axis information, which needs to be recalibrated. */
+/* How far pointer moves the pointer for a report sampleDt after the last:
+by as many report periods as have really passed, so bursts and gaps don't
+change its speed. Moves smaller than the deadzone are none. */
+static void PointerDelta(const WM_POINTER *pointer, const float *inputs, WM_TIME sampleDt, float *dx, float *dy)
+{
+	float steps = sampleDt ? (float)sampleDt / WM_REPORT_PERIOD_NS : 1.0f;
+	if(steps > WM_POINTER_MAX_STEPS)
+		steps = WM_POINTER_MAX_STEPS;
+	*dx = inputs[pointer->sourceX] * pointer->scaleX * steps;
+	*dy = inputs[pointer->sourceY] * pointer->scaleY * steps;
+	/* Tilt is NaN past 1G. NaN and infinity both fail the compare, and move nothing. */
+	if(!(fabs(*dx) <= FLT_MAX && fabs(*dy) <= FLT_MAX))
+		*dx = *dy = 0;
+	if(fabs(*dx) < pointer->deadzone)
+		*dx = 0;
+	if(fabs(*dy) < pointer->deadzone)
+		*dy = 0;
+}
 
-			buttons = rdPkt.buffer[1] << 8;
-			buttons |= rdPkt.buffer[2];
+/* The pointer motion profile makes from the last report, in fractions of a
+count, or none if it has no pointer. For replaying captures offline. */
+void CWiimote::PointerMotion(const CProfile *profile, float *dx, float *dy)
+{
+	*dx = *dy = 0;
+	if(!profile->Pointer()->enabled)
+		return;
+	float inputs[WM_IN_COUNT];
+	SampleInputs(inputs, profile->Derived());
+	PointerDelta(profile->Pointer(), inputs, mote.sampleDt, dx, dy);
+}
 
-			UpdateButtonStates(buttons);
+/* Turn this report into keyboard and mouse input through profile.
+Key and mouse button bindings act on the edges, wheel bindings on every
+report they are active for, and the pointer moves every report - or, with
+a pointer schedule, is handed to the scheduler to move on its ticks.
+Returns true if any of that amounted to input. */
+bool CWiimote::MapReport(const CProfile *profile)
+{
+	bool produced = false;
 
-			mote.axis.x = rdPkt.buffer[3];
-			mote.axis.y = rdPkt.buffer[4];
-			mote.axis.z = rdPkt.buffer[5];
+	float inputs[WM_IN_COUNT];
+	SampleInputs(inputs, profile->Derived());
 
-			/* If calibration data has been gathered...recalibrate */
-			if(mote.zero.x)
-			{
-				CalcTilt();
-				CalcForce();
-			}
-		}
+	const WM_POINTER *pointer = profile->Pointer();
+	if(pointer->enabled)
+	{
+		float dx, dy;
+		PointerDelta(pointer, inputs, mote.sampleDt, &dx, &dy);
+		if(scheduler.Enabled())
+			scheduler.Add(mote.sampleTime, clock.Period(), dx, dy);
+		else
+			MouseEvent(MOUSEEVENTF_MOVE, (DWORD)(int)dx, (DWORD)(int)dy);
+		produced = (int)dx || (int)dy;
+	}
 
-		if(reportType == WM_MODE_ACC_EXT)
+	for(int i = 0; i < profile->Count(); i++)
+	{
+		const WM_BINDING *binding = profile->Binding(i);
+		float value = inputs[binding->source];
+		bool active = value > binding->low && value < binding->high;
+
+		if(binding->action == WM_ACT_WHEEL)
 		{
-			/* WM_MODE_ACC_EXT contains a full payload.
-			As before, the first 2 payload bytes are combined and bit-tested against button masks.
-			The next 3 payload bytes are raw axis information, which needs to be recalibrated.
-			The last 16 payload bytes are extension controller data, which also needs recalibration
-			and bit-testing against button masks. */
-			buttons = rdPkt.buffer[1] << 8;
-			buttons |= rdPkt.buffer[2];
-
-			/* Update the button information */
-			UpdateButtonStates(buttons);
-
-			mote.axis.x = rdPkt.buffer[3];
-			mote.axis.y = rdPkt.buffer[4];
-			mote.axis.z = rdPkt.buffer[5];
-
-			mote.chuk.stickAxis.x = WiiDecrypt(rdPkt.buffer[6]);
-			mote.chuk.stickAxis.y = WiiDecrypt(rdPkt.buffer[7]);
-			mote.chuk.axis.x = WiiDecrypt(rdPkt.buffer[8]);
-			mote.chuk.axis.y = WiiDecrypt(rdPkt.buffer[9]);
-			mote.chuk.axis.z = WiiDecrypt(rdPkt.buffer[10]);
-			
-			byte chukButtons = WiiDecrypt(rdPkt.buffer[11]);
-			/* Unlike the mote buttons, 0 means the button is pressed */
-			if(chukButtons & WM_CHUK_BUT_C) mote.chuk.button.c = false;
-			else mote.chuk.button.c = true;
-			if(chukButtons & WM_CHUK_BUT_Z) mote.chuk.button.z = false;
-			else mote.chuk.button.z = true;
-
-			/* If calibration data has been gathered...recalibrate */
-			if(mote.zero.x)
+			if(active)
 			{
-				CalcTilt();
-				CalcForce();
-				CalcStick();
+				MouseEvent(MOUSEEVENTF_WHEEL, 0, 0, (DWORD)binding->amount);
+				produced = true;
 			}
+			continue;
 		}
 
-		/* This section isn't working as designed ... */
-		if(reportType == WM_MODE_WRITE_DATA)
+		if(active != held[i])
 		{
-			/* TODO: Write confirmation packet not yet understood */
+			held[i] = active;
+			PressBinding(binding, active);
+			produced = true;
 		}
-
-		/* TODO: Add dissection for the rest of the input report types */
 	}
+
+	return produced;
 }
 
-/* Using the WM_OUT_REPORT_TYPE report ID, write a packet
-to set the mode, such a buttons, or buttons + accelerometer, etc. 
-First parameter is the mode, second is continuous mode */
-BOOL CWiimote::SetReportMode(byte mode, byte continuous)
+/* A stick or trigger reading, -1 to 1, as a gamepad axis */
+static int PadAxis(float value)
 {
-	ClearPackets();
-
-	/* Set accelerometer mode */
-	wrPkt.buffer[0] = WM_OUT_REPORT_TYPE;
-	wrPkt.buffer[1] = continuous;
-	wrPkt.buffer[2] = mode;
-	WritePacket();
-
-	return wrPkt.success;
+	return (int)((value < -1.f ? -1.f : value > 1.f ? 1.f : value) * WM_PAD_AXIS_MAX);
 }
 
-/* Turn on/off the rumble effect - 
-Note that rumbling needs to carry forward to certain other 
-write packets such as: 
-WM_OUT_LEDFF (0x11) LED control and force feedback
-WM_OUT_IRSENSE (0x13) IR Sensor enable
-WM_OUT_SPKR_ENABLE (0x14) Speaker enable
-WM_OUT_CTRLSTAT (0x15) Controller status
-WM_OUT_SPKR_MUTE (0x19) Speaker mute
-WM_OUT_IRSENSE2 (0x1a) IR Sense 2 */
-BOOL CWiimote::Rumble(bool on)
+/* Turn this report into one gamepad frame: every button, both sticks, tilt
+and the triggers at once, at full resolution. Tilt past 1G on an axis has
+no angle, so that axis keeps its last value. Returns true if the frame
+changed anything. */
+bool CWiimote::MapGamepad()
 {
-	ClearPackets();
-
-	/* Rumble */
-	wrPkt.buffer[0] = WM_OUT_IRSENSE2;
-	if(on)
+	WM_GAMEPAD_FRAME frame;
+	gamepad.Last(&frame);
+	Derive(WM_DERIVE_TILT | WM_DERIVE_STICK);
+
+	unsigned buttons = 0;
+	if(mote.button.a) buttons |= WM_PAD_SOUTH;
+	if(mote.button.b) buttons |= WM_PAD_EAST;
+	if(mote.button.one) buttons |= WM_PAD_WEST;
+	if(mote.button.two) buttons |= WM_PAD_NORTH;
+	if(mote.button.minus) buttons |= WM_PAD_SELECT;
+	if(mote.button.plus) buttons |= WM_PAD_START;
+	if(mote.button.home) buttons |= WM_PAD_MODE;
+	if(mote.dpad.up) buttons |= WM_PAD_UP;
+	if(mote.dpad.down) buttons |= WM_PAD_DOWN;
+	if(mote.dpad.left) buttons |= WM_PAD_LEFT;
+	if(mote.dpad.right) buttons |= WM_PAD_RIGHT;
+
+	float stickX = 0.f, stickY = 0.f;
+	frame.axes[WM_PAD_RX] = frame.axes[WM_PAD_RY] = 0;
+	frame.axes[WM_PAD_LT] = frame.axes[WM_PAD_RT] = 0;
+	if(mote.chuk.connected)
 	{
-		mote.rumbling = true;	
-		wrPkt.buffer[1] = WM_OUT_RUMBLE;
+		if(mote.chuk.button.c) buttons |= WM_PAD_TL;
+		if(mote.chuk.button.z) buttons |= WM_PAD_TL2;
+		stickX = mote.chuk.stick.x;
+		stickY = mote.chuk.stick.y;
 	}
-	else
+	else if(mote.extension == WM_EXT_CLASSIC)
 	{
-		mote.rumbling = false;
-		wrPkt.buffer[1] = 0x00;
+		static const unsigned short classic[] = {
+			WM_CLASSIC_B, WM_CLASSIC_A, WM_CLASSIC_Y, WM_CLASSIC_X, WM_CLASSIC_L, WM_CLASSIC_R, WM_CLASSIC_ZL, WM_CLASSIC_ZR,
+			WM_CLASSIC_MINUS, WM_CLASSIC_PLUS, WM_CLASSIC_HOME, WM_CLASSIC_UP, WM_CLASSIC_DOWN, WM_CLASSIC_LEFT, WM_CLASSIC_RIGHT };
+		for(int i = 0; i < WM_PAD_BUTTONS; i++)
+			if(mote.classic.buttons & classic[i])
+				buttons |= 1u << i;
+		stickX = mote.classic.left.x;
+		stickY = mote.classic.left.y;
+		frame.axes[WM_PAD_RX] = PadAxis(mote.classic.right.x);
+		frame.axes[WM_PAD_RY] = -PadAxis(mote.classic.right.y);
+		frame.axes[WM_PAD_LT] = PadAxis(mote.classic.leftTrigger);
+		frame.axes[WM_PAD_RT] = PadAxis(mote.classic.rightTrigger);
 	}
+	frame.buttons = buttons;
+	frame.axes[WM_PAD_X] = PadAxis(stickX);
+	frame.axes[WM_PAD_Y] = -PadAxis(stickY); /* up is negative on a pad */
 
-	WritePacket();
+	/* NaN fails both compares and leaves the axis as it was */
+	if(mote.tilt.x >= -90.f && mote.tilt.x <= 90.f)
+		frame.axes[WM_PAD_TILT_X] = PadAxis(mote.tilt.x / 90.f);
+	if(mote.tilt.y >= -90.f && mote.tilt.y <= 90.f)
+		frame.axes[WM_PAD_TILT_Y] = PadAxis(mote.tilt.y / 90.f);
 
-	return wrPkt.success;
+	return GamepadEvent(&frame) > 0;
 }
 
-/* Enable LED's based on a provided mask - 
-WM_LED_NONE, WM_LED_ONE, WM_LED_TWO, etc */
-BOOL CWiimote::EnableLED(byte mask)
+/* Release every key and mouse button profile's bindings are holding */
+void CWiimote::ReleaseHeld(const CProfile *profile)
 {
-	ClearPackets();
+	for(int i = 0; i < profile->Count(); i++)
+	{
+		if(!held[i])
+			continue;
+		held[i] = false;
+		PressBinding(profile->Binding(i), false);
+	}
+}
 
-	/* Enable an LED */
-	wrPkt.buffer[0] = WM_OUT_LEDFF;
-	wrPkt.buffer[1] = mask;
+void CWiimote::PressBinding(const WM_BINDING *binding, bool down)
+{
+	WM_TRACE(bind, binding->code, down);
+	if(binding->action == WM_ACT_KEY)
+		KeyboardEvent((byte)binding->code, down ? 0 : KEYEVENTF_KEYUP);
+	else if(binding->action == WM_ACT_MOUSE)
+		MouseEvent(down ? binding->code : binding->code << 1);
+}
 
-	if(mote.rumbling)
-		wrPkt.buffer[1] |= WM_OUT_RUMBLE;
+/* The motion CIdleDetector watches, from the last report that carried it */
+void CWiimote::MotionSample(float *sample)
+{
+	Derive(WM_DERIVE_FORCE | WM_DERIVE_CHUK_FORCE | WM_DERIVE_STICK);
+	sample[0] = mote.force.x;
+	sample[1] = mote.force.y;
+	sample[2] = mote.force.z;
+	sample[3] = mote.chuk.force.x;
+	sample[4] = mote.chuk.force.y;
+	sample[5] = mote.chuk.force.z;
+	sample[6] = mote.chuk.stick.x;
+	sample[7] = mote.chuk.stick.y;
+}
 
-	WritePacket();
+/* How long DebugLoop() may wait for a report: the usual poll while streaming,
+otherwise until the next idle probe or probe timeout is due */
+int CWiimote::IdleWaitMs()
+{
+	if(idleState == WM_IDLE_ACTIVE)
+		return WM_POLL_WAIT_MS;
 
-	return wrPkt.success;
+	WM_TIME now = WmNow();
+	if(now >= idleDeadline)
+		return 0;
+	return (int)((idleDeadline - now + WM_NS_PER_MS - 1) / WM_NS_PER_MS);
 }
 
-/* Calculate Tilt for each axis, in degrees, based on the raw G-force
-data...assumes axis and calibration data is already gathered */
-void CWiimote::CalcTilt()
+/* Step the idle state machine after each poll (see Idle.h). got says whether
+a report arrived, produced whether the mapping made input from it. */
+void CWiimote::UpdateIdle(BOOL got, bool produced)
 {
-    float xs = (float) (mote.scale.x) - (float) (mote.zero.x);
-    float ys = (float) (mote.scale.y) - (float) (mote.zero.y);
-    float zs = (float) (mote.scale.z) - (float) (mote.zero.z);	
-	
-    float x = (float) ((float)mote.axis.x - (float)mote.zero.x) / xs;
-    float y = (float) ((float)mote.axis.y - (float)mote.zero.y) / ys;
-    float z = (float) ((float)mote.axis.z - (float)mote.zero.z) / zs;
+	/* A mote that only reports changes is already as quiet as it gets */
+	if(!idleAfter || streamCont == WM_MODE_NONCONT)
+		return;
 
-    mote.tilt.x = (asin(x) * 180.0f / (float) M_PI);
-    mote.tilt.y = (asin(y) * 180.0f / (float) M_PI);
-    mote.tilt.z = (asin(z) * 180.0f / (float) M_PI);
+	WM_TIME now = WmNow();
+	float sample[WM_IDLE_SAMPLE];
+	MotionSample(sample);
+	unsigned buttons = ButtonMask() | (mote.chuk.button.c ? 0x10000 : 0) | (mote.chuk.button.z ? 0x20000 : 0);
+
+	bool wake = false;
+
+	switch(idleState)
+	{
+	case WM_IDLE_ACTIVE:
+		if(!got)
+			break;
+		idle.Observe(sample, buttons, produced, now);
+		if(idle.Idle(now, idleAfter))
+		{
+			idle.Settle(sample, buttons);
+			SetReportMode(WM_MODE_DEFAULT, WM_MODE_NONCONT);
+			idleState = WM_IDLE_ASLEEP;
+			idleDeadline = now + WM_IDLE_PROBE_MS * WM_NS_PER_MS;
+		}
+		break;
+
+	case WM_IDLE_ASLEEP:
+		/* Only the buttons are fresh in 0x30 reports, the rest still matches the settled sample */
+		if(got && idle.Moved(sample, buttons))
+			wake = true;
+		else if(now >= idleDeadline)
+		{
+			SetReportMode(streamMode, WM_MODE_NONCONT);
+			idleState = WM_IDLE_PROBING;
+			idleDeadline = now + WM_IDLE_PROBE_TIMEOUT_MS * WM_NS_PER_MS;
+		}
+		break;
+
+	case WM_IDLE_PROBING:
+		if(got && idle.Moved(sample, buttons))
+			wake = true;
+		else if((got && rdPkt.buffer[0] == streamMode) || now >= idleDeadline)
+		{
+			/* Still at rest, or no answer - back to buttons only until the next probe */
+			SetReportMode(WM_MODE_DEFAULT, WM_MODE_NONCONT);
+			idleState = WM_IDLE_ASLEEP;
+			idleDeadline = now + WM_IDLE_PROBE_MS * WM_NS_PER_MS;
+		}
+		break;
+	}
 
-	if(mote.chuk.connected == true)
+	/* Woken by a button or movement - back to full rate */
+	if(wake)
 	{
-		xs = (float) (mote.chuk.scale.x) - (float) (mote.chuk.zero.x);
-		ys = (float) (mote.chuk.scale.y) - (float) (mote.chuk.zero.y);
-		zs = (float) (mote.chuk.scale.z) - (float) (mote.chuk.zero.z);
+		SetReportMode(streamMode, streamCont);
+		idle.Reset(now);
+		idleState = WM_IDLE_ACTIVE;
+	}
+}
+
+/* WM_IDLE_* state of DebugLoop(). Safe to call from any thread. */
+int CWiimote::IdleState() const
+{
+	return idleState;
+}
+
+/* Times DebugLoop() has woken for a report or a timeout. Safe to call from any thread. */
+unsigned long long CWiimote::Wakeups() const
+{
+	return wakeups;
+}
+
+/* The mote's buttons as WM_BUT_* bits */
+unsigned short CWiimote::ButtonMask()
+{
+	unsigned short buttons = 0;
+	if(mote.dpad.up) buttons |= WM_BUT_UP;
+	if(mote.dpad.down) buttons |= WM_BUT_DOWN;
+	if(mote.dpad.left) buttons |= WM_BUT_LEFT;
+	if(mote.dpad.right) buttons |= WM_BUT_RIGHT;
+	if(mote.button.a) buttons |= WM_BUT_A;
+	if(mote.button.b) buttons |= WM_BUT_B;
+	if(mote.button.one) buttons |= WM_BUT_ONE;
+	if(mote.button.two) buttons |= WM_BUT_TWO;
+	if(mote.button.plus) buttons |= WM_BUT_PLUS;
+	if(mote.button.minus) buttons |= WM_BUT_MINUS;
+	if(mote.button.home) buttons |= WM_BUT_HOME;
+	return buttons;
+}
+
+/* Load mapping profiles through watcher from now on. Call before DebugLoop() starts. */
+void CWiimote::WatchProfiles(CProfileWatcher *watcher)
+{
+	profileWatcher = watcher;
+}
+
+/* Which WM_MY_* mode DebugLoop() is in, or -1 when it isn't running.
+Safe to call from any thread. */
+int CWiimote::Mode() const
+{
+	return currentMode;
+}
+
+/* Blank the write packet before building a request in it.
+Input reports land in fresh pool slots, so there is nothing to clear on that side. */
+void CWiimote::ClearPackets()
+{
+	cold->wrPkt.success = false;
+	cold->wrPkt.bytesTransferred = 0;
+	memset(&cold->wrPkt.buffer,0,WM_PACKET_SIZE);
+}
+
+/* Given an input mask with button states, save the 
+individual button states into the booleans of the class */
+void CWiimote::UpdateButtonStates(unsigned short buttons)
+{
+	mote.dpad.up = (buttons & WM_BUT_UP) != 0; // Avoiding C4800 warning
+	mote.dpad.down = (buttons & WM_BUT_DOWN) != 0;
+	mote.dpad.left = (buttons & WM_BUT_LEFT) != 0;
+	mote.dpad.right = (buttons & WM_BUT_RIGHT) != 0;
 
-		x = (float) (mote.chuk.axis.x - mote.chuk.zero.x) / xs;
-		y = (float) (mote.chuk.axis.y - mote.chuk.zero.y) / ys;
-		z = (float) (mote.chuk.axis.z - mote.chuk.zero.z) / zs;
+	mote.button.minus = (buttons & WM_BUT_MINUS) != 0;
+	mote.button.plus = (buttons & WM_BUT_PLUS) != 0;
+	mote.button.home = (buttons & WM_BUT_HOME) != 0;
+	mote.button.a = (buttons & WM_BUT_A) != 0;
+
+	mote.button.b = (buttons & WM_BUT_B) != 0;
+	mote.button.one = (buttons & WM_BUT_ONE) != 0;
+	mote.button.two = (buttons & WM_BUT_TWO) != 0;
+}
+
+/* Read a packet from the device into a pooled slot and publish it to the subscribers.
+rdPkt then points at the slot until the next read; its success and bytesTransferred
+say how the read went. A timeout leaves success false without counting as an error. */
+void CWiimote::ReadPacket(int timeoutMs)
+{ 
+	/* Let go of the last report - subscribers may still be holding it */
+	ReleaseReport();
+
+	/* If slow consumers hold every slot, read into the spare so input keeps
+	flowing. That report just doesn't get published. */
+	WM_REPORT *slot = cold->reports.Acquire();
+	if(!slot)
+		slot = &cold->spare;
+
+	WM_TIME readStart = WmNow();
+	int got = hid.Read(slot->data, WM_PACKET_SIZE, timeoutMs);
+	WM_TIME readDone = WmNow();
+
+	if(got <= 0)
+	{
+		if(slot->owner)
+			ReportRelease(slot);
+		if(got == WM_READ_ERROR)
+			stats.OnReadError();
+		return;
+	}
+
+	/* Short reports mustn't show bytes left over from the slot's last use */
+	if(got < WM_PACKET_SIZE)
+		memset(slot->data + got, 0, WM_PACKET_SIZE - got);
+	slot->length = got;
+	slot->readStart = readStart;
+	slot->readDone = readDone;
+	slot->seq = ++reportSeq;
+
+	rdPkt.slot = slot;
+	rdPkt.buffer = slot->data;
+	rdPkt.success = true;
+	rdPkt.bytesTransferred = got;
+
+	WM_LAT_SET(read, readDone);
+	WM_TRACE_SPAN(read, readStart, readDone, slot->seq, slot->data[0]);
+	stats.OnReport(slot->data[0], readStart, readDone);
+
+	if(slot->owner)
+		cold->reports.Publish(slot);
+}
+
+/* Drop our reference to the current report */
+void CWiimote::ReleaseReport()
+{
+	static const byte noReport[WM_PACKET_SIZE] = { 0 };
+
+	if(rdPkt.slot && rdPkt.slot->owner)
+		ReportRelease(rdPkt.slot);
+
+	rdPkt.slot = NULL;
+	rdPkt.buffer = noReport;
+	rdPkt.success = false;
+	rdPkt.bytesTransferred = 0;
+}
+
+/* Write a packet to the device.
+Assumes the caller has set up the write packet buffer with appropriate contents.
+The packet goes through the output queue in order with any other one-shot reports,
+and only the report's real length goes out. */
+void CWiimote::WritePacket()
+{ 
+	int length = COutputQueue::ReportSize(cold->wrPkt.buffer[0]);
+	cold->wrPkt.success = cold->output.Submit(cold->wrPkt.buffer, length);
+	cold->wrPkt.bytesTransferred = cold->wrPkt.success ? length : 0;
+}
+
+/* Read a report from the wiimote and dissect
+it, saving the reports data. Returns FALSE if nothing
+arrived within timeoutMs. */
+BOOL CWiimote::ParseReport(int timeoutMs)
+{
+	/* MAJOR TODO: Rewrite this section to do better breakdowns of the different types of reports.
+	Maybe break out the button mask checks into separate functions for cleanliness...*/
+	ClearPackets();
+	ReadPacket(timeoutMs);
+	if(rdPkt.success)
+	{
+		byte reportType = rdPkt.buffer[0];
+
+		/* Data reports are the mote's stream; the rest answer requests */
+		mote.sampleTime = clock.Stamp(rdPkt.slot->readDone, reportType >= WM_MODE_DEFAULT);
+		mote.sampleDt = clock.Delta();
 		
-		mote.chuk.tilt.x = (asin(x) * 180.0f / (float) M_PI);
-		mote.chuk.tilt.y = (asin(y) * 180.0f / (float) M_PI);
-		mote.chuk.tilt.z = (asin(z) * 180.0f / (float) M_PI);
+		WM_TRACE_BEGIN(decode);
+		DecodeReport(rdPkt.buffer, rdPkt.bytesTransferred);
+		WM_TRACE_END(decode, rdPkt.slot->seq, reportType);
+
+		WM_LAT_STAMP(decode);
+	}
+
+	return rdPkt.success;
+}
+
+/* Dissect one input report into mote. ParseReport() hands it each report
+read; an offline decoder (see Analytics.h) hands it recorded ones. */
+void CWiimote::DecodeReport(const byte *report, int length)
+{
+	unsigned short buttons = 0;
+	byte reportType = report[0];
+
+	/* Depending on the report type, dissect the packets appropriately */
+	if(reportType == WM_MODE_DEFAULT)
+	{
+		/* WM_MODE_DEFAULT contains only 2 bytes of relevent payload.
+		These need to be combined into a 16-bit value and then bit-tested
+		with each of the button masks. */
+
+		// Combine the buffer bytes into the unsigned shot
+		buttons = report[1] << 8;
+		buttons |= report[2];
+
+		// Update button state based on the bytes provided
+		UpdateButtonStates(buttons);
+	}
+
+	if(reportType == WM_MODE_ACC)
+	{
+		/* WM_MODE_ACC contains 5 bytes of relevent payload.
+		As before, the first 2 payload bytes are combined and bit-tested against masks.
+		The last 3 payload bytes are raw axis information, which needs to be recalibrated. */
+
+		buttons = report[1] << 8;
+		buttons |= report[2];
+
+		UpdateButtonStates(buttons);
+
+		mote.axis.x = report[3];
+		mote.axis.y = report[4];
+		mote.axis.z = report[5];
+
+		/* Recalibrated when something reads them */
+		stale |= WM_DERIVE_TILT | WM_DERIVE_FORCE;
+	}
+
+	if(reportType == WM_MODE_ACC_IR)
+	{
+		/* Buttons, accelerometer, then 4 IR points in the 3-byte extended format */
+		buttons = report[1] << 8;
+		buttons |= report[2];
+
+		UpdateButtonStates(buttons);
+
+		mote.axis.x = report[3];
+		mote.axis.y = report[4];
+		mote.axis.z = report[5];
+
+		stale |= WM_DERIVE_TILT | WM_DERIVE_FORCE;
+
+		DecodeIR(&report[6], true);
+	}
+
+	if(reportType == WM_MODE_IR_EXT || reportType == WM_MODE_ACC_IR_EXT)
+	{
+		/* Buttons, accelerometer in 0x37 only, then 4 IR points in the 10-byte basic format.
+		The extension bytes that follow are left alone for now. */
+		buttons = report[1] << 8;
+		buttons |= report[2];
+
+		UpdateButtonStates(buttons);
+
+		if(reportType == WM_MODE_ACC_IR_EXT)
+		{
+			mote.axis.x = report[3];
+			mote.axis.y = report[4];
+			mote.axis.z = report[5];
+
+			stale |= WM_DERIVE_TILT | WM_DERIVE_FORCE;
+
+			DecodeIR(&report[6], false);
+		}
+		else
+			DecodeIR(&report[3], false);
+	}
+
+	if(reportType == WM_MODE_ACC_EXT)
+	{
+		/* WM_MODE_ACC_EXT contains a full payload.
+		As before, the first 2 payload bytes are combined and bit-tested against button masks.
+		The next 3 payload bytes are raw axis information, which needs to be recalibrated.
+		The last 16 payload bytes are extension controller data, which also needs recalibration
+		and bit-testing against button masks. */
+		buttons = report[1] << 8;
+		buttons |= report[2];
+
+		/* Update the button information */
+		UpdateButtonStates(buttons);
+
+		mote.axis.x = report[3];
+		mote.axis.y = report[4];
+		mote.axis.z = report[5];
+
+		/* Recalibrated when something reads them */
+		stale |= WM_DERIVE_TILT | WM_DERIVE_FORCE;
+
+		DecodeExtension(&report[6]);
+	}
+
+	if(reportType == WM_MODE_EXT)
+	{
+		/* Buttons and 19 extension bytes. Asked for by profiles that read
+		the nunchuk but not the mote's accelerometer, so the mote's tilt and
+		force aren't touched. */
+		buttons = report[1] << 8;
+		buttons |= report[2];
+
+		UpdateButtonStates(buttons);
+
+		DecodeExtension(&report[3]);
+	}
+
+	/* Memory read data and write acks belong to whatever transfer is running */
+	if(reportType == WM_MODE_READ_DATA || reportType == WM_MODE_WRITE_DATA)
+		cold->memory.OnReport(report, length);
+
+	/* TODO: Add dissection for the rest of the input report types */
+}
+
+/* Wait up to maxWaitMs for a report and decode it, then run any timed effects
+and memory transfer retries that are due. The wait is cut short when either
+has something coming up, so they keep time even when the mote is quiet. Returns TRUE if a report
+was decoded. */
+BOOL CWiimote::Poll(int maxWaitMs)
+{
+	int wait = maxWaitMs;
+
+	WM_TIME dues[3] = { rumbleFx.NextTransition(), cold->memory.NextDeadline(), scheduler.NextTick() };
+	for(int i = 0; i < 3; i++)
+	{
+		if(!dues[i])
+			continue;
+		WM_TIME now = WmNow();
+		int ms = dues[i] > now ? (int)((dues[i] - now + WM_NS_PER_MS - 1) / WM_NS_PER_MS) : 0;
+		if(wait == WM_WAIT_FOREVER || ms < wait)
+			wait = ms;
+	}
+
+	BOOL got = ParseReport(wait);
+	if(got)
+		PublishState();
+	WM_TIME now = WmNow();
+	UpdateEffects(now);
+	cold->memory.Tick(now);
+	TickPointer(now);
+
+	return got;
+}
+
+/* Hand any rumble change from the effect scheduler to the output queue */
+void CWiimote::UpdateEffects(WM_TIME now)
+{
+	int change = rumbleFx.Tick(now);
+	if(change != WM_FX_UNCHANGED)
+		Rumble(change == WM_FX_ON);
+}
+
+/* Send the pointer motion the schedule has due. It belongs to no one
+report, so it goes straight to the injector without latency stamps. */
+void CWiimote::TickPointer(WM_TIME now)
+{
+	int dx, dy;
+	if(!scheduler.Tick(now, &dx, &dy))
+		return;
+
+	WM_TRACE_BEGIN(inject);
+	injector.Mouse(MOUSEEVENTF_MOVE, (DWORD)dx, (DWORD)dy, 0, 0);
+	WM_TRACE_END(inject, 1, MOUSEEVENTF_MOVE);
+}
+
+/* Unpack the IR camera's points. The extended format is 3 bytes a point:
+X low, Y low, then Y high (bits 7-6), X high (5-4) and size (3-0). The basic
+format packs 2 points into 5 bytes, X1 low, Y1 low, then the high bits of
+Y1, X1, Y2, X2, then X2 low, Y2 low. A missing point reads as all ones. */
+void CWiimote::DecodeIR(const byte *data, bool extended)
+{
+	for(int i = 0; i < WM_IR_DOTS; i++)
+	{
+		_irdot &dot = mote.ir[i];
+
+		if(extended)
+		{
+			const byte *p = data + i * 3;
+			dot.x = (unsigned short)(p[0] | ((p[2] & 0x30) << 4));
+			dot.y = (unsigned short)(p[1] | ((p[2] & 0xc0) << 2));
+			dot.size = p[2] & 0x0f;
+		}
+		else
+		{
+			const byte *p = data + (i / 2) * 5;
+			if(i & 1)
+			{
+				dot.x = (unsigned short)(p[3] | ((p[2] & 0x03) << 8));
+				dot.y = (unsigned short)(p[4] | ((p[2] & 0x0c) << 6));
+			}
+			else
+			{
+				dot.x = (unsigned short)(p[0] | ((p[2] & 0x30) << 4));
+				dot.y = (unsigned short)(p[1] | ((p[2] & 0xc0) << 2));
+			}
+			dot.size = 0;
+		}
+
+		dot.visible = dot.x != 0x3ff || dot.y != 0x3ff;
+	}
+}
+
+/* Using the WM_OUT_REPORT_TYPE report ID, ask for a reporting mode,
+such a buttons, or buttons + accelerometer, etc. 
+First parameter is the mode, second is continuous mode.
+Nothing is written if the mote is already in that mode. */
+BOOL CWiimote::SetReportMode(byte mode, byte continuous)
+{
+	BOOL success = cold->output.SetReportMode(mode, continuous);
+
+	/* Only continuous mode has a steady rate to measure gaps against,
+	or a clock to reconstruct */
+	if(success)
+	{
+		stats.SetStreaming(continuous == WM_MODE_CONT);
+		clock.SetStreaming(continuous == WM_MODE_CONT);
+	}
+
+	return success;
+}
+
+/* Turn on/off the rumble effect.
+Rumble isn't a report of its own - the bit rides in the first payload byte of
+every output report, so the output queue carries it on whichever report goes
+out next and only sends a 0x11 (LEDs and force feedback) if nothing else is due. */
+BOOL CWiimote::Rumble(bool on)
+{
+	mote.rumbling = on;
+	return cold->output.SetRumble(on);
+}
+
+/* Enable LED's based on a provided mask - 
+WM_LED_NONE, WM_LED_ONE, WM_LED_TWO, etc */
+BOOL CWiimote::EnableLED(byte mask)
+{
+	return cold->output.SetLeds(mask);
+}
+
+/* Queue a memory transfer (see MemoryAccess.h). Safe to call from any thread. */
+BOOL CWiimote::StartTransfer(WM_TRANSFER *transfer)
+{
+	return cold->memory.Start(transfer);
+}
+
+/* Wait for a transfer to finish. Outside DebugLoop() the calling thread reads
+the reports that drive it; while DebugLoop() runs on another thread this just
+waits for it. Not to be called from DebugLoop()'s own thread. Returns TRUE if
+the transfer succeeded. */
+BOOL CWiimote::WaitTransfer(WM_TRANSFER *transfer)
+{
+	while(transfer->state == WM_XFER_QUEUED || transfer->state == WM_XFER_RUNNING)
+	{
+		if(currentMode < 0)
+			Poll(WM_MEM_TIMEOUT_MS);
+		else
+			Sleep(1);
+	}
+	return transfer->state == WM_XFER_DONE;
+}
+
+/* Read length bytes of EEPROM or register space, waiting for them */
+BOOL CWiimote::ReadMemory(byte space, DWORD address, byte *data, int length)
+{
+	WM_TRANSFER transfer;
+	transfer.write = false;
+	transfer.space = space;
+	transfer.address = address;
+	transfer.length = length;
+	transfer.data = data;
+	return StartTransfer(&transfer) && WaitTransfer(&transfer);
+}
+
+/* Write length bytes of EEPROM or register space, waiting for every ack */
+BOOL CWiimote::WriteMemory(byte space, DWORD address, const byte *data, int length)
+{
+	WM_TRANSFER transfer;
+	transfer.write = true;
+	transfer.space = space;
+	transfer.address = address;
+	transfer.length = length;
+	transfer.data = (byte *)data;
+	return StartTransfer(&transfer) && WaitTransfer(&transfer);
+}
+
+/* Write up to 16 bytes to the control registers (0x04 address space).
+Fire and forget - the write-ack comes back through ParseReport() and is ignored. */
+BOOL CWiimote::WriteRegister(DWORD address, const byte *data, int length)
+{
+	if(length > 16)
+		return false;
+
+	ClearPackets();
+	cold->wrPkt.buffer[0] = WM_OUT_WRITE_DATA;
+	cold->wrPkt.buffer[1] = 0x04; /* control register space, ignoring RUMBLE flag */
+	cold->wrPkt.buffer[2] = (byte)(address >> 16);
+	cold->wrPkt.buffer[3] = (byte)(address >> 8);
+	cold->wrPkt.buffer[4] = (byte)address;
+	cold->wrPkt.buffer[5] = (byte)length;
+	memcpy(&cold->wrPkt.buffer[6], data, length);
+	WritePacket();
+
+	return cold->wrPkt.success;
+}
+
+/* Power up and configure the speaker for 4-bit ADPCM at sampleRate.
+The sequence is enable, mute, configure the 0xa2 registers, unmute; the
+output queue sends it in order. */
+BOOL CWiimote::SpeakerOn(int sampleRate, byte volume)
+{
+	DWORD rate = WM_SPKR_CLOCK / sampleRate;
+	byte one = 0x01;
+	byte reset = 0x08;
+	/* unknown, format (0x00 is 4-bit ADPCM), rate divider low byte first, volume, unknown */
+	byte config[7] = { 0x00, 0x00, (byte)rate, (byte)(rate >> 8), volume, 0x00, 0x00 };
+
+	BOOL success = true;
+
+	ClearPackets();
+	cold->wrPkt.buffer[0] = WM_OUT_SPKR_ENABLE;
+	cold->wrPkt.buffer[1] = 0x04;
+	WritePacket();
+	success &= cold->wrPkt.success;
+
+	ClearPackets();
+	cold->wrPkt.buffer[0] = WM_OUT_SPKR_MUTE;
+	cold->wrPkt.buffer[1] = 0x04;
+	WritePacket();
+	success &= cold->wrPkt.success;
+
+	success &= WriteRegister(0xa20009, &one, 1);
+	success &= WriteRegister(0xa20001, &reset, 1);
+	success &= WriteRegister(0xa20001, config, 7);
+	success &= WriteRegister(0xa20008, &one, 1);
+
+	ClearPackets();
+	cold->wrPkt.buffer[0] = WM_OUT_SPKR_MUTE;
+	cold->wrPkt.buffer[1] = 0x00;
+	WritePacket();
+	success &= cold->wrPkt.success;
+
+	/* The speaker's decoder starts over once configured, so ours does too */
+	speakerRate = sampleRate;
+	cold->speakerCodec.Reset();
+
+	return success;
+}
+
+/* Stop any audio, then mute and power down the speaker */
+BOOL CWiimote::SpeakerOff()
+{
+	cold->output.StopAudio();
+
+	BOOL success = true;
+
+	ClearPackets();
+	cold->wrPkt.buffer[0] = WM_OUT_SPKR_MUTE;
+	cold->wrPkt.buffer[1] = 0x04;
+	WritePacket();
+	success &= cold->wrPkt.success;
+
+	ClearPackets();
+	cold->wrPkt.buffer[0] = WM_OUT_SPKR_ENABLE;
+	cold->wrPkt.buffer[1] = 0x00;
+	WritePacket();
+	success &= cold->wrPkt.success;
+
+	speakerRate = 0;
+	return success;
+}
+
+/* Play a clip of 16-bit PCM at the rate given to SpeakerOn(), replacing anything playing.
+The clip is encoded here, up front, and streamed by the output queue's writer thread,
+so this returns straight away. The encoder carries on from the previous clip, as the
+speaker's decoder does. */
+BOOL CWiimote::PlaySound(const short *pcm, int samples)
+{
+	if(!speakerRate || samples <= 0)
+		return false;
+
+	std::vector<byte> adpcm((samples + 1) / 2);
+	int length = cold->speakerCodec.Encode(pcm, samples, &adpcm[0]);
+
+	return cold->output.PlayAudio(&adpcm[0], length, SpeakerPeriod(speakerRate));
+}
+
+/* Have every input report shown to subscriber as it arrives, on the read loop's thread.
+Returns false if there are already WM_MAX_SUBSCRIBERS. */
+BOOL CWiimote::Subscribe(CReportSubscriber *subscriber)
+{
+	return cold->reports.Subscribe(subscriber);
+}
+
+void CWiimote::Unsubscribe(CReportSubscriber *subscriber)
+{
+	cold->reports.Unsubscribe(subscriber);
+}
+
+/* Record every input report to path, with this mote's calibration in the header */
+BOOL CWiimote::StartCapture(const char *path)
+{
+	WM_CAPTURE_HEADER header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, WM_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = WM_CAPTURE_VERSION;
+	header.recordSize = sizeof(WM_CAPTURE_RECORD);
+	header.started = WmNow();
+	header.moteZero[0] = calibration.zero.x;
+	header.moteZero[1] = calibration.zero.y;
+	header.moteZero[2] = calibration.zero.z;
+	header.moteScale[0] = calibration.scale.x;
+	header.moteScale[1] = calibration.scale.y;
+	header.moteScale[2] = calibration.scale.z;
+	header.chukZero[0] = calibration.chuk.zero.x;
+	header.chukZero[1] = calibration.chuk.zero.y;
+	header.chukZero[2] = calibration.chuk.zero.z;
+	header.chukScale[0] = calibration.chuk.scale.x;
+	header.chukScale[1] = calibration.chuk.scale.y;
+	header.chukScale[2] = calibration.chuk.scale.z;
+	header.stickMin[0] = calibration.chuk.stickMin.x;
+	header.stickMin[1] = calibration.chuk.stickMin.y;
+	header.stickMax[0] = calibration.chuk.stickMax.x;
+	header.stickMax[1] = calibration.chuk.stickMax.y;
+	header.stickCenter[0] = calibration.chuk.stickCenter.x;
+	header.stickCenter[1] = calibration.chuk.stickCenter.y;
+	header.chukConnected = mote.chuk.connected ? 1 : 0;
+
+	if(!cold->capture.Start(path, &header))
+		return false;
+
+	if(!cold->reports.Subscribe(&cold->capture))
+	{
+		cold->capture.Stop();
+		return false;
+	}
+
+	return true;
+}
+
+/* Take the calibration StartCapture() saved, for decoding a capture offline */
+void CWiimote::LoadCalibration(const WM_CAPTURE_HEADER *header)
+{
+	calibration.zero.x = header->moteZero[0];
+	calibration.zero.y = header->moteZero[1];
+	calibration.zero.z = header->moteZero[2];
+	calibration.scale.x = header->moteScale[0];
+	calibration.scale.y = header->moteScale[1];
+	calibration.scale.z = header->moteScale[2];
+	calibration.chuk.zero.x = header->chukZero[0];
+	calibration.chuk.zero.y = header->chukZero[1];
+	calibration.chuk.zero.z = header->chukZero[2];
+	calibration.chuk.scale.x = header->chukScale[0];
+	calibration.chuk.scale.y = header->chukScale[1];
+	calibration.chuk.scale.z = header->chukScale[2];
+	calibration.chuk.stickMin.x = header->stickMin[0];
+	calibration.chuk.stickMin.y = header->stickMin[1];
+	calibration.chuk.stickMax.x = header->stickMax[0];
+	calibration.chuk.stickMax.y = header->stickMax[1];
+	calibration.chuk.stickCenter.x = header->stickCenter[0];
+	calibration.chuk.stickCenter.y = header->stickCenter[1];
+	mote.chuk.connected = header->chukConnected != 0;
+	/* Captures only record a nunchuk's calibration */
+	mote.extension = mote.chuk.connected ? WM_EXT_NUNCHUK : WM_EXT_NONE;
+	mote.extEncrypted = false;
+}
+
+void CWiimote::StopCapture()
+{
+	if(!cold->capture.Running())
+		return;
+
+	cold->reports.Unsubscribe(&cold->capture);
+	cold->capture.Stop();
+	printf("Captured %llu reports, %llu dropped\n", cold->capture.Written(), cold->capture.Dropped());
+}
+
+/* Publish this mote's decoded state to other processes as shared-memory device N.
+See SharedState.h for the reader side. */
+BOOL CWiimote::StartSharing(int device)
+{
+	if(!shared.Open(device))
+		return false;
+	PublishState();
+	return true;
+}
+
+void CWiimote::StopSharing()
+{
+	shared.Close();
+}
+
+/* Also send each decoded state over UDP as device N of sender's stream.
+Pass NULL to stop. Call before DebugLoop() starts. */
+void CWiimote::StreamTo(CStateSender *sender, int device)
+{
+	netSender = sender;
+	netDevice = device;
+}
+
+/* Hand the decoded state to the shared segment and the network stream, where enabled */
+void CWiimote::PublishState()
+{
+	if(!shared.IsOpen() && !netSender)
+		return;
+	Derive(WM_DERIVE_ALL);
+
+	WM_SHARED_STATE state;
+	memset(&state, 0, sizeof(state));
+
+	if(rdPkt.slot)
+	{
+		state.time = mote.sampleTime;
+		state.report = rdPkt.slot->seq;
+	}
+
+	state.buttons = ButtonMask();
+
+	if(mote.connected) state.flags |= WM_SHM_CONNECTED;
+	if(mote.rumbling) state.flags |= WM_SHM_RUMBLING;
+	state.battery = mote.battery;
+
+	state.force[0] = mote.force.x;
+	state.force[1] = mote.force.y;
+	state.force[2] = mote.force.z;
+	state.tilt[0] = mote.tilt.x;
+	state.tilt[1] = mote.tilt.y;
+	state.tilt[2] = mote.tilt.z;
+
+	if(mote.chuk.connected)
+	{
+		state.flags |= WM_SHM_CHUK;
+		if(mote.chuk.button.c) state.chukButtons |= WM_SHM_CHUK_C;
+		if(mote.chuk.button.z) state.chukButtons |= WM_SHM_CHUK_Z;
+		state.chukForce[0] = mote.chuk.force.x;
+		state.chukForce[1] = mote.chuk.force.y;
+		state.chukForce[2] = mote.chuk.force.z;
+		state.chukTilt[0] = mote.chuk.tilt.x;
+		state.chukTilt[1] = mote.chuk.tilt.y;
+		state.chukTilt[2] = mote.chuk.tilt.z;
+		state.stick[0] = mote.chuk.stick.x;
+		state.stick[1] = mote.chuk.stick.y;
+	}
+
+	for(int i = 0; i < WM_IR_DOTS && i < WM_SHM_IR_DOTS; i++)
+	{
+		state.ir[i].x = mote.ir[i].x;
+		state.ir[i].y = mote.ir[i].y;
+		state.ir[i].size = mote.ir[i].size;
+		state.ir[i].visible = mote.ir[i].visible ? 1 : 0;
 	}
+
+	if(shared.IsOpen())
+		shared.Publish(&state);
+	if(netSender)
+		netSender->Queue(netDevice, &state);
+}
+
+/* How closely the last clip's reports kept to schedule */
+void CWiimote::GetAudioStats(WM_AUDIO_STATS *out)
+{
+	cold->output.GetAudioStats(out);
+}
+
+/* Print the latency histograms for this mote.
+Safe to call from any thread while DebugLoop() is running. */
+void CWiimote::DumpLatency()
+{
+#ifndef WM_NO_LATENCY
+	cold->latency.Dump(stdout, "wiimote");
+#else
+	printf("Latency instrumentation was compiled out (WM_NO_LATENCY).\n");
+#endif
+}
+
+/* Add this mote's latency histograms to into, e.g. to see several motes as one.
+Safe to call from any thread while DebugLoop() is running. */
+void CWiimote::AddLatency(CLatencyStats *into)
+{
+#ifndef WM_NO_LATENCY
+	into->Add(cold->latency);
+#else
+	(void)into;
+#endif
+}
+
+/* Start the latency histograms over, e.g. after a warm-up.
+A report in flight at the time may still land in the old counts. */
+void CWiimote::ResetLatency()
+{
+#ifndef WM_NO_LATENCY
+	cold->latency.Reset();
+#endif
+}
+
+/* Map reports as usual but send nothing to the host. For benchmarks, and for
+running many motes without each one moving the real pointer. */
+void CWiimote::SetNullOutput(bool on)
+{
+	injector.SetDiscard(on);
+	gamepad.SetDiscard(on);
+}
+
+/* Keyboard, mouse and gamepad events swallowed by the null output */
+unsigned long long CWiimote::NullEvents() const
+{
+	return injector.Discarded() + gamepad.Discarded();
+}
+
+/* The last frame MapGamepad() sent. Only while DebugLoop() isn't running. */
+void CWiimote::GetGamepadFrame(WM_GAMEPAD_FRAME *out) const
+{
+	gamepad.Last(out);
+}
+
+/* Copy the report counters for this mote.
+Safe to call from any thread while DebugLoop() is running. */
+void CWiimote::GetStats(WM_STATS *out)
+{
+	stats.Snapshot(out);
+}
+
+/* Print the running totals of the report counters */
+void CWiimote::PrintStats()
+{
+	WM_STATS s;
+	stats.Snapshot(&s);
+
+	printf("Stats wiimote: %llu reports, period %.2f ms, jitter %.2f ms, drops %llu in %llu gaps, "
+		"overruns %llu, read errors %llu, write errors %llu, init unexpected %llu\n",
+		s.received, s.period / 1e6, s.jitter / 1e6, s.drops, s.gaps,
+		s.overruns, s.readErrors, s.writeErrors, s.initUnexpected);
+}
+
+/* Calculate Tilt for each axis, in degrees, based on the raw G-force
+data...assumes axis and calibration data is already gathered */
+void CWiimote::CalcTilt()
+{
+    float xs = (float) (calibration.scale.x) - (float) (calibration.zero.x);
+    float ys = (float) (calibration.scale.y) - (float) (calibration.zero.y);
+    float zs = (float) (calibration.scale.z) - (float) (calibration.zero.z);	
+	
+    float x = (float) ((float)mote.axis.x - (float)calibration.zero.x) / xs;
+    float y = (float) ((float)mote.axis.y - (float)calibration.zero.y) / ys;
+    float z = (float) ((float)mote.axis.z - (float)calibration.zero.z) / zs;
+
+    mote.tilt.x = (asin(x) * 180.0f / (float) M_PI);
+    mote.tilt.y = (asin(y) * 180.0f / (float) M_PI);
+    mote.tilt.z = (asin(z) * 180.0f / (float) M_PI);
+
 }
 
 /* Calculate Force for each axis, based on the raw G-force
 data...assumes axis and calibration data is already gathered */
 void CWiimote::CalcForce()
 {
-    mote.force.x = (float) (mote.axis.x - mote.zero.x) / (mote.scale.x - mote.zero.x);
-    mote.force.y = (float) (mote.axis.y - mote.zero.y) / (mote.scale.y - mote.zero.y);
-    mote.force.z = (float) (mote.axis.z - mote.zero.z) / (mote.scale.z - mote.zero.z);
+    mote.force.x = (float) (mote.axis.x - calibration.zero.x) / (calibration.scale.x - calibration.zero.x);
+    mote.force.y = (float) (mote.axis.y - calibration.zero.y) / (calibration.scale.y - calibration.zero.y);
+    mote.force.z = (float) (mote.axis.z - calibration.zero.z) / (calibration.scale.z - calibration.zero.z);
+}
+
+/* Bring the WM_DERIVE_* values in groups up to date with the last report.
+Each is worked out at most once per report, and only while the calibration
+it needs is in; without it the value keeps what it had. Call it from the
+thread that decodes. */
+void CWiimote::Derive(unsigned groups)
+{
+	groups &= stale;
+	if(!groups)
+		return;
+	stale &= ~groups;
 
-	if(mote.chuk.connected == true)
+	if(calibration.zero.x)
 	{
-		mote.chuk.force.x = (float) (mote.chuk.axis.x - mote.chuk.zero.x) / (mote.chuk.scale.x - mote.chuk.zero.x);
-		mote.chuk.force.y = (float) (mote.chuk.axis.y - mote.chuk.zero.y) / (mote.chuk.scale.y - mote.chuk.zero.y);
-		mote.chuk.force.z = (float) (mote.chuk.axis.z - mote.chuk.zero.z) / (mote.chuk.scale.z - mote.chuk.zero.z);
+		if(groups & WM_DERIVE_TILT)
+			CalcTilt();
+		if(groups & WM_DERIVE_FORCE)
+			CalcForce();
+	}
+
+	if(mote.chuk.connected && calibration.chuk.zero.x)
+	{
+		if(groups & WM_DERIVE_CHUK_FORCE)
+			CalcChukForce();
+		if(groups & WM_DERIVE_CHUK_TILT)
+			CalcChukTilt();
+		if(groups & WM_DERIVE_STICK)
+			CalcStick();
+	}
+}
+
+const CWiimote::_float3 &CWiimote::Force() { Derive(WM_DERIVE_FORCE); return mote.force; }
+const CWiimote::_float3 &CWiimote::Tilt() { Derive(WM_DERIVE_TILT); return mote.tilt; }
+const CWiimote::_float3 &CWiimote::ChukForce() { Derive(WM_DERIVE_CHUK_FORCE); return mote.chuk.force; }
+const CWiimote::_float3 &CWiimote::ChukTilt() { Derive(WM_DERIVE_CHUK_TILT); return mote.chuk.tilt; }
+const CWiimote::_float2 &CWiimote::ChukStick() { Derive(WM_DERIVE_STICK); return mote.chuk.stick; }
+
+/* Hand the extension bytes of a report to the decoder for whatever is
+plugged in. Only an extension that needed the old init sends them encrypted,
+and only then do they go through WiiDecrypt() first. */
+void CWiimote::DecodeExtension(const byte *data)
+{
+	byte clear[8];
+	if(mote.extEncrypted)
+	{
+		for(int i = 0; i < (int)sizeof(clear); i++)
+			clear[i] = WiiDecrypt(data[i]);
+		data = clear;
+	}
+
+	switch(mote.extension)
+	{
+	case WM_EXT_NUNCHUK:
+		DecodeNunchuk(data);
+		break;
+	case WM_EXT_CLASSIC:
+		DecodeClassic(data);
+		break;
+	case WM_EXT_MOTIONPLUS:
+		DecodeMotionPlus(data);
+		break;
+	case WM_EXT_BALANCE:
+		DecodeBalance(data);
+		break;
 	}
 }
+
+/* The nunchuk's 6 bytes: stick x and y, acceleration x, y and z, then the
+buttons. Its tilt, force and stick position are worked out from them when
+something reads them. */
+void CWiimote::DecodeNunchuk(const byte *data)
+{
+	mote.chuk.stickAxis.x = data[0];
+	mote.chuk.stickAxis.y = data[1];
+	mote.chuk.axis.x = data[2];
+	mote.chuk.axis.y = data[3];
+	mote.chuk.axis.z = data[4];
+
+	byte chukButtons = data[5];
+	/* Unlike the mote buttons, 0 means the button is pressed */
+	if(chukButtons & WM_CHUK_BUT_C) mote.chuk.button.c = false;
+	else mote.chuk.button.c = true;
+	if(chukButtons & WM_CHUK_BUT_Z) mote.chuk.button.z = false;
+	else mote.chuk.button.z = true;
+
+	stale |= WM_DERIVE_CHUK_FORCE | WM_DERIVE_CHUK_TILT | WM_DERIVE_STICK;
+}
+
+/* The nunchuk's force in G's, from its raw axes */
+void CWiimote::CalcChukForce()
+{
+	float xs = (float) (calibration.chuk.scale.x) - (float) (calibration.chuk.zero.x);
+	float ys = (float) (calibration.chuk.scale.y) - (float) (calibration.chuk.zero.y);
+	float zs = (float) (calibration.chuk.scale.z) - (float) (calibration.chuk.zero.z);
+
+	mote.chuk.force.x = (float) (mote.chuk.axis.x - calibration.chuk.zero.x) / xs;
+	mote.chuk.force.y = (float) (mote.chuk.axis.y - calibration.chuk.zero.y) / ys;
+	mote.chuk.force.z = (float) (mote.chuk.axis.z - calibration.chuk.zero.z) / zs;
+}
+
+/* The nunchuk's tilt in degrees, from its force */
+void CWiimote::CalcChukTilt()
+{
+	Derive(WM_DERIVE_CHUK_FORCE);
+	mote.chuk.tilt.x = (asin(mote.chuk.force.x) * 180.0f / (float) M_PI);
+	mote.chuk.tilt.y = (asin(mote.chuk.force.y) * 180.0f / (float) M_PI);
+	mote.chuk.tilt.z = (asin(mote.chuk.force.z) * 180.0f / (float) M_PI);
+}
+
 /* Calculate the stick position relative to it's min/max/center */
 void CWiimote::CalcStick()
 {
 	float temp = 0.f;
 	float stickAxisX = mote.chuk.stickAxis.x;
 	float stickAxisY = mote.chuk.stickAxis.y;
-	float stickCenterX = mote.chuk.stickCenter.x;
-	float stickCenterY = mote.chuk.stickCenter.y;
-	float stickMaxX = mote.chuk.stickMax.x;
-	float stickMaxY = mote.chuk.stickMax.y;
-	float stickMinX = mote.chuk.stickMin.x;
-	float stickMinY = mote.chuk.stickMin.y;
-
-	if(mote.chuk.stickAxis.x == mote.chuk.stickCenter.x)
+	float stickCenterX = calibration.chuk.stickCenter.x;
+	float stickCenterY = calibration.chuk.stickCenter.y;
+	float stickMaxX = calibration.chuk.stickMax.x;
+	float stickMaxY = calibration.chuk.stickMax.y;
+	float stickMinX = calibration.chuk.stickMin.x;
+	float stickMinY = calibration.chuk.stickMin.y;
+
+	if(mote.chuk.stickAxis.x == calibration.chuk.stickCenter.x)
 		mote.chuk.stick.x = 0.f;
-	if(mote.chuk.stickAxis.y == mote.chuk.stickCenter.y)
+	if(mote.chuk.stickAxis.y == calibration.chuk.stickCenter.y)
 		mote.chuk.stick.y = 0.f;
 
 	if(stickAxisX < stickCenterX)
@@ -1074,46 +1967,129 @@ void CWiimote::CalcStick()
 
 }
 
-/* Send a keyboard event using SendInput.
+/* Send a keyboard event.
 Accepts a key and a flag value */
 UINT CWiimote::KeyboardEvent(byte keyCode, DWORD flags)
 {
-	INPUT key;
 	UINT ret = 0;
 
-	key.type = INPUT_KEYBOARD;
-	key.ki.wVk = keyCode;
-	key.ki.dwFlags = flags;
-	key.ki.time = 0;
-	key.ki.wScan = MapVirtualKeyEx(keyCode, 0, kbLayout); /* 2nd param is MAPVK_VK_TO_VSC, PSDK guys didn't
-														  feel it necessary to include this in winuser.h...*/
-	key.ki.dwExtraInfo = 0;
-
-	// Send a single key using the keyCode and flags provided
-	ret = SendInput(1, &key, sizeof(INPUT));
+	WM_LAT_STAMP_ONCE(map);
+	WM_TRACE_BEGIN(inject);
+	ret = injector.Key(keyCode, flags);
+	WM_TRACE_END(inject, 0, keyCode);
+	WM_LAT_STAMP(inject);
 
 	return ret;
 }
 
-/* Sends a mouse event using SendInput. */
+/* Sends a mouse event. */
 UINT CWiimote::MouseEvent(DWORD flags, DWORD dx, DWORD dy, DWORD data, ULONG_PTR extraInfo)
 {
-	INPUT key;
 	UINT ret;
 
-	key.type = INPUT_MOUSE;
-	key.mi.dwFlags = flags;
-	key.mi.dwExtraInfo = extraInfo;
-	key.mi.dx = dx;
-	key.mi.dy = dy;
-	key.mi.mouseData = data;
-	key.mi.time = 0;
-	
-	ret = SendInput(1, &key, sizeof(INPUT));
+	WM_LAT_STAMP_ONCE(map);
+	WM_TRACE_BEGIN(inject);
+	ret = injector.Mouse(flags, dx, dy, data, extraInfo);
+	WM_TRACE_END(inject, 1, flags);
+	WM_LAT_STAMP(inject);
+
+	return ret;
+}
+
+/* Send a whole frame to the virtual gamepad, returning what CGamepad::Send() does */
+int CWiimote::GamepadEvent(const WM_GAMEPAD_FRAME *frame)
+{
+	int ret;
+
+	WM_LAT_STAMP_ONCE(map);
+	WM_TRACE_BEGIN(inject);
+	ret = gamepad.Send(frame);
+	WM_TRACE_END(inject, 2, frame->buttons);
+	WM_LAT_STAMP(inject);
 
 	return ret;
 }
 
+/* A stick reading against its calibration, -1 to +1 */
+static float StickAxis(int value, int min, int center, int max)
+{
+	float position = 0.f;
+	if(value < center && center > min)
+		position = (float)(value - center) / (center - min);
+	else if(value > center && max > center)
+		position = (float)(value - center) / (max - center);
+	return position < -1.f ? -1.f : position > 1.f ? 1.f : position;
+}
+
+/* The Classic Controller's 6 bytes: the left stick's 6-bit axes, the right
+stick's 5-bit axes and the 5-bit triggers packed around them, then the
+buttons as an active-low word */
+void CWiimote::DecodeClassic(const byte *data)
+{
+	_classic &classic = mote.classic;
+
+	classic.leftAxis.x = data[0] & 0x3f;
+	classic.leftAxis.y = data[1] & 0x3f;
+	classic.rightAxis.x = (byte)(((data[0] & 0xc0) >> 3) | ((data[1] & 0xc0) >> 5) | ((data[2] & 0x80) >> 7));
+	classic.rightAxis.y = data[2] & 0x1f;
+	int leftTrigger = ((data[2] & 0x60) >> 2) | ((data[3] & 0xe0) >> 5);
+	int rightTrigger = data[3] & 0x1f;
+	classic.buttons = (unsigned short)(~((data[4] << 8) | data[5]) & 0xfeff);
+
+	classic.leftTrigger = leftTrigger / 31.f;
+	classic.rightTrigger = rightTrigger / 31.f;
+
+	/* The calibration is in 8-bit units, so scale the raw axes up to match */
+	int raw[4] = { classic.leftAxis.x << 2, classic.leftAxis.y << 2, classic.rightAxis.x << 3, classic.rightAxis.y << 3 };
+	float *axes[4] = { &classic.left.x, &classic.left.y, &classic.right.x, &classic.right.y };
+	for(int i = 0; i < 4; i++)
+		*axes[i] = StickAxis(raw[i], calibration.classic.stickMin[i], calibration.classic.stickCenter[i], calibration.classic.stickMax[i]);
+}
+
+/* The MotionPlus's 6 bytes: yaw, roll and pitch as 14-bit rates, each with a
+flag for the slow, finer range. Bit 1 of the last byte is clear on reports
+passed through from an extension plugged into the MotionPlus, which aren't
+handled yet. */
+void CWiimote::DecodeMotionPlus(const byte *data)
+{
+	_motionplus &plus = mote.motionPlus;
+	if(!(data[5] & 0x02))
+		return;
+
+	plus.axis[0] = (unsigned short)(data[0] | ((data[3] & 0xfc) << 6));
+	plus.axis[1] = (unsigned short)(data[1] | ((data[4] & 0xfc) << 6));
+	plus.axis[2] = (unsigned short)(data[2] | ((data[5] & 0xfc) << 6));
+	plus.slow[0] = (data[3] & 0x02) != 0;
+	plus.slow[1] = (data[4] & 0x02) != 0;
+	plus.slow[2] = (data[3] & 0x01) != 0;
+
+	float rate[3];
+	for(int i = 0; i < 3; i++)
+		rate[i] = (plus.axis[i] - WM_MPLUS_ZERO) / (plus.slow[i] ? WM_MPLUS_SLOW_SCALE : WM_MPLUS_SLOW_SCALE / WM_MPLUS_FAST_FACTOR);
+	plus.rate.x = rate[2];
+	plus.rate.y = rate[1];
+	plus.rate.z = rate[0];
+}
+
+/* The Balance Board's first 8 bytes: its four sensors, big-endian, each
+turned into kg by interpolating between its 0, 17 and 34 kg readings */
+void CWiimote::DecodeBalance(const byte *data)
+{
+	_balance &board = mote.balance;
+	board.total = 0.f;
+
+	for(int i = 0; i < 4; i++)
+	{
+		int raw = (data[i * 2] << 8) | data[i * 2 + 1];
+		board.sensor[i] = (unsigned short)raw;
+
+		int low = raw < calibration.balance[1][i] ? 0 : 1;
+		int span = calibration.balance[low + 1][i] - calibration.balance[low][i];
+		board.kg[i] = span > 0 ? 17.f * low + 17.f * (raw - calibration.balance[low][i]) / span : 0.f;
+		board.total += board.kg[i];
+	}
+}
+
 /* Decrypt a byte value from a packet.
 Some packets include data which must be decrypted with:
 (cryptByte XOR 0x17) + 0x17 */
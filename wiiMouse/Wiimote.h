@@ -1,5 +1,6 @@
 #pragma once
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN		// Exclude rarely-used stuff from Windows headers
 #include <stdio.h>
 #include <tchar.h>
@@ -7,43 +8,21 @@
 
 #define _WIN32_WINNT 0x0501
 #include <windows.h>
+#else
+#include "PosixCompat.h"
+#endif
 
 #include <iostream>
 #include <sstream>
 using namespace std;
 
+#ifdef _WIN32
 #include "objbase.h"
+#endif
 #include "stdlib.h"
 
-/***************************
-	IMPORTANT
-You'll need these headers 
-and lib files from the DDK:
-
-1. hid.lib
-2. setupapi.lib
-3. hidpi.h
-4. hidsdi.h
-5. hidusage.h
-6. setupapi.h
-
-Also, the libs are not
-compiled with safe exception
-handling, so any project
-including them needs to 
-specify /SAFEESH:NO.
-In Project Properties, this
-is in the Configuration,
-Linker, Advanced section.
-
-***************************/
-extern "C"{
-#include "setupapi.h"		// needs setupapi.lib
-#include "hidsdi.h"			// needs hid.lib
-}
-
-#pragma comment(lib, "hid.lib")
-#pragma comment(lib, "setupapi.lib")
+/* The Windows build needs hid.lib and setupapi.lib from the DDK,
+see HidDeviceWin32.cpp for details. */
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -52,9 +31,12 @@ extern "C"{
 #define WIIMOTE_VID 0x057e /* Nintendo */
 #define WIIMOTE_PID 0x0306 /* WiiMote */
 
-#define WM_MAX_DEVICES 20
 #define WM_STRING_SIZE 256
 #define WM_PACKET_SIZE 22
+#define WM_IR_DOTS 4 /* the IR camera tracks up to 4 points */
+#define WM_POLL_WAIT_MS 100 /* Longest DebugLoop() waits for a report before checking timed effects */
+#define WM_MODE_REPEAT_NS (1 * WM_NS_PER_SEC) /* Plus or minus held this long steps the mode again */
+#define WM_POINTER_MAX_STEPS 3.0f /* Most report periods of movement the pointer makes up for after a gap */
 
 /* My modes */
 #define WM_MY_MAX 0x02 /* how many my modes do I have; used for rotation */
@@ -120,6 +102,38 @@ corresponding mask */
 #define WM_CHUK_BUT_Z 0x0001
 #define WM_CHUK_BUT_C 0x0002
 
+/* Extension controllers, told apart by the 6-byte ID at 0xa400fa */
+#define WM_EXT_NONE 0
+#define WM_EXT_NUNCHUK 1
+#define WM_EXT_CLASSIC 2
+#define WM_EXT_MOTIONPLUS 3
+#define WM_EXT_BALANCE 4
+#define WM_EXT_UNKNOWN 5 /* something is plugged in, but not one of the above */
+
+/* Classic Controller button masks - bytes 4 and 5 of its data as a word,
+inverted, since the controller sends 0 for a pressed button */
+#define WM_CLASSIC_UP 0x0001
+#define WM_CLASSIC_LEFT 0x0002
+#define WM_CLASSIC_ZR 0x0004
+#define WM_CLASSIC_X 0x0008
+#define WM_CLASSIC_A 0x0010
+#define WM_CLASSIC_Y 0x0020
+#define WM_CLASSIC_B 0x0040
+#define WM_CLASSIC_ZL 0x0080
+#define WM_CLASSIC_R 0x0200
+#define WM_CLASSIC_PLUS 0x0400
+#define WM_CLASSIC_HOME 0x0800
+#define WM_CLASSIC_MINUS 0x1000
+#define WM_CLASSIC_L 0x2000
+#define WM_CLASSIC_DOWN 0x4000
+#define WM_CLASSIC_RIGHT 0x8000
+
+/* MotionPlus gyro scale: raw units per degree per second in slow mode, and
+how much wider the range is in fast mode */
+#define WM_MPLUS_ZERO 8192
+#define WM_MPLUS_SLOW_SCALE 13.768f
+#define WM_MPLUS_FAST_FACTOR 4.545f
+
 /* Wiimote LED masks */
 #define WM_LED_NONE 0x00
 #define WM_LED_ONE 0x10
@@ -127,6 +141,28 @@ corresponding mask */
 #define WM_LED_THREE 0x40
 #define WM_LED_FOUR 0x80
 
+#include "Latency.h"
+#include "ReportStats.h"
+#include "HidDevice.h"
+#include "InputInjector.h"
+#include "Gamepad.h"
+#include "Profile.h"
+#include "OutputQueue.h"
+#include "RumbleFx.h"
+#include "Speaker.h"
+#include "ReportPool.h"
+#include "Capture.h"
+#include "SharedState.h"
+#include "NetStream.h"
+#include "CommandQueue.h"
+#include "Idle.h"
+#include "MemoryAccess.h"
+#include "RealTime.h"
+#include "SampleClock.h"
+#include "PointerScheduler.h"
+#include "StateArena.h"
+#include "Trace.h"
+
 class CWiimote
 {
 struct _byte3 {
@@ -175,31 +211,92 @@ struct _float3 {
 
 struct _wiichuk {
 	_byte2 stickAxis; /* Min/Max/Center determined by calibration data */
-	_byte2 stickMin; /* Stick minimums calibration data */
-	_byte2 stickMax; /* Stick maximums calibration data */
-	_byte2 stickCenter; /* Stick centers calibration data */
-	_float2 stick;	/* Center is 0.0f, Min is -1, Max is +1 */
+	_float2 stick;	/* Center is 0.0f, Min is -1, Max is +1. Read through ChukStick(). */
 	_chuk_buttons button;
 	_byte3 axis; /* G's are relative to calibration data */
-	_byte3 scale; /* Calibration for each axis (what +1G equal to) */
-	_byte3 zero; /* Calibration for each axis (what 0G is equal to) */
-	_float3 force; /* Calibrated force in G's */
-	_float3 tilt; /* Calibrated tilt in degrees */
+	_float3 force; /* Calibrated force in G's, worked out on demand: read through ChukForce() */
+	_float3 tilt; /* Calibrated tilt in degrees, read through ChukTilt() */
 	bool connected; /* Is the nunchuk connected to the mote? */
 };
 
+struct _classic {
+	unsigned short buttons; /* WM_CLASSIC_* bits, set while pressed */
+	_byte2 leftAxis; /* raw, 6 bits */
+	_byte2 rightAxis; /* raw, 5 bits */
+	_float2 left; /* Center is 0.0f, Min is -1, Max is +1 */
+	_float2 right;
+	float leftTrigger; /* 0 released to 1 pressed all the way */
+	float rightTrigger;
+	bool connected;
+};
+
+struct _motionplus {
+	unsigned short axis[3]; /* raw 14-bit yaw, roll and pitch */
+	bool slow[3]; /* which axes are in the narrow, finer range */
+	_float3 rate; /* degrees per second: x pitch, y roll, z yaw */
+	bool connected;
+};
+
+struct _balance {
+	unsigned short sensor[4]; /* raw top right, bottom right, top left, bottom left */
+	float kg[4];
+	float total; /* all four, in kg */
+	bool connected;
+};
+
+struct _irdot {
+	unsigned short x; /* 0 to 1023 */
+	unsigned short y; /* 0 to 767 */
+	byte size; /* 0 to 15, only reported in extended IR mode */
+	bool visible;
+};
+
+/* Decoded state, rewritten on every report. Calibration, which only changes
+when something connects, is kept apart in _calibration. Force, tilt and the
+nunchuk's stick are the exception: decoding only marks them stale, and they
+are worked out from the raw axes the first time something asks for them after
+a report (see Derive()), so a reader of buttons never pays for the asin()s. */
 struct _wiimote {
 	BOOL connected; /* Are we connected and talking to this mote? */
 	BOOL rumbling; /* Is the mote rumbling? */
 	int battery; /* Battery level, 0 to 100 */
+	int extension; /* WM_EXT_* */
+	bool extEncrypted; /* initialized the old way, so its bytes need WiiDecrypt() */
 	_wiichuk chuk; /* Nunchuk controller */
+	_classic classic; /* Classic Controller */
+	_motionplus motionPlus;
+	_balance balance; /* Balance Board */
 	_directionalpad dpad; /* Up/Down/Left/Right */
 	_mote_buttons button; /* A, B, One, Two, Plus, Minus, Home */
 	_byte3 axis; /* G's are relative to calibration data */
+	_float3 force; /* Calibrated force in G's, worked out on demand: read through Force() */
+	_float3 tilt; /* Calibrated tilt in degrees, read through Tilt() */
+	_irdot ir[WM_IR_DOTS]; /* IR camera points, in report modes that carry them */
+	WM_TIME sampleTime; /* when the mote sampled the last report, with delivery bursts taken out (see SampleClock.h) */
+	WM_TIME sampleDt; /* sample time since the report before it */
+};
+
+struct _chuk_calibration {
+	_byte3 scale; /* Calibration for each axis (what +1G equal to) */
+	_byte3 zero; /* Calibration for each axis (what 0G is equal to) */
+	_byte2 stickMin; /* Stick minimums calibration data */
+	_byte2 stickMax; /* Stick maximums calibration data */
+	_byte2 stickCenter; /* Stick centers calibration data */
+};
+
+struct _classic_calibration {
+	byte stickMax[4]; /* left x, left y, right x, right y, in 8-bit units */
+	byte stickMin[4];
+	byte stickCenter[4];
+};
+
+/* Read from the mote and extension when they connect, then only read */
+struct _calibration {
 	_byte3 scale; /* Calibration for each axis (what +1G equal to) */
 	_byte3 zero; /* Calibration for each axis (what 0G is equal to) */
-	_float3 force; /* Calibrated force in G's */
-	_float3 tilt; /* Calibrated tilt in degrees */
+	_chuk_calibration chuk;
+	_classic_calibration classic;
+	unsigned short balance[3][4]; /* Balance Board sensor readings at 0, 17 and 34 kg */
 };
 
 struct _packet {
@@ -207,37 +304,169 @@ struct _packet {
 	DWORD bytesTransferred;
 	byte buffer[WM_PACKET_SIZE];
 };
+
+/* The input report being decoded - a view of a pooled slot */
+struct _report_ref {
+	BOOL success;
+	DWORD bytesTransferred;
+	const byte *buffer; /* the slot's data, or all zeroes when there is no report */
+	WM_REPORT *slot; /* held until the next read */
+};
+
+/* What a mote needs but the read loop doesn't touch on every report - or, in
+the report pool and the latency histograms, touches a line or two of at a
+time. Allocated on its own so the CWiimote itself stays a few KB. */
+struct _cold {
+	_cold(CHidDevice *hid, CReportStats *stats);
+	CCommandQueue commands; /* written by other threads, so kept off the loop's lines */
+	WCHAR sManuf[WM_STRING_SIZE];
+	WCHAR sProd[WM_STRING_SIZE];
+	_packet wrPkt;
+	CReportPool reports;
+	WM_REPORT spare; /* read into when the pool is exhausted, never published */
+	CReportCapture capture; /* Declared after reports, whose slots it holds */
+	CAdpcmEncoder speakerCodec;
+	COutputQueue output;
+	CMemoryAccess memory; /* Declared after output, which it sends through */
+#ifndef WM_NO_LATENCY
+	CLatencyStats latency;
+#endif
+};
+
+	_cold *cold; /* Declared first, everything else may refer to it */
+	unsigned stale; /* WM_DERIVE_* values in mote that the last report changed the inputs of */
 public:
+	_wiimote mote; /* Up front, so the state every report rewrites shares as few lines as possible */
+	const _float3 &Force();
+	const _float3 &Tilt();
+	const _float3 &ChukForce();
+	const _float3 &ChukTilt();
+	const _float2 &ChukStick();
+	void Derive(unsigned groups);
+	void PointerMotion(const CProfile *profile, float *dx, float *dy);
 	CWiimote(void);
+#ifndef _WIN32
+	CWiimote(int fd, const char *name);
+#endif
+	CWiimote(const WM_CAPTURE_HEADER *header);
 	int DebugLoop();
+	BOOL Poll(int maxWaitMs = WM_WAIT_FOREVER);
+	void DecodeReport(const byte *report, int length);
+	void LoadCalibration(const WM_CAPTURE_HEADER *header);
+	unsigned short ButtonMask();
+	BOOL SetReportMode(byte, byte = 0);
 	BOOL Rumble(bool);
 	BOOL EnableLED(byte);
-	HANDLE HIDHandle;
-	WCHAR sManuf[WM_STRING_SIZE];
-	WCHAR sProd[WM_STRING_SIZE];
+	BOOL SpeakerOn(int sampleRate = WM_SPKR_RATE, byte volume = WM_SPKR_VOLUME);
+	BOOL SpeakerOff();
+	BOOL PlaySound(const short *pcm, int samples);
+	void GetAudioStats(WM_AUDIO_STATS *);
+	BOOL StartTransfer(WM_TRANSFER *);
+	BOOL WaitTransfer(WM_TRANSFER *);
+	BOOL ReadMemory(byte space, DWORD address, byte *data, int length);
+	BOOL WriteMemory(byte space, DWORD address, const byte *data, int length);
+	BOOL Subscribe(CReportSubscriber *);
+	void Unsubscribe(CReportSubscriber *);
+	BOOL StartCapture(const char *path);
+	void StopCapture();
+	BOOL StartSharing(int device);
+	void StopSharing();
+	void StreamTo(CStateSender *sender, int device);
+	int Mode() const;
+	static const char *ExtensionName(int extension);
+	void WatchProfiles(CProfileWatcher *watcher);
+	int IdleState() const;
+	unsigned long long Wakeups() const;
+	WM_SCHED_CONFIG pointerSchedule; /* How DebugLoop() spreads pointer motion over time (see PointerScheduler.h). Off by default: the pointer moves with each report. */
+	bool gamepadOutput; /* DebugLoop() shows each report on a virtual gamepad (see Gamepad.h) instead of mapping it through the mode's profile */
+	bool minimalReports; /* DebugLoop() asks for only what the mode's profile reads. false always streams 0x31 or 0x35. */
+	WM_TIME idleAfter; /* Quiet time before DebugLoop() drops to buttons-only reports, in ns. 0 disables it. */
+	WM_RT_CONFIG realTime; /* Priority, CPU and busy-poll for the thread running DebugLoop(). All off by default. */
+	void DumpLatency();
+	void AddLatency(CLatencyStats *into);
+	void ResetLatency();
+	void SetNullOutput(bool on);
+	unsigned long long NullEvents() const;
+	void GetGamepadFrame(WM_GAMEPAD_FRAME *out) const;
+	WM_TIME latencyDumpInterval; /* Periodic latency dump from DebugLoop(), in ns. 0 disables it. */
+	void GetStats(WM_STATS *);
+	void PrintStats();
+	WM_TIME statsSummaryInterval; /* Periodic stats line from DebugLoop(), in ns. 0 disables it. */
+	CHidDevice hid;
+	CRumbleScheduler rumbleFx; /* Timed rumble effects, played from Poll() */
 	BOOL disconnect;
-	_wiimote mote;
+	BOOL quitOnHome; /* Home ends DebugLoop(). A daemon clears this and stops with WM_CMD_QUIT. */
+	CCommandQueue &commands; /* Posted from any thread, applied by DebugLoop() between reports */
 public:
 	~CWiimote(void);
+	static void *operator new(size_t size);
+	static void operator delete(void *block, size_t size);
 private:
-	HANDLE AttachToPnP();
-	HANDLE GetDeviceHandle();
+	void Reset();
+	void Connect();
 	BOOL Initialize();
 	void UpdateButtonStates(unsigned short buttons);
 	void ClearPackets();
-	void ReadPacket();
+	void ReadPacket(int timeoutMs = WM_WAIT_FOREVER);
+	void ReleaseReport();
 	void WritePacket();
-	void ParseReport();
-	BOOL SetReportMode(byte, byte = NULL);
+	BOOL ParseReport(int timeoutMs = WM_WAIT_FOREVER);
+	void UpdateEffects(WM_TIME);
+	void TickPointer(WM_TIME);
+	bool ApplyCommands(int *myMode);
+	void SwitchMode(int *myMode, int mode);
+	void SwapProfiles(int myMode);
+	void NegotiateReports(int myMode);
+	void SampleInputs(float *inputs, unsigned groups);
+	bool MapReport(const CProfile *profile);
+	bool MapGamepad();
+	void ReleaseHeld(const CProfile *profile);
+	void PressBinding(const WM_BINDING *binding, bool down);
+	void MotionSample(float *sample);
+	int IdleWaitMs();
+	void UpdateIdle(BOOL got, bool produced);
 	void CalcForce();
 	void CalcTilt();
+	void CalcChukForce();
+	void CalcChukTilt();
 	void CalcStick();
-	UINT KeyboardEvent(byte, DWORD = NULL);
-	UINT MouseEvent(DWORD, DWORD = NULL, DWORD = NULL, DWORD = NULL, ULONG_PTR = NULL);
+	BOOL InitExtension(bool present);
+	void DecodeExtension(const byte *data);
+	void DecodeNunchuk(const byte *data);
+	void DecodeClassic(const byte *data);
+	void DecodeMotionPlus(const byte *data);
+	void DecodeBalance(const byte *data);
+	void DecodeIR(const byte *data, bool extended);
+	void PublishState();
+	UINT KeyboardEvent(byte, DWORD = 0);
+	UINT MouseEvent(DWORD, DWORD = 0, DWORD = 0, DWORD = 0, ULONG_PTR = 0);
+	int GamepadEvent(const WM_GAMEPAD_FRAME *frame);
 	byte WiiDecrypt(byte);
-	struct _GUID GUID;
-	HANDLE PnPHandle;
-	HKL kbLayout;
-	_packet rdPkt;
-	_packet wrPkt;
+	BOOL WriteRegister(DWORD address, const byte *data, int length);
+	static CStateArena arena; /* every CWiimote made with new, packed together */
+	CInputInjector injector;
+	CGamepad gamepad; /* created on the first frame, so only with gamepadOutput */
+	_report_ref rdPkt;
+	unsigned long long reportSeq;
+	CStatePublisher shared;
+	CStateSender *netSender; /* not owned - one sender can batch several motes */
+	int netDevice;
+	std::atomic<int> currentMode; /* DebugLoop()'s WM_MY_* mode, -1 outside it */
+	CProfileWatcher *profileWatcher; /* not owned */
+	CProfile *profiles[WM_MY_MAX + 1]; /* bindings for each mode, owned while DebugLoop() runs */
+	bool held[WM_PROFILE_BINDINGS]; /* which of the current profile's bindings are pressed */
+	byte streamMode; /* report mode DebugLoop() streams in while the mote is active */
+	byte streamCont; /* WM_MODE_CONT, or WM_MODE_NONCONT when nothing acts on unchanged reports */
+	CIdleDetector idle;
+	std::atomic<int> idleState; /* WM_IDLE_* */
+	WM_TIME idleDeadline; /* next probe, or when to give up on the current one */
+	std::atomic<unsigned long long> wakeups;
+	CReportStats stats;
+	CSampleClock clock; /* sample times for mote.sampleTime */
+	CPointerScheduler scheduler; /* pointerSchedule, while DebugLoop() runs */
+	int speakerRate; /* 0 while the speaker is off */
+#ifndef WM_NO_LATENCY
+	WM_LAT_STAMPS latStamps; /* Stamps for the report currently in flight */
+#endif
+	_calibration calibration; /* Read on every report, but only written when something connects */
 };
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN		// Exclude rarely-used stuff from Windows headers
 #include <stdio.h>
 #include <tchar.h>
@@ -14,4 +15,6 @@
 
 #define _WIN32_WINNT 0x0501
 #include <windows.h>
-
+#else
+#include "PosixCompat.h"
+#endif